@@ -26,6 +26,8 @@ static struct sd_option cluster_options[] = {
 	{'t', "strict", false,
 	 "do not serve write request if number of nodes is not sufficient"},
 	{'s', "manual", false, "enable manual membership control"},
+	{'k', "checksum", false,
+	 "keep checksums of objects and verify them on read"},
 	{'d', "diff", false,
 	 "just output the changes between the two adjacent epoches"
 		"for cluster info"},
@@ -39,6 +41,7 @@ static struct cluster_cmd_data {
 	bool force;
 	bool strict;
 	bool manual;
+	bool checksum;
 	bool diff;
 	char name[STORE_LEN];
 } cluster_cmd_data;
@@ -131,6 +134,8 @@ static int cluster_format(int argc, char **argv)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_STRICT;
 	if (cluster_cmd_data.manual)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_MANUAL;
+	if (cluster_cmd_data.checksum)
+		hdr.cluster.flags |= SD_CLUSTER_FLAG_CHECKSUM;
 
 #ifdef HAVE_DISKVNODES
 	hdr.cluster.flags |= SD_CLUSTER_FLAG_DISKMODE;
@@ -425,7 +430,7 @@ static void fill_cb(struct sd_index *idx, void *arg, int ignore)
 	if (idx->vdi_id) {
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
 		object_tree_insert(oid, inode->nr_copies,
-				   inode->copy_policy);
+				   inode->copy_policy, inode->block_size_shift);
 	}
 }
 
@@ -459,7 +464,8 @@ static void fill_object_tree(uint32_t vid, const char *name, const char *tag,
 		opt->nr_snapshot++;
 
 	/* fill vdi object id */
-	object_tree_insert(vdi_oid, i->nr_copies, i->copy_policy);
+	object_tree_insert(vdi_oid, i->nr_copies, i->copy_policy,
+			   i->block_size_shift);
 
 	/* fill data object id */
 	if (i->store_policy == 0) {
@@ -469,16 +475,18 @@ static void fill_object_tree(uint32_t vid, const char *name, const char *tag,
 			if (!vdi_id)
 				continue;
 			uint64_t oid = vid_to_data_oid(vdi_id, idx);
-			object_tree_insert(oid, i->nr_copies, i->copy_policy);
+			object_tree_insert(oid, i->nr_copies, i->copy_policy,
+					   i->block_size_shift);
 		}
 	} else
-		sd_inode_index_walk(i, fill_cb, &i);
+		sd_inode_index_walk(i, fill_cb, (void *)i);
 
 	/* fill vmstate object id */
 	nr_vmstate_object = DIV_ROUND_UP(i->vm_state_size, SD_DATA_OBJ_SIZE);
 	for (uint32_t idx = 0; idx < nr_vmstate_object; idx++) {
 		vmstate_oid = vid_to_vmstate_oid(vid, idx);
-		object_tree_insert(vmstate_oid, i->nr_copies, i->copy_policy);
+		object_tree_insert(vmstate_oid, i->nr_copies, i->copy_policy,
+				   i->block_size_shift);
 	}
 }
 
@@ -802,7 +810,7 @@ failure:
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprhvTd", "show cluster information",
 	 NULL, CMD_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bctaphTfs", "create a Sheepdog store",
+	{"format", NULL, "bctaphTfsk", "create a Sheepdog store",
 	 NULL, CMD_NEED_NODELIST, cluster_format, cluster_options},
 	{"shutdown", NULL, "aphT", "stop Sheepdog",
 	 NULL, 0, cluster_shutdown, cluster_options},
@@ -857,6 +865,10 @@ static int cluster_parser(int ch, const char *opt)
 		break;
 	case 's':
 		cluster_cmd_data.manual = true;
+		break;
+	case 'k':
+		cluster_cmd_data.checksum = true;
+		break;
 	}
 
 	return 0;
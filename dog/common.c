@@ -80,6 +80,29 @@ char *strnumber(uint64_t size)
 	return strnumber_raw(size, raw_output);
 }
 
+/*
+ * Returns the latency under which 'pct' percent of the requests in the
+ * histogram of SD_NR_LAT_BUCKETS buckets completed
+ */
+uint64_t latency_percentile(const uint64_t *hist, int pct)
+{
+	uint64_t total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < SD_NR_LAT_BUCKETS; i++)
+		total += hist[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < SD_NR_LAT_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+
+	return SD_LAT_BUCKET_BASE << i;
+}
+
 int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 		    uint64_t offset, bool direct)
 {
@@ -216,21 +239,14 @@ out:
 
 int dog_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 {
-	struct sockfd *sfd;
 	int ret;
 
-	sfd = sockfd_cache_get(nid);
-	if (!sfd)
-		return -1;
-
 	/*
 	 * Retry forever for dog because
 	 * 1. We can't get the newest epoch
 	 * 2. Some operations might take unexpected long time
 	 */
-	ret = exec_req(sfd->fd, hdr, buf, NULL, 0, UINT32_MAX);
-
-	sockfd_cache_put(nid, sfd);
+	ret = sockfd_cache_exec(nid, hdr, buf, NULL, 0, UINT32_MAX);
 
 	return ret ? -1 : 0;
 }
@@ -374,7 +390,8 @@ void show_progress(uint64_t done, uint64_t total, bool raw)
 	free(buf);
 }
 
-size_t get_store_objsize(uint8_t copy_policy, uint64_t oid)
+size_t get_store_objsize(uint8_t copy_policy, uint8_t block_size_shift,
+			 uint64_t oid)
 {
 	if (is_vdi_obj(oid))
 		return SD_INODE_SIZE;
@@ -384,9 +401,9 @@ size_t get_store_objsize(uint8_t copy_policy, uint64_t oid)
 		int d;
 
 		ec_policy_to_dp(copy_policy, &d, NULL);
-		return SD_DATA_OBJ_SIZE / d;
+		return sd_data_obj_size(block_size_shift) / d;
 	}
-	return get_objsize(oid);
+	return get_objsize(oid, block_size_shift);
 }
 
 bool is_erasure_oid(uint64_t oid, uint8_t policy)
@@ -571,11 +571,6 @@ int main(int argc, char **argv)
 		exit(EXIT_SYSFAIL);
 	}
 
-	if (sockfd_init()) {
-		sd_err("sockfd_init() failed");
-		exit(EXIT_SYSFAIL);
-	}
-
 	ret = command_fn(argc, argv);
 	if (ret == EXIT_USAGE)
 		subcommand_usage(argv[1], argv[2], EXIT_USAGE);
@@ -70,6 +70,7 @@ extern int sd_zones_nr;
 bool is_current(const struct sd_inode *i);
 char *strnumber(uint64_t _size);
 char *strnumber_raw(uint64_t _size, bool raw);
+uint64_t latency_percentile(const uint64_t *hist, int pct);
 typedef void (*vdi_parser_func_t)(uint32_t vid, const char *name,
 				  const char *tag, uint32_t snapid,
 				  uint32_t flags,
@@ -89,10 +90,12 @@ void confirm(const char *message);
 void work_queue_wait(struct work_queue *q);
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
-		  uint8_t copy_policy, uint8_t store_policy);
+		  uint8_t copy_policy, uint8_t store_policy,
+		  uint8_t compression, uint8_t block_size_shift);
 int do_vdi_check(const struct sd_inode *inode);
 void show_progress(uint64_t done, uint64_t total, bool raw);
-size_t get_store_objsize(uint8_t copy_policy, uint64_t oid);
+size_t get_store_objsize(uint8_t copy_policy, uint8_t block_size_shift,
+			 uint64_t oid);
 bool is_erasure_oid(uint64_t oid, uint8_t policy);
 uint8_t parse_copy(const char *str, uint8_t *copy_policy);
 
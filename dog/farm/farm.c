@@ -131,7 +131,7 @@ static int create_active_vdis(void)
 				  vdi->vdi_id, &new_vid,
 				  false,
 				  vdi->copy_policy,
-				  vdi->store_policy) < 0)
+				  vdi->store_policy, 0, 0) < 0)
 			return -1;
 	}
 	return 0;
@@ -202,7 +202,7 @@ out:
 }
 
 static int notify_vdi_add(uint32_t vdi_id, uint8_t nr_copies,
-			  uint8_t copy_policy)
+			  uint8_t copy_policy, uint8_t block_size_shift)
 {
 	int ret;
 	struct sd_req hdr;
@@ -213,6 +213,7 @@ static int notify_vdi_add(uint32_t vdi_id, uint8_t nr_copies,
 	hdr.vdi_state.new_vid = vdi_id;
 	hdr.vdi_state.copies = nr_copies;
 	hdr.vdi_state.copy_policy = copy_policy;
+	hdr.vdi_state.block_size_shift = block_size_shift;
 	hdr.vdi_state.set_bitmap = true;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
@@ -261,7 +262,7 @@ static void do_save_object(struct work *work)
 
 	sw = container_of(work, struct snapshot_work, work);
 
-	size = get_objsize(sw->entry.oid);
+	size = get_objsize(sw->entry.oid, sw->entry.block_size_shift);
 	buf = xmalloc(size);
 
 	if (dog_read_object(sw->entry.oid, buf, size, 0, true) < 0)
@@ -300,6 +301,7 @@ out:
 
 static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 				    uint8_t copy_policy,
+				    uint8_t block_size_shift,
 				    void *data)
 {
 	struct snapshot_work *sw = xzalloc(sizeof(struct snapshot_work));
@@ -308,6 +310,7 @@ static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 	sw->entry.oid = oid;
 	sw->entry.nr_copies = nr_copies;
 	sw->entry.copy_policy = copy_policy;
+	sw->entry.block_size_shift = block_size_shift;
 	sw->trunk_buf = trunk_buf;
 	sw->work.fn = do_save_object;
 	sw->work.done = save_object_done;
@@ -411,7 +414,8 @@ static void do_load_object(struct work *work)
 	vid = oid_to_vid(sw->entry.oid);
 	if (register_vdi(vid)) {
 		if (notify_vdi_add(vid, sw->entry.nr_copies,
-				   sw->entry.copy_policy) < 0)
+				   sw->entry.copy_policy,
+				   sw->entry.block_size_shift) < 0)
 			goto error;
 	}
 
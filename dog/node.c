@@ -18,6 +18,8 @@ static struct node_cmd_data {
 	bool local;
 	bool force;
 	bool io_addr;
+	bool vdi_stat;
+	int top;
 } node_cmd_data;
 
 static void cal_total_vdi_size(uint32_t vid, const char *name, const char *tag,
@@ -398,6 +400,237 @@ static int node_kill(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/* max nr of VDIs 'dog node stat --vdi' shows */
+#define NR_VDI_STATS 4096
+/* max nr of hot objects a node reports */
+#define NR_HOT_OBJS 128
+
+/* Get the statistics of the VDIs accessed through the node 'nid' */
+static int get_vdi_stats(const struct node_id *nid, struct sd_vdi_stat **stats)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	size_t len = sizeof(struct sd_stat) +
+		NR_VDI_STATS * sizeof(struct sd_vdi_stat);
+	char *buf = xmalloc(len);
+	int ret, nr = 0;
+
+	sd_init_req(&hdr, SD_OP_STAT);
+	hdr.data_length = len;
+	ret = dog_exec_req(nid, &hdr, buf);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get stat information of %s: %s",
+		       addr_to_str(nid->addr, nid->port),
+		       ret < 0 ? "network error" : sd_strerror(rsp->result));
+		free(buf);
+		return -1;
+	}
+
+	if (rsp->data_length > sizeof(struct sd_stat))
+		nr = (rsp->data_length - sizeof(struct sd_stat)) /
+			sizeof(struct sd_vdi_stat);
+	*stats = xmalloc(sizeof(**stats) * (nr + 1));
+	memcpy(*stats, buf + sizeof(struct sd_stat),
+	       sizeof(**stats) * nr);
+	free(buf);
+
+	return nr;
+}
+
+/* Get the hottest objects of the node 'nid' */
+static int get_hot_objs(const struct node_id *nid, struct sd_hot_obj *objs)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_GET_HOT_OBJS);
+	hdr.data_length = NR_HOT_OBJS * sizeof(*objs);
+	ret = dog_exec_req(nid, &hdr, objs);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get hot objects of %s: %s",
+		       addr_to_str(nid->addr, nid->port),
+		       ret < 0 ? "network error" : sd_strerror(rsp->result));
+		return -1;
+	}
+
+	return rsp->data_length / sizeof(*objs);
+}
+
+static void get_vdi_name(uint32_t vid, char *name)
+{
+	if (dog_read_object(vid_to_vdi_oid(vid), name, SD_MAX_VDI_LEN, 0,
+			    true) != SD_RES_SUCCESS)
+		snprintf(name, SD_MAX_VDI_LEN, "%"PRIx32, vid);
+}
+
+static int node_vdi_stat(void)
+{
+	struct sd_vdi_stat *stats, *vs;
+	char name[SD_MAX_VDI_LEN];
+	int nr;
+
+	nr = get_vdi_stats(&sd_nid, &stats);
+	if (nr < 0)
+		return EXIT_SYSFAIL;
+
+	if (!raw_output)
+		printf("VDI\tRead\tWrite\tAll RD\tAll WR\tAvg Lat\t"
+		       "P99 Lat\tMax Lat\tThrottled\tIOPS Limit\t"
+		       "BW Limit\n");
+	for (vs = stats; vs < stats + nr; vs++) {
+		uint64_t nr_ios = vs->nr_reads + vs->nr_writes;
+
+		get_vdi_name(vs->vid, name);
+
+		/* latencies are shown in microseconds */
+		printf("%s\t%"PRIu64"\t%"PRIu64"\t%s\t", name, vs->nr_reads,
+		       vs->nr_writes, strnumber(vs->read_bytes));
+		printf("%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t"
+		       "%"PRIu64"\t%s\n", strnumber(vs->write_bytes),
+		       nr_ios ? vs->total_latency / nr_ios / 1000 : 0,
+		       latency_percentile(vs->latency_hist, 99) / 1000,
+		       vs->max_latency / 1000, vs->nr_throttled,
+		       vs->iops_limit, strnumber(vs->bps_limit));
+	}
+	free(stats);
+
+	return EXIT_SUCCESS;
+}
+
+static int vdi_stat_vid_cmp(const struct sd_vdi_stat *a,
+			    const struct sd_vdi_stat *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int vdi_stat_ops_cmp(const struct sd_vdi_stat *a,
+			    const struct sd_vdi_stat *b)
+{
+	return -intcmp(a->nr_reads + a->nr_writes, b->nr_reads + b->nr_writes);
+}
+
+static int hot_obj_oid_cmp(const struct sd_hot_obj *a,
+			   const struct sd_hot_obj *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static int hot_obj_count_cmp(const struct sd_hot_obj *a,
+			     const struct sd_hot_obj *b)
+{
+	return -intcmp(a->count, b->count);
+}
+
+/* Sum up the statistics of the same VDI gathered from different gateways */
+static int merge_vdi_stats(struct sd_vdi_stat *stats, int nr)
+{
+	int i, n = 0;
+
+	xqsort(stats, nr, vdi_stat_vid_cmp);
+	for (i = 0; i < nr; i++) {
+		struct sd_vdi_stat *dst = stats + n - 1, *src = stats + i;
+
+		if (n == 0 || dst->vid != src->vid) {
+			stats[n++] = *src;
+			continue;
+		}
+
+		dst->nr_reads += src->nr_reads;
+		dst->nr_writes += src->nr_writes;
+		dst->read_bytes += src->read_bytes;
+		dst->write_bytes += src->write_bytes;
+		dst->total_latency += src->total_latency;
+		dst->max_latency = max(dst->max_latency, src->max_latency);
+		dst->nr_throttled += src->nr_throttled;
+		for (int j = 0; j < SD_NR_LAT_BUCKETS; j++)
+			dst->latency_hist[j] += src->latency_hist[j];
+	}
+
+	return n;
+}
+
+/* Sum up the counts of the same object reported by different nodes */
+static int merge_hot_objs(struct sd_hot_obj *objs, int nr)
+{
+	int i, n = 0;
+
+	xqsort(objs, nr, hot_obj_oid_cmp);
+	for (i = 0; i < nr; i++) {
+		if (n > 0 && objs[n - 1].oid == objs[i].oid) {
+			objs[n - 1].count += objs[i].count;
+			objs[n - 1].error += objs[i].error;
+			objs[n - 1].bytes += objs[i].bytes;
+		} else
+			objs[n++] = objs[i];
+	}
+
+	return n;
+}
+
+static int node_top(int top)
+{
+	struct sd_vdi_stat *stats = NULL, *vs;
+	struct sd_hot_obj *objs;
+	char name[SD_MAX_VDI_LEN];
+	int nr_stats = 0, nr_objs = 0, ret = EXIT_SUCCESS;
+	struct sd_node *n;
+
+	objs = xmalloc(sizeof(*objs) * NR_HOT_OBJS * sd_nodes_nr);
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		struct sd_vdi_stat *node_stats;
+		int nr;
+
+		nr = get_vdi_stats(&n->nid, &node_stats);
+		if (nr < 0) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		stats = xrealloc(stats, sizeof(*stats) * (nr_stats + nr));
+		memcpy(stats + nr_stats, node_stats, sizeof(*stats) * nr);
+		nr_stats += nr;
+		free(node_stats);
+
+		nr = get_hot_objs(&n->nid, objs + nr_objs);
+		if (nr < 0) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		nr_objs += nr;
+	}
+
+	nr_stats = merge_vdi_stats(stats, nr_stats);
+	xqsort(stats, nr_stats, vdi_stat_ops_cmp);
+	nr_objs = merge_hot_objs(objs, nr_objs);
+	xqsort(objs, nr_objs, hot_obj_count_cmp);
+
+	if (!raw_output)
+		printf("VDI\tRequests\tAll RD\tAll WR\tAvg Lat\tP99 Lat\n");
+	for (vs = stats; vs < stats + min(top, nr_stats); vs++) {
+		uint64_t nr_ios = vs->nr_reads + vs->nr_writes;
+
+		get_vdi_name(vs->vid, name);
+		printf("%s\t%"PRIu64"\t%s\t", name, nr_ios,
+		       strnumber(vs->read_bytes));
+		printf("%s\t%"PRIu64"\t%"PRIu64"\n",
+		       strnumber(vs->write_bytes),
+		       nr_ios ? vs->total_latency / nr_ios / 1000 : 0,
+		       latency_percentile(vs->latency_hist, 99) / 1000);
+	}
+
+	if (!raw_output)
+		printf("\nObject\t\t\tVDI\tRequests\tBytes\n");
+	for (int i = 0; i < min(top, nr_objs); i++) {
+		get_vdi_name(oid_to_vid(objs[i].oid), name);
+		printf("%016"PRIx64"\t%s\t%"PRIu64"\t%s\n", objs[i].oid, name,
+		       objs[i].count, strnumber(objs[i].bytes));
+	}
+
+	free(stats);
+	free(objs);
+	return ret;
+}
+
 static int node_stat(int argc, char **argv)
 {
 	struct sd_req hdr;
@@ -406,6 +639,11 @@ static int node_stat(int argc, char **argv)
 	int ret;
 	bool watch = node_cmd_data.watch ? true : false, first = true;
 
+	if (node_cmd_data.vdi_stat)
+		return node_vdi_stat();
+	if (node_cmd_data.top)
+		return node_top(node_cmd_data.top);
+
 again:
 	sd_init_req(&hdr, SD_OP_STAT);
 	hdr.data_length = sizeof(stat);
@@ -472,6 +710,22 @@ again:
 		       stat.r.peer_total_remove_nr, 0UL,
 		       strnumber(stat.r.peer_total_rx),
 		       strnumber(stat.r.peer_total_tx));
+
+		/* older sheep don't report scrubbing */
+		if (rsp->data_length < offsetof(struct sd_stat, d))
+			return EXIT_SUCCESS;
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t"
+		       "%"PRIu64"\n",
+		       raw_output ? "" :
+		       "Scrub\tPasses\tDone\tTotal\tCorrupt\tRepaired\n\t",
+		       stat.s.nr_passes, stat.s.nr_scrubbed, stat.s.nr_objs,
+		       stat.s.nr_corrupted, stat.s.nr_repaired);
+
+		if (rsp->data_length < sizeof(stat))
+			return EXIT_SUCCESS;
+		printf("%s%"PRIu64"\t%s\n",
+		       raw_output ? "" : "Dedup\tShared\tSaved\n\t",
+		       stat.d.nr_shared, strnumber(stat.d.saved_bytes));
 	}
 
 	return EXIT_SUCCESS;
@@ -500,20 +754,26 @@ static int node_md_info(struct node_id *nid)
 	for (i = 0; i < info.nr; i++) {
 		uint64_t size = info.disk[i].free + info.disk[i].used;
 		int ratio = (int)(((double)info.disk[i].used / size) * 100);
+		uint64_t saved = 0;
+
+		/* space the compression of the data objects spares */
+		if (info.disk[i].compressed > info.disk[i].compressed_used)
+			saved = info.disk[i].compressed -
+				info.disk[i].compressed_used;
 
 		if (raw_output)
-			fprintf(stdout, "%s %d %s %s %s %d%% %s\n",
+			fprintf(stdout, "%s %d %s %s %s %d%% %s %s\n",
 				addr_to_str(nid->addr, nid->port),
 				info.disk[i].idx, strnumber(size),
 				strnumber(info.disk[i].used),
 				strnumber(info.disk[i].free),
-				ratio, info.disk[i].path);
+				ratio, strnumber(saved), info.disk[i].path);
 		else
-			fprintf(stdout, "%2d\t%s\t%s\t%s\t%3d%%\t%s\n",
+			fprintf(stdout, "%2d\t%s\t%s\t%s\t%3d%%\t%s\t%s\n",
 				info.disk[i].idx, strnumber(size),
 				strnumber(info.disk[i].used),
 				strnumber(info.disk[i].free),
-				ratio, info.disk[i].path);
+				ratio, strnumber(saved), info.disk[i].path);
 	}
 	return EXIT_SUCCESS;
 }
@@ -524,7 +784,7 @@ static int md_info(int argc, char **argv)
 	int ret, i = 0;
 
 	if (!raw_output)
-		fprintf(stdout, "Id\tSize\tUsed\tAvail\tUse%%\tPath\n");
+		fprintf(stdout, "Id\tSize\tUsed\tAvail\tUse%%\tSaved\tPath\n");
 
 	if (!node_cmd_data.all_nodes)
 		return node_md_info(&sd_nid);
@@ -612,6 +872,8 @@ static int node_md(int argc, char **argv)
 
 static int node_parser(int ch, const char *opt)
 {
+	char *p;
+
 	switch (ch) {
 	case 'A':
 		node_cmd_data.all_nodes = true;
@@ -631,6 +893,17 @@ static int node_parser(int ch, const char *opt)
 	case 'i':
 		node_cmd_data.io_addr = true;
 		break;
+	case 'V':
+		node_cmd_data.vdi_stat = true;
+		break;
+	case 't':
+		node_cmd_data.top = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || node_cmd_data.top < 1) {
+			sd_err("The number of entries must be a positive "
+			       "integer");
+			exit(EXIT_FAILURE);
+		}
+		break;
 	}
 
 	return 0;
@@ -643,6 +916,8 @@ static struct sd_option node_options[] = {
 	{'l', "local", false, "issue request to local node"},
 	{'f', "force", false, "ignore the confirmation"},
 	{'i', "io", false, "show data io address"},
+	{'V', "vdi", false, "show the I/O statistics of each VDI"},
+	{'t', "top", true, "show the N busiest VDIs and objects of the cluster"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -744,8 +1019,8 @@ static struct subcommand node_cmd[] = {
 	 CMD_NEED_NODELIST, node_recovery, node_options},
 	{"md", "[disks]", "aprAfhT", "See 'dog node md' for more information",
 	 node_md_cmd, CMD_NEED_ARG, node_md, node_options},
-	{"stat", NULL, "aprwhT", "show stat information about the node", NULL,
-	 0, node_stat, node_options},
+	{"stat", NULL, "aprwVthT", "show stat information about the node", NULL,
+	 CMD_NEED_NODELIST, node_stat, node_options},
 	{"log", NULL, "aphT", "show or set log level of the node", node_log_cmd,
 	 CMD_NEED_ARG, node_log},
 	{"ping", "<node id>", "aprhlT", "ping node", NULL,
@@ -38,6 +38,9 @@ static struct sd_option vdi_options[] = {
 	{'e', "exist", false, "only check objects exist or not,\n"
 	 "                          neither comparing nor repairing"},
 	{'A', "async", false, "delete vdi asynchronously"},
+	{'z', "compress", true, "compress the data objects with lz4 or zstd"},
+	{'S', "object-size", true, "specify the size of the data objects\n"
+	 "                          (a power of 2 from 1M to 64M, default: 4M)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -57,6 +60,8 @@ static struct vdi_cmd_data {
 	bool no_share;
 	bool exist;
 	bool async;
+	uint8_t compression;
+	uint8_t block_size_shift;
 } vdi_cmd_data = { ~0, };
 
 struct get_vdi_info {
@@ -144,8 +149,8 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 		}
 		printf(" %d %s %s %s %s %" PRIx32 " %s %s\n", snapid,
 		       strnumber(i->vdi_size),
-		       strnumber(my_objs * SD_DATA_OBJ_SIZE),
-		       strnumber(cow_objs * SD_DATA_OBJ_SIZE),
+		       strnumber(my_objs * sd_data_obj_size(i->block_size_shift)),
+		       strnumber(cow_objs * sd_data_obj_size(i->block_size_shift)),
 		       dbuf, vid,
 		       redundancy_scheme(i->nr_copies, i->copy_policy),
 		       i->tag);
@@ -154,8 +159,8 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 		       vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : ' '),
 		       name, snapid,
 		       strnumber(i->vdi_size),
-		       strnumber(my_objs * SD_DATA_OBJ_SIZE),
-		       strnumber(cow_objs * SD_DATA_OBJ_SIZE),
+		       strnumber(my_objs * sd_data_obj_size(i->block_size_shift)),
+		       strnumber(cow_objs * sd_data_obj_size(i->block_size_shift)),
 		       dbuf, vid,
 		       redundancy_scheme(i->nr_copies, i->copy_policy),
 		       i->tag);
@@ -395,7 +400,8 @@ int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
 
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
-		  uint8_t copy_policy, uint8_t store_policy)
+		  uint8_t copy_policy, uint8_t store_policy,
+		  uint8_t compression, uint8_t block_size_shift)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -414,6 +420,8 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.vdi_size = vdi_size;
 	hdr.vdi.copy_policy = copy_policy;
 	hdr.vdi.store_policy = store_policy;
+	hdr.vdi.compression = compression;
+	hdr.vdi.block_size_shift = block_size_shift;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
@@ -450,21 +458,26 @@ static int vdi_create(int argc, char **argv)
 	if (ret < 0)
 		return EXIT_USAGE;
 
-	if (size > SD_OLD_MAX_VDI_SIZE && 0 == vdi_cmd_data.store_policy) {
+	if (size > sd_max_vdi_size(0, vdi_cmd_data.block_size_shift) &&
+	    0 == vdi_cmd_data.store_policy) {
 		sd_err("VDI size is larger than %s bytes, please use '-y' to "
 		       "create a hyper volume with size up to %s bytes",
-		       strnumber(SD_OLD_MAX_VDI_SIZE),
-		       strnumber(SD_MAX_VDI_SIZE));
+		       strnumber(sd_max_vdi_size(0,
+						 vdi_cmd_data.block_size_shift)),
+		       strnumber(sd_max_vdi_size(1,
+						 vdi_cmd_data.block_size_shift)));
 		return EXIT_USAGE;
 	}
 
-	if (size > SD_MAX_VDI_SIZE) {
+	if (size > sd_max_vdi_size(1, vdi_cmd_data.block_size_shift)) {
 		sd_err("VDI size is too large");
 		return EXIT_USAGE;
 	}
 
 	ret = do_vdi_create(vdiname, size, 0, &vid, false, 0,
-			    vdi_cmd_data.store_policy);
+			    vdi_cmd_data.store_policy,
+			    vdi_cmd_data.compression,
+			    vdi_cmd_data.block_size_shift);
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
@@ -477,10 +490,11 @@ static int vdi_create(int argc, char **argv)
 		ret = EXIT_FAILURE;
 		goto out;
 	}
-	max_idx = DIV_ROUND_UP(size, SD_DATA_OBJ_SIZE);
+	max_idx = count_data_objs(inode);
 
 	for (idx = 0; idx < max_idx; idx++) {
-		vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+		vdi_show_progress(idx * sd_data_obj_size(inode->block_size_shift),
+				  inode->vdi_size);
 		oid = vid_to_data_oid(vid, idx);
 
 		ret = dog_write_object(oid, 0, NULL, 0, 0, 0, inode->nr_copies,
@@ -497,7 +511,8 @@ static int vdi_create(int argc, char **argv)
 			goto out;
 		}
 	}
-	vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+	vdi_show_progress(idx * sd_data_obj_size(inode->block_size_shift),
+			  inode->vdi_size);
 	ret = EXIT_SUCCESS;
 
 out:
@@ -564,7 +579,7 @@ static int vdi_snapshot(int argc, char **argv)
 		goto out;
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, vid, &new_vid, true,
-			    inode->copy_policy, inode->store_policy);
+			    inode->copy_policy, inode->store_policy, 0, 0);
 
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
@@ -587,6 +602,7 @@ static int vdi_clone(int argc, char **argv)
 	uint32_t max_idx, ret;
 	struct sd_inode *inode = NULL, *new_inode = NULL;
 	char *buf = NULL;
+	uint64_t obj_size;
 
 	dst_vdi = argv[optind];
 	if (!dst_vdi) {
@@ -614,7 +630,9 @@ static int vdi_clone(int argc, char **argv)
 		base_vid = 0;
 
 	ret = do_vdi_create(dst_vdi, inode->vdi_size, base_vid, &new_vid, false,
-			    inode->copy_policy, inode->store_policy);
+			    inode->copy_policy, inode->store_policy,
+			    vdi_cmd_data.compression ?: inode->compression,
+			    inode->block_size_shift);
 	if (ret != EXIT_SUCCESS ||
 			(!vdi_cmd_data.prealloc && !vdi_cmd_data.no_share))
 		goto out;
@@ -625,23 +643,23 @@ static int vdi_clone(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
-	buf = xzalloc(SD_DATA_OBJ_SIZE);
+	obj_size = sd_data_obj_size(inode->block_size_shift);
+	buf = xzalloc(obj_size);
 	max_idx = count_data_objs(inode);
 
 	for (idx = 0; idx < max_idx; idx++) {
 		size_t size;
 
-		vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+		vdi_show_progress(idx * obj_size, inode->vdi_size);
 		vdi_id = sd_inode_get_vid(inode, idx);
 		if (vdi_id) {
 			oid = vid_to_data_oid(vdi_id, idx);
-			ret = dog_read_object(oid, buf, SD_DATA_OBJ_SIZE, 0,
-					      true);
+			ret = dog_read_object(oid, buf, obj_size, 0, true);
 			if (ret) {
 				ret = EXIT_FAILURE;
 				goto out;
 			}
-			size = SD_DATA_OBJ_SIZE;
+			size = obj_size;
 		} else {
 			if (vdi_cmd_data.no_share && !vdi_cmd_data.prealloc)
 				continue;
@@ -665,7 +683,7 @@ static int vdi_clone(int argc, char **argv)
 			goto out;
 		}
 	}
-	vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+	vdi_show_progress(idx * obj_size, inode->vdi_size);
 	ret = EXIT_SUCCESS;
 
 out:
@@ -704,12 +722,8 @@ static int vdi_resize(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	if (new_size > SD_OLD_MAX_VDI_SIZE && 0 == inode->store_policy) {
-		sd_err("New VDI size is too large");
-		return EXIT_USAGE;
-	}
-
-	if (new_size > SD_MAX_VDI_SIZE) {
+	if (new_size > sd_max_vdi_size(inode->store_policy,
+				       inode->block_size_shift)) {
 		sd_err("New VDI size is too large");
 		return EXIT_USAGE;
 	}
@@ -822,7 +836,7 @@ static int vdi_rollback(int argc, char **argv)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, base_vid, &new_vid,
 			     false, inode->copy_policy,
-			     inode->store_policy);
+			     inode->store_policy, 0, 0);
 
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
@@ -1356,6 +1370,7 @@ static int vdi_read(int argc, char **argv)
 	uint64_t offset = 0, oid, done = 0, total = (uint64_t) -1;
 	uint32_t vdi_id, idx;
 	unsigned int len;
+	uint64_t obj_size;
 	char *buf = NULL;
 
 	if (argv[optind]) {
@@ -1370,7 +1385,6 @@ static int vdi_read(int argc, char **argv)
 	}
 
 	inode = malloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
 
 	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
 			   vdi_cmd_data.snapshot_tag, NULL, inode,
@@ -1378,6 +1392,9 @@ static int vdi_read(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
+	obj_size = sd_data_obj_size(inode->block_size_shift);
+	buf = xmalloc(obj_size);
+
 	if (inode->vdi_size < offset) {
 		sd_err("Read offset is beyond the end of the VDI");
 		ret = EXIT_FAILURE;
@@ -1385,10 +1402,10 @@ static int vdi_read(int argc, char **argv)
 	}
 
 	total = min(total, inode->vdi_size - offset);
-	idx = offset / SD_DATA_OBJ_SIZE;
-	offset %= SD_DATA_OBJ_SIZE;
+	idx = offset / obj_size;
+	offset %= obj_size;
 	while (done < total) {
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
+		len = min(total - done, obj_size - offset);
 		vdi_id = sd_inode_get_vid(inode, idx);
 		if (vdi_id) {
 			oid = vid_to_data_oid(vdi_id, idx);
@@ -1429,6 +1446,7 @@ static int vdi_write(int argc, char **argv)
 	struct sd_inode *inode = NULL;
 	uint64_t offset = 0, oid, old_oid, done = 0, total = (uint64_t) -1;
 	unsigned int len;
+	uint64_t obj_size;
 	char *buf = NULL;
 	bool create;
 
@@ -1444,12 +1462,14 @@ static int vdi_write(int argc, char **argv)
 	}
 
 	inode = xmalloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
 
 	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_SIZE);
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
+	obj_size = sd_data_obj_size(inode->block_size_shift);
+	buf = xmalloc(obj_size);
+
 	if (inode->vdi_size < offset) {
 		sd_err("Write offset is beyond the end of the VDI");
 		ret = EXIT_FAILURE;
@@ -1457,13 +1477,13 @@ static int vdi_write(int argc, char **argv)
 	}
 
 	total = min(total, inode->vdi_size - offset);
-	idx = offset / SD_DATA_OBJ_SIZE;
-	offset %= SD_DATA_OBJ_SIZE;
+	idx = offset / obj_size;
+	offset %= obj_size;
 	while (done < total) {
 		create = false;
 		old_oid = 0;
 		flags = 0;
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
+		len = min(total - done, obj_size - offset);
 
 		vdi_id = sd_inode_get_vid(inode, idx);
 		if (!vdi_id)
@@ -1508,7 +1528,7 @@ static int vdi_write(int argc, char **argv)
 		}
 
 		offset += len;
-		if (offset == SD_DATA_OBJ_SIZE) {
+		if (offset == obj_size) {
 			offset = 0;
 			idx++;
 		}
@@ -1522,6 +1542,72 @@ out:
 	return ret;
 }
 
+/*
+ * Discard a range of the VDI.  The objects shared with a snapshot are left
+ * alone, and a partial range of an object is punched out of it.
+ */
+static int vdi_discard(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	uint64_t offset = 0, done = 0, total = (uint64_t) -1, obj_size;
+	struct sd_inode *inode = NULL;
+	struct sd_req hdr;
+	uint32_t vid, idx, len;
+	int ret;
+
+	if (argv[optind]) {
+		ret = option_parse_size(argv[optind++], &offset);
+		if (ret < 0)
+			return EXIT_USAGE;
+		if (argv[optind]) {
+			ret = option_parse_size(argv[optind++], &total);
+			if (ret < 0)
+				return EXIT_USAGE;
+		}
+	}
+
+	inode = xmalloc(sizeof(*inode));
+
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	if (inode->vdi_size < offset) {
+		sd_err("Discard offset is beyond the end of the VDI");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	obj_size = sd_data_obj_size(inode->block_size_shift);
+	total = min(total, inode->vdi_size - offset);
+	idx = offset / obj_size;
+	offset %= obj_size;
+	while (done < total) {
+		len = min(total - done, obj_size - offset);
+
+		if (sd_inode_get_vid(inode, idx) == inode->vdi_id) {
+			sd_init_req(&hdr, SD_OP_DISCARD_OBJ);
+			hdr.obj.oid = vid_to_data_oid(inode->vdi_id, idx);
+			hdr.obj.offset = offset;
+			hdr.obj.length = len == obj_size ? 0 : len;
+			if (send_light_req(&sd_nid, &hdr) < 0) {
+				sd_err("Failed to discard VDI");
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+		}
+
+		offset = 0;
+		idx++;
+		done += len;
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(inode);
+
+	return ret;
+}
+
 static void write_object_to(const struct sd_vnode *vnode, uint64_t oid,
 			void *buf, unsigned int len, bool create, uint8_t ec_index)
 {
@@ -1570,6 +1656,7 @@ struct vdi_check_info {
 	uint64_t oid;
 	uint8_t nr_copies;
 	uint8_t copy_policy;
+	uint8_t block_size_shift;
 	uint64_t total;
 	uint64_t *done;
 	int refcnt;
@@ -1582,7 +1669,7 @@ struct vdi_check_info {
 static void free_vdi_check_info(struct vdi_check_info *info)
 {
 	if (info->done) {
-		*info->done += SD_DATA_OBJ_SIZE;
+		*info->done += sd_data_obj_size(info->block_size_shift);
 		vdi_show_progress(*info->done, info->total);
 	}
 	free(info);
@@ -1644,6 +1731,7 @@ static void vdi_check_object_work(struct work *work)
 	if (is_erasure_oid(info->oid, info->copy_policy)) {
 		sd_init_req(&hdr, SD_OP_READ_PEER);
 		hdr.data_length = get_store_objsize(info->copy_policy,
+						    info->block_size_shift,
 						    info->oid);
 		hdr.obj.ec_index = vcw->ec_index;
 		hdr.epoch = sd_epoch;
@@ -1675,6 +1763,141 @@ static void vdi_check_object_work(struct work *work)
 	}
 }
 
+/*
+ * Digests of replicated objects are asked in batches of VDI_CHECK_BATCH
+ * objects per node with a single SD_OP_GET_HASHES.  A sheep which doesn't
+ * know the op drops the connection, so we then ask the objects one by one
+ * over a new connection.
+ */
+#define VDI_CHECK_BATCH 256
+
+/* true if some node doesn't support SD_OP_GET_HASHES */
+static uatomic_bool get_hashes_unsupported;
+
+struct vdi_check_batch {
+	const struct sd_node *node;
+	int nr;
+	struct vdi_check_work *vcw[VDI_CHECK_BATCH];
+	struct work work;
+	struct rb_node rb;
+};
+
+static struct rb_root check_batch_tree = RB_ROOT;
+
+static int check_batch_cmp(const struct vdi_check_batch *b1,
+			   const struct vdi_check_batch *b2)
+{
+	return node_cmp(b1->node, b2->node);
+}
+
+static void vdi_check_batch_work(struct work *work)
+{
+	struct vdi_check_batch *batch = container_of(work,
+						     struct vdi_check_batch,
+						     work);
+	struct sd_oid_hash *entries = xzalloc(sizeof(*entries) * batch->nr);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	if (uatomic_is_true(&get_hashes_unsupported))
+		goto fallback;
+
+	for (int i = 0; i < batch->nr; i++)
+		entries[i].oid = batch->vcw[i]->info->oid;
+
+	sd_init_req(&hdr, SD_OP_GET_HASHES);
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+	hdr.data_length = sizeof(*entries) * batch->nr;
+	hdr.obj.tgt_epoch = sd_epoch;
+
+	ret = dog_exec_req(&batch->node->nid, &hdr, entries);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		/*
+		 * The node doesn't support batching.  If the connection is
+		 * really broken, the single queries fail as well.
+		 */
+		sd_debug("GET_HASHES failed on %s, ask one by one",
+			 addr_to_str(batch->node->nid.addr,
+				     batch->node->nid.port));
+		uatomic_set_true(&get_hashes_unsupported);
+		goto fallback;
+	}
+
+	for (int i = 0; i < batch->nr; i++) {
+		struct vdi_check_work *vcw = batch->vcw[i];
+
+		switch (entries[i].result) {
+		case SD_RES_SUCCESS:
+			vcw->object_found = true;
+			memcpy(vcw->hash, entries[i].digest, sizeof(vcw->hash));
+			break;
+		case SD_RES_NO_OBJ:
+			vcw->object_found = false;
+			break;
+		default:
+			sd_err("failed to read %" PRIx64 " from %s, %s",
+			       entries[i].oid,
+			       addr_to_str(batch->node->nid.addr,
+					   batch->node->nid.port),
+			       sd_strerror(entries[i].result));
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(entries);
+	return;
+fallback:
+	for (int i = 0; i < batch->nr; i++)
+		vdi_check_object_work(&batch->vcw[i]->work);
+	free(entries);
+}
+
+static void vdi_check_object_main(struct work *work);
+
+static void vdi_check_batch_main(struct work *work)
+{
+	struct vdi_check_batch *batch = container_of(work,
+						     struct vdi_check_batch,
+						     work);
+
+	for (int i = 0; i < batch->nr; i++)
+		vdi_check_object_main(&batch->vcw[i]->work);
+	free(batch);
+}
+
+static void queue_check_batch(struct vdi_check_batch *batch,
+			      struct work_queue *wq)
+{
+	rb_erase(&batch->rb, &check_batch_tree);
+	batch->work.fn = vdi_check_batch_work;
+	batch->work.done = vdi_check_batch_main;
+	queue_work(wq, &batch->work);
+}
+
+static void add_check_batch(struct vdi_check_work *vcw, struct work_queue *wq)
+{
+	struct vdi_check_batch *batch, key = { .node = vcw->vnode->node };
+
+	batch = rb_search(&check_batch_tree, &key, rb, check_batch_cmp);
+	if (!batch) {
+		batch = xzalloc(sizeof(*batch));
+		batch->node = vcw->vnode->node;
+		rb_insert(&check_batch_tree, batch, rb, check_batch_cmp);
+	}
+
+	batch->vcw[batch->nr++] = vcw;
+	if (batch->nr == VDI_CHECK_BATCH)
+		queue_check_batch(batch, wq);
+}
+
+static void flush_check_batches(struct work_queue *wq)
+{
+	struct vdi_check_batch *batch;
+
+	rb_for_each_entry(batch, &check_batch_tree, rb)
+		queue_check_batch(batch, wq);
+}
+
 static void check_replicatoin_object(struct vdi_check_info *info)
 {
 	if (info->majority == NULL) {
@@ -1717,7 +1940,8 @@ static void check_erasure_object(struct vdi_check_info *info)
 	struct fec *ctx = ec_init(d, dp);
 	int miss_idx[dp], input_idx[dp];
 	uint64_t oid = info->oid;
-	size_t len = get_store_objsize(info->copy_policy, oid);
+	size_t len = get_store_objsize(info->copy_policy,
+				       info->block_size_shift, oid);
 	char *obj = xmalloc(len);
 	uint8_t *input[dp];
 
@@ -1743,7 +1967,7 @@ static void check_erasure_object(struct vdi_check_info *info)
 			uint8_t *ds[d];
 			for (j = 0; j < d; j++)
 				ds[j] = info->vcw[j].buf;
-			ec_decode_buffer(ctx, ds, idx, obj, d + k);
+			ec_decode_buffer(ctx, ds, idx, obj, d + k, len);
 			if (memcmp(obj, info->vcw[d + k].buf, len) != 0) {
 				/* TODO repair the inconsistency */
 				sd_err("object %"PRIx64" is inconsistent", oid);
@@ -1761,7 +1985,7 @@ static void check_erasure_object(struct vdi_check_info *info)
 
 			for (i = 0; i < d; i++)
 				ds[i] = input[i];
-			ec_decode_buffer(ctx, ds, input_idx, obj, m);
+			ec_decode_buffer(ctx, ds, input_idx, obj, m, len);
 			write_object_to(info->vcw[m].vnode, oid, obj,
 					len, true, info->vcw[m].ec_index);
 			fprintf(stdout, "fixed missing %"PRIx64", "
@@ -1866,15 +2090,20 @@ static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
 	info->done = done;
 	info->wq = wq;
 	info->copy_policy = inode->copy_policy;
+	info->block_size_shift = inode->block_size_shift;
 
 	oid_to_vnodes(oid, &sd_vroot, nr_copies, tgt_vnodes);
 	for (int i = 0; i < nr_copies; i++) {
 		info->vcw[i].info = info;
 		info->vcw[i].ec_index = i;
 		info->vcw[i].vnode = tgt_vnodes[i];
+		info->refcnt++;
+		if (!is_erasure_oid(oid, info->copy_policy)) {
+			add_check_batch(&info->vcw[i], info->wq);
+			continue;
+		}
 		info->vcw[i].work.fn = vdi_check_object_work;
 		info->vcw[i].work.done = vdi_check_object_main;
-		info->refcnt++;
 		queue_work(info->wq, &info->vcw[i].work);
 	}
 }
@@ -1893,7 +2122,8 @@ static void check_cb(struct sd_index *idx, void *arg, int ignore)
 
 	if (idx->vdi_id) {
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
-		*(carg->done) = (uint64_t)idx->idx * SD_DATA_OBJ_SIZE;
+		*(carg->done) = idx->idx *
+			sd_data_obj_size(carg->inode->block_size_shift);
 		vdi_show_progress(*(carg->done), carg->inode->vdi_size);
 		queue_vdi_check_work(carg->inode, oid, NULL, carg->wq,
 				     carg->nr_copies);
@@ -1931,7 +2161,8 @@ int do_vdi_check(const struct sd_inode *inode)
 				queue_vdi_check_work(inode, oid, &done, wq,
 						     nr_copies);
 			} else {
-				done += SD_DATA_OBJ_SIZE;
+				done += sd_data_obj_size(
+					inode->block_size_shift);
 				vdi_show_progress(done, inode->vdi_size);
 			}
 		}
@@ -1941,6 +2172,7 @@ int do_vdi_check(const struct sd_inode *inode)
 		vdi_show_progress(inode->vdi_size, inode->vdi_size);
 	}
 
+	flush_check_batches(wq);
 	work_queue_wait(wq);
 
 	fprintf(stdout, "finish check&repair %s\n", inode->name);
@@ -1986,11 +2218,12 @@ struct obj_backup {
 	uint32_t offset;
 	uint32_t length;
 	uint32_t reserved;
-	uint8_t data[SD_DATA_OBJ_SIZE];
+	uint8_t data[0]; /* the data object, sized by the VDI */
 };
 
 /* discards redundant area from backup data */
-static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data)
+static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data,
+			       uint64_t obj_size)
 {
 	uint8_t *p1, *p2;
 
@@ -2003,8 +2236,8 @@ static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data)
 		backup->length -= SECTOR_SIZE;
 	}
 
-	p1 = backup->data + SD_DATA_OBJ_SIZE - SECTOR_SIZE;
-	p2 = from_data + SD_DATA_OBJ_SIZE - SECTOR_SIZE;
+	p1 = backup->data + obj_size - SECTOR_SIZE;
+	p2 = from_data + obj_size - SECTOR_SIZE;
 	while (backup->length > 0 && memcmp(p1, p2, SECTOR_SIZE) == 0) {
 		p1 -= SECTOR_SIZE;
 		p2 -= SECTOR_SIZE;
@@ -2013,29 +2246,29 @@ static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data)
 }
 
 static int get_obj_backup(uint32_t idx, uint32_t from_vid, uint32_t to_vid,
-			  struct obj_backup *backup)
+			  struct obj_backup *backup, uint64_t obj_size)
 {
 	int ret;
-	uint8_t *from_data = xzalloc(SD_DATA_OBJ_SIZE);
+	uint8_t *from_data = xzalloc(obj_size);
 
 	backup->idx = idx;
 	backup->offset = 0;
-	backup->length = SD_DATA_OBJ_SIZE;
+	backup->length = obj_size;
 
 	if (to_vid) {
 		ret = dog_read_object(vid_to_data_oid(to_vid, idx),
-				      backup->data, SD_DATA_OBJ_SIZE, 0, true);
+				      backup->data, obj_size, 0, true);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to read object %" PRIx32 ", %d", to_vid,
 			       idx);
 			return EXIT_FAILURE;
 		}
 	} else
-		memset(backup->data, 0, SD_DATA_OBJ_SIZE);
+		memset(backup->data, 0, obj_size);
 
 	if (from_vid) {
 		ret = dog_read_object(vid_to_data_oid(from_vid, idx), from_data,
-				      SD_DATA_OBJ_SIZE, 0, true);
+				      obj_size, 0, true);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to read object %" PRIx32 ", %d",
 			       from_vid, idx);
@@ -2043,7 +2276,7 @@ static int get_obj_backup(uint32_t idx, uint32_t from_vid, uint32_t to_vid,
 		}
 	}
 
-	compact_obj_backup(backup, from_data);
+	compact_obj_backup(backup, from_data, obj_size);
 
 	free(from_data);
 
@@ -2061,7 +2294,8 @@ static int vdi_backup(int argc, char **argv)
 		.version = VDI_BACKUP_FORMAT_VERSION,
 		.magic = VDI_BACKUP_MAGIC,
 	};
-	struct obj_backup *backup = xzalloc(sizeof(*backup));
+	struct obj_backup *backup = NULL;
+	uint64_t obj_size;
 
 	if ((!vdi_cmd_data.snapshot_id && !vdi_cmd_data.snapshot_tag[0]) ||
 	    (!vdi_cmd_data.from_snapshot_id &&
@@ -2084,6 +2318,8 @@ static int vdi_backup(int argc, char **argv)
 		goto out;
 
 	nr_objs = count_data_objs(to_inode);
+	obj_size = sd_data_obj_size(to_inode->block_size_shift);
+	backup = xzalloc(sizeof(*backup) + obj_size);
 
 	ret = xwrite(STDOUT_FILENO, &hdr, sizeof(hdr));
 	if (ret < 0) {
@@ -2099,15 +2335,14 @@ static int vdi_backup(int argc, char **argv)
 		if (to_vid == 0 && from_vid == 0)
 			continue;
 
-		ret = get_obj_backup(idx, from_vid, to_vid, backup);
+		ret = get_obj_backup(idx, from_vid, to_vid, backup, obj_size);
 		if (ret != EXIT_SUCCESS)
 			goto out;
 
 		if (backup->length == 0)
 			continue;
 
-		ret = xwrite(STDOUT_FILENO, backup,
-			     sizeof(*backup) - sizeof(backup->data));
+		ret = xwrite(STDOUT_FILENO, backup, sizeof(*backup));
 		if (ret < 0) {
 			sd_err("failed to write backup data, %m");
 			ret = EXIT_SYSFAIL;
@@ -2123,10 +2358,9 @@ static int vdi_backup(int argc, char **argv)
 	}
 
 	/* write end marker */
-	memset(backup, 0, sizeof(*backup) - sizeof(backup->data));
+	memset(backup, 0, sizeof(*backup));
 	backup->idx = UINT32_MAX;
-	ret = xwrite(STDOUT_FILENO, backup,
-		     sizeof(*backup) - sizeof(backup->data));
+	ret = xwrite(STDOUT_FILENO, backup, sizeof(*backup));
 	if (ret < 0) {
 		sd_err("failed to write end marker, %m");
 		ret = EXIT_SYSFAIL;
@@ -2172,8 +2406,9 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 	int ret;
 	uint32_t vid;
 	struct backup_hdr hdr;
-	struct obj_backup *backup = xzalloc(sizeof(*backup));
+	struct obj_backup *backup = NULL;
 	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	uint64_t obj_size;
 
 	ret = xread(STDIN_FILENO, &hdr, sizeof(hdr));
 	if (ret != sizeof(hdr))
@@ -2190,18 +2425,21 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
+	/* the VDI is restored onto its snapshot, so the objects fit */
+	obj_size = sd_data_obj_size(inode->block_size_shift);
+	backup = xzalloc(sizeof(*backup) + obj_size);
+
 	ret = do_vdi_create(vdiname, inode->vdi_size, inode->vdi_id, &vid,
 			    false, inode->copy_policy,
-			    inode->store_policy);
+			    inode->store_policy, 0, 0);
 	if (ret != EXIT_SUCCESS) {
 		sd_err("Failed to read VDI");
 		goto out;
 	}
 
 	while (true) {
-		ret = xread(STDIN_FILENO, backup,
-			    sizeof(*backup) - sizeof(backup->data));
-		if (ret != sizeof(*backup) - sizeof(backup->data)) {
+		ret = xread(STDIN_FILENO, backup, sizeof(*backup));
+		if (ret != sizeof(*backup)) {
 			sd_err("failed to read backup data");
 			ret = EXIT_SYSFAIL;
 			break;
@@ -2212,6 +2450,13 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 			break;
 		}
 
+		if ((uint64_t)backup->offset + backup->length > obj_size) {
+			sd_err("The backup file doesn't fit the objects of %s",
+			       vdiname);
+			ret = EXIT_FAILURE;
+			break;
+		}
+
 		ret = xread(STDIN_FILENO, backup->data, backup->length);
 		if (ret != backup->length) {
 			sd_err("failed to read backup data");
@@ -2301,7 +2546,7 @@ out:
 					     current_inode->parent_vdi_id, NULL,
 					     true,
 					     current_inode->copy_policy,
-					     current_inode->store_policy);
+					     current_inode->store_policy, 0, 0);
 		if (recovery_ret != EXIT_SUCCESS) {
 			sd_err("failed to resume the current vdi");
 			ret = recovery_ret;
@@ -2386,7 +2631,8 @@ out:
 	return ret;
 }
 
-static int vid_to_name_tag(uint32_t vid, char *name, char *tag)
+static int vid_to_name_tag(uint32_t vid, char *name, char *tag,
+			   uint8_t *block_size_shift)
 {
 	struct sd_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
 	int ret;
@@ -2398,11 +2644,41 @@ static int vid_to_name_tag(uint32_t vid, char *name, char *tag)
 
 	pstrcpy(name, SD_MAX_VDI_LEN, inode->name);
 	pstrcpy(tag, SD_MAX_VDI_TAG_LEN, inode->tag);
+	*block_size_shift = inode->block_size_shift;
 out:
 	free(inode);
 	return ret;
 }
 
+static void print_cache_tier(const char *name, uint64_t hits, uint64_t misses)
+{
+	uint64_t total = hits + misses;
+
+	fprintf(stdout, "%s\t%"PRIu64"\t%"PRIu64"\t%.1f%%\n", name, hits,
+		misses, total ? (double)hits * 100 / total : 0.0);
+}
+
+/* latencies are shown in milliseconds */
+static void print_cache_flush(const struct object_cache_info *info)
+{
+	uint64_t nr = 0;
+
+	if (info->push_bw_limit)
+		fprintf(stdout, "Writeback %s/s, background pushes limited to "
+			"%s/s\n", strnumber(info->push_bw),
+			strnumber(info->push_bw_limit));
+	else if (info->push_bw)
+		fprintf(stdout, "Writeback %s/s\n", strnumber(info->push_bw));
+
+	for (int i = 0; i < SD_NR_LAT_BUCKETS; i++)
+		nr += info->flush_hist[i];
+	if (nr)
+		fprintf(stdout, "Flushes %"PRIu64", 99th percentile latency "
+			"%"PRIu64" ms, target %"PRIu32" ms\n", nr,
+			latency_percentile(info->flush_hist, 99) / 1000000,
+			info->flush_target);
+}
+
 static int vdi_cache_info(int argc, char **argv)
 {
 	struct object_cache_info info = {};
@@ -2424,22 +2700,39 @@ static int vdi_cache_info(int argc, char **argv)
 
 	fprintf(stdout, "Name\tTag\tTotal\tDirty\tClean\n");
 	for (i = 0; i < info.count; i++) {
-		uint64_t total = info.caches[i].total * SD_DATA_OBJ_SIZE,
-			 dirty = info.caches[i].dirty * SD_DATA_OBJ_SIZE,
-			 clean = total - dirty;
+		uint64_t total, dirty, clean, obj_size;
 		char name[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
+		uint8_t shift;
 
-		ret = vid_to_name_tag(info.caches[i].vid, name, tag);
+		ret = vid_to_name_tag(info.caches[i].vid, name, tag, &shift);
 		if (ret != SD_RES_SUCCESS)
 			return EXIT_FAILURE;
+		obj_size = sd_data_obj_size(shift);
+		total = info.caches[i].total * obj_size;
+		dirty = info.caches[i].dirty * obj_size;
+		clean = total - dirty;
 		fprintf(stdout, "%s\t%s\t%s\t%s\t%s\n",
 			name, tag, strnumber(total), strnumber(dirty),
 			strnumber(clean));
 	}
 
-	fprintf(stdout, "\nCache size %s, used %s, %s\n",
+	fprintf(stdout, "\nCache size %s, used %s, %s%s\n",
 		strnumber(info.size), strnumber(info.used),
-		info.directio ? "directio" : "non-directio");
+		info.directio ? "directio" : "non-directio",
+		info.slab ? ", slab" : "");
+	if (info.mem_size)
+		fprintf(stdout, "Memory size %s, used %s\n",
+			strnumber(info.mem_size), strnumber(info.mem_used));
+	print_cache_flush(&info);
+
+	if (!info.mem_hits && !info.mem_misses && !info.disk_hits &&
+	    !info.disk_misses)
+		return EXIT_SUCCESS;
+
+	fprintf(stdout, "\nTier\tHits\tMisses\tHit rate\n");
+	if (info.mem_size)
+		print_cache_tier("memory", info.mem_hits, info.mem_misses);
+	print_cache_tier("disk", info.disk_hits, info.disk_misses);
 
 	return EXIT_SUCCESS;
 }
@@ -2508,6 +2801,7 @@ static int vdi_object_dump_inode(int argc, char **argv)
 	printf("vm_state_size: %"PRIu64"\n", inode->vm_state_size);
 	printf("copy_policy: %d\n", inode->copy_policy);
 	printf("store_policy: %d\n", inode->store_policy);
+	printf("compression: %d\n", inode->compression);
 	printf("nr_copies: %d\n", inode->nr_copies);
 	printf("block_size_shift: %d\n", inode->block_size_shift);
 	printf("snap_id: %"PRIu32"\n", inode->snap_id);
@@ -2580,13 +2874,13 @@ static struct subcommand vdi_cmd[] = {
 	{"check", "<vdiname>", "seaphT", "check and repair image's consistency",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_check, vdi_options},
-	{"create", "<vdiname> <size>", "PyaphrvT", "create an image",
+	{"create", "<vdiname> <size>", "PyzSaphrvT", "create an image",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_create, vdi_options},
 	{"snapshot", "<vdiname>", "saphrvT", "create a snapshot",
 	 NULL, CMD_NEED_ARG,
 	 vdi_snapshot, vdi_options},
-	{"clone", "<src vdi> <dst vdi>", "sPnaphrvT", "clone an image",
+	{"clone", "<src vdi> <dst vdi>", "sPnzaphrvT", "clone an image",
 	 NULL, CMD_NEED_ARG,
 	 vdi_clone, vdi_options},
 	{"delete", "<vdiname>", "saphTA", "delete an image",
@@ -2626,6 +2920,10 @@ static struct subcommand vdi_cmd[] = {
 	 "write data to an image",
 	 NULL, CMD_NEED_ARG,
 	 vdi_write, vdi_options},
+	{"discard", "<vdiname> [<offset> [<len>]]", "aphT",
+	 "discard data of an image",
+	 NULL, CMD_NEED_ARG,
+	 vdi_discard, vdi_options},
 	{"backup", "<vdiname> <backup>", "sFaphT",
 	 "create an incremental backup between two snapshots",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
@@ -2644,6 +2942,8 @@ static struct subcommand vdi_cmd[] = {
 static int vdi_parser(int ch, const char *opt)
 {
 	char *p;
+	uint64_t size;
+	int shift;
 
 	switch (ch) {
 	case 'P':
@@ -2698,6 +2998,27 @@ static int vdi_parser(int ch, const char *opt)
 	case 'y':
 		vdi_cmd_data.store_policy = 1;
 		break;
+	case 'z':
+		if (!strcmp(opt, "lz4"))
+			vdi_cmd_data.compression = SD_COMPRESS_LZ4;
+		else if (!strcmp(opt, "zstd"))
+			vdi_cmd_data.compression = SD_COMPRESS_ZSTD;
+		else {
+			sd_err("unknown compression algorithm: %s", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'S':
+		if (option_parse_size(opt, &size) < 0)
+			exit(EXIT_FAILURE);
+		shift = ffsll(size) - 1;
+		if ((size & (size - 1)) || shift < SD_MIN_BLOCK_SIZE_SHIFT ||
+		    shift > SD_MAX_BLOCK_SIZE_SHIFT) {
+			sd_err("object size must be a power of 2 from 1M to 64M");
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.block_size_shift = shift;
+		break;
 	case 'o':
 		vdi_cmd_data.oid = strtoull(opt, &p, 16);
 		if (opt == p) {
@@ -117,6 +117,7 @@ static inline int fallocate(int fd, int mode, __off_t offset, __off_t len)
 #ifdef __x86_64__
 
 #define X86_FEATURE_SSSE3	(4 * 32 + 9) /* Supplemental SSE-3 */
+#define X86_FEATURE_XMM4_2	(4 * 32 + 20) /* "sse4_2" SSE-4.2 */
 #define X86_FEATURE_OSXSAVE	(4 * 32 + 27) /* "" XSAVE enabled in the OS */
 #define X86_FEATURE_AVX	(4 * 32 + 28) /* Advanced Vector Extensions */
 
@@ -152,6 +153,7 @@ static inline uint64_t xgetbv(uint32_t idx)
 }
 
 #define cpu_has_ssse3           cpu_has(X86_FEATURE_SSSE3)
+#define cpu_has_sse4_2		cpu_has(X86_FEATURE_XMM4_2)
 #define cpu_has_avx		cpu_has(X86_FEATURE_AVX)
 #define cpu_has_osxsave		cpu_has(X86_FEATURE_OSXSAVE)
 
@@ -0,0 +1,19 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* CRC32C (Castagnoli) of buf, e.g. crc32c("123456789", 9) is 0xe3069283 */
+uint32_t crc32c(const void *buf, size_t len);
+
+#endif
@@ -97,12 +97,12 @@ void fec_encode(const struct fec *code,
 		size_t num_block_nums, size_t sz);
 
 void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
-		       char *buf, int idx);
+		       char *buf, int idx, size_t len);
 
 /* for isa-l */
 
 void isa_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
-		       char *buf, int idx);
+		       char *buf, int idx, size_t len);
 
 /*
  * @param inpkts an array of packets (size k); If a primary block, i, is present
@@ -120,7 +120,6 @@ void fec_decode(const struct fec *code,
 
 /* Set data stripe as sector size to make VM happy */
 #define SD_EC_DATA_STRIPE_SIZE (512) /* 512 Byte */
-#define SD_EC_NR_STRIPE_PER_OBJECT (SD_DATA_OBJ_SIZE / SD_EC_DATA_STRIPE_SIZE)
 #define SD_EC_MAX_STRIP (16)
 
 static inline int ec_policy_to_dp(uint8_t policy, int *d, int *p)
@@ -205,12 +204,14 @@ static inline void ec_destroy(struct fec *ctx)
 	fec_free(ctx);
 }
 
+/* Rebuild the strip 'idx' of an object, 'len' is the size of a strip */
 static inline void ec_decode_buffer(struct fec *ctx, uint8_t *input[],
-				    const int in_idx[], char *buf, int idx)
+				    const int in_idx[], char *buf, int idx,
+				    size_t len)
 {
 	if (cpu_has_ssse3)
-		isa_decode_buffer(ctx, input, in_idx, buf, idx);
+		isa_decode_buffer(ctx, input, in_idx, buf, idx, len);
 	else
-		fec_decode_buffer(ctx, input, in_idx, buf, idx);
+		fec_decode_buffer(ctx, input, in_idx, buf, idx, len);
 }
 #endif
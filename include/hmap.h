@@ -0,0 +1,54 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HMAP_H__
+#define __HMAP_H__
+
+#include "util.h"
+#include "list.h"
+
+/*
+ * A concurrent hash map of nodes embedded in the user structures, keyed by
+ * 64 bit integers.
+ *
+ * The buckets are guarded by a fixed number of striped locks, the bucket b is
+ * guarded by the lock b % nr_locks.  Lookups of different keys seldom take the
+ * same lock, and the map grows by taking all of them, which keeps the lock of
+ * a bucket the same because the numbers of buckets and locks are powers of 2.
+ */
+struct hmap_node {
+	struct hlist_node h;
+	uint64_t key;
+};
+
+struct hmap {
+	struct hlist_head *buckets;
+	uint32_t nr_buckets;
+	uint32_t nr_nodes;
+	uint32_t nr_locks;
+	struct sd_rw_lock *locks;
+};
+
+void hmap_init(struct hmap *map, uint32_t nr_locks);
+void hmap_destroy(struct hmap *map);
+struct hmap_node *hmap_insert(struct hmap *map, struct hmap_node *node);
+struct hmap_node *hmap_lookup(struct hmap *map, uint64_t key,
+			      void (*get)(struct hmap_node *));
+void hmap_remove(struct hmap *map, struct hmap_node *node);
+bool hmap_remove_if(struct hmap *map, struct hmap_node *node,
+		    bool (*fn)(struct hmap_node *));
+void hmap_for_each(struct hmap *map, uint32_t start,
+		   bool (*fn)(struct hmap_node *, void *), void *arg);
+
+static inline uint32_t hmap_count(const struct hmap *map)
+{
+	return uatomic_read(&map->nr_nodes);
+}
+
+#endif
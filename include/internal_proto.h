@@ -110,12 +110,23 @@
 /* #define SD_OP_VDI_STATE_SNAPSHOT_CTL  0xC7 */
 /* #define SD_OP_INODE_COHERENCE 0xC8 */
 /* #define SD_OP_READ_DEL_VDIS  0xC9 */
+#define SD_OP_GET_HASHES	0xCA
+#define SD_OP_GET_HOT_OBJS	0xCB
+/* only used in cluster messages, see group.c */
+#define SD_OP_CLUSTER_BATCH	0xCC
+#define SD_OP_PUNCH_OBJ	0xCD
+#define SD_OP_PUNCH_PEER	0xCE
+#define SD_OP_GET_VDI_STATE	0xCF
 #define SD_OP_LIVEPATCH_PATCH    0xD0
 #define SD_OP_LIVEPATCH_UNPATCH  0xD1
 #define SD_OP_LIVEPATCH_STATUS   0xD2
+#define SD_OP_WRITE_BATCH	0xD3
+#define SD_OP_WRITE_BATCH_PEER	0xD4
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
+/* I/O of background work, scheduled behind the I/O of the guests */
+#define SD_FLAG_CMD_BACKGROUND 0x0800
 
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
@@ -126,7 +137,8 @@
 			 SD_FLAG_CMD_CACHE | SD_FLAG_CMD_DIRECT | \
 			 SD_FLAG_CMD_PIGGYBACK | SD_FLAG_CMD_RECOVERY | \
 			 SD_FLAG_CMD_CREAT | SD_FLAG_CMD_EXCL | \
-			 SD_FLAG_CMD_DEL | SD_FLAG_CMD_TGT)
+			 SD_FLAG_CMD_DEL | SD_FLAG_CMD_TGT | \
+			 SD_FLAG_CMD_BACKGROUND)
 
 /* internal error return values, must be above 0x80 */
 #define SD_RES_OLD_NODE_VER  0x81 /* Request has an old epoch */
@@ -158,6 +170,7 @@
 #define SD_CLUSTER_FLAG_STRICT		0x0001 /* Strict mode for write */
 #define SD_CLUSTER_FLAG_DISKMODE	0x0002 /* Disk mode for cluster */
 #define SD_CLUSTER_FLAG_MANUAL		0x0004 /* Manual recovery mode */
+#define SD_CLUSTER_FLAG_CHECKSUM	0x0008 /* Per-block checksums */
 
 
 enum sd_status {
@@ -281,6 +294,9 @@ struct md_info {
 	int idx;
 	uint64_t free;
 	uint64_t used;
+	/* logical and stored size of the compressed objects */
+	uint64_t compressed;
+	uint64_t compressed_used;
 	char path[PATH_MAX];
 };
 
@@ -309,6 +325,13 @@ struct recovery_state {
 	uint64_t nr_total;
 };
 
+/*
+ * Latency histogram buckets, bucket i counts the latencies below 64us << i
+ * and the last one all the others
+ */
+#define SD_NR_LAT_BUCKETS 16
+#define SD_LAT_BUCKET_BASE 64000ULL /* in ns */
+
 #define CACHE_MAX	1024
 struct cache_info {
 	uint32_t vid;
@@ -322,6 +345,48 @@ struct object_cache_info {
 	struct cache_info caches[CACHE_MAX];
 	int count;
 	uint8_t directio;
+	uint8_t slab; /* objects are kept in the slots of a device */
+	uint64_t mem_size; /* the memory tier in front of the disk */
+	uint64_t mem_used;
+	uint64_t mem_hits;
+	uint64_t mem_misses;
+	uint64_t disk_hits;
+	uint64_t disk_misses;
+	uint64_t push_bw; /* measured writeback bandwidth in bytes/s */
+	uint64_t push_bw_limit; /* of the background pushes, 0 if unlimited */
+	uint32_t flush_target; /* latency target of a guest flush in ms */
+	uint32_t __pad;
+	uint64_t flush_latency; /* in ns, of all the guest flushes */
+	uint64_t flush_hist[SD_NR_LAT_BUCKETS]; /* latency of guest flushes */
+};
+
+/* SD_OP_GET_VDI_STATE returns the state of the VDIs known to a node */
+struct sd_vdi_state {
+	uint32_t vid;
+	uint8_t block_size_shift;
+	uint8_t compression;
+	uint8_t __pad[2];
+};
+
+/* SD_OP_GET_HASHES fills result and digest of each entry in place */
+struct sd_oid_hash {
+	uint64_t oid;
+	uint32_t result;
+	uint8_t digest[20];
+};
+
+/*
+ * SD_OP_WRITE_BATCH writes to several data objects of a VDI at once.  The data
+ * starts with obj.length entries, and the data of each entry is at data_offset
+ * of the request data, which the sender aligns to its page size.
+ */
+struct sd_batch_entry {
+	uint64_t oid;
+	uint32_t offset; /* in the object */
+	uint32_t length;
+	uint32_t data_offset; /* in the request data */
+	uint8_t create; /* create the object with the data */
+	uint8_t __pad[3];
 };
 
 struct sd_stat {
@@ -342,6 +407,41 @@ struct sd_stat {
 		uint64_t peer_total_read_nr;
 		uint64_t peer_total_write_nr;
 	} r;
+	struct s_scrub {
+		uint64_t nr_objs; /* nr of objects of the latest pass */
+		uint64_t nr_scrubbed; /* nr of them verified so far */
+		uint64_t nr_passes; /* nr of completed passes */
+		uint64_t nr_corrupted;
+		uint64_t nr_repaired;
+	} s;
+	struct s_dedup {
+		uint64_t nr_shared; /* nr of objects shared by deduplication */
+		uint64_t saved_bytes; /* disk space freed by them */
+	} d;
+};
+
+/* Statistics of a VDI in the gateway, which follow struct sd_stat */
+struct sd_vdi_stat {
+	uint32_t vid;
+	uint32_t __pad;
+	uint64_t nr_reads;
+	uint64_t nr_writes;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t total_latency; /* in ns, of the completed requests */
+	uint64_t max_latency;
+	uint64_t nr_throttled; /* times the VDI ran out of tokens */
+	uint64_t iops_limit;
+	uint64_t bps_limit;
+	uint64_t latency_hist[SD_NR_LAT_BUCKETS];
+};
+
+/* One of the most accessed objects of a node */
+struct sd_hot_obj {
+	uint64_t oid;
+	uint64_t count; /* nr of requests, decayed over time */
+	uint64_t error; /* max overestimation of count */
+	uint64_t bytes;
 };
 
 void sd_inode_stat(const struct sd_inode *inode, uint64_t *, uint64_t *);
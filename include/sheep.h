@@ -33,6 +33,10 @@ struct vnode_info {
 	int nr_nodes;
 	int nr_zones;
 	refcnt_t refcnt;
+	/* backing arrays of nroot and vroot, vnodes are sorted by hash */
+	struct sd_node *nodes;
+	struct sd_vnode *vnodes;
+	int nr_vnodes;
 };
 
 static inline void sd_init_req(struct sd_req *req, uint8_t opcode)
@@ -65,12 +69,10 @@ oid_to_first_vnode(uint64_t oid, struct rb_root *root)
 }
 
 /* Replica are placed along the ring one by one with different zones */
-static inline void oid_to_vnodes(uint64_t oid, struct rb_root *root,
-				 int nr_copies,
-				 const struct sd_vnode **vnodes)
+static inline void vnode_to_vnodes(const struct sd_vnode *next,
+				   struct rb_root *root, int nr_copies,
+				   const struct sd_vnode **vnodes)
 {
-	const struct sd_vnode *next = oid_to_first_vnode(oid, root);
-
 	vnodes[0] = next;
 	for (int i = 1; i < nr_copies; i++) {
 next:
@@ -86,6 +88,13 @@ next:
 	}
 }
 
+static inline void oid_to_vnodes(uint64_t oid, struct rb_root *root,
+				 int nr_copies,
+				 const struct sd_vnode **vnodes)
+{
+	vnode_to_vnodes(oid_to_first_vnode(oid, root), root, nr_copies, vnodes);
+}
+
 static inline const struct sd_vnode *
 oid_to_vnode(uint64_t oid, struct rb_root *root, int copy_idx)
 {
@@ -269,7 +278,7 @@ static inline bool is_cluster_diskmode(const struct cluster_info *cinfo)
 static inline size_t count_data_objs(const struct sd_inode *inode)
 {
 	return DIV_ROUND_UP(inode->vdi_size,
-			    (1UL << inode->block_size_shift));
+			    sd_data_obj_size(inode->block_size_shift));
 }
 
 static inline __attribute__((used)) void __sd_proto_build_bug_ons(void)
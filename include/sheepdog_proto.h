@@ -31,7 +31,7 @@
  */
 #define SD_PROTO_VER 0x01
 
-#define SD_SHEEP_PROTO_VER 0x09
+#define SD_SHEEP_PROTO_VER 0x0d
 
 #define SD_LISTEN_PORT 7000
 
@@ -120,6 +120,13 @@
 #define SD_OLD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * OLD_MAX_DATA_OBJS)
 #define SD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * MAX_DATA_OBJS)
 #define SD_DEFAULT_BLOCK_SIZE_SHIFT 22 /* 4M */
+#define SD_MIN_BLOCK_SIZE_SHIFT 20 /* 1M */
+#define SD_MAX_BLOCK_SIZE_SHIFT 26 /* 64M */
+
+/* compression of the data objects of a VDI */
+#define SD_COMPRESS_NONE 0
+#define SD_COMPRESS_LZ4  1
+#define SD_COMPRESS_ZSTD 2
 
 #define SD_INODE_SIZE (sizeof(struct sd_inode))
 #define SD_INODE_INDEX_SIZE (sizeof(uint32_t) * MAX_DATA_OBJS)
@@ -151,7 +158,11 @@ struct sd_req {
 			uint8_t		reserved;
 			uint32_t	tgt_epoch;
 			uint32_t	offset;
-			uint32_t	__pad;
+			/*
+			 * the range of SD_OP_DISCARD_OBJ, 0 for the whole, or
+			 * the nr of entries of SD_OP_WRITE_BATCH
+			 */
+			uint32_t	length;
 		} obj;
 		struct {
 			uint64_t	vdi_size;
@@ -162,7 +173,8 @@ struct sd_req {
 			uint8_t		block_size_shift;
 			uint32_t	snapid;
 			uint8_t		async_delete;
-			uint8_t		reserved[3];
+			uint8_t		compression;
+			uint8_t		reserved[2];
 		} vdi;
 
 		/* sheepdog-internal */
@@ -213,7 +225,9 @@ struct sd_rsp {
 		struct {
 			uint32_t	__pad;
 			uint8_t		copies;
-			uint8_t		reserved[3];
+			/* the discarded object holds no data and is removed */
+			uint8_t		empty;
+			uint8_t		reserved[2];
 			uint64_t	offset;
 		} obj;
 		struct {
@@ -223,7 +237,8 @@ struct sd_rsp {
 			uint32_t	attr_id;
 			uint8_t		copies;
 			uint8_t		block_size_shift;
-			uint8_t		reserved[2];
+			uint8_t		compression;
+			uint8_t		reserved;
 		} vdi;
 
 		/* sheepdog-internal */
@@ -261,6 +276,7 @@ struct sd_rsp {
  *
  * users of the released area:
  * - uint32_t btree_counter
+ * - uint8_t compression
  */
 #define OLD_MAX_CHILDREN 1024U
 
@@ -286,7 +302,9 @@ struct sd_inode {
 	uint32_t parent_vdi_id;
 
 	uint32_t btree_counter;
-	uint32_t __unused[OLD_MAX_CHILDREN - 1];
+	uint8_t compression;
+	uint8_t __reserved[3];
+	uint32_t __unused[OLD_MAX_CHILDREN - 2];
 
 	uint32_t data_vdi_id[SD_INODE_DATA_INDEX];
 	struct generation_reference gref[SD_INODE_DATA_INDEX];
@@ -471,7 +489,28 @@ static inline bool is_data_obj(uint64_t oid)
 		!is_ledger_object(oid);
 }
 
-static inline size_t get_objsize(uint64_t oid)
+/* Size of the data objects of a VDI, 0 means the default one */
+static inline uint64_t sd_data_obj_size(uint8_t block_size_shift)
+{
+	if (!block_size_shift)
+		return SD_DATA_OBJ_SIZE;
+
+	return UINT64_C(1) << block_size_shift;
+}
+
+static inline uint64_t sd_max_vdi_size(uint8_t store_policy,
+				       uint8_t block_size_shift)
+{
+	uint64_t nr = store_policy ? MAX_DATA_OBJS : OLD_MAX_DATA_OBJS;
+
+	return sd_data_obj_size(block_size_shift) * nr;
+}
+
+/*
+ * The data objects of a VDI are 1 << inode->block_size_shift bytes long, the
+ * other objects have a fixed size.
+ */
+static inline size_t get_objsize(uint64_t oid, uint8_t block_size_shift)
 {
 	if (is_vdi_obj(oid))
 		return SD_INODE_SIZE;
@@ -485,7 +524,10 @@ static inline size_t get_objsize(uint64_t oid)
 	if (is_ledger_object(oid))
 		return SD_LEDGER_OBJ_SIZE;
 
-	return SD_DATA_OBJ_SIZE;
+	if (is_vmstate_obj(oid))
+		return SD_DATA_OBJ_SIZE;
+
+	return sd_data_obj_size(block_size_shift);
 }
 
 static inline uint64_t data_oid_to_idx(uint64_t oid)
@@ -4,19 +4,36 @@
 #include "internal_proto.h"
 #include "work.h"
 
-struct sockfd *sockfd_cache_get(const struct node_id *nid);
-void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd);
-void sockfd_cache_del_node(const struct node_id *nid);
-void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd);
-void sockfd_cache_add(const struct node_id *nid);
-void sockfd_cache_add_group(const struct rb_root *nroot);
+struct sockfd_channel;
 
-int sockfd_init(void);
+/* A request multiplexed on one of the cached connections to a node */
+struct sockfd_req {
+	/* request header, replaced with the response header on completion */
+	struct sd_req hdr;
+	void *data;
+	unsigned int wlen; /* length of data to send */
+	unsigned int rlen; /* max length of data to receive into 'data' */
 
-/* sockfd_cache */
-struct sockfd {
-	int fd;
-	int idx;
+	/* private */
+	struct rb_node rb;
+	uint32_t id;
+	int state;
+	int ret;
+	struct sd_rsp rsp;
+	struct sd_cond wait;
+	struct sockfd_channel *chan;
 };
 
+int sockfd_cache_submit(const struct node_id *nid, struct sockfd_req *sreq,
+			bool (*need_retry)(uint32_t), uint32_t epoch,
+			uint32_t max_count);
+int sockfd_cache_wait(struct sockfd_req *sreq, bool (*need_retry)(uint32_t),
+		      uint32_t epoch, uint32_t max_count);
+int sockfd_cache_exec(const struct node_id *nid, struct sd_req *hdr,
+		      void *data, bool (*need_retry)(uint32_t),
+		      uint32_t epoch, uint32_t max_count);
+void sockfd_cache_del_node(const struct node_id *nid);
+void sockfd_cache_add(const struct node_id *nid);
+void sockfd_cache_add_group(const struct rb_root *nroot);
+
 #endif	/* SOCKFD_CACHE_H */
@@ -125,6 +125,7 @@ void *xrealloc(void *ptr, size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 void *xvalloc(size_t size);
 int prealloc(int fd, uint64_t size);
+int punch_hole(int fd, off_t offset, off_t len);
 ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
 ssize_t xpread(int fd, void *buf, size_t count, off_t offset);
@@ -132,6 +133,7 @@ ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset);
 int xmkdir(const char *pathname, mode_t mode);
 int xfallocate(int fd, int mode, off_t offset, off_t len);
 int xftruncate(int fd, off_t length);
+int clone_file(int dst_fd, int src_fd, size_t len);
 int eventfd_xread(int efd);
 void eventfd_xwrite(int efd, int value);
 void pstrcpy(char *buf, int buf_size, const char *str);
@@ -140,6 +142,7 @@ bool is_numeric(const char *p);
 const char *data_to_str(void *data, size_t data_length);
 pid_t gettid(void);
 int tkill(int tid, int sig);
+int set_thread_ioprio(int level);
 bool is_xattr_enabled(const char *path);
 const char *my_exe_path(void);
 
@@ -66,6 +66,14 @@ void queue_work(struct work_queue *q, struct work *work);
 bool work_queue_empty(struct work_queue *q);
 int wq_trace_init(void);
 
+struct wq_stat {
+	const char *name;
+	size_t nr_threads;
+	size_t nr_queued_work;
+};
+
+int wq_get_stats(struct wq_stat *stats, int nr_max);
+
 #if (defined HAVE_TRACE) || (defined HAVE_LIVEPATCH)
 void suspend_worker_threads(void);
 void resume_worker_threads(void);
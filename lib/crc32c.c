@@ -0,0 +1,111 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CRC32C with the SSE4.2 crc32 instruction when the CPU has it, or a
+ * slicing-by-8 table lookup otherwise.
+ */
+
+#include <string.h>
+
+#include "crc32c.h"
+#include "util.h"
+
+#define CRC32C_POLY 0x82f63b78 /* reflected 0x1edc6f41 */
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_update)(uint32_t, const uint8_t *, size_t);
+
+static uint32_t crc32c_update_generic(uint32_t crc, const uint8_t *p,
+				      size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+	}
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef __x86_64__
+
+static uint32_t crc32c_update_sse42(uint32_t crc, const uint8_t *p,
+				    size_t len)
+{
+	uint64_t crc64;
+
+	while (len && ((uintptr_t)p & 7)) {
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+		p++;
+		len--;
+	}
+
+	crc64 = crc;
+	for (; len >= 8; len -= 8, p += 8)
+		asm("crc32q %1, %0" : "+r" (crc64) : "rm" (*(uint64_t *)p));
+	crc = crc64;
+
+	while (len--) {
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+		p++;
+	}
+
+	return crc;
+}
+
+#endif
+
+uint32_t crc32c(const void *buf, size_t len)
+{
+	return ~crc32c_update(~0U, buf, len);
+}
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++) {
+			uint32_t prev = crc32c_table[j - 1][i];
+
+			crc32c_table[j][i] = crc32c_table[0][prev & 0xff] ^
+				(prev >> 8);
+		}
+	}
+
+	crc32c_update = crc32c_update_generic;
+#ifdef __x86_64__
+	if (cpu_has_sse4_2)
+		crc32c_update = crc32c_update_sse42;
+#endif
+}
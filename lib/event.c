@@ -20,8 +20,12 @@
 #include "util.h"
 #include "event.h"
 
-static int efd;
-static struct rb_root events_tree = RB_ROOT;
+/*
+ * The event loop state is per thread, so a thread other than the main one can
+ * run its own loop after calling init_event().
+ */
+static __thread int efd;
+static __thread struct rb_root events_tree = RB_ROOT;
 
 static void timer_handler(int fd, int events, void *data)
 {
@@ -69,8 +73,8 @@ struct event_info {
 	int prio;
 };
 
-static struct epoll_event *events;
-static int nr_events;
+static __thread struct epoll_event *events;
+static __thread int nr_events;
 
 static int event_cmp(const struct event_info *e1, const struct event_info *e2)
 {
@@ -170,7 +174,7 @@ int modify_event(int fd, unsigned int new_events)
 	return 0;
 }
 
-static bool event_loop_refresh;
+static __thread bool event_loop_refresh;
 
 void event_force_refresh(void)
 {
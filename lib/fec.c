@@ -697,12 +697,13 @@ out:
 }
 
 void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
-		      char *buf, int idx)
+		      char *buf, int idx, size_t len)
 {
 	int i, j, d = ctx->d;
 	size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
+	int nr_stripes = len / strip_size;
 
-	for (i = 0; i < SD_EC_NR_STRIPE_PER_OBJECT; i++) {
+	for (i = 0; i < nr_stripes; i++) {
 		const uint8_t *in[d];
 		uint8_t out[strip_size];
 
@@ -714,9 +715,9 @@ void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 }
 
 void isa_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
-		       char *buf, int idx)
+		       char *buf, int idx, size_t len)
 {
-	int ed = ctx->d, edp = ctx->dp, len = SD_DATA_OBJ_SIZE / ed, i;
+	int ed = ctx->d, edp = ctx->dp, i;
 	unsigned char ec_tbl[ed * edp * 32];
 	unsigned char bm[ed * ed];
 	unsigned char cm[ed];
@@ -0,0 +1,190 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hmap.h"
+#include "sheepdog_proto.h"
+
+/* grow when the chains get longer than this on average */
+#define HMAP_MAX_LOAD	2
+
+static inline uint32_t key_to_bucket(const struct hmap *map, uint64_t key)
+{
+	return sd_hash_64(key) & (map->nr_buckets - 1);
+}
+
+/* The lock of a bucket doesn't change when the map grows */
+static inline struct sd_rw_lock *key_to_lock(const struct hmap *map,
+					     uint64_t key)
+{
+	return map->locks + (sd_hash_64(key) & (map->nr_locks - 1));
+}
+
+void hmap_init(struct hmap *map, uint32_t nr_locks)
+{
+	sd_assert(nr_locks && !(nr_locks & (nr_locks - 1)));
+
+	map->nr_locks = nr_locks;
+	map->locks = xmalloc(sizeof(*map->locks) * nr_locks);
+	for (uint32_t i = 0; i < nr_locks; i++)
+		sd_init_rw_lock(map->locks + i);
+
+	map->nr_buckets = nr_locks;
+	map->buckets = xzalloc(sizeof(*map->buckets) * map->nr_buckets);
+	map->nr_nodes = 0;
+}
+
+/* The nodes must be removed before */
+void hmap_destroy(struct hmap *map)
+{
+	for (uint32_t i = 0; i < map->nr_locks; i++)
+		sd_destroy_rw_lock(map->locks + i);
+	free(map->locks);
+	free(map->buckets);
+}
+
+static void hmap_grow(struct hmap *map, uint32_t nr_buckets)
+{
+	struct hlist_head *buckets;
+
+	for (uint32_t i = 0; i < map->nr_locks; i++)
+		sd_write_lock(map->locks + i);
+
+	/* somebody else might have done it */
+	if (map->nr_buckets >= nr_buckets)
+		goto out;
+
+	buckets = xzalloc(sizeof(*buckets) * nr_buckets);
+	for (uint32_t i = 0; i < map->nr_buckets; i++) {
+		struct hlist_node *pos;
+
+		hlist_for_each(pos, map->buckets + i) {
+			struct hmap_node *node =
+				container_of(pos, struct hmap_node, h);
+
+			hlist_add_head(pos, buckets +
+				       (sd_hash_64(node->key) &
+					(nr_buckets - 1)));
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->nr_buckets = nr_buckets;
+out:
+	for (uint32_t i = 0; i < map->nr_locks; i++)
+		sd_rw_unlock(map->locks + i);
+}
+
+static struct hmap_node *__hmap_lookup(struct hmap *map, uint64_t key)
+{
+	struct hlist_node *pos;
+
+	hlist_for_each(pos, map->buckets + key_to_bucket(map, key)) {
+		struct hmap_node *node = container_of(pos, struct hmap_node, h);
+
+		if (node->key == key)
+			return node;
+	}
+	return NULL;
+}
+
+/* Add the node unless its key is there, return the node of the key if so */
+struct hmap_node *hmap_insert(struct hmap *map, struct hmap_node *node)
+{
+	struct sd_rw_lock *lock = key_to_lock(map, node->key);
+	struct hmap_node *old;
+	uint32_t nr_buckets;
+
+	sd_write_lock(lock);
+	old = __hmap_lookup(map, node->key);
+	if (old) {
+		sd_rw_unlock(lock);
+		return old;
+	}
+	hlist_add_head(&node->h, map->buckets + key_to_bucket(map, node->key));
+	nr_buckets = map->nr_buckets;
+	sd_rw_unlock(lock);
+
+	if (uatomic_add_return(&map->nr_nodes, 1) > nr_buckets * HMAP_MAX_LOAD)
+		hmap_grow(map, nr_buckets * 2);
+
+	return NULL;
+}
+
+/*
+ * Find the node of the key.  If get is given, it is called with the lock of
+ * the node held, e.g. to take a reference which keeps it from being removed.
+ */
+struct hmap_node *hmap_lookup(struct hmap *map, uint64_t key,
+			      void (*get)(struct hmap_node *))
+{
+	struct sd_rw_lock *lock = key_to_lock(map, key);
+	struct hmap_node *node;
+
+	sd_read_lock(lock);
+	node = __hmap_lookup(map, key);
+	if (node && get)
+		get(node);
+	sd_rw_unlock(lock);
+
+	return node;
+}
+
+void hmap_remove(struct hmap *map, struct hmap_node *node)
+{
+	struct sd_rw_lock *lock = key_to_lock(map, node->key);
+
+	sd_write_lock(lock);
+	hlist_del(&node->h);
+	sd_rw_unlock(lock);
+	uatomic_dec(&map->nr_nodes);
+}
+
+/* Remove the node if fn, called with its lock held, returns true */
+bool hmap_remove_if(struct hmap *map, struct hmap_node *node,
+		    bool (*fn)(struct hmap_node *))
+{
+	struct sd_rw_lock *lock = key_to_lock(map, node->key);
+	bool removed = false;
+
+	sd_write_lock(lock);
+	if (fn(node)) {
+		hlist_del(&node->h);
+		removed = true;
+	}
+	sd_rw_unlock(lock);
+	if (removed)
+		uatomic_dec(&map->nr_nodes);
+
+	return removed;
+}
+
+/*
+ * Call fn for the nodes until it returns false, starting from the buckets of
+ * the lock 'start'.  fn is called with the lock of the node held for read, so
+ * it must not add or remove the nodes of the map.
+ */
+void hmap_for_each(struct hmap *map, uint32_t start,
+		   bool (*fn)(struct hmap_node *, void *), void *arg)
+{
+	for (uint32_t i = 0; i < map->nr_locks; i++) {
+		uint32_t l = (start + i) & (map->nr_locks - 1);
+		struct hlist_node *pos;
+
+		sd_read_lock(map->locks + l);
+		for (uint32_t b = l; b < map->nr_buckets; b += map->nr_locks)
+			hlist_for_each(pos, map->buckets + b) {
+				if (!fn(container_of(pos, struct hmap_node, h),
+					arg)) {
+					sd_rw_unlock(map->locks + l);
+					return;
+				}
+			}
+		sd_rw_unlock(map->locks + l);
+	}
+}
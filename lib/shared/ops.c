@@ -69,9 +69,11 @@ static int vdi_rw_request(struct sheep_aiocb *aiocb)
 	struct sd_request *request = aiocb->request;
 	uint64_t offset = aiocb->offset;
 	uint64_t total = aiocb->length;
-	int start = offset % SD_DATA_OBJ_SIZE;
-	uint32_t idx = offset / SD_DATA_OBJ_SIZE;
-	int len = SD_DATA_OBJ_SIZE - start;
+	uint64_t obj_size =
+		sd_data_obj_size(request->vdi->inode->block_size_shift);
+	int start = offset % obj_size;
+	uint32_t idx = offset / obj_size;
+	int len = obj_size - start;
 	struct sd_cluster *c = request->cluster;
 
 	if (total < len)
@@ -140,8 +142,8 @@ submit:
 done:
 		idx++;
 		total -= len;
-		start = (start + len) % SD_DATA_OBJ_SIZE;
-		len = total > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : total;
+		start = (start + len) % obj_size;
+		len = total > obj_size ? obj_size : total;
 	} while (total > 0);
 
 	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
@@ -547,18 +547,19 @@ int sd_vdi_resize(struct sd_cluster *c, char *name, uint64_t new_size)
 		goto out;
 	}
 
-	if (new_size > SD_MAX_VDI_SIZE) {
-		fprintf(stderr, "new size is too large, not allowed\n");
-		ret = SD_RES_INVALID_PARMS;
-		goto out;
-	}
-
 	ret = vdi_read_inode(c, name, (char *)"", inode, true);
 	if (ret != SD_RES_SUCCESS) {
 		fprintf(stderr, "Failed to read inode for VDI: %s\n", name);
 		goto out;
 	}
 
+	if (new_size > sd_max_vdi_size(inode->store_policy,
+				       inode->block_size_shift)) {
+		fprintf(stderr, "new size is too large, not allowed\n");
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+
 	if (new_size < inode->vdi_size) {
 		fprintf(stderr, "shrinking VDI is not implemented\n");
 		ret = SD_RES_INVALID_PARMS;
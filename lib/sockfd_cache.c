@@ -16,14 +16,18 @@
  * in the cluster to accelerator the data transfer, which has the following
  * characteristics:
  *    0 dynamically allocated/deallocated at node granularity.
- *    1 cached fds are multiplexed by all threads.
- *    2 each session (for e.g, forward_write_obj_req) can grab one fd at a time.
- *    3 if there isn't any FD available from cache, use normal connect_to() and
- *      close() internally.
+ *    1 each node is served by CHANNELS_PER_NODE channels, and every channel is
+ *      one long TCP connection multiplexed by all threads.
+ *    2 requests on a channel are tagged with sd_req.id and matched with their
+ *      responses by a per-channel reader thread, so any number of requests
+ *      can be in flight on one connection.
+ *    3 a broken channel fails all its inflight requests and is reconnected
+ *      lazily by the next request which picks it.
  *    4 FD are named by IP:PORT uniquely, hence no need of resetting at
  *      membership change.
- *    5 the total number of FDs is scalable to massive nodes.
- *    6 total 3 APIs: sheep_{get,put,del}_sockfd().
+ *    5 the total number of FDs is nr_nodes * CHANNELS_PER_NODE, no matter how
+ *      deep the request queues are.
+ *    6 APIs: sockfd_cache_{submit,wait,exec}() and sockfd_cache_{add,del}*().
  *    7 support dual connections to a single node.
  */
 
@@ -35,6 +39,15 @@
 #include "util.h"
 #include "sheep.h"
 
+/*
+ * The peer sheep reads the requests on one connection in order but executes
+ * them concurrently, so a handful of connections per node is enough to keep
+ * both the network and the peer busy.  More than one channel is still
+ * useful because a sender holds the channel while it pushes a whole 4 MB
+ * object to the socket.
+ */
+#define CHANNELS_PER_NODE	4
+
 struct sockfd_cache {
 	struct rb_root root;
 	struct sd_rw_lock lock;
@@ -46,30 +59,33 @@ static struct sockfd_cache sockfd_cache = {
 	.lock = SD_RW_LOCK_INITIALIZER,
 };
 
-/*
- * Suppose request size from Guest is 512k, then 4M / 512k = 8, so at
- * most 8 requests can be issued to the same sheep object. Based on this
- * assumption, '8' would be efficient for servers that only host 2~4
- * Guests.
- *
- * This fd count will be dynamically grown when the idx reaches watermark which
- * is calculated by FDS_WATERMARK
- */
-#define FDS_WATERMARK(x) ((x) * 3 / 4)
-#define DEFAULT_FDS_COUNT	8
+struct sockfd_channel {
+	int fd;
+	struct node_id nid;
+	uatomic_bool dead;
+	refcnt_t refcnt;
 
-/* How many FDs we cache for one node */
-static int fds_count = DEFAULT_FDS_COUNT;
+	/* serializes the senders so that requests don't interleave */
+	struct sd_mutex tx_lock;
 
-struct sockfd_cache_fd {
-	int fd;
-	uatomic_bool in_use;
+	/* protects the fields below and the state of the inflight requests */
+	struct sd_mutex lock;
+	struct rb_root inflight;
+	uint32_t next_id;
 };
 
 struct sockfd_cache_entry {
 	struct rb_node rb;
 	struct node_id nid;
-	struct sockfd_cache_fd *fds;
+	struct sd_mutex lock;
+	unsigned long next;
+	struct sockfd_channel *chans[CHANNELS_PER_NODE];
+};
+
+enum sockfd_req_state {
+	SOCKFD_REQ_INFLIGHT,
+	SOCKFD_REQ_RECEIVING,
+	SOCKFD_REQ_DONE,
 };
 
 static int sockfd_cache_cmp(const struct sockfd_cache_entry *a,
@@ -91,73 +107,219 @@ static struct sockfd_cache_entry *sockfd_cache_search(const struct node_id *nid)
 	return rb_search(&sockfd_cache.root, &key, rb, sockfd_cache_cmp);
 }
 
-static inline int get_free_slot(struct sockfd_cache_entry *entry)
+static int sockfd_req_cmp(const struct sockfd_req *a,
+			  const struct sockfd_req *b)
 {
-	int idx = -1, i;
+	return intcmp(a->id, b->id);
+}
 
-	for (i = 0; i < fds_count; i++) {
-		if (!uatomic_set_true(&entry->fds[i].in_use))
-			continue;
-		idx = i;
-		break;
-	}
-	return idx;
+static void put_channel(struct sockfd_channel *chan)
+{
+	if (refcount_dec(&chan->refcnt) > 0)
+		return;
+
+	sd_debug("%s, fd %d", addr_to_str(chan->nid.addr, chan->nid.port),
+		 chan->fd);
+	close(chan->fd);
+	sd_destroy_mutex(&chan->tx_lock);
+	sd_destroy_mutex(&chan->lock);
+	free(chan);
 }
 
 /*
- * Grab a free slot of the node and inc the refcount of the slot
- *
- * If no free slot available, this typically means we should use short FD.
+ * Kick the reader out of read() so that it fails all the inflight requests of
+ * the channel.  The fd itself is closed when the last reference is dropped.
  */
-static struct sockfd_cache_entry *sockfd_cache_grab(const struct node_id *nid,
-						    int *ret_idx)
+static void shutdown_channel(struct sockfd_channel *chan)
 {
-	struct sockfd_cache_entry *entry;
+	if (!uatomic_set_true(&chan->dead))
+		return;
 
-	sd_read_lock(&sockfd_cache.lock);
-	entry = sockfd_cache_search(nid);
-	if (!entry) {
-		sd_debug("failed node %s", addr_to_str(nid->addr, nid->port));
-		goto out;
+	sd_debug("%s, fd %d", addr_to_str(chan->nid.addr, chan->nid.port),
+		 chan->fd);
+	shutdown(chan->fd, SHUT_RDWR);
+}
+
+static void complete_req(struct sockfd_req *sreq, int ret)
+{
+	sreq->ret = ret;
+	sreq->state = SOCKFD_REQ_DONE;
+	sd_cond_signal(&sreq->wait);
+}
+
+static void fail_inflight_reqs(struct sockfd_channel *chan)
+{
+	struct sockfd_req *sreq;
+
+	sd_mutex_lock(&chan->lock);
+	rb_for_each_entry(sreq, &chan->inflight, rb) {
+		rb_erase(&sreq->rb, &chan->inflight);
+		complete_req(sreq, -1);
+	}
+	sd_mutex_unlock(&chan->lock);
+}
+
+static int discard_data(int fd, uint32_t len)
+{
+	char buf[BLOCK_SIZE];
+
+	while (len > 0) {
+		uint32_t n = min(len, (uint32_t)sizeof(buf));
+
+		if (do_read(fd, buf, n, NULL, 0, UINT32_MAX))
+			return -1;
+		len -= n;
 	}
 
-	*ret_idx = get_free_slot(entry);
-	if (*ret_idx == -1)
-		entry = NULL;
-out:
-	sd_rw_unlock(&sockfd_cache.lock);
-	return entry;
+	return 0;
 }
 
-static inline bool slots_all_free(struct sockfd_cache_entry *entry)
+/* Receive one response and hand it over to the waiting thread */
+static int channel_recv_one(struct sockfd_channel *chan)
 {
-	int i;
-	for (i = 0; i < fds_count; i++)
-		if (uatomic_is_true(&entry->fds[i].in_use))
-			return false;
-	return true;
+	struct sockfd_req *sreq, key;
+	struct sd_rsp rsp;
+	uint32_t rlen;
+
+	if (do_read(chan->fd, &rsp, sizeof(rsp), NULL, 0, UINT32_MAX))
+		return -1;
+
+	key.id = rsp.id;
+	sd_mutex_lock(&chan->lock);
+	sreq = rb_search(&chan->inflight, &key, rb, sockfd_req_cmp);
+	if (sreq) {
+		rb_erase(&sreq->rb, &chan->inflight);
+		sreq->state = SOCKFD_REQ_RECEIVING;
+	}
+	sd_mutex_unlock(&chan->lock);
+
+	if (!sreq) {
+		/* The waiter has given up on this request */
+		sd_debug("drop response %"PRIu32, rsp.id);
+		return discard_data(chan->fd, rsp.data_length);
+	}
+
+	rlen = min(sreq->rlen, rsp.data_length);
+	if (rlen && do_read(chan->fd, sreq->data, rlen, NULL, 0, UINT32_MAX))
+		goto err;
+	if (discard_data(chan->fd, rsp.data_length - rlen) < 0)
+		goto err;
+
+	sd_mutex_lock(&chan->lock);
+	sreq->rsp = rsp;
+	complete_req(sreq, 0);
+	sd_mutex_unlock(&chan->lock);
+
+	return 0;
+err:
+	sd_mutex_lock(&chan->lock);
+	complete_req(sreq, -1);
+	sd_mutex_unlock(&chan->lock);
+
+	return -1;
+}
+
+static void *channel_reader(void *arg)
+{
+	struct sockfd_channel *chan = arg;
+
+	while (!uatomic_is_true(&chan->dead)) {
+		if (channel_recv_one(chan) < 0)
+			break;
+	}
+
+	sd_debug("%s, fd %d is closed",
+		 addr_to_str(chan->nid.addr, chan->nid.port), chan->fd);
+	shutdown_channel(chan);
+	fail_inflight_reqs(chan);
+	put_channel(chan);
+
+	return NULL;
+}
+
+/* Try to create IO connection. If failed, fallback to non-IO one */
+static int connect_to_node(const struct node_id *nid)
+{
+	bool use_io = nid->io_port ? true : false;
+	int fd;
+
+	if (use_io) {
+		fd = connect_to_addr(nid->io_addr, nid->io_port);
+		if (fd >= 0)
+			return fd;
+		sd_err("fallback to non-io connection");
+	}
+
+	return connect_to_addr(nid->addr, nid->port);
 }
 
-static inline void destroy_all_slots(struct sockfd_cache_entry *entry)
+static struct sockfd_channel *create_channel(const struct node_id *nid)
 {
-	int i;
-	for (i = 0; i < fds_count; i++)
-		if (entry->fds[i].fd != -1)
-			close(entry->fds[i].fd);
+	struct sockfd_channel *chan;
+	sd_thread_t thread;
+	int fd, ret;
+
+	fd = connect_to_node(nid);
+	if (fd < 0)
+		return NULL;
+
+	chan = xzalloc(sizeof(*chan));
+	chan->fd = fd;
+	chan->nid = *nid;
+	INIT_RB_ROOT(&chan->inflight);
+	sd_init_mutex(&chan->tx_lock);
+	sd_init_mutex(&chan->lock);
+	/* one for the creator and one for the reader */
+	refcount_set(&chan->refcnt, 2);
+
+	ret = sd_thread_create("sockfd", &thread, channel_reader, chan);
+	if (ret) {
+		sd_err("failed to create a reader thread, %s", strerror(ret));
+		refcount_set(&chan->refcnt, 1);
+		put_channel(chan);
+		return NULL;
+	}
+	pthread_detach(thread);
+
+	sd_debug("create cache connection %s, fd %d",
+		 addr_to_str(nid->addr, nid->port), fd);
+	return chan;
 }
 
 static void free_cache_entry(struct sockfd_cache_entry *entry)
 {
-	free(entry->fds);
+	sd_destroy_mutex(&entry->lock);
 	free(entry);
 }
 
+static struct sockfd_cache_entry *alloc_cache_entry(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *new = xzalloc(sizeof(*new));
+
+	memcpy(&new->nid, nid, sizeof(struct node_id));
+	sd_init_mutex(&new->lock);
+
+	return new;
+}
+
+static void destroy_all_channels(struct sockfd_cache_entry *entry)
+{
+	for (int i = 0; i < CHANNELS_PER_NODE; i++) {
+		struct sockfd_channel *chan = entry->chans[i];
+
+		if (!chan)
+			continue;
+		shutdown_channel(chan);
+		put_channel(chan);
+	}
+}
+
 /*
- * Destroy all the Cached FDs of the node
+ * Destroy all the cached channels of the node
  *
- * We don't proceed if some other node grab one FD of the node. In this case,
- * the victim node will finally find itself talking to a dead node and call
- * sockfd_cache_del() to delete this node from the cache.
+ * Threads which are still talking over a channel hold a reference of it, so
+ * they will see their requests failed and the channel is freed by the last
+ * one.
  */
 static bool sockfd_cache_destroy(const struct node_id *nid)
 {
@@ -167,36 +329,23 @@ static bool sockfd_cache_destroy(const struct node_id *nid)
 	entry = sockfd_cache_search(nid);
 	if (!entry) {
 		sd_debug("It is already destroyed");
-		goto false_out;
-	}
-
-	if (!slots_all_free(entry)) {
-		sd_debug("Some victim still holds it");
-		goto false_out;
+		sd_rw_unlock(&sockfd_cache.lock);
+		return false;
 	}
 
 	rb_erase(&entry->rb, &sockfd_cache.root);
 	sd_rw_unlock(&sockfd_cache.lock);
 
-	destroy_all_slots(entry);
+	destroy_all_channels(entry);
 	free_cache_entry(entry);
 
 	return true;
-false_out:
-	sd_rw_unlock(&sockfd_cache.lock);
-	return false;
 }
 
 static void sockfd_cache_add_nolock(const struct node_id *nid)
 {
-	struct sockfd_cache_entry *new = xmalloc(sizeof(*new));
-	int i;
-
-	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	for (i = 0; i < fds_count; i++)
-		new->fds[i].fd = -1;
+	struct sockfd_cache_entry *new = alloc_cache_entry(nid);
 
-	memcpy(&new->nid, nid, sizeof(struct node_id));
 	if (sockfd_cache_insert(new)) {
 		free_cache_entry(new);
 		return;
@@ -220,15 +369,10 @@ void sockfd_cache_add_group(const struct rb_root *nroot)
 void sockfd_cache_add(const struct node_id *nid)
 {
 	struct sockfd_cache_entry *new;
-	int n, i;
+	int n;
 
 	sd_write_lock(&sockfd_cache.lock);
-	new = xmalloc(sizeof(*new));
-	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	for (i = 0; i < fds_count; i++)
-		new->fds[i].fd = -1;
-
-	memcpy(&new->nid, nid, sizeof(struct node_id));
+	new = alloc_cache_entry(nid);
 	if (sockfd_cache_insert(new)) {
 		free_cache_entry(new);
 		sd_rw_unlock(&sockfd_cache.lock);
@@ -239,87 +383,82 @@ void sockfd_cache_add(const struct node_id *nid)
 	sd_debug("%s, count %d", addr_to_str(nid->addr, nid->port), n);
 }
 
-static uatomic_bool fds_in_grow;
-static int fds_high_watermark = FDS_WATERMARK(DEFAULT_FDS_COUNT);
-
-static struct work_queue *grow_wq;
-
-static void do_grow_fds(struct work *work)
+/* Add the node back if it is still alive */
+static inline int revalidate_node(const struct node_id *nid)
 {
-	struct sockfd_cache_entry *entry;
-	int old_fds_count, new_fds_count, new_size, i;
-
-	sd_debug("%d", fds_count);
-	sd_write_lock(&sockfd_cache.lock);
-	old_fds_count = fds_count;
-	new_fds_count = fds_count * 2;
-	new_size = sizeof(struct sockfd_cache_fd) * fds_count * 2;
-	rb_for_each_entry(entry, &sockfd_cache.root, rb) {
-		entry->fds = xrealloc(entry->fds, new_size);
-		for (i = old_fds_count; i < new_fds_count; i++) {
-			entry->fds[i].fd = -1;
-			uatomic_set_false(&entry->fds[i].in_use);
-		}
-	}
+	int fd;
 
-	fds_count *= 2;
-	fds_high_watermark = FDS_WATERMARK(fds_count);
-	sd_rw_unlock(&sockfd_cache.lock);
-}
+	fd = connect_to_node(nid);
+	if (fd < 0)
+		return false;
 
-static void grow_fds_done(struct work *work)
-{
-	sd_debug("fd count has been grown into %d", fds_count);
-	uatomic_set_false(&fds_in_grow);
-	free(work);
+	close(fd);
+	sockfd_cache_add(nid);
+	return true;
 }
 
-static inline void check_idx(int idx)
+/* Return a live channel of the slot with its refcount incremented */
+static struct sockfd_channel *grab_slot(struct sockfd_cache_entry *entry,
+					int idx)
 {
-	struct work *w;
+	struct sockfd_channel *chan;
 
-	if (idx <= fds_high_watermark)
-		return;
-	if (!uatomic_set_true(&fds_in_grow))
-		return;
+	sd_mutex_lock(&entry->lock);
+	chan = entry->chans[idx];
+	if (chan && !uatomic_is_true(&chan->dead))
+		refcount_inc(&chan->refcnt);
+	else
+		chan = NULL;
+	sd_mutex_unlock(&entry->lock);
 
-	w = xmalloc(sizeof(*w));
-	w->fn = do_grow_fds;
-	w->done = grow_fds_done;
-	queue_work(grow_wq, w);
+	return chan;
 }
 
-/* Add the node back if it is still alive */
-static inline int revalidate_node(const struct node_id *nid)
+/*
+ * Install a new channel into the slot unless someone else has already done
+ * it.  Returns the channel to use, with a reference for the caller.
+ */
+static struct sockfd_channel *install_slot(struct sockfd_cache_entry *entry,
+					   int idx, struct sockfd_channel *new)
 {
-	bool use_io = nid->io_port ? true : false;
-	int fd;
+	struct sockfd_channel *old;
 
-	if (use_io) {
-		fd = connect_to_addr(nid->io_addr, nid->io_port);
-		if (fd >= 0)
-			goto alive;
+	sd_mutex_lock(&entry->lock);
+	old = entry->chans[idx];
+	if (old && !uatomic_is_true(&old->dead)) {
+		refcount_inc(&old->refcnt);
+		sd_mutex_unlock(&entry->lock);
+
+		shutdown_channel(new);
+		put_channel(new);
+		return old;
 	}
-	fd = connect_to_addr(nid->addr, nid->port);
-	if (fd < 0)
-		return false;
-alive:
-	close(fd);
-	sockfd_cache_add(nid);
-	return true;
+
+	/* the reference of the creator is taken over by the slot */
+	entry->chans[idx] = new;
+	refcount_inc(&new->refcnt);
+	sd_mutex_unlock(&entry->lock);
+
+	if (old)
+		put_channel(old);
+	return new;
 }
 
-/* Try to create/get cached IO connection. If failed, fallback to non-IO one */
-static struct sockfd *sockfd_cache_get_long(const struct node_id *nid)
+static struct sockfd_channel *sockfd_cache_get_channel(const struct node_id *nid)
 {
 	struct sockfd_cache_entry *entry;
-	struct sockfd *sfd;
-	bool use_io = nid->io_port ? true : false;
-	const uint8_t *addr = use_io ? nid->io_addr : nid->addr;
-	int fd, idx = -1, port = use_io ? nid->io_port : nid->port;
+	struct sockfd_channel *chan, *new = NULL;
+	int idx = 0;
 grab:
-	entry = sockfd_cache_grab(nid, &idx);
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
 	if (!entry) {
+		sd_rw_unlock(&sockfd_cache.lock);
+		if (new) {
+			shutdown_channel(new);
+			put_channel(new);
+			return NULL;
+		}
 		/*
 		 * The node is deleted, but someone asks us to grab it.
 		 * The nid is not in the sockfd cache but probably it might be
@@ -333,137 +472,172 @@ grab:
 		goto grab;
 	}
 
-	check_idx(idx);
-	if (entry->fds[idx].fd != -1) {
-		sd_debug("%s, idx %d", addr_to_str(addr, port), idx);
-		goto out;
-	}
-
-	/* Create a new cached connection for this node */
-	sd_debug("create cache connection %s idx %d", addr_to_str(addr, port),
-		 idx);
-	fd = connect_to_addr(addr, port);
-	if (fd < 0) {
-		if (use_io) {
-			sd_err("fallback to non-io connection");
-			fd = connect_to_addr(nid->addr, nid->port);
-			if (fd >= 0)
-				goto new;
-		}
-		uatomic_set_false(&entry->fds[idx].in_use);
-		return NULL;
+	if (new) {
+		chan = install_slot(entry, idx, new);
+		sd_rw_unlock(&sockfd_cache.lock);
+		return chan;
 	}
-new:
-	entry->fds[idx].fd = fd;
-out:
-	sfd = xmalloc(sizeof(*sfd));
-	sfd->fd = entry->fds[idx].fd;
-	sfd->idx = idx;
-	return sfd;
-}
-
-static void sockfd_cache_put_long(const struct node_id *nid, int idx)
-{
-	bool use_io = nid->io_port ? true : false;
-	const uint8_t *addr = use_io ? nid->io_addr : nid->addr;
-	int port = use_io ? nid->io_port : nid->port;
-	struct sockfd_cache_entry *entry;
-
-	sd_debug("%s idx %d", addr_to_str(addr, port), idx);
 
-	sd_read_lock(&sockfd_cache.lock);
-	entry = sockfd_cache_search(nid);
-	if (entry)
-		uatomic_set_false(&entry->fds[idx].in_use);
+	idx = uatomic_add_return(&entry->next, 1) % CHANNELS_PER_NODE;
+	chan = grab_slot(entry, idx);
 	sd_rw_unlock(&sockfd_cache.lock);
-}
-
-static void sockfd_cache_close(const struct node_id *nid, int idx)
-{
-	bool use_io = nid->io_port ? true : false;
-	const uint8_t *addr = use_io ? nid->io_addr : nid->addr;
-	int port = use_io ? nid->io_port : nid->port;
-	struct sockfd_cache_entry *entry;
+	if (chan)
+		return chan;
 
-	sd_debug("%s idx %d", addr_to_str(addr, port), idx);
+	/* Connect without holding any lock, then try to install it */
+	new = create_channel(nid);
+	if (!new)
+		return NULL;
 
-	sd_write_lock(&sockfd_cache.lock);
-	entry = sockfd_cache_search(nid);
-	if (entry) {
-		close(entry->fds[idx].fd);
-		entry->fds[idx].fd = -1;
-		uatomic_set_false(&entry->fds[idx].in_use);
-	}
-	sd_rw_unlock(&sockfd_cache.lock);
+	goto grab;
 }
 
 /*
- * Create work queue for growing fds.
- * Before this function called, growing cannot be done.
+ * Send a request to the node without waiting for the response
+ *
+ * sreq->hdr, data, wlen and rlen must be set by the caller.  Returns 0 if the
+ * request is queued on a channel, and then the caller must call
+ * sockfd_cache_wait() before releasing sreq.  Network failures after this
+ * point are reported by sockfd_cache_wait().
  */
-int sockfd_init(void)
+int sockfd_cache_submit(const struct node_id *nid, struct sockfd_req *sreq,
+			bool (*need_retry)(uint32_t), uint32_t epoch,
+			uint32_t max_count)
 {
-	grow_wq = create_ordered_work_queue("sockfd_grow");
+	struct sockfd_channel *chan;
+	int ret;
+
+	chan = sockfd_cache_get_channel(nid);
+	if (!chan)
+		return -1;
 
-	if (!grow_wq) {
-		sd_err("error at creating workqueue for sockfd growth");
+	sd_cond_init(&sreq->wait);
+	sreq->chan = chan;
+	sreq->ret = -1;
+	sreq->state = SOCKFD_REQ_INFLIGHT;
+
+	/*
+	 * The response can arrive before send_req() returns.  The reader sets
+	 * dead before it fails the inflight requests under chan->lock, so a
+	 * request inserted into a live channel here is always completed.
+	 */
+	sd_mutex_lock(&chan->lock);
+	if (uatomic_is_true(&chan->dead)) {
+		sd_mutex_unlock(&chan->lock);
+		sd_destroy_cond(&sreq->wait);
+		sreq->chan = NULL;
+		put_channel(chan);
 		return -1;
 	}
+	do {
+		sreq->id = chan->next_id++;
+	} while (rb_insert(&chan->inflight, sreq, rb, sockfd_req_cmp));
+	sd_mutex_unlock(&chan->lock);
+	sreq->hdr.id = sreq->id;
+
+	sd_mutex_lock(&chan->tx_lock);
+	ret = send_req(chan->fd, &sreq->hdr, sreq->data, sreq->wlen,
+		       need_retry, epoch, max_count);
+	sd_mutex_unlock(&chan->tx_lock);
+	if (ret)
+		/*
+		 * A partially sent request corrupts the stream, so nobody can
+		 * use this channel any more.  The reader fails all the inflight
+		 * requests including this one.
+		 */
+		shutdown_channel(chan);
 
 	return 0;
 }
 
 /*
- * Return a sockfd connected to the node to the caller
- *
- * Try to get a 'long' FD as best, which is cached and never closed. If no FD
- * available, we return a 'short' FD which is supposed to be closed by
- * sockfd_cache_put().
+ * Wait for the completion of the request submitted by sockfd_cache_submit()
  *
- * ret_idx is opaque to the caller, -1 indicates it is a short FD.
+ * On success, sreq->hdr is filled with the response header as exec_req()
+ * does, and up to sreq->rlen bytes of the response data are stored in
+ * sreq->data.  Returns non-zero if the request failed on the network.
  */
-struct sockfd *sockfd_cache_get(const struct node_id *nid)
+int sockfd_cache_wait(struct sockfd_req *sreq, bool (*need_retry)(uint32_t),
+		      uint32_t epoch, uint32_t max_count)
 {
-	struct sockfd *sfd;
-	int fd;
+	struct sockfd_channel *chan = sreq->chan;
+	uint32_t repeat = max_count;
+	int ret;
+
+	sd_mutex_lock(&chan->lock);
+	while (sreq->state != SOCKFD_REQ_DONE) {
+		ret = sd_cond_wait_timeout(&sreq->wait, &chan->lock,
+					   POLL_TIMEOUT);
+		if (ret != ETIMEDOUT || sreq->state == SOCKFD_REQ_DONE)
+			continue;
+		/*
+		 * If IO NIC is down, epoch isn't incremented, so we can't retry
+		 * for ever.
+		 */
+		if (repeat && (need_retry == NULL || need_retry(epoch))) {
+			repeat--;
+			sd_warn("timeout, disks of %s or network is busy. "
+				"Going to wait again",
+				addr_to_str(chan->nid.addr, chan->nid.port));
+			continue;
+		}
 
-	sfd = sockfd_cache_get_long(nid);
-	if (sfd)
-		return sfd;
+		if (sreq->state == SOCKFD_REQ_INFLIGHT) {
+			rb_erase(&sreq->rb, &chan->inflight);
+			complete_req(sreq, -1);
+		}
+		/*
+		 * XXX Blindly close the connection.  The reader then fails the
+		 * request if it is being received.
+		 */
+		shutdown_channel(chan);
+	}
+	sd_mutex_unlock(&chan->lock);
 
-	/* Fallback on a non-io connection that is to be closed shortly */
-	fd = connect_to_addr(nid->addr, nid->port);
-	if (fd < 0)
-		return NULL;
+	put_channel(chan);
+	sreq->chan = NULL;
+	sd_destroy_cond(&sreq->wait);
+	if (sreq->ret == 0)
+		memcpy(&sreq->hdr, &sreq->rsp, sizeof(sreq->rsp));
 
-	sfd = xmalloc(sizeof(*sfd));
-	sfd->idx = -1;
-	sfd->fd = fd;
-	sd_debug("%d", fd);
-	return sfd;
+	return sreq->ret;
 }
 
 /*
- * Release a sockfd connected to the node, which is acquired from
- * sockfd_cache_get()
+ * Execute a request on a cached connection of the node synchronously
  *
- * If it is a long FD, just decrease the refcount to make it available again.
- * If it is a short FD, close it.
+ * This has the same semantics as exec_req() except the connection is shared
+ * with the other threads.
  */
-void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd)
+int sockfd_cache_exec(const struct node_id *nid, struct sd_req *hdr,
+		      void *data, bool (*need_retry)(uint32_t),
+		      uint32_t epoch, uint32_t max_count)
 {
-	if (sfd->idx == -1) {
-		sd_debug("%d", sfd->fd);
-		close(sfd->fd);
-		free(sfd);
-		return;
-	}
-
-	sockfd_cache_put_long(nid, sfd->idx);
-	free(sfd);
+	struct sockfd_req sreq = {
+		.hdr = *hdr,
+		.data = data,
+	};
+	int ret;
+
+	if (hdr->flags & SD_FLAG_CMD_WRITE) {
+		sreq.wlen = hdr->data_length;
+		if (hdr->flags & SD_FLAG_CMD_PIGGYBACK)
+			sreq.rlen = hdr->data_length;
+	} else
+		sreq.rlen = hdr->data_length;
+
+	ret = sockfd_cache_submit(nid, &sreq, need_retry, epoch, max_count);
+	if (ret)
+		return ret;
+
+	ret = sockfd_cache_wait(&sreq, need_retry, epoch, max_count);
+	if (ret == 0)
+		memcpy(hdr, &sreq.hdr, sizeof(*hdr));
+
+	return ret;
 }
 
-/* Delete all sockfd connected to the node, when node is crashed. */
+/* Delete all channels connected to the node, when node is crashed. */
 void sockfd_cache_del_node(const struct node_id *nid)
 {
 	int n;
@@ -474,24 +648,3 @@ void sockfd_cache_del_node(const struct node_id *nid)
 	n = uatomic_sub_return(&sockfd_cache.count, 1);
 	sd_debug("%s, count %d", addr_to_str(nid->addr, nid->port), n);
 }
-
-/*
- * Delete a sockfd connected to the node.
- *
- * If it is a long FD, de-refcount it and try to destroy all the cached FDs of
- * this node in the cache.
- * If it is a short FD, just close it.
- */
-void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd)
-{
-	if (sfd->idx == -1) {
-		sd_debug("%d", sfd->fd);
-		close(sfd->fd);
-		free(sfd);
-		return;
-	}
-
-	sockfd_cache_close(nid, sfd->idx);
-	sockfd_cache_del_node(nid);
-	free(sfd);
-}
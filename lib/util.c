@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <sys/eventfd.h>
 #include <sys/syscall.h>
+#include <sys/ioctl.h>
 
 
 #include "util.h"
@@ -121,6 +122,32 @@ int prealloc(int fd, uint64_t size)
 	return 0;
 }
 
+/*
+ * Deallocate the range of the file so that it reads as zeros.  If the file
+ * system can't punch holes, the range is overwritten with zeros instead.
+ */
+int punch_hole(int fd, off_t offset, off_t len)
+{
+	static const char zero[64 * 1024];
+	ssize_t ret;
+
+	if (xfallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       offset, len) == 0)
+		return 0;
+	if (errno != ENOSYS && errno != EOPNOTSUPP)
+		return -1;
+
+	while (len > 0) {
+		ret = xpwrite(fd, zero, min((off_t)sizeof(zero), len), offset);
+		if (ret < 0)
+			return -1;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
 static ssize_t _read(int fd, void *buf, size_t len)
 {
 	ssize_t nr;
@@ -278,6 +305,44 @@ int xfallocate(int fd, int mode, off_t offset, off_t len)
 	return ret;
 }
 
+/*
+ * Copy the first len bytes of src_fd to dst_fd within the kernel.  The extents
+ * are shared if the file system supports reflink, otherwise the data is copied
+ * with copy_file_range(2).  Return -1 with errno set if neither is supported.
+ */
+#ifndef FICLONE
+/* from linux/fs.h, which conflicts with our BLOCK_SIZE */
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+int clone_file(int dst_fd, int src_fd, size_t len)
+{
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return xftruncate(dst_fd, len);
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t off = 0;
+	ssize_t ret;
+
+	while (off < len) {
+		ret = copy_file_range(src_fd, &off, dst_fd, NULL, len - off, 0);
+		if (unlikely(ret < 0)) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0) {
+			/* src_fd is shorter than len */
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 int xftruncate(int fd, off_t length)
 {
 	int ret;
@@ -401,6 +466,20 @@ int tkill(int tid, int sig)
 	return syscall(SYS_tgkill, getpid(), tid, sig);
 }
 
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_SHIFT	13
+
+/*
+ * Set the best effort I/O priority of the calling thread, 0 (highest) to 7.
+ * Only the CFQ and BFQ I/O schedulers take it into account.
+ */
+int set_thread_ioprio(int level)
+{
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		       IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level);
+}
+
 bool is_xattr_enabled(const char *path)
 {
 	int ret, dummy;
@@ -432,6 +432,29 @@ bool work_queue_empty(struct work_queue *q)
 	return uatomic_read(&wi->nr_queued_work) == 0;
 }
 
+/*
+ * Fill 'stats' with the state of at most 'nr_max' work queues.  Work queues
+ * are created at start-up only, so this can be called from any thread.
+ */
+int wq_get_stats(struct wq_stat *stats, int nr_max)
+{
+	struct wq_info *wi;
+	int nr = 0;
+
+	list_for_each_entry(wi, &wq_info_list, list) {
+		if (nr == nr_max)
+			break;
+		stats[nr].name = wi->name;
+		sd_mutex_lock(&wi->pending_lock);
+		stats[nr].nr_threads = wi->nr_threads;
+		sd_mutex_unlock(&wi->pending_lock);
+		stats[nr].nr_queued_work = uatomic_read(&wi->nr_queued_work);
+		nr++;
+	}
+
+	return nr;
+}
+
 struct thread_args {
 	const char *name;
 	void *(*start_routine)(void *);
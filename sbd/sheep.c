@@ -500,9 +500,10 @@ int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 	struct sbd_device *dev = sheep_aiocb_to_device(aiocb);
 	u64 offset = aiocb->offset;
 	u64 total = aiocb->length;
-	u64 start = offset % SD_DATA_OBJ_SIZE;
-	u32 idx = offset / SD_DATA_OBJ_SIZE;
-	int len = SD_DATA_OBJ_SIZE - start;
+	u64 obj_size = sd_data_obj_size(dev->vdi.inode->block_size_shift);
+	u64 start = offset & (obj_size - 1);
+	u32 idx = offset >> ilog2(obj_size);
+	int len = obj_size - start;
 
 	if (total < len)
 		len = total;
@@ -577,8 +578,8 @@ submit:
 done:
 		idx++;
 		total -= len;
-		start = (start + len) % SD_DATA_OBJ_SIZE;
-		len = total > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : total;
+		start = (start + len) & (obj_size - 1);
+		len = total > obj_size ? obj_size : total;
 	} while (total > 0);
 
 	if (atomic_dec_return(&aiocb->nr_requests) <= 0)
@@ -93,6 +93,7 @@ static int sbd_add_disk(struct sbd_device *dev)
 {
 	struct gendisk *disk;
 	struct request_queue *rq;
+	u64 obj_size = sd_data_obj_size(dev->vdi.inode->block_size_shift);
 
 	disk = alloc_disk(1 << SBD_MINORS_SHIFT);
 	if (!disk)
@@ -110,10 +111,10 @@ static int sbd_add_disk(struct sbd_device *dev)
 		return -ENOMEM;
 	}
 
-	blk_queue_max_hw_sectors(rq, SD_DATA_OBJ_SIZE / SECTOR_SIZE);
-	blk_queue_max_segments(rq, SD_DATA_OBJ_SIZE / SECTOR_SIZE);
-	blk_queue_max_segment_size(rq, SD_DATA_OBJ_SIZE);
-	blk_queue_io_opt(rq, SD_DATA_OBJ_SIZE);
+	blk_queue_max_hw_sectors(rq, obj_size / SECTOR_SIZE);
+	blk_queue_max_segments(rq, obj_size / SECTOR_SIZE);
+	blk_queue_max_segment_size(rq, obj_size);
+	blk_queue_io_opt(rq, obj_size);
 
 	disk->queue = rq;
 	rq->queuedata = dev;
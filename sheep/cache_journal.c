@@ -0,0 +1,381 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The dirty journal records which blocks of the objects in the object cache
+ * are not pushed back yet, so that a restart pushes only them instead of all
+ * the objects in the cache.
+ *
+ * It is a log of records (vid, idx, dirty bitmap, generation).  The last
+ * record of an object wins, and a record with an empty bitmap says that the
+ * object is clean.  A write makes a dirty record durable before writing the
+ * object, and the records of the concurrent writes are committed together
+ * with one write and one fdatasync.  The clean records are written with the
+ * next commit, losing them only costs an unneeded push at restart.
+ *
+ * The current state is also kept in memory and written out as a new journal
+ * when the log gets much longer than the state.  If the journal can't be
+ * written, it is removed and the next start marks all the objects dirty like
+ * before.
+ */
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define JOURNAL_MAGIC		0x534a524e /* "SJRN" */
+#define JOURNAL_VERSION		1
+
+/* rewrite the journal when it has this many records and 4 times the state */
+#define JOURNAL_COMPACT_RECORDS	4096
+
+#define JOURNAL_CREATE		0x1
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct journal_record {
+	uint64_t gen;
+	uint64_t idx;
+	uint64_t bmap;
+	uint32_t vid;
+	uint32_t flags;
+	uint32_t reserved;
+	uint32_t crc; /* of the fields above */
+};
+
+struct journal_entry {
+	uint32_t vid;
+	uint64_t idx;
+	uint64_t bmap;
+	bool create;
+	bool replayed;
+	struct rb_node node;
+};
+
+static struct {
+	char path[PATH_MAX];
+	int fd;
+	off_t offset;
+	bool enabled;
+	bool replay; /* the journal of the last run was found */
+
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	struct rb_root root; /* the objects with dirty blocks */
+	uint32_t nr_entries;
+	uint32_t nr_records; /* in the file */
+
+	/* the records not written yet */
+	struct journal_record *pending;
+	uint32_t nr_pending;
+	uint32_t max_pending;
+
+	uint64_t gen; /* of the last record */
+	uint64_t committed; /* the last generation written to the file */
+	bool committing;
+} journal = {
+	.fd = -1,
+	.lock = SD_MUTEX_INITIALIZER,
+	.cond = SD_COND_INITIALIZER,
+	.root = RB_ROOT,
+};
+
+static int journal_entry_cmp(const struct journal_entry *a,
+			     const struct journal_entry *b)
+{
+	return intcmp(a->vid, b->vid) ?: intcmp(a->idx, b->idx);
+}
+
+static struct journal_entry *journal_entry_search(uint32_t vid, uint64_t idx)
+{
+	struct journal_entry key = { .vid = vid, .idx = idx };
+
+	return rb_search(&journal.root, &key, node, journal_entry_cmp);
+}
+
+static inline uint32_t record_crc(const struct journal_record *rec)
+{
+	return crc32c(rec, offsetof(struct journal_record, crc));
+}
+
+static void update_journal_entry(uint32_t vid, uint64_t idx, uint64_t bmap,
+				 bool create)
+{
+	struct journal_entry *entry = journal_entry_search(vid, idx);
+
+	if (!bmap) {
+		if (entry) {
+			rb_erase(&entry->node, &journal.root);
+			journal.nr_entries--;
+			free(entry);
+		}
+		return;
+	}
+
+	if (!entry) {
+		entry = xzalloc(sizeof(*entry));
+		entry->vid = vid;
+		entry->idx = idx;
+		rb_insert(&journal.root, entry, node, journal_entry_cmp);
+		journal.nr_entries++;
+	}
+	entry->bmap = bmap;
+	entry->create = create;
+}
+
+static void fill_record(struct journal_record *rec, uint32_t vid, uint64_t idx,
+			uint64_t bmap, bool create)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->gen = ++journal.gen;
+	rec->idx = idx;
+	rec->bmap = bmap;
+	rec->vid = vid;
+	rec->flags = create ? JOURNAL_CREATE : 0;
+	rec->crc = record_crc(rec);
+}
+
+/* Stop journaling, the next start marks all the objects dirty */
+static void disable_journal(void)
+{
+	sd_err("the dirty journal %s is disabled", journal.path);
+	journal.enabled = false;
+	if (unlink(journal.path) < 0 && errno != ENOENT)
+		sd_err("failed to remove %s, %m", journal.path);
+}
+
+/* Write the current state as a new journal */
+static int rewrite_journal(void)
+{
+	struct journal_header *hdr;
+	struct journal_record *rec;
+	struct journal_entry *entry;
+	size_t len = sizeof(*hdr) + sizeof(*rec) * journal.nr_entries;
+	char *buf = xmalloc(len);
+	int fd, ret;
+
+	hdr = (struct journal_header *)buf;
+	hdr->magic = JOURNAL_MAGIC;
+	hdr->version = JOURNAL_VERSION;
+	rec = (struct journal_record *)(hdr + 1);
+	rb_for_each_entry(entry, &journal.root, node)
+		fill_record(rec++, entry->vid, entry->idx, entry->bmap,
+			    entry->create);
+
+	ret = atomic_create_and_write(journal.path, buf, len, true);
+	free(buf);
+	if (ret < 0)
+		return -1;
+
+	fd = open(journal.path, O_RDWR);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", journal.path);
+		return -1;
+	}
+	if (journal.fd >= 0)
+		close(journal.fd);
+	journal.fd = fd;
+	journal.offset = len;
+	journal.nr_records = journal.nr_entries;
+	return 0;
+}
+
+static inline bool journal_too_long(void)
+{
+	return journal.nr_records > JOURNAL_COMPACT_RECORDS &&
+		journal.nr_records > journal.nr_entries * 4;
+}
+
+/*
+ * Write the pending records, or the whole state if the journal is too long.
+ * Called with the lock held, which is released while writing.
+ */
+static void commit_journal(void)
+{
+	struct journal_record *pending = journal.pending;
+	uint32_t nr = journal.nr_pending;
+	uint64_t gen = journal.gen;
+	size_t len = sizeof(*pending) * nr;
+	bool compact = journal_too_long();
+	int ret = 0;
+
+	journal.committing = true;
+	journal.pending = NULL;
+	journal.nr_pending = journal.max_pending = 0;
+
+	if (compact) {
+		/* rewrite_journal() needs the state as of now */
+		ret = rewrite_journal();
+		sd_debug("compacted, %"PRIu32" records", journal.nr_records);
+	} else {
+		sd_mutex_unlock(&journal.lock);
+		if (xpwrite(journal.fd, pending, len, journal.offset) != len ||
+		    fdatasync(journal.fd) < 0) {
+			sd_err("failed to write %s, %m", journal.path);
+			ret = -1;
+		}
+		sd_mutex_lock(&journal.lock);
+		if (ret == 0) {
+			journal.offset += len;
+			journal.nr_records += nr;
+		}
+	}
+	free(pending);
+
+	if (ret < 0)
+		disable_journal();
+	journal.committed = gen;
+	journal.committing = false;
+	sd_cond_broadcast(&journal.cond);
+}
+
+/*
+ * Record that the blocks in 'bmap' of the object are dirty, or that it is
+ * clean if bmap is 0.  The dirty records are durable when this returns.
+ */
+void cache_journal_log(uint32_t vid, uint64_t idx, uint64_t bmap, bool create)
+{
+	uint64_t gen;
+
+	sd_mutex_lock(&journal.lock);
+	if (!journal.enabled) {
+		sd_mutex_unlock(&journal.lock);
+		return;
+	}
+
+	update_journal_entry(vid, idx, bmap, create);
+	if (journal.nr_pending == journal.max_pending) {
+		journal.max_pending = max(journal.max_pending * 2, 16U);
+		journal.pending = xrealloc(journal.pending,
+					   sizeof(*journal.pending) *
+					   journal.max_pending);
+	}
+	fill_record(journal.pending + journal.nr_pending++, vid, idx, bmap,
+		    create);
+	gen = journal.gen;
+
+	/* the first writer commits the records of the others waiting for it */
+	while (bmap && journal.enabled && journal.committed < gen) {
+		if (journal.committing)
+			sd_cond_wait(&journal.cond, &journal.lock);
+		else
+			commit_journal();
+	}
+	sd_mutex_unlock(&journal.lock);
+}
+
+/*
+ * Return the dirty blocks of the object found at start-up.  If there was no
+ * journal, all the blocks are dirty and the object might not exist in the
+ * backend yet.
+ */
+uint64_t cache_journal_replay(uint32_t vid, uint64_t idx, bool *create)
+{
+	struct journal_entry *entry;
+	uint64_t bmap;
+
+	sd_mutex_lock(&journal.lock);
+	if (!journal.replay)
+		update_journal_entry(vid, idx, UINT64_MAX, true);
+	entry = journal_entry_search(vid, idx);
+	if (entry) {
+		entry->replayed = true;
+		bmap = entry->bmap;
+		*create = entry->create;
+	} else {
+		bmap = 0;
+		*create = false;
+	}
+	sd_mutex_unlock(&journal.lock);
+
+	return bmap;
+}
+
+/*
+ * Forget the records of the objects which are not in the cache any more, and
+ * start a new journal of the objects found at start-up.
+ */
+int cache_journal_replayed(void)
+{
+	struct journal_entry *entry;
+	int ret = 0;
+
+	sd_mutex_lock(&journal.lock);
+	rb_for_each_entry(entry, &journal.root, node) {
+		if (!entry->replayed) {
+			rb_erase(&entry->node, &journal.root);
+			journal.nr_entries--;
+			free(entry);
+		}
+	}
+	journal.replay = true;
+	if (journal.enabled && rewrite_journal() < 0) {
+		disable_journal();
+		ret = -1;
+	}
+	sd_mutex_unlock(&journal.lock);
+
+	return ret;
+}
+
+static int load_journal(void)
+{
+	struct journal_header hdr;
+	struct journal_record rec;
+	uint32_t nr = 0;
+	int fd;
+
+	fd = open(journal.path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		sd_err("failed to open %s, %m", journal.path);
+		return -1;
+	}
+	if (xread(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != JOURNAL_MAGIC || hdr.version != JOURNAL_VERSION) {
+		sd_err("%s is not a dirty journal", journal.path);
+		close(fd);
+		return -1;
+	}
+
+	/* the records of an interrupted commit end the journal */
+	while (xread(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		if (rec.crc != record_crc(&rec) || rec.gen <= journal.gen)
+			break;
+		journal.gen = rec.gen;
+		update_journal_entry(rec.vid, rec.idx, rec.bmap,
+				     rec.flags & JOURNAL_CREATE);
+		nr++;
+	}
+	close(fd);
+	journal.committed = journal.gen;
+	journal.replay = true;
+	sd_info("%"PRIu32" records, %"PRIu32" dirty objects in %s", nr,
+		journal.nr_entries, journal.path);
+	return 0;
+}
+
+/*
+ * Read the journal at 'path'.  The objects found in the cache are passed to
+ * cache_journal_replay() and then cache_journal_replayed() writes a new one.
+ */
+void cache_journal_init(const char *path)
+{
+	snprintf(journal.path, sizeof(journal.path), "%s", path);
+	if (load_journal() < 0) {
+		/* treat the objects as if there were no journal */
+		rb_destroy(&journal.root, struct journal_entry, node);
+		journal.nr_entries = 0;
+		journal.replay = false;
+	}
+	journal.enabled = true;
+}
@@ -0,0 +1,263 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The memory tier keeps blocks of the objects in the object cache in DRAM, so
+ * that the hot ones, e.g. inode objects and the pages of a database, are read
+ * without going to the disk.  It only holds the blocks of the objects which
+ * are in the cache on disk, and it is written through: the object cache
+ * writes the disk first and then the blocks here, so they never have to be
+ * flushed and are simply dropped with their objects.
+ *
+ * The eviction is a segmented LRU to resist scans.  A block read for the first
+ * time goes to the probation list and is moved to the protected list when it
+ * is read again.  The blocks are evicted from the probation list first, so a
+ * long sequential read doesn't push the hot blocks out.
+ */
+
+#include "sheep_priv.h"
+
+/* the share of the budget for the blocks read more than once */
+#define PROTECTED_RATIO(nr)	((nr) * 3 / 4)
+
+struct mem_block {
+	uint32_t vid;
+	uint64_t idx; /* index of the object in the cache of the VDI */
+	uint32_t nr; /* which block of the object */
+	uint32_t len; /* less than MEM_CACHE_BLOCK_SIZE at the end of an object */
+	bool protected;
+	struct rb_node node;
+	struct list_node list;
+	char *data;
+};
+
+static struct {
+	struct sd_mutex lock;
+	struct rb_root root;
+	struct list_head probation;
+	struct list_head protected;
+	uint32_t nr_blocks;
+	uint32_t nr_protected;
+	uint32_t max_blocks; /* 0 if the memory tier is disabled */
+
+	uint64_t hits;
+	uint64_t misses;
+} mem = {
+	.lock = SD_MUTEX_INITIALIZER,
+	.root = RB_ROOT,
+	.probation = LIST_HEAD_INIT(mem.probation),
+	.protected = LIST_HEAD_INIT(mem.protected),
+};
+
+static int mem_block_cmp(const struct mem_block *a, const struct mem_block *b)
+{
+	return intcmp(a->vid, b->vid) ?: intcmp(a->idx, b->idx) ?:
+		intcmp(a->nr, b->nr);
+}
+
+static struct mem_block *mem_block_search(uint32_t vid, uint64_t idx,
+					  uint32_t nr)
+{
+	struct mem_block key = { .vid = vid, .idx = idx, .nr = nr };
+
+	return rb_search(&mem.root, &key, node, mem_block_cmp);
+}
+
+static void free_mem_block(struct mem_block *block)
+{
+	rb_erase(&block->node, &mem.root);
+	list_del(&block->list);
+	mem.nr_blocks--;
+	if (block->protected)
+		mem.nr_protected--;
+	free(block->data);
+	free(block);
+}
+
+static void promote_mem_block(struct mem_block *block)
+{
+	struct mem_block *victim;
+
+	if (block->protected) {
+		list_move_tail(&block->list, &mem.protected);
+		return;
+	}
+
+	block->protected = true;
+	mem.nr_protected++;
+	list_move_tail(&block->list, &mem.protected);
+	if (mem.nr_protected <= PROTECTED_RATIO(mem.max_blocks))
+		return;
+
+	/* the coldest protected block gets one more chance */
+	victim = list_first_entry(&mem.protected, struct mem_block, list);
+	victim->protected = false;
+	mem.nr_protected--;
+	list_move_tail(&victim->list, &mem.probation);
+}
+
+static void evict_mem_block(void)
+{
+	struct mem_block *victim;
+
+	if (!list_empty(&mem.probation))
+		victim = list_first_entry(&mem.probation, struct mem_block,
+					  list);
+	else
+		victim = list_first_entry(&mem.protected, struct mem_block,
+					  list);
+	free_mem_block(victim);
+}
+
+static inline bool mem_cache_enabled(void)
+{
+	return mem.max_blocks > 0;
+}
+
+/* Return true if all the blocks of the request are in memory */
+bool mem_cache_read(uint32_t vid, uint64_t idx, void *buf, size_t count,
+		    off_t offset)
+{
+	uint32_t first = offset / MEM_CACHE_BLOCK_SIZE;
+	uint32_t last = (offset + count - 1) / MEM_CACHE_BLOCK_SIZE;
+	struct mem_block *block;
+
+	if (!mem_cache_enabled())
+		return false;
+
+	sd_mutex_lock(&mem.lock);
+	for (uint32_t nr = first; nr <= last; nr++) {
+		off_t start = (off_t)nr * MEM_CACHE_BLOCK_SIZE;
+
+		block = mem_block_search(vid, idx, nr);
+		if (!block || start + block->len < min(offset + (off_t)count,
+				start + MEM_CACHE_BLOCK_SIZE)) {
+			sd_mutex_unlock(&mem.lock);
+			uatomic_inc(&mem.misses);
+			return false;
+		}
+	}
+
+	for (uint32_t nr = first; nr <= last; nr++) {
+		off_t start = (off_t)nr * MEM_CACHE_BLOCK_SIZE;
+		off_t from = max(offset, start);
+		off_t to = min(offset + (off_t)count,
+			       start + MEM_CACHE_BLOCK_SIZE);
+
+		block = mem_block_search(vid, idx, nr);
+		memcpy((char *)buf + (from - offset), block->data +
+		       (from - start), to - from);
+		promote_mem_block(block);
+	}
+	sd_mutex_unlock(&mem.lock);
+	uatomic_inc(&mem.hits);
+
+	return true;
+}
+
+/*
+ * Keep the blocks of buf, which holds the object of 'size' bytes at 'offset',
+ * if buf covers them entirely.
+ */
+void mem_cache_fill(uint32_t vid, uint64_t idx, const void *buf, size_t count,
+		    off_t offset, size_t size)
+{
+	uint32_t first = DIV_ROUND_UP(offset, MEM_CACHE_BLOCK_SIZE);
+	off_t end = offset + count;
+
+	if (!mem_cache_enabled())
+		return;
+
+	sd_mutex_lock(&mem.lock);
+	for (uint32_t nr = first; ; nr++) {
+		off_t start = (off_t)nr * MEM_CACHE_BLOCK_SIZE;
+		uint32_t len = min(end - start, (off_t)MEM_CACHE_BLOCK_SIZE);
+		struct mem_block *block;
+
+		if (start >= end || (len < MEM_CACHE_BLOCK_SIZE && end != size))
+			break;
+		if (mem_block_search(vid, idx, nr))
+			continue;
+
+		if (mem.nr_blocks >= mem.max_blocks)
+			evict_mem_block();
+		block = xzalloc(sizeof(*block));
+		block->vid = vid;
+		block->idx = idx;
+		block->nr = nr;
+		block->len = len;
+		block->data = xmalloc(MEM_CACHE_BLOCK_SIZE);
+		memcpy(block->data, (const char *)buf + (start - offset), len);
+		rb_insert(&mem.root, block, node, mem_block_cmp);
+		list_add_tail(&block->list, &mem.probation);
+		mem.nr_blocks++;
+	}
+	sd_mutex_unlock(&mem.lock);
+}
+
+/* Update the blocks in memory after the write to the disk */
+void mem_cache_write(uint32_t vid, uint64_t idx, const void *buf, size_t count,
+		     off_t offset)
+{
+	uint32_t first = offset / MEM_CACHE_BLOCK_SIZE;
+	uint32_t last = (offset + count - 1) / MEM_CACHE_BLOCK_SIZE;
+
+	if (!mem_cache_enabled())
+		return;
+
+	sd_mutex_lock(&mem.lock);
+	for (uint32_t nr = first; nr <= last; nr++) {
+		off_t start = (off_t)nr * MEM_CACHE_BLOCK_SIZE;
+		struct mem_block *block = mem_block_search(vid, idx, nr);
+		off_t from, to;
+
+		if (!block)
+			continue;
+		from = max(offset, start);
+		to = min(offset + (off_t)count, start + (off_t)block->len);
+		if (from < to)
+			memcpy(block->data + (from - start),
+			       (const char *)buf + (from - offset), to - from);
+	}
+	sd_mutex_unlock(&mem.lock);
+}
+
+/* Drop the blocks of the object of 'size' bytes */
+void mem_cache_drop(uint32_t vid, uint64_t idx, size_t size)
+{
+	uint32_t nr_blocks = DIV_ROUND_UP(size, MEM_CACHE_BLOCK_SIZE);
+	struct mem_block *block;
+
+	if (!mem_cache_enabled())
+		return;
+
+	sd_mutex_lock(&mem.lock);
+	for (uint32_t nr = 0; nr < nr_blocks; nr++) {
+		block = mem_block_search(vid, idx, nr);
+		if (block)
+			free_mem_block(block);
+	}
+	sd_mutex_unlock(&mem.lock);
+}
+
+void mem_cache_get_info(struct object_cache_info *info)
+{
+	info->mem_size = (uint64_t)mem.max_blocks * MEM_CACHE_BLOCK_SIZE;
+	info->mem_used = (uint64_t)uatomic_read(&mem.nr_blocks) *
+		MEM_CACHE_BLOCK_SIZE;
+	info->mem_hits = uatomic_read(&mem.hits);
+	info->mem_misses = uatomic_read(&mem.misses);
+}
+
+void mem_cache_init(uint64_t size)
+{
+	mem.max_blocks = size / MEM_CACHE_BLOCK_SIZE;
+	if (mem.max_blocks)
+		sd_info("%"PRIu32" blocks of memory cache", mem.max_blocks);
+}
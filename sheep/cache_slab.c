@@ -0,0 +1,442 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The slab keeps the objects of the object cache in fixed-size slots of one
+ * block device or one big preallocated file, instead of a file per object.
+ * An object takes as many slots as its size needs, and they don't have to be
+ * contiguous.
+ *
+ *  +--------+---------------------+--------+--------+-----
+ *  | header | slot table          | slot 0 | slot 1 | ...
+ *  +--------+---------------------+--------+--------+-----
+ *
+ * The slot table tells which part of which object a slot holds.  It is only
+ * read at start-up to rebuild the cache, after that the object cache keeps
+ * the slots of each object in memory and the data is read and written with
+ * O_DIRECT at the offsets they give.
+ *
+ * A slot is recorded in the table only after its first data is synced, and a
+ * freed slot is dropped from the table durably before it is reused, so a slot
+ * found at start-up never holds the data of another object.  The writes to the
+ * object after that may be lost by a crash like those to a file.
+ */
+
+#include <sys/ioctl.h>
+
+#include "sheep_priv.h"
+
+#ifndef BLKGETSIZE64
+/* from linux/fs.h, which conflicts with our BLOCK_SIZE */
+#define BLKSSZGET	_IO(0x12, 104)
+#define BLKGETSIZE64	_IOR(0x12, 114, size_t)
+#endif
+
+#define SLAB_MAGIC		0x534c4142 /* "SLAB" */
+#define SLAB_VERSION		1
+#define SLAB_HEADER_SIZE	4096
+
+#define SLAB_SLOT_USED		0x1
+
+struct slab_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t nr_slots;
+};
+
+struct slab_slot {
+	uint64_t idx; /* index of the object in the cache of the VDI */
+	uint32_t vid;
+	uint8_t nr; /* which part of the object the slot holds */
+	uint8_t count; /* nr of slots the object takes */
+	uint16_t flags;
+};
+
+static struct {
+	int fd; /* opened with O_DIRECT */
+	int buffered_fd; /* for the slot table and the unaligned requests */
+	uint32_t align; /* alignment required by O_DIRECT */
+	uint32_t nr_slots;
+	off_t data_offset;
+
+	struct sd_mutex lock; /* protects the free slots */
+	uint32_t *free_slots;
+	uint32_t nr_free;
+} slab = {
+	.fd = -1,
+	.buffered_fd = -1,
+};
+
+static inline off_t slot_offset(uint32_t slot)
+{
+	return slab.data_offset + (off_t)slot * SLAB_SLOT_SIZE;
+}
+
+static inline off_t slot_record_offset(uint32_t slot)
+{
+	return SLAB_HEADER_SIZE + (off_t)slot * sizeof(struct slab_slot);
+}
+
+static int write_slot_record(uint32_t slot, const struct slab_slot *rec)
+{
+	if (xpwrite(slab.buffered_fd, rec, sizeof(*rec),
+		    slot_record_offset(slot)) != sizeof(*rec)) {
+		sd_err("failed to record slot %"PRIu32", %m", slot);
+		return SD_RES_EIO;
+	}
+	return SD_RES_SUCCESS;
+}
+
+/* Reserve nr free slots, NULL if the slab is full */
+uint32_t *slab_alloc(int nr)
+{
+	uint32_t *slot;
+
+	sd_mutex_lock(&slab.lock);
+	if (slab.nr_free < nr) {
+		sd_mutex_unlock(&slab.lock);
+		sd_debug("no room for %d slots, %"PRIu32" free", nr,
+			 slab.nr_free);
+		return NULL;
+	}
+	slab.nr_free -= nr;
+	slot = xmalloc(sizeof(*slot) * nr);
+	memcpy(slot, slab.free_slots + slab.nr_free, sizeof(*slot) * nr);
+	sd_mutex_unlock(&slab.lock);
+
+	return slot;
+}
+
+/* Make the data written to the slab and the slot table durable */
+int slab_sync(void)
+{
+	if (fdatasync(slab.buffered_fd) < 0) {
+		sd_err("failed to sync the slab, %m");
+		return SD_RES_EIO;
+	}
+	return SD_RES_SUCCESS;
+}
+
+/* Record the slots in the table, their data must be synced already */
+int slab_commit(const uint32_t *slot, int nr, uint32_t vid, uint64_t idx)
+{
+	struct slab_slot rec = {
+		.idx = idx,
+		.vid = vid,
+		.count = nr,
+		.flags = SLAB_SLOT_USED,
+	};
+	int ret;
+
+	for (int i = 0; i < nr; i++) {
+		rec.nr = i;
+		ret = write_slot_record(slot[i], &rec);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Drop the slots from the table and give them back.  If the table can't be
+ * synced, the slots are leaked until restart rather than recorded for two
+ * objects.
+ */
+void slab_free(const uint32_t *slot, int nr)
+{
+	static const struct slab_slot unused;
+
+	for (int i = 0; i < nr; i++)
+		write_slot_record(slot[i], &unused);
+	if (slab_sync() != SD_RES_SUCCESS)
+		return;
+
+	sd_mutex_lock(&slab.lock);
+	memcpy(slab.free_slots + slab.nr_free, slot, sizeof(*slot) * nr);
+	slab.nr_free += nr;
+	sd_mutex_unlock(&slab.lock);
+}
+
+static inline bool dio_aligned(const void *buf, size_t count, off_t offset)
+{
+	return (((uintptr_t)buf | count | offset) & (slab.align - 1)) == 0;
+}
+
+static int slab_rw(const uint32_t *slot, void *buf, size_t count, off_t offset,
+		   bool write)
+{
+	while (count > 0) {
+		size_t off = offset % SLAB_SLOT_SIZE;
+		size_t len = min(count, SLAB_SLOT_SIZE - off);
+		off_t pos = slot_offset(slot[offset / SLAB_SLOT_SIZE]) + off;
+		int fd = dio_aligned(buf, len, pos) ? slab.fd : slab.buffered_fd;
+		ssize_t size;
+
+		if (write)
+			size = xpwrite(fd, buf, len, pos);
+		else
+			size = xpread(fd, buf, len, pos);
+		if (unlikely(size != len)) {
+			sd_err("size %zd, count:%zu, offset %jd %m", size, len,
+			       (intmax_t)pos);
+			return SD_RES_EIO;
+		}
+		buf = (char *)buf + len;
+		offset += len;
+		count -= len;
+	}
+	return SD_RES_SUCCESS;
+}
+
+int slab_read(const uint32_t *slot, void *buf, size_t count, off_t offset)
+{
+	return slab_rw(slot, buf, count, offset, false);
+}
+
+int slab_write(const uint32_t *slot, const void *buf, size_t count,
+	       off_t offset)
+{
+	return slab_rw(slot, (void *)buf, count, offset, true);
+}
+
+/* Make the slots read as zeros, like a preallocated file */
+int slab_zero(const uint32_t *slot, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		if (punch_hole(slab.buffered_fd, slot_offset(slot[i]),
+			       SLAB_SLOT_SIZE) < 0) {
+			sd_err("failed to zero slot %"PRIu32", %m", slot[i]);
+			return SD_RES_EIO;
+		}
+	return SD_RES_SUCCESS;
+}
+
+struct slab_load_entry {
+	struct slab_slot rec;
+	uint32_t slot;
+};
+
+static int slab_load_cmp(const struct slab_load_entry *a,
+			 const struct slab_load_entry *b)
+{
+	return intcmp(a->rec.vid, b->rec.vid) ?:
+		intcmp(a->rec.idx, b->rec.idx) ?:
+		intcmp(a->rec.nr, b->rec.nr);
+}
+
+/*
+ * Hand the objects recorded in the slot table to fn.  The slots of the objects
+ * which are not whole, e.g. because of a crash while they were recorded or
+ * freed, are dropped.
+ */
+static int slab_load(void (*fn)(uint32_t vid, uint64_t idx, uint32_t *slot,
+				int nr))
+{
+	size_t len = sizeof(struct slab_slot) * slab.nr_slots;
+	struct slab_slot *table = xvalloc(len);
+	struct slab_load_entry *ents;
+	bool *used;
+	int nr_ents = 0;
+
+	if (xpread(slab.buffered_fd, table, len, SLAB_HEADER_SIZE) != len) {
+		sd_err("failed to read the slot table, %m");
+		free(table);
+		return SD_RES_EIO;
+	}
+
+	ents = xmalloc(sizeof(*ents) * slab.nr_slots);
+	for (uint32_t i = 0; i < slab.nr_slots; i++) {
+		if (!(table[i].flags & SLAB_SLOT_USED))
+			continue;
+		ents[nr_ents].rec = table[i];
+		ents[nr_ents].slot = i;
+		nr_ents++;
+	}
+	free(table);
+	xqsort(ents, nr_ents, slab_load_cmp);
+
+	used = xzalloc(sizeof(*used) * slab.nr_slots);
+	for (int i = 0, j; i < nr_ents; i = j) {
+		static const struct slab_slot unused;
+		uint32_t *slot;
+		bool whole = true;
+
+		for (j = i; j < nr_ents && ents[j].rec.vid == ents[i].rec.vid &&
+			     ents[j].rec.idx == ents[i].rec.idx; j++)
+			if (ents[j].rec.nr != j - i ||
+			    ents[j].rec.count != ents[i].rec.count)
+				whole = false;
+		if (j - i != ents[i].rec.count)
+			whole = false;
+
+		if (!whole) {
+			sd_info("drop the partial object %"PRIx64" of %"PRIx32,
+				ents[i].rec.idx, ents[i].rec.vid);
+			for (int k = i; k < j; k++)
+				write_slot_record(ents[k].slot, &unused);
+			continue;
+		}
+
+		slot = xmalloc(sizeof(*slot) * (j - i));
+		for (int k = i; k < j; k++) {
+			slot[k - i] = ents[k].slot;
+			used[ents[k].slot] = true;
+		}
+		fn(ents[i].rec.vid, ents[i].rec.idx, slot, j - i);
+	}
+
+	/* the dropped slots are reused */
+	if (slab_sync() != SD_RES_SUCCESS) {
+		free(used);
+		free(ents);
+		return SD_RES_EIO;
+	}
+	for (uint32_t i = 0; i < slab.nr_slots; i++)
+		if (!used[i])
+			slab.free_slots[slab.nr_free++] = i;
+
+	free(used);
+	free(ents);
+	return SD_RES_SUCCESS;
+}
+
+static int slab_format(void)
+{
+	struct slab_header *hdr = xvalloc(SLAB_HEADER_SIZE);
+	int ret = SD_RES_SUCCESS;
+
+	sd_info("format the slab, %"PRIu32" slots", slab.nr_slots);
+
+	if (punch_hole(slab.buffered_fd, SLAB_HEADER_SIZE,
+		       slab.data_offset - SLAB_HEADER_SIZE) < 0) {
+		sd_err("failed to clear the slot table, %m");
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	memset(hdr, 0, SLAB_HEADER_SIZE);
+	hdr->magic = SLAB_MAGIC;
+	hdr->version = SLAB_VERSION;
+	hdr->slot_size = SLAB_SLOT_SIZE;
+	hdr->nr_slots = slab.nr_slots;
+	if (xpwrite(slab.buffered_fd, hdr, SLAB_HEADER_SIZE, 0) !=
+	    SLAB_HEADER_SIZE || fdatasync(slab.buffered_fd) < 0) {
+		sd_err("failed to write the slab header, %m");
+		ret = SD_RES_EIO;
+	}
+out:
+	free(hdr);
+	return ret;
+}
+
+/* Lay the slots out in the first 'size' bytes of the device */
+static void slab_layout(uint64_t size)
+{
+	uint64_t nr;
+
+	nr = (size - SLAB_HEADER_SIZE) /
+		(SLAB_SLOT_SIZE + sizeof(struct slab_slot));
+	for (;;) {
+		slab.data_offset = round_up(slot_record_offset(nr),
+					    SLAB_SLOT_SIZE);
+		if (slab.data_offset + nr * SLAB_SLOT_SIZE <= size)
+			break;
+		nr--;
+	}
+	slab.nr_slots = min(nr, (uint64_t)UINT32_MAX);
+}
+
+static int slab_open(const char *path, uint64_t *size)
+{
+	struct stat st;
+
+	slab.buffered_fd = open(path, O_RDWR | O_CREAT, sd_def_fmode);
+	if (slab.buffered_fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return -1;
+	}
+	if (fstat(slab.buffered_fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", path);
+		return -1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t dev_size;
+		int sector_size;
+
+		if (ioctl(slab.buffered_fd, BLKGETSIZE64, &dev_size) < 0 ||
+		    ioctl(slab.buffered_fd, BLKSSZGET, &sector_size) < 0) {
+			sd_err("failed to get the geometry of %s, %m", path);
+			return -1;
+		}
+		*size = min(*size, dev_size);
+		slab.align = sector_size;
+	} else {
+		if (st.st_size < *size && prealloc(slab.buffered_fd, *size)) {
+			sd_err("failed to preallocate %s, %m", path);
+			return -1;
+		}
+		slab.align = 4096;
+	}
+
+	slab.fd = open(path, O_RDWR | O_DIRECT);
+	if (slab.fd < 0) {
+		sd_err("failed to open %s with O_DIRECT, %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Use 'path' as the slab, a block device or a file which is preallocated to
+ * 'size' bytes, and load the objects found in it.  The slab takes at most
+ * 'size' bytes of a device, the size actually used is returned.
+ */
+uint64_t slab_init(const char *path, uint64_t size,
+		   void (*fn)(uint32_t vid, uint64_t idx, uint32_t *slot,
+			      int nr))
+{
+	struct slab_header *hdr = xvalloc(SLAB_HEADER_SIZE);
+	uint64_t ret = 0;
+
+	sd_init_mutex(&slab.lock);
+	if (slab_open(path, &size) < 0)
+		goto out;
+
+	if (size < SLAB_HEADER_SIZE + SLAB_SLOT_SIZE * 2) {
+		sd_err("%s is too small for the object cache", path);
+		goto out;
+	}
+	slab_layout(size);
+	slab.free_slots = xmalloc(sizeof(uint32_t) * slab.nr_slots);
+	slab.nr_free = 0;
+
+	if (xpread(slab.buffered_fd, hdr, SLAB_HEADER_SIZE, 0) !=
+	    SLAB_HEADER_SIZE) {
+		sd_err("failed to read the slab header, %m");
+		goto out;
+	}
+	if (hdr->magic != SLAB_MAGIC || hdr->version != SLAB_VERSION ||
+	    hdr->slot_size != SLAB_SLOT_SIZE ||
+	    hdr->nr_slots != slab.nr_slots) {
+		if (slab_format() != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	if (slab_load(fn) != SD_RES_SUCCESS)
+		goto out;
+
+	sd_info("%s: %"PRIu32" slots, %"PRIu32" free", path, slab.nr_slots,
+		slab.nr_free);
+	ret = (uint64_t)slab.nr_slots * SLAB_SLOT_SIZE;
+out:
+	free(hdr);
+	return ret;
+}
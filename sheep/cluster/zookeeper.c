@@ -49,6 +49,15 @@ struct cluster_lock {
 	/* lock for different threads of the same node on the same id */
 	struct sd_mutex id_lock;
 	char lock_path[MAX_NODE_STR_LEN];
+	/*
+	 * After the last local unlock we keep lock_path for a lease period, so
+	 * the next zk_lock() of this node is granted without a round trip to
+	 * zookeeper. The lease holds one reference and ends when it expires or
+	 * is revoked by a waiter from another node.
+	 */
+	bool leased;
+	bool revoked;
+	uint64_t lease_expire;	/* nanosecond */
 };
 
 #define WAIT_TIME	1		/* second */
@@ -57,6 +66,10 @@ struct cluster_lock {
 static struct hlist_head *cluster_locks_table;
 static struct sd_mutex table_locks[HASH_BUCKET_NR];
 
+#define LOCK_LEASE_TIME	2000		/* millisecond */
+static int lease_efd;
+static bool lease_timer_armed;
+
 /*
  * Wait a while when create, delete or get_children fail on
  * zookeeper lock so it will not print too much loop log
@@ -326,6 +339,27 @@ static int lock_table_lookup_wakeup(uint64_t lock_id)
 	return res;
 }
 
+/* Called by zk_watcher() when the children of the lock directory change */
+static void lock_table_lookup_revoke(uint64_t lock_id)
+{
+	uint64_t hval = sd_hash_64(lock_id) % HASH_BUCKET_NR;
+	struct hlist_node *iter;
+	struct cluster_lock *lock;
+
+	sd_mutex_lock(table_locks + hval);
+	hlist_for_each_entry(lock, iter, cluster_locks_table + hval, hnode) {
+		if (lock->id != lock_id)
+			continue;
+		if (lock->leased) {
+			sd_debug("revoke lease of lock %"PRIu64, lock_id);
+			lock->revoked = true;
+			eventfd_xwrite(lease_efd, 1);
+		}
+		break;
+	}
+	sd_mutex_unlock(table_locks + hval);
+}
+
 static struct cluster_lock *lock_table_lookup_acquire(uint64_t lock_id)
 {
 	uint64_t hval = sd_hash_64(lock_id) % HASH_BUCKET_NR;
@@ -370,54 +404,220 @@ static struct cluster_lock *lock_table_lookup_acquire(uint64_t lock_id)
 	return ret_lock;
 }
 
+static void lock_delete_znode(struct cluster_lock *lock)
+{
+	int rc;
+
+	while (true) {
+		rc = zk_delete_node(lock->lock_path, -1);
+		if (rc == ZOK || rc == ZNONODE) {
+			sd_debug("delete path: %s ok", lock->lock_path);
+			break;
+		}
+		sd_err("Failed to delete path: %s %s", lock->lock_path,
+		       zerror(rc));
+		zk_wait();
+	}
+	lock->lock_path[0] = '\0';
+}
+
+/* Drop a reference of the lock, the caller must hold its bucket lock */
+static void lock_put_nolock(struct cluster_lock *lock)
+{
+	int rc;
+	char path[MAX_NODE_STR_LEN];
+
+	lock->ref--;
+	if (lock->ref)
+		return;
+
+	hlist_del(&lock->hnode);
+	/* free all resource used by this lock */
+	sd_destroy_mutex(&lock->id_lock);
+	sem_destroy(&lock->wait_wakeup);
+	snprintf(path, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64, lock->id);
+	/*
+	 * If deletion of directory 'lock_id' fail, we only get
+	 * a * empty directory in zookeeper. That's unharmful
+	 * so we don't need to retry it.
+	 */
+	rc = zk_delete_node(path, -1);
+	if (rc != ZOK)
+		sd_err("Failed to delete path: %s %s", path, zerror(rc));
+	free(lock);
+}
+
+/* Drop the lease and its reference, its znode must be gone already */
+static void lock_drop_lease_nolock(struct cluster_lock *lock)
+{
+	lock->lock_path[0] = '\0';
+	lock->leased = false;
+	lock->revoked = false;
+	lock_put_nolock(lock);
+}
+
+/* Give up the znode held by the lease and the reference of the lease */
+static void lock_end_lease_nolock(struct cluster_lock *lock)
+{
+	lock_delete_znode(lock);
+	lock_drop_lease_nolock(lock);
+}
+
+/*
+ * End the lease without waiting for zookeeper, for the main thread.  Returns
+ * false if the znode can't be deleted now and the lease is left for a later
+ * try.
+ */
+static bool lock_try_end_lease_nolock(struct cluster_lock *lock)
+{
+	int rc, state = zoo_state(zhandle);
+
+	if (state == ZOO_EXPIRED_SESSION_STATE) {
+		/* the ephemeral znode has gone with the session */
+		lock_drop_lease_nolock(lock);
+		return true;
+	}
+	if (state != ZOO_CONNECTED_STATE)
+		return false;
+
+	rc = zoo_delete(zhandle, lock->lock_path, -1);
+	if (rc != ZOK && rc != ZNONODE) {
+		sd_err("Failed to delete path: %s %s", lock->lock_path,
+		       zerror(rc));
+		return false;
+	}
+
+	sd_debug("delete path: %s ok", lock->lock_path);
+	lock_drop_lease_nolock(lock);
+	return true;
+}
+
+/*
+ * Return true if a node other than us is queued on the lock. This also leaves
+ * a child watch on the lock directory, so a waiter which shows up later
+ * revokes the lease through zk_watcher().
+ */
+static bool lock_has_waiters(struct cluster_lock *lock)
+{
+	char parent[MAX_NODE_STR_LEN], path[MAX_NODE_STR_LEN];
+	struct String_vector strs;
+	int nr = 0;
+
+	snprintf(parent, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64, lock->id);
+	if (zk_get_children(parent, &strs) != ZOK)
+		return true;
+
+	FOR_EACH_ZNODE(parent, path, &strs)
+		nr++;
+
+	return nr > 1;
+}
+
+/*
+ * Try to re-grant the lock from the lease of a previous local owner. Return
+ * false if there is no valid lease and the caller has to compete for the lock
+ * in zookeeper.
+ */
+static bool lock_table_take_lease(struct cluster_lock *lock)
+{
+	uint64_t hval = sd_hash_64(lock->id) % HASH_BUCKET_NR;
+	bool ret = false;
+
+	sd_mutex_lock(table_locks + hval);
+	if (!lock->leased)
+		goto out;
+
+	/*
+	 * The session may have expired behind our back, and then our ephemeral
+	 * znode is gone with it.
+	 */
+	if (lock->revoked || clock_get_time() >= lock->lease_expire ||
+	    zoo_state(zhandle) != ZOO_CONNECTED_STATE) {
+		lock_end_lease_nolock(lock);
+		goto out;
+	}
+
+	/* the reference of the lease is passed to the caller */
+	lock->leased = false;
+	lock->ref--;
+	ret = true;
+out:
+	sd_mutex_unlock(table_locks + hval);
+	return ret;
+}
+
 static void lock_table_lookup_release(uint64_t lock_id)
 {
 	uint64_t hval = sd_hash_64(lock_id) % HASH_BUCKET_NR;
-	int rc;
 	struct hlist_node *iter;
 	struct cluster_lock *lock;
-	char path[MAX_NODE_STR_LEN];
 
 	sd_mutex_lock(table_locks + hval);
 	hlist_for_each_entry(lock, iter, cluster_locks_table + hval, hnode) {
 		if (lock->id != lock_id)
 			continue;
-		while (true) {
-			rc = zk_delete_node(lock->lock_path, -1);
-			if (rc == ZOK || rc == ZNONODE) {
-				sd_debug("delete path: %s ok", lock->lock_path);
-				break;
-			}
-			sd_err("Failed to delete path: %s %s", lock->lock_path,
-			       zerror(rc));
-			zk_wait();
+		if (!lock_has_waiters(lock)) {
+			/* keep the znode, our reference goes to the lease */
+			lock->leased = true;
+			lock->lease_expire = clock_get_time() +
+				LOCK_LEASE_TIME * 1000000ULL;
+			sd_mutex_unlock(&lock->id_lock);
+			break;
 		}
-		lock->lock_path[0] = '\0';
+		lock_delete_znode(lock);
 		sd_mutex_unlock(&lock->id_lock);
-		lock->ref--;
-		if (!lock->ref) {
-			hlist_del(iter);
-			/* free all resource used by this lock */
-			sd_destroy_mutex(&lock->id_lock);
-			sem_destroy(&lock->wait_wakeup);
-			snprintf(path, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64,
-				 lock->id);
-			/*
-			 * If deletion of directory 'lock_id' fail, we only get
-			 * a * empty directory in zookeeper. That's unharmful
-			 * so we don't need to retry it.
-			 */
-			rc = zk_delete_node(path, -1);
-			if (rc != ZOK)
-				sd_err("Failed to delete path: %s %s", path,
-				      zerror(rc));
-			free(lock);
-		}
+		lock_put_nolock(lock);
 		break;
 	}
 	sd_mutex_unlock(table_locks + hval);
 }
 
+/*
+ * End the leases which are expired or revoked.  This is called in the main
+ * thread, which must not wait for zookeeper so that handle_session_expire()
+ * can run, so a lease whose znode can't be deleted now is left for the next
+ * tick of lease_timer.
+ */
+static void lock_table_reap_leases(void)
+{
+	uint64_t hval, now = clock_get_time();
+	struct hlist_node *iter;
+	struct cluster_lock *lock;
+
+	for (hval = 0; hval < HASH_BUCKET_NR; hval++) {
+		sd_mutex_lock(table_locks + hval);
+		hlist_for_each_entry(lock, iter, cluster_locks_table + hval,
+				     hnode) {
+			if (!lock->leased)
+				continue;
+			if (!lock->revoked && now < lock->lease_expire)
+				continue;
+			sd_debug("end lease of lock %"PRIu64, lock->id);
+			if (!lock_try_end_lease_nolock(lock))
+				lock->revoked = true;
+		}
+		sd_mutex_unlock(table_locks + hval);
+	}
+}
+
+static void lease_event_handler(int fd, int events, void *data)
+{
+	eventfd_xread(fd);
+	lock_table_reap_leases();
+}
+
+static void lease_timer_handler(void *data);
+
+static struct timer lease_timer = {
+	.callback = lease_timer_handler,
+};
+
+static void lease_timer_handler(void *data)
+{
+	lock_table_reap_leases();
+	add_timer(&lease_timer, LOCK_LEASE_TIME / 2);
+}
+
 /*
  * If this node leave the cluster, we need to delete the znode which created
  * for distributed lock. Otherwise, the lock will never be released.
@@ -425,7 +625,6 @@ static void lock_table_lookup_release(uint64_t lock_id)
 static void lock_table_remove_znodes(void)
 {
 	uint64_t hval;
-	int rc;
 	struct hlist_node *iter;
 	struct cluster_lock *lock;
 
@@ -433,18 +632,10 @@ static void lock_table_remove_znodes(void)
 		sd_mutex_lock(table_locks + hval);
 		hlist_for_each_entry(lock, iter, cluster_locks_table + hval,
 				     hnode) {
-			while (true) {
-				rc = zk_delete_node(lock->lock_path, -1);
-				if (rc == ZOK || rc == ZNONODE) {
-					sd_debug("delete path: %s ok",
-						 lock->lock_path);
-					break;
-				}
-				sd_err("Failed to delete path: %s %s",
-				       lock->lock_path,
-				       zerror(rc));
-				zk_wait();
-			}
+			if (lock->leased)
+				lock_end_lease_nolock(lock);
+			else
+				lock_delete_znode(lock);
 		}
 		sd_mutex_unlock(table_locks + hval);
 	}
@@ -746,6 +937,11 @@ static void zk_watcher(zhandle_t *zh, int type, int state, const char *path,
 			zk_node_exists(path);
 		/* kick off the event handler */
 		eventfd_xwrite(efd, 1);
+	} else if (type == ZOO_CHILD_EVENT) {
+		/* a waiter from other node revokes our lease */
+		ret = sscanf(path, LOCK_ZNODE "/%"PRIu64"%s", &lock_id, str);
+		if (ret == 1)
+			lock_table_lookup_revoke(lock_id);
 	} else if (type == ZOO_DELETED_EVENT) {
 		struct zk_node *n;
 
@@ -1269,6 +1465,8 @@ static inline void handle_session_expire(void)
 	/* clean memory states */
 	unregister_event(efd);
 	close(efd);
+	unregister_event(lease_efd);
+	close(lease_efd);
 	zk_tree_destroy();
 	INIT_RB_ROOT(&zk_node_root);
 	INIT_LIST_HEAD(&zk_block_list);
@@ -1345,6 +1543,9 @@ kick_block_event:
  * of zookeeper (use lock-id as dir name). The smallest file path in
  * this directory wil be the owner of the lock; the other threads will
  * wait on a sem_t (cluster_lock->wait_wakeup)
+ *
+ * If this node still holds the znode from the lease of the previous owner,
+ * the lock is granted locally.
  */
 static void zk_lock(uint64_t lock_id)
 {
@@ -1357,6 +1558,10 @@ static void zk_lock(uint64_t lock_id)
 	struct cluster_lock *cluster_lock;
 
 	cluster_lock = lock_table_lookup_acquire(lock_id);
+	if (lock_table_take_lease(cluster_lock)) {
+		sd_debug("granted lock %"PRIu64" from lease", lock_id);
+		return;
+	}
 
 	my_path = cluster_lock->lock_path;
 
@@ -1544,6 +1749,23 @@ static int zk_init(const char *option)
 		free(cluster_locks_table);
 		return -1;
 	}
+
+	lease_efd = eventfd(0, EFD_NONBLOCK);
+	if (lease_efd < 0) {
+		sd_err("failed to create an event fd: %m");
+		return -1;
+	}
+
+	ret = register_event(lease_efd, lease_event_handler, NULL);
+	if (ret) {
+		sd_err("failed to register lock lease handler (%d)", ret);
+		return -1;
+	}
+
+	if (!lease_timer_armed) {
+		add_timer(&lease_timer, LOCK_LEASE_TIME / 2);
+		lease_timer_armed = true;
+	}
 	return 0;
 }
 
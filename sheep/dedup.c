@@ -0,0 +1,102 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The dedup worker periodically walks the objects stored on this node, see
+ * walk.c, at most sys->dedup_iops objects a second per disk, and lets the
+ * store share the data objects which have not been written for
+ * sys->dedup_age seconds with the objects of the same content.
+ * Clones of one base image then keep the blocks they all got, e.g. from the
+ * same OS update, only once per disk.  Nothing is done in the write path
+ * except for giving a shared object its own copy on the first write.
+ */
+
+#include "sheep_priv.h"
+
+/* delay before the first pass after start-up, in seconds */
+#define DEDUP_START_DELAY	600
+
+/* state of the running pass, there is one at a time */
+static time_t cold;
+static uint64_t nr_shared, saved_bytes;
+
+static void dedup_object(uint64_t oid, struct oid_walk *walk)
+{
+	uint64_t saved;
+	int ret;
+
+	ret = sd_store->dedup(oid, cold, &saved);
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		if (saved) {
+			uatomic_inc(&nr_shared);
+			uatomic_add(&saved_bytes, saved);
+		}
+		break;
+	case SD_RES_NO_OBJ:
+		break;
+	default:
+		sd_err("failed to deduplicate %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+		break;
+	}
+}
+
+static bool dedup_prepare(struct oid_walk *walk)
+{
+	if (!sd_store->dedup) {
+		sd_err("%s store doesn't support deduplication",
+		       sd_store->name);
+		return false;
+	}
+
+	cold = time(NULL) - sys->dedup_age;
+	nr_shared = 0;
+	saved_bytes = 0;
+	return true;
+}
+
+static void dedup_finish(struct oid_walk *walk, bool done)
+{
+	if (done)
+		sd_store->purge_dedup();
+
+	uatomic_add(&sys->stat.d.nr_shared, nr_shared);
+	uatomic_add(&sys->stat.d.saved_bytes, saved_bytes);
+	sd_info("%"PRIu64" objects are deduplicated, %"PRIu64" bytes freed",
+		nr_shared, saved_bytes);
+}
+
+static struct oid_walker deduplicator = {
+	.name = "dedup",
+	.start_delay = DEDUP_START_DELAY,
+	.prepare = dedup_prepare,
+	.object_fn = dedup_object,
+	.finish = dedup_finish,
+};
+
+int dedup_init(void)
+{
+	if (!sys->dedup_age || sys->gateway_only)
+		return 0;
+
+	sys->dedup_wqueue = create_ordered_work_queue("dedup");
+	if (!sys->dedup_wqueue)
+		return -1;
+
+	deduplicator.iops = sys->dedup_iops;
+	deduplicator.interval = sys->dedup_interval;
+	deduplicator.wqueue = sys->dedup_wqueue;
+	start_oid_walker(&deduplicator);
+	sd_info("deduplicating objects older than %"PRIu32" seconds at %"
+		PRIu32" iops per disk every %"PRIu32" seconds", sys->dedup_age,
+		sys->dedup_iops, sys->dedup_interval);
+
+	return 0;
+}
@@ -24,6 +24,7 @@ struct req_iter {
 	uint32_t wlen;
 	uint32_t dlen;
 	uint64_t off;
+	uint32_t plen; /* length of the range to punch */
 };
 
 static struct req_iter *prepare_replication_requests(struct request *req,
@@ -43,6 +44,7 @@ static struct req_iter *prepare_replication_requests(struct request *req,
 		reqs[i].dlen = len;
 		reqs[i].off = off;
 		reqs[i].wlen = len;
+		reqs[i].plen = req->rq.obj.length;
 	}
 	return reqs;
 }
@@ -183,6 +185,33 @@ out:
 	return reqs;
 }
 
+/*
+ * The strips of the stripes which are zero are zero, parity strips included,
+ * so we punch the same range of every strip for the stripes which are wholly
+ * in the range.  The rest of the range is left as is.
+ */
+static struct req_iter *prepare_erasure_punch(struct request *req, int *nr)
+{
+	uint64_t off = req->rq.obj.offset, len = req->rq.obj.length;
+	int start = DIV_ROUND_UP(off, SD_EC_DATA_STRIPE_SIZE);
+	int end = (off + len) / SD_EC_DATA_STRIPE_SIZE;
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
+	int ed = 0, edp, strip_size;
+	struct req_iter *reqs;
+
+	edp = ec_policy_to_dp(policy, &ed, NULL);
+	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+	reqs = xzalloc(sizeof(*reqs) * edp);
+
+	*nr = edp;
+	for (int i = 0; i < edp; i++) {
+		reqs[i].off = start * strip_size;
+		reqs[i].plen = start < end ? (end - start) * strip_size : 0;
+	}
+	return reqs;
+}
+
 bool is_erasure_oid(uint64_t oid)
 {
 	return !is_vdi_obj(oid) && !is_vdi_btree_obj(oid) &&
@@ -192,10 +221,12 @@ bool is_erasure_oid(uint64_t oid)
 /* Prepare request iterator and buffer for each replica */
 static struct req_iter *prepare_requests(struct request *req, int *nr)
 {
-	if (is_erasure_oid(req->rq.obj.oid))
-		return prepare_erasure_requests(req, nr);
-	else
+	if (!is_erasure_oid(req->rq.obj.oid))
 		return prepare_replication_requests(req, nr);
+	else if (req->rq.opcode == SD_OP_PUNCH_OBJ)
+		return prepare_erasure_punch(req, nr);
+	else
+		return prepare_erasure_requests(req, nr);
 }
 
 static void finish_requests(struct request *req, struct req_iter *reqs,
@@ -307,177 +338,54 @@ out:
 	return ret;
 }
 
-struct forward_info_entry {
-	struct pollfd pfd;
-	const struct node_id *nid;
-	struct sockfd *sfd;
-	void *buf;
-};
-
 struct forward_info {
-	struct forward_info_entry ent[SD_MAX_NODES];
+	struct sockfd_req sreqs[SD_MAX_COPIES];
 	int nr_sent;
 };
 
-static inline void forward_info_update(struct forward_info *fi, int pos)
-{
-	sd_debug("%d, %d", fi->nr_sent, pos);
-	fi->nr_sent--;
-	memmove(fi->ent + pos, fi->ent + pos + 1,
-		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
-}
-
-static inline void finish_one_entry(struct forward_info *fi, int i)
-{
-	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
-	forward_info_update(fi, i);
-}
-
-static inline void finish_one_entry_err(struct forward_info *fi, int i)
-{
-	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
-	forward_info_update(fi, i);
-}
-
-static inline struct forward_info_entry *
-forward_info_find(struct forward_info *fi, int fd)
-{
-	for (int i = 0; i < fi->nr_sent; i++)
-		if (fi->ent[i].pfd.fd == fd)
-			return &fi->ent[i];
-
-	panic("can't find entry for %d", fd);
-	return NULL;
-}
-
-struct pfd_info {
-	struct pollfd pfds[SD_MAX_NODES];
-	int nr;
-};
-
-static inline void pfd_info_init(struct forward_info *fi, struct pfd_info *pi)
-{
-	int i;
-	for (i = 0; i < fi->nr_sent; i++)
-		pi->pfds[i] = fi->ent[i].pfd;
-	pi->nr = fi->nr_sent;
-}
-
 /*
  * Wait for all forward requests completion.
  *
- * Even if something goes wrong, we have to wait forward requests completion to
- * avoid interleaved requests.
+ * Even if something goes wrong, we have to wait forward requests completion
+ * because the peers write the responses into the buffers of the requests.
  *
  * Return error code if any one request fails.
  */
 static int wait_forward_request(struct forward_info *fi, struct request *req)
 {
-	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i,
-	    repeat = MAX_RETRY_COUNT;
-	struct pfd_info pi;
-	struct sd_rsp *rsp = &req->rp;
-again:
-	pfd_info_init(fi, &pi);
-	pollret = poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
-	if (pollret < 0) {
-		if (errno == EINTR)
-			goto again;
-
-		panic("%m");
-	} else if (pollret == 0) {
-		/*
-		 * If IO NIC is down, epoch isn't incremented, so we can't retry
-		 * for ever.
-		 */
-		if (sheep_need_retry(req->rq.epoch) && repeat) {
-			repeat--;
-			sd_warn("poll timeout %d, disks of some nodes or "
-				"network is busy. Going to poll-wait again",
-				fi->nr_sent);
-			goto again;
-		}
-
-		nr_sent = fi->nr_sent;
-		/* XXX Blindly close all the connections */
-		for (i = 0; i < nr_sent; i++)
-			sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+	int err_ret = SD_RES_SUCCESS, ret, i;
+	bool empty = true;
 
-		return SD_RES_NETWORK_ERROR;
-	}
+	for (i = 0; i < fi->nr_sent; i++) {
+		struct sockfd_req *sreq = fi->sreqs + i;
+		struct sd_rsp *rsp = (struct sd_rsp *)&sreq->hdr;
 
-	nr_sent = fi->nr_sent;
-	for (i = 0; i < nr_sent; i++)
-		if (pi.pfds[i].revents & POLLIN)
-			break;
-	if (i < nr_sent) {
-		int re = pi.pfds[i].revents;
-		sd_debug("%d, revents %x", i, re);
-		if (re & (POLLERR | POLLHUP | POLLNVAL)) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
-			goto out;
-		}
-		if (do_read(pi.pfds[i].fd, rsp, sizeof(*rsp), sheep_need_retry,
-			    req->rq.epoch, MAX_RETRY_COUNT)) {
+		if (sockfd_cache_wait(sreq, sheep_need_retry, req->rq.epoch,
+				      MAX_RETRY_COUNT)) {
 			sd_err("remote node might have gone away");
 			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
-			goto out;
+			continue;
 		}
 
-		if (rsp->data_length) {
-			struct forward_info_entry *ent;
-
-			ent = forward_info_find(fi, pi.pfds[i].fd);
-			if (do_read(pi.pfds[i].fd, ent->buf, rsp->data_length,
-				    sheep_need_retry, req->rq.epoch,
-				    MAX_RETRY_COUNT)) {
-				sd_err("remote node might have gone away");
-				err_ret = SD_RES_NETWORK_ERROR;
-				finish_one_entry_err(fi, i);
-				goto out;
-			}
-		}
+		memcpy(&req->rp, rsp, sizeof(*rsp));
 		ret = rsp->result;
 		if (ret != SD_RES_SUCCESS) {
 			sd_debug("fail %"PRIx64", %s", req->rq.obj.oid,
 				 sd_strerror(ret));
 			err_ret = ret;
 		}
-		finish_one_entry(fi, i);
+		empty = empty && rsp->obj.empty;
 	}
-out:
-	if (fi->nr_sent > 0)
-		goto again;
 
-	return err_ret;
-}
+	/* the object is empty only if all the replicas say so */
+	req->rp.obj.empty = empty && err_ret == SD_RES_SUCCESS;
 
-static inline void forward_info_init(struct forward_info *fi, size_t nr_to_send)
-{
-	int i;
-	for (i = 0; i < nr_to_send; i++)
-		fi->ent[i].pfd.fd = -1;
-	fi->nr_sent = 0;
-}
-
-static inline void
-forward_info_advance(struct forward_info *fi, const struct node_id *nid,
-		     struct sockfd *sfd, void *buf)
-{
-	fi->ent[fi->nr_sent].nid = nid;
-	fi->ent[fi->nr_sent].pfd.fd = sfd->fd;
-	fi->ent[fi->nr_sent].pfd.events = POLLIN;
-	fi->ent[fi->nr_sent].sfd = sfd;
-	fi->ent[fi->nr_sent].buf = buf;
-	fi->nr_sent++;
+	return err_ret;
 }
 
 static int gateway_forward_request(struct request *req)
 {
 	int i, err_ret = SD_RES_SUCCESS, ret;
-	unsigned wlen;
 	uint64_t oid = req->rq.obj.oid;
 	struct forward_info fi;
 	struct sd_req hdr;
@@ -489,7 +397,7 @@ static int gateway_forward_request(struct request *req)
 
 	gateway_init_fwd_hdr(&hdr, &req->rq);
 	oid_to_nodes(oid, &req->vinfo->vroot, nr_copies, target_nodes);
-	forward_info_init(&fi, nr_copies);
+	fi.nr_sent = 0;
 	reqs = prepare_requests(req, &nr_to_send);
 	if (!reqs)
 		return SD_RES_NETWORK_ERROR;
@@ -517,7 +425,7 @@ static int gateway_forward_request(struct request *req)
 	}
 
 	for (i = 0; i < nr_to_send; i++) {
-		struct sockfd *sfd;
+		struct sockfd_req *sreq = fi.sreqs + fi.nr_sent;
 		const struct node_id *nid;
 
 		nid = &target_nodes[i]->nid;
@@ -530,27 +438,23 @@ static int gateway_forward_request(struct request *req)
 		if (nid->status == NODE_STATUS_OFFLINE)
 			continue;
 
-		sfd = sockfd_cache_get(nid);
-		if (!sfd) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			break;
-		}
-
-		hdr.data_length = reqs[i].dlen;
-		wlen = reqs[i].wlen;
-		hdr.obj.offset = reqs[i].off;
-		hdr.obj.ec_index = i;
-		hdr.obj.copy_policy = req->rq.obj.copy_policy;
-		ret = send_req(sfd->fd, &hdr, reqs[i].buf, wlen,
-			       sheep_need_retry, req->rq.epoch,
-			       MAX_RETRY_COUNT);
+		sreq->hdr = hdr;
+		sreq->hdr.data_length = reqs[i].dlen;
+		sreq->hdr.obj.offset = reqs[i].off;
+		sreq->hdr.obj.length = reqs[i].plen;
+		sreq->hdr.obj.ec_index = i;
+		sreq->hdr.obj.copy_policy = req->rq.obj.copy_policy;
+		sreq->data = reqs[i].buf;
+		sreq->wlen = reqs[i].wlen;
+		sreq->rlen = reqs[i].dlen;
+		ret = sockfd_cache_submit(nid, sreq, sheep_need_retry,
+					  req->rq.epoch, MAX_RETRY_COUNT);
 		if (ret) {
-			sockfd_cache_del_node(nid);
 			err_ret = SD_RES_NETWORK_ERROR;
 			sd_debug("fail %d", ret);
 			break;
 		}
-		forward_info_advance(&fi, nid, sfd, reqs[i].buf);
+		fi.nr_sent++;
 	}
 
 	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
@@ -559,6 +463,9 @@ static int gateway_forward_request(struct request *req)
 		if (ret != SD_RES_SUCCESS)
 			err_ret = ret;
 	}
+	/* we can't tell about the replicas on the offline nodes */
+	if (fi.nr_sent < nr_to_send)
+		req->rp.obj.empty = 0;
 out:
 	finish_requests(req, reqs, nr_reqs);
 	return err_ret;
@@ -656,7 +563,8 @@ static int unref_cow_object(const struct sd_req *hdr, uint32_t *vids,
 
 		/* Unrefount a COW object in the referenced vdi */
 		ret = sd_unref_object(vid_to_data_oid(vids[i], i + start),
-				      refs[i].generation, refs[i].count);
+				      refs[i].generation, refs[i].count,
+				      false);
 		if (ret != SD_RES_SUCCESS)
 			sd_err("fail, %d", ret);
 
@@ -730,14 +638,30 @@ out:
 	return ret;
 }
 
+/*
+ * Replicas try to clone the COW object from their copy of the parent first, see
+ * peer_cow_obj().  If one of them doesn't hold the parent, we build the whole
+ * object here and send it to all of them as before.  The strips of an erasure
+ * coded object are different from the ones of its parent on the same node, so
+ * they always take the latter path.
+ */
 static int gateway_handle_cow(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
-	size_t len = get_objsize(oid);
+	size_t len = get_vdi_objsize(oid);
 	struct sd_req hdr, *req_hdr = &req->rq;
-	char *buf = xvalloc(len);
+	char *buf;
 	int ret;
 
+	if (!is_erasure_oid(oid)) {
+		ret = gateway_forward_request(req);
+		if (ret != SD_RES_NO_OBJ)
+			return ret;
+		sd_debug("send the whole %"PRIx64, oid);
+	}
+
+	buf = xvalloc(len);
+
 	if (req->rq.data_length != len) {
 		/* Partial write, need read the copy first */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
@@ -782,6 +706,186 @@ int gateway_remove_object(struct request *req)
 	return gateway_forward_request(req);
 }
 
+/*
+ * Punch a hole in the range of every replica.  rp.obj.empty is set if no
+ * replica holds any data afterwards.
+ */
+int gateway_punch_object(struct request *req)
+{
+	if (oid_is_readonly(req->rq.obj.oid))
+		return SD_RES_READONLY;
+
+	return gateway_forward_request(req);
+}
+
+/* The entries of a batch must be in the request data and in their objects */
+bool write_batch_valid(const struct sd_req *hdr, const void *data)
+{
+	const struct sd_batch_entry *be = data;
+	uint32_t nr = hdr->obj.length, vid = oid_to_vid(hdr->obj.oid);
+
+	if (!nr || (uint64_t)nr * sizeof(*be) > hdr->data_length)
+		return false;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		if (!is_data_obj(be[i].oid) || oid_to_vid(be[i].oid) != vid)
+			return false;
+		if ((uint64_t)be[i].data_offset + be[i].length >
+		    hdr->data_length ||
+		    (uint64_t)be[i].offset + be[i].length >
+		    get_vdi_objsize(be[i].oid))
+			return false;
+	}
+	return true;
+}
+
+/* The entries of a batch which are written to the same node */
+struct batch_target {
+	const struct sd_node *node;
+	uint32_t nr;
+	uint32_t *idx; /* of the entries of the batch */
+	void *buf;
+	uint32_t len;
+};
+
+static struct batch_target *find_batch_target(struct batch_target *targets,
+					      int *nr_targets,
+					      const struct sd_node *node,
+					      uint32_t nr_entries)
+{
+	for (int i = 0; i < *nr_targets; i++)
+		if (targets[i].node == node)
+			return targets + i;
+
+	targets[*nr_targets].node = node;
+	targets[*nr_targets].idx = xmalloc(sizeof(uint32_t) * nr_entries);
+	return targets + (*nr_targets)++;
+}
+
+/* Build the request of the entries of the batch written to the node */
+static void prepare_batch_target(struct request *req, struct batch_target *t)
+{
+	const struct sd_batch_entry *be = req->data;
+	struct sd_batch_entry *tbe;
+	uint32_t align = getpagesize();
+	uint32_t len = round_up(sizeof(*tbe) * t->nr, align);
+
+	for (uint32_t i = 0; i < t->nr; i++)
+		len += round_up(be[t->idx[i]].length, align);
+
+	t->buf = xvalloc(len);
+	t->len = len;
+	tbe = t->buf;
+	memset(tbe, 0, sizeof(*tbe) * t->nr);
+
+	len = round_up(sizeof(*tbe) * t->nr, align);
+	for (uint32_t i = 0; i < t->nr; i++) {
+		const struct sd_batch_entry *e = be + t->idx[i];
+
+		tbe[i] = *e;
+		tbe[i].data_offset = len;
+		memcpy((char *)t->buf + len, (char *)req->data + e->data_offset,
+		       e->length);
+		len += round_up(e->length, align);
+	}
+}
+
+/*
+ * Write the entries of a batch with one request to each node, which carries
+ * all the entries of the batch the node holds a replica of.  Only replicated
+ * objects are written in batches.
+ */
+int gateway_write_batch(struct request *req)
+{
+	const struct sd_batch_entry *be = req->data;
+	uint32_t nr = req->rq.obj.length;
+	int nr_copies = get_req_copy_number(req), nr_targets = 0, nr_sent = 0;
+	int err_ret = SD_RES_SUCCESS, ret;
+	struct batch_target *targets;
+	struct sockfd_req *sreqs;
+	struct sd_req hdr;
+
+	if (!write_batch_valid(&req->rq, req->data) ||
+	    is_erasure_oid(req->rq.obj.oid))
+		return SD_RES_INVALID_PARMS;
+
+	for (uint32_t i = 0; i < nr; i++)
+		if (oid_is_readonly(be[i].oid))
+			return SD_RES_READONLY;
+
+	targets = xzalloc(sizeof(*targets) * nr * nr_copies);
+	for (uint32_t i = 0; i < nr; i++) {
+		const struct sd_node *target_nodes[SD_MAX_COPIES];
+
+		oid_to_nodes(be[i].oid, &req->vinfo->vroot, nr_copies,
+			     target_nodes);
+		for (int j = 0; j < nr_copies; j++) {
+			struct batch_target *t;
+
+			t = find_batch_target(targets, &nr_targets,
+					      target_nodes[j], nr);
+			t->idx[t->nr++] = i;
+		}
+	}
+	sd_debug("%"PRIu32" objects to %d nodes", nr, nr_targets);
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	sreqs = xzalloc(sizeof(*sreqs) * nr_targets);
+	for (int i = 0; i < nr_targets; i++) {
+		struct batch_target *t = targets + i;
+		struct sockfd_req *sreq = sreqs + nr_sent;
+
+		/* the same as gateway_forward_request() */
+		if (t->node->nid.status == NODE_STATUS_OFFLINE)
+			continue;
+
+		prepare_batch_target(req, t);
+		sreq->hdr = hdr;
+		sreq->hdr.data_length = t->len;
+		sreq->hdr.obj.oid = be[t->idx[0]].oid;
+		sreq->hdr.obj.offset = 0;
+		sreq->hdr.obj.length = t->nr;
+		sreq->data = t->buf;
+		sreq->wlen = t->len;
+		ret = sockfd_cache_submit(&t->node->nid, sreq, sheep_need_retry,
+					  req->rq.epoch, MAX_RETRY_COUNT);
+		if (ret) {
+			err_ret = SD_RES_NETWORK_ERROR;
+			sd_debug("fail %d", ret);
+			break;
+		}
+		nr_sent++;
+	}
+
+	/* wait for all of them, the peers write the responses into sreqs */
+	for (int i = 0; i < nr_sent; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)&sreqs[i].hdr;
+
+		if (sockfd_cache_wait(sreqs + i, sheep_need_retry,
+				      req->rq.epoch, MAX_RETRY_COUNT)) {
+			sd_err("remote node might have gone away");
+			err_ret = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+
+		memcpy(&req->rp, rsp, sizeof(*rsp));
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_debug("fail %"PRIx64", %s", req->rq.obj.oid,
+				 sd_strerror(rsp->result));
+			err_ret = rsp->result;
+		}
+	}
+	req->rp.data_length = 0;
+
+	for (int i = 0; i < nr_targets; i++) {
+		free(targets[i].idx);
+		free(targets[i].buf);
+	}
+	free(targets);
+	free(sreqs);
+	return err_ret;
+}
+
 static bool object_noref(uint32_t *ledger)
 {
 
@@ -804,6 +908,7 @@ int gateway_unref_object(struct request *req)
 	uint64_t ledger_oid = data_oid_to_ledger_oid(data_oid);
 	uint32_t generation = h->ref.generation;
 	uint32_t count = h->ref.count;
+	bool background = !!(h->flags & SD_FLAG_CMD_BACKGROUND);
 	uint32_t *ledger = xvalloc(SD_LEDGER_OBJ_SIZE);
 	int ret, offset;
 
@@ -832,11 +937,11 @@ int gateway_unref_object(struct request *req)
 
 	if (object_noref(ledger)) {
 		sd_debug("remove %"PRIx64, data_oid);
-		ret = sd_remove_object(data_oid);
+		ret = sd_remove_object(data_oid, background);
 		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
 			goto out;
 
-		ret = sd_remove_object(ledger_oid);
+		ret = sd_remove_object(ledger_oid, background);
 		if (ret == SD_RES_NO_OBJ)
 			ret = SD_RES_SUCCESS;
 		goto out;
@@ -29,50 +29,9 @@ static refcnt_t nr_get_vdis_works;
 
 static main_thread(struct vnode_info *) current_vnode_info;
 static main_thread(struct list_head *) pending_block_list;
+static main_thread(struct list_head *) running_block_list;
 static main_thread(struct list_head *) pending_notify_list;
 
-static int get_zones_nr_from(struct rb_root *nroot)
-{
-	int nr_zones = 0, j;
-	uint32_t zones[SD_MAX_COPIES];
-	struct sd_node *n;
-
-	rb_for_each_entry(n, nroot, rb) {
-		/*
-		 * Only count zones that actually store data, pure gateways
-		 * don't contribute to the redundancy level.
-		 */
-		if (!n->nr_vnodes)
-			continue;
-
-		for (j = 0; j < nr_zones; j++) {
-			if (n->zone == zones[j])
-				break;
-		}
-
-		if (j == nr_zones) {
-			zones[nr_zones] = n->zone;
-			if (++nr_zones == ARRAY_SIZE(zones))
-				break;
-		}
-	}
-
-	return nr_zones;
-}
-
-/*
- * Grab an additional reference to the passed in vnode info.
- *
- * The caller must already hold a reference to vnode_info, this function must
- * only be used to grab an additional reference from code that wants the
- * vnode information to outlive the request structure.
- */
-struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info)
-{
-	refcount_inc(&vnode_info->refcnt);
-	return vnode_info;
-}
-
 /*
  * Get a reference to the currently active vnode information structure,
  * this must only be called from the main thread.
@@ -88,91 +47,136 @@ main_fn struct vnode_info *get_vnode_info(void)
 	return grab_vnode_info(cur_vinfo);
 }
 
-/* Release a reference to the current vnode information. */
-void put_vnode_info(struct vnode_info *vnode_info)
+struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
+					struct vnode_info *cur_vinfo)
 {
-	if (vnode_info) {
-		if (refcount_dec(&vnode_info->refcnt) == 0) {
-			rb_destroy(&vnode_info->vroot, struct sd_vnode, rb);
-			rb_destroy(&vnode_info->nroot, struct sd_node, rb);
-			free(vnode_info);
-		}
+	struct sd_node nodes[SD_MAX_NODES];
+	struct rb_root nroot = RB_ROOT;
+	int nr_nodes = 0, ret;
+
+	ret = epoch_log_read(epoch, nodes, sizeof(nodes), &nr_nodes);
+	if (ret != SD_RES_SUCCESS) {
+		ret = epoch_log_read_remote(epoch, nodes, sizeof(nodes),
+						 &nr_nodes, NULL, cur_vinfo);
+		if (ret != SD_RES_SUCCESS)
+			return NULL;
 	}
+	for (int i = 0; i < nr_nodes; i++)
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+
+	return alloc_vnode_info_from(cur_vinfo, &nroot);
 }
 
-static void recalculate_vnodes(struct rb_root *nroot)
+/*
+ * Return the replica index of this node for objects whose first vnode is
+ * 'first', or nr_copies if this node doesn't hold any of them.
+ */
+static int local_copy_index(struct vnode_info *vinfo,
+			    const struct sd_vnode *first, int nr_copies)
 {
-	int nr_non_gateway_nodes = 0;
-	uint64_t avg_size = 0;
-	struct sd_node *n;
-	float factor;
-
-	rb_for_each_entry(n, nroot, rb) {
-		if (n->space) {
-			avg_size += n->space;
-			nr_non_gateway_nodes++;
-		}
-	}
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 
-	if (!nr_non_gateway_nodes)
-		return;
-
-	avg_size /= nr_non_gateway_nodes;
+	vnode_to_vnodes(first, &vinfo->vroot, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++)
+		if (vnode_is_local(vnodes[i]))
+			return i;
 
-	rb_for_each_entry(n, nroot, rb) {
-		factor = (float)n->space / (float)avg_size;
-		n->nr_vnodes = rintf(SD_DEFAULT_VNODES * factor);
-		sd_debug("node %s has %d vnodes, free space %" PRIu64,
-			 node_to_str(n), n->nr_vnodes, n->space);
-	}
+	return nr_copies;
 }
 
-struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
+static int add_vnode_range(struct vnode_range **ranges, int nr,
+			   uint64_t start, uint64_t end)
 {
-	struct vnode_info *vnode_info;
-	struct sd_node *n;
+	if (nr && (*ranges)[nr - 1].end + 1 == start) {
+		(*ranges)[nr - 1].end = end;
+		return nr;
+	}
 
-	vnode_info = xzalloc(sizeof(*vnode_info));
+	*ranges = xrealloc(*ranges, sizeof(**ranges) * (nr + 1));
+	(*ranges)[nr].start = start;
+	(*ranges)[nr].end = end;
+	return nr + 1;
+}
 
-	INIT_RB_ROOT(&vnode_info->vroot);
-	INIT_RB_ROOT(&vnode_info->nroot);
-	rb_for_each_entry(n, nroot, rb) {
-		struct sd_node *new = xmalloc(sizeof(*new));
-		*new = *n;
-		if (unlikely(rb_insert(&vnode_info->nroot, new, rb, node_cmp)))
-			panic("node hash collision");
-		vnode_info->nr_nodes++;
+static uint64_t *merge_vnode_hashes(struct vnode_info *old,
+				    struct vnode_info *cur, int *nr)
+{
+	struct rb_node *o = rb_first(&old->vroot), *c = rb_first(&cur->vroot);
+	uint64_t *hashes, h;
+	int n = 0;
+
+	hashes = xmalloc(sizeof(*hashes) *
+			 (old->vroot.nr + cur->vroot.nr));
+	while (o || c) {
+		uint64_t oh = o ? rb_entry(o, struct sd_vnode, rb)->hash : 0;
+		uint64_t ch = c ? rb_entry(c, struct sd_vnode, rb)->hash : 0;
+
+		if (!c || (o && oh <= ch)) {
+			h = oh;
+			o = rb_next(o);
+			if (c && ch == oh)
+				c = rb_next(c);
+		} else {
+			h = ch;
+			c = rb_next(c);
+		}
+		if (n == 0 || hashes[n - 1] != h)
+			hashes[n++] = h;
 	}
 
-	recalculate_vnodes(&vnode_info->nroot);
-
-	if (is_cluster_diskmode(&sys->cinfo))
-		disks_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
-	else
-		nodes_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
-	vnode_info->nr_zones = get_zones_nr_from(&vnode_info->nroot);
-	refcount_set(&vnode_info->refcnt, 1);
-	return vnode_info;
+	*nr = n;
+	return hashes;
 }
 
-struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
-					struct vnode_info *cur_vinfo)
+/*
+ * Compute the sorted hash ranges of the ring where this node's role for the
+ * first nr_copies replicas differs between 'old' and 'cur'.  Objects whose
+ * hash falls outside them are stored (or not) on this node in both rings.
+ *
+ * Returns the number of ranges, or -1 if the rings can't be compared and the
+ * caller has to check every object.
+ */
+int get_changed_vnode_ranges(struct vnode_info *old, struct vnode_info *cur,
+			     int nr_copies, struct vnode_range **ranges)
 {
-	struct sd_node nodes[SD_MAX_NODES];
-	struct rb_root nroot = RB_ROOT;
-	int nr_nodes = 0, ret;
+	uint64_t *hashes;
+	int nr_hashes, nr = 0;
+	bool wrap = false;
 
-	ret = epoch_log_read(epoch, nodes, sizeof(nodes), &nr_nodes);
-	if (ret != SD_RES_SUCCESS) {
-		ret = epoch_log_read_remote(epoch, nodes, sizeof(nodes),
-						 &nr_nodes, NULL, cur_vinfo);
-		if (ret != SD_RES_SUCCESS)
-			return NULL;
+	*ranges = NULL;
+	if (RB_EMPTY_ROOT(&old->vroot) || RB_EMPTY_ROOT(&cur->vroot) ||
+	    old->nr_zones != cur->nr_zones)
+		return -1;
+	nr_copies = min(nr_copies, cur->nr_zones);
+
+	/*
+	 * Every hash in (hashes[i - 1], hashes[i]] is placed starting from the
+	 * same vnode in both rings, so one lookup per boundary is enough.  The
+	 * segment ending at hashes[0] wraps around the top of the ring.
+	 */
+	hashes = merge_vnode_hashes(old, cur, &nr_hashes);
+	for (int i = 0; i < nr_hashes; i++) {
+		struct sd_vnode key = { .hash = hashes[i] }, *ov, *cv;
+
+		ov = rb_nsearch(&old->vroot, &key, rb, vnode_cmp);
+		cv = rb_nsearch(&cur->vroot, &key, rb, vnode_cmp);
+		if (local_copy_index(old, ov, nr_copies) ==
+		    local_copy_index(cur, cv, nr_copies))
+			continue;
+
+		if (i == 0) {
+			nr = add_vnode_range(ranges, nr, 0, hashes[0]);
+			wrap = true;
+		} else
+			nr = add_vnode_range(ranges, nr, hashes[i - 1] + 1,
+					     hashes[i]);
 	}
-	for (int i = 0; i < nr_nodes; i++)
-		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+	if (wrap && hashes[nr_hashes - 1] != UINT64_MAX)
+		nr = add_vnode_range(ranges, nr, hashes[nr_hashes - 1] + 1,
+				     UINT64_MAX);
 
-	return alloc_vnode_info(&nroot);
+	free(hashes);
+	return nr;
 }
 
 int get_nodes_epoch(uint32_t epoch, struct vnode_info *cur_vinfo,
@@ -207,21 +211,41 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 	return SD_RES_SUCCESS;
 }
 
+/* Nr of cluster operations executed in one block of the cluster at most */
+#define MAX_BLOCK_BATCH		64
+#define MAX_CLUSTER_OP_KEYS	2
+
+/* a run of the VDI bitmap a cluster operation touches */
+struct cluster_op_key {
+	unsigned long run;
+	/* only conflicts with the keys which are not shared */
+	bool shared;
+};
+
 /* Indicator if a cluster operation is currently running. */
 static bool cluster_op_running;
-
-static struct vdi_op_message *prepare_cluster_msg(struct request *req,
-		size_t *sizep)
+/* Indicator if this node has a block event queued in the cluster driver */
+static bool cluster_block_requested;
+/* Nr of the operations of the current block whose process_work is running */
+static int nr_running_block_ops;
+/* Nr of the notify messages sent by this node and not delivered yet */
+static int nr_notify_inflight;
+
+static size_t cluster_msg_size(const struct request *req)
 {
-	struct vdi_op_message *msg;
-	size_t size;
-
 	if (has_process_main(req->op) && req->rq.flags & SD_FLAG_CMD_WRITE)
 		/* notify data that was received from the sender */
-		size = sizeof(*msg) + req->rq.data_length;
+		return sizeof(struct vdi_op_message) + req->rq.data_length;
 	else
 		/* notify data that was set in process_work */
-		size = sizeof(*msg) + req->rp.data_length;
+		return sizeof(struct vdi_op_message) + req->rp.data_length;
+}
+
+static struct vdi_op_message *prepare_cluster_msg(struct request *req,
+		size_t *sizep)
+{
+	struct vdi_op_message *msg;
+	size_t size = cluster_msg_size(req);
 
 	sd_assert(size <= SD_MAX_EVENT_BUF_SIZE);
 
@@ -236,21 +260,218 @@ static struct vdi_op_message *prepare_cluster_msg(struct request *req,
 	return msg;
 }
 
-static void cluster_op_done(struct work *work)
+/*
+ * Several cluster messages can be sent in one ->notify or ->unblock as a
+ * batch message.  Its data is the sequence of the messages, each preceded by
+ * its length and padded to 8 bytes.
+ */
+static size_t batch_entry_size(size_t msg_size)
 {
-	struct request *req = container_of(work, struct request, work);
-	struct vdi_op_message *msg;
-	size_t size;
+	return sizeof(uint64_t) + round_up(msg_size, sizeof(uint64_t));
+}
+
+static void batch_init(struct strbuf *buf)
+{
+	struct vdi_op_message hdr = {};
+
+	strbuf_init(buf, 0);
+	strbuf_add(buf, &hdr, sizeof(hdr));
+}
+
+static void batch_add(struct strbuf *buf, const struct vdi_op_message *msg,
+		      size_t size)
+{
+	uint64_t len = size;
+
+	strbuf_add(buf, &len, sizeof(len));
+	strbuf_add(buf, msg, size);
+	while (buf->len % sizeof(uint64_t))
+		strbuf_addch(buf, 0);
+}
+
+static struct vdi_op_message *batch_finish(struct strbuf *buf, size_t *sizep)
+{
+	struct vdi_op_message *msg = (struct vdi_op_message *)buf->buf;
+
+	msg->req.opcode = SD_OP_CLUSTER_BATCH;
+	msg->req.proto_ver = SD_SHEEP_PROTO_VER;
+	msg->req.data_length = buf->len - sizeof(*msg);
+	msg->rsp.result = SD_RES_SUCCESS;
+
+	sd_assert(buf->len <= SD_MAX_EVENT_BUF_SIZE);
+	*sizep = buf->len;
+	return (struct vdi_op_message *)strbuf_detach(buf);
+}
+
+/*
+ * Ask the cluster driver for the next block if any cluster operation is
+ * waiting for it.  A node has at most one block queued at a time, the
+ * operations queued meanwhile are executed together in the next block.
+ */
+static void request_cluster_block(void)
+{
+	struct list_head *pending = main_thread_get(pending_block_list);
+	struct request *req;
 	int ret;
 
-	if (req->status == REQUEST_DROPPED)
-		goto drop;
+	if (cluster_op_running || cluster_block_requested ||
+	    list_empty(pending))
+		return;
 
-	sd_debug("%s (%p)", op_name(req->op), req);
+	ret = sys->cdrv->block();
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to broadcast block to cluster, %s",
+		       sd_strerror(ret));
+		list_for_each_entry(req, pending, pending_list) {
+			list_del(&req->pending_list);
+			req->rp.result = ret;
+			put_request(req);
+		}
+		return;
+	}
+	cluster_block_requested = true;
+}
+
+static unsigned long vdi_run_key(unsigned long start)
+{
+	unsigned long bit;
+
+	bit = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, start);
+	if (bit == SD_NR_VDIS)
+		bit = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, 0);
+	return bit;
+}
+
+/*
+ * The VDIs a cluster operation can look up or create are in the run of used
+ * bits of the VDI bitmap which its VDI name hashes into: vdi_lookup() walks
+ * the run and a new VDI takes the free bit which ends it.  So operations on
+ * different runs don't conflict, and the first free bit after the hash
+ * identifies the run.
+ *
+ * Returns the number of keys of the VDI state 'req' touches, or -1 if it has
+ * to run alone in a block.
+ */
+static int cluster_op_keys(const struct request *req,
+			   struct cluster_op_key *keys)
+{
+	char name[SD_MAX_VDI_LEN];
+	size_t len = min(req->rq.data_length, SD_MAX_VDI_LEN - 1);
+	int nr = 0;
 
-	msg = prepare_cluster_msg(req, &size);
+	switch (req->rq.opcode) {
+	case SD_OP_RELEASE_VDI:
+		/* only flushes the object cache of this node */
+		return 0;
+	case SD_OP_NEW_VDI:
+	case SD_OP_DEL_VDI:
+	case SD_OP_GET_VDI_INFO:
+	case SD_OP_LOCK_VDI:
+	case SD_OP_GET_VDI_ATTR:
+		/* the VDI name leads the data of all of them */
+		if (!len)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
 
-	ret = sys->cdrv->unblock(msg, size);
+	memcpy(name, req->data, len);
+	name[len] = '\0';
+	keys[nr].run = vdi_run_key(sd_hash_vdi(name));
+	keys[nr++].shared = false;
+	/*
+	 * The inode of the base VDI is updated on clone and snapshot.  The
+	 * clones of a base only bump its gref counts, which clone_vdi() does
+	 * under a lock of the base, so they can run together.
+	 */
+	if (req->rq.opcode == SD_OP_NEW_VDI && req->rq.vdi.base_vdi_id) {
+		keys[nr].run = vdi_run_key(req->rq.vdi.base_vdi_id);
+		keys[nr++].shared = !req->rq.vdi.snapid;
+	}
+
+	return nr;
+}
+
+static bool keys_overlap(const struct cluster_op_key *a, int nr_a,
+			 const struct cluster_op_key *b, int nr_b)
+{
+	for (int i = 0; i < nr_a; i++)
+		for (int j = 0; j < nr_b; j++)
+			if (a[i].run == b[j].run &&
+			    !(a[i].shared && b[j].shared))
+				return true;
+	return false;
+}
+
+/*
+ * Move the pending operations which don't conflict with each other to the
+ * running list, in order.  An operation conflicting with an earlier one which
+ * is left pending is left pending too, so the operations on the same VDIs are
+ * executed in the order they were queued.
+ */
+static void select_block_batch(void)
+{
+	struct list_head *pending = main_thread_get(pending_block_list),
+		*running = main_thread_get(running_block_list);
+	struct cluster_op_key used[MAX_BLOCK_BATCH * MAX_CLUSTER_OP_KEYS],
+		held[MAX_BLOCK_BATCH * MAX_CLUSTER_OP_KEYS],
+		keys[MAX_CLUSTER_OP_KEYS];
+	size_t size = sizeof(struct vdi_op_message), entry_size;
+	int nr_used = 0, nr_held = 0, nr_batch = 0, nr;
+	struct request *req;
+
+	list_for_each_entry(req, pending, pending_list) {
+		nr = cluster_op_keys(req, keys);
+		if (nr < 0) {
+			/* an exclusive operation runs alone */
+			if (!nr_batch)
+				list_move_tail(&req->pending_list, running);
+			break;
+		}
+
+		entry_size = batch_entry_size(sizeof(struct vdi_op_message) +
+					      req->rq.data_length);
+		if (nr_batch && size + entry_size > SD_MAX_EVENT_BUF_SIZE)
+			break;
+
+		if (keys_overlap(keys, nr, used, nr_used) ||
+		    keys_overlap(keys, nr, held, nr_held)) {
+			if (nr_held + nr > ARRAY_SIZE(held))
+				break;
+			memcpy(held + nr_held, keys, sizeof(*keys) * nr);
+			nr_held += nr;
+			continue;
+		}
+
+		memcpy(used + nr_used, keys, sizeof(*keys) * nr);
+		nr_used += nr;
+		size += entry_size;
+		list_move_tail(&req->pending_list, running);
+		if (++nr_batch == MAX_BLOCK_BATCH)
+			break;
+	}
+}
+
+/* Notify the results of the operations of the block and unblock the cluster */
+static void unblock_cluster(void)
+{
+	struct list_head *running = main_thread_get(running_block_list);
+	struct vdi_op_message *msg, *batch;
+	struct strbuf buf;
+	struct request *req;
+	size_t size;
+	int ret;
+
+	batch_init(&buf);
+	list_for_each_entry(req, running, pending_list) {
+		msg = prepare_cluster_msg(req, &size);
+		batch_add(&buf, msg, size);
+		free(msg);
+	}
+	batch = batch_finish(&buf, &size);
+
+	ret = sys->cdrv->unblock(batch, size);
 	if (ret != SD_RES_SUCCESS) {
 		/*
 		 * Failed to unblock, shoot myself to let other sheep
@@ -260,20 +481,48 @@ static void cluster_op_done(struct work *work)
 		sd_emerg("Failed to unblock, %s, exiting.", sd_strerror(ret));
 		exit(1);
 	}
+	free(batch);
 
-	free(msg);
-	req->status = REQUEST_DONE;
-	return;
-drop:
-	list_del(&req->pending_list);
-	req->rp.result = SD_RES_CLUSTER_ERROR;
-	put_request(req);
+	list_for_each_entry(req, running, pending_list)
+		req->status = REQUEST_DONE;
+}
+
+static void cluster_op_done(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	struct list_head *running = main_thread_get(running_block_list);
+	bool dropped = false;
+
+	sd_debug("%s (%p)", op_name(req->op), req);
+
+	if (--nr_running_block_ops > 0)
+		return;
+
+	list_for_each_entry(req, running, pending_list)
+		if (req->status == REQUEST_DROPPED)
+			dropped = true;
+
+	if (!dropped) {
+		unblock_cluster();
+		return;
+	}
+
+	list_for_each_entry(req, running, pending_list) {
+		list_del(&req->pending_list);
+		req->rp.result = SD_RES_CLUSTER_ERROR;
+		put_request(req);
+	}
 	cluster_op_running = false;
+	request_cluster_block();
 }
 
 /*
- * Perform a blocked cluster operation if we were the node requesting it
- * and do not have any other operation pending.
+ * Perform the blocked cluster operations if we were the node requesting the
+ * block and do not have any other operation running.
+ *
+ * The pending operations which don't conflict with each other are executed
+ * concurrently in the block and their results are notified together with
+ * ->unblock.
  *
  * If this method returns false the caller must call the method again for
  * the same event once it gets notified again.
@@ -283,6 +532,7 @@ drop:
  */
 main_fn bool sd_block_handler(const struct sd_node *sender)
 {
+	struct list_head *running = main_thread_get(running_block_list);
 	struct request *req;
 
 	if (!node_is_local(sender))
@@ -290,16 +540,102 @@ main_fn bool sd_block_handler(const struct sd_node *sender)
 	if (cluster_op_running)
 		return false;
 
+	cluster_block_requested = false;
+	select_block_batch();
+	if (list_empty(running)) {
+		/* the operations were dropped after the block was queued */
+		unblock_cluster();
+		request_cluster_block();
+		return true;
+	}
+
 	cluster_op_running = true;
+	list_for_each_entry(req, running, pending_list) {
+		req->work.fn = do_process_work;
+		req->work.done = cluster_op_done;
+		req->status = REQUEST_QUEUED;
+		nr_running_block_ops++;
+		queue_work(sys->block_wqueue, &req->work);
+	}
+	return true;
+}
+
+static void send_notify_batch(struct list_head *batch, int nr)
+{
+	struct list_head *pending = main_thread_get(pending_notify_list);
+	struct vdi_op_message *msg, *m;
+	struct request *req;
+	struct strbuf buf;
+	size_t size;
+	int ret;
 
-	req = list_first_entry(main_thread_get(pending_block_list),
-				struct request, pending_list);
-	req->work.fn = do_process_work;
-	req->work.done = cluster_op_done;
+	if (nr == 1) {
+		req = list_first_entry(batch, struct request, pending_list);
+		msg = prepare_cluster_msg(req, &size);
+		msg->rsp.result = SD_RES_SUCCESS;
+	} else {
+		batch_init(&buf);
+		list_for_each_entry(req, batch, pending_list) {
+			m = prepare_cluster_msg(req, &size);
+			m->rsp.result = SD_RES_SUCCESS;
+			batch_add(&buf, m, size);
+			free(m);
+		}
+		msg = batch_finish(&buf, &size);
+	}
 
-	queue_work(sys->block_wqueue, &req->work);
-	req->status = REQUEST_QUEUED;
-	return true;
+	ret = sys->cdrv->notify(msg, size);
+	free(msg);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to broadcast notify to cluster, %s",
+		       sd_strerror(ret));
+
+	list_for_each_entry(req, batch, pending_list) {
+		if (ret != SD_RES_SUCCESS) {
+			list_del(&req->pending_list);
+			req->rp.result = ret;
+			put_request(req);
+			continue;
+		}
+		req->status = REQUEST_DONE;
+		nr_notify_inflight++;
+		list_move_tail(&req->pending_list, pending);
+	}
+}
+
+/*
+ * Send the notify messages queued in pending_notify_list and not sent yet.
+ *
+ * A message is sent at once if no message of this node is in flight.
+ * Otherwise it waits for the messages in flight to be delivered, and all the
+ * messages queued meanwhile are sent together in batch messages.  So a lone
+ * message isn't delayed, while a burst of them costs a few broadcasts.
+ */
+static void flush_cluster_notify(void)
+{
+	struct list_head *pending = main_thread_get(pending_notify_list);
+	LIST_HEAD(queued);
+	LIST_HEAD(batch);
+	struct request *req;
+
+	list_for_each_entry(req, pending, pending_list)
+		if (req->status == REQUEST_INIT)
+			list_move_tail(&req->pending_list, &queued);
+
+	while (!list_empty(&queued)) {
+		size_t size = sizeof(struct vdi_op_message), entry_size;
+		int nr = 0;
+
+		list_for_each_entry(req, &queued, pending_list) {
+			entry_size = batch_entry_size(cluster_msg_size(req));
+			if (nr && size + entry_size > SD_MAX_EVENT_BUF_SIZE)
+				break;
+			size += entry_size;
+			nr++;
+			list_move_tail(&req->pending_list, &batch);
+		}
+		send_notify_batch(&batch, nr);
+	}
 }
 
 /*
@@ -311,42 +647,20 @@ main_fn bool sd_block_handler(const struct sd_node *sender)
  */
 main_fn void queue_cluster_request(struct request *req)
 {
-	int ret;
 	sd_debug("%s (%p)", op_name(req->op), req);
 
+	req->status = REQUEST_INIT;
 	if (has_process_work(req->op)) {
-		ret = sys->cdrv->block();
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to broadcast block to cluster, %s",
-			       sd_strerror(ret));
-			goto error;
-		}
 		list_add_tail(&req->pending_list,
 			      main_thread_get(pending_block_list));
-	} else {
-		struct vdi_op_message *msg;
-		size_t size;
-
-		msg = prepare_cluster_msg(req, &size);
-		msg->rsp.result = SD_RES_SUCCESS;
-
-		ret = sys->cdrv->notify(msg, size);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to broadcast notify to cluster, %s",
-			       sd_strerror(ret));
-			goto error;
-		}
-
-		list_add_tail(&req->pending_list,
-			      main_thread_get(pending_notify_list));
-
-		free(msg);
+		request_cluster_block();
+		return;
 	}
-	req->status = REQUEST_INIT;
-	return;
-error:
-	req->rp.result = ret;
-	put_request(req);
+
+	list_add_tail(&req->pending_list,
+		      main_thread_get(pending_notify_list));
+	if (!nr_notify_inflight)
+		flush_cluster_notify();
 }
 
 int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len,
@@ -385,8 +699,7 @@ int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len,
 
 		*nr_nodes = nodes_len / sizeof(struct sd_node);
 		/* epoch file is missing in local node, try to create one */
-		update_epoch_log(epoch, nodes, *nr_nodes, *(time_t *)(buf + nodes_len),
-                         false);
+		update_epoch_log(epoch, nodes, *nr_nodes, *(time_t *)(buf + nodes_len));
 		return SD_RES_SUCCESS;
 	}
 
@@ -492,6 +805,32 @@ static int get_vdi_bitmap_from(struct sd_node *node)
 	return ret;
 }
 
+/*
+ * The size of the objects of a VDI is only told to the nodes in the cluster
+ * when it is created, so a joining node learns it from the others.
+ */
+static int get_vdi_state_from(struct sd_node *node)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_vdi_state *vs = NULL;
+	size_t nr = 1024;
+	int ret;
+
+	do {
+		nr *= 2;
+		vs = xrealloc(vs, nr * sizeof(*vs));
+		sd_init_req(&hdr, SD_OP_GET_VDI_STATE);
+		hdr.data_length = nr * sizeof(*vs);
+		ret = sheep_exec_req(&node->nid, &hdr, (char *)vs);
+	} while (ret == SD_RES_BUFFER_SMALL && nr < SD_NR_VDIS);
+
+	if (ret == SD_RES_SUCCESS)
+		apply_vdi_state_list(vs, rsp->data_length / sizeof(*vs));
+	free(vs);
+	return ret;
+}
+
 static void do_get_vdi_bitmap(struct work *work)
 {
 	struct get_vdis_work *w =
@@ -507,6 +846,10 @@ static void do_get_vdi_bitmap(struct work *work)
 			sd_err("failed to get vdi bitmap from %s",
 			       node_to_str(&w->joined));
 		}
+		ret = get_vdi_state_from(&w->joined);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("failed to get vdi state from %s",
+			       node_to_str(&w->joined));
 		return;
 	}
 
@@ -520,6 +863,10 @@ static void do_get_vdi_bitmap(struct work *work)
 		if (ret != SD_RES_SUCCESS)
 			sd_err("failed to get vdi bitmap from %s",
 			       node_to_str(n));
+		ret = get_vdi_state_from(n);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("failed to get vdi state from %s",
+			       node_to_str(n));
 	}
 }
 
@@ -553,7 +900,7 @@ int inc_and_log_epoch(void)
 	uatomic_inc(&sys->cinfo.epoch);
 
 	return update_epoch_log(sys->cinfo.epoch, sys->cinfo.nodes,
-				sys->cinfo.nr_nodes, 0, true);
+				sys->cinfo.nr_nodes, 0);
 }
 
 static struct vnode_info *alloc_old_vnode_info(void)
@@ -575,7 +922,9 @@ static struct vnode_info *alloc_old_vnode_info(void)
 			panic("node hash collision");
 	}
 
-	old = alloc_vnode_info(&old_root);
+	/* the old membership differs from the current one in a few nodes */
+	old = alloc_vnode_info_from(main_thread_get(current_vnode_info),
+				    &old_root);
 	rb_destroy(&old_root, struct sd_node, rb);
 	return old;
 }
@@ -692,7 +1041,7 @@ static void manual_update_cluster_info(const struct sd_node *joined)
 
 		rb_destroy(&nroot, struct sd_node, rb);
 		update_epoch_log(sys->cinfo.epoch, sys->cinfo.nodes,
-				 sys->cinfo.nr_nodes, 0, false);
+				 sys->cinfo.nr_nodes, 0);
 	} else {
 		struct vnode_info *cur_vinfo = get_vnode_info();
 		struct sd_node *n = rb_search(&cur_vinfo->nroot,
@@ -731,8 +1080,10 @@ static void auto_update_cluster_info(const struct cluster_info *cinfo,
 {
 	struct vnode_info *old_vnode_info;
 
-	put_vnode_info(main_thread_get(current_vnode_info));
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	old_vnode_info = main_thread_get(current_vnode_info);
+	main_thread_set(current_vnode_info,
+			alloc_vnode_info_from(old_vnode_info, nroot));
+	put_vnode_info(old_vnode_info);
 
 	if (cinfo->status != SD_STATUS_OK)
 		return;
@@ -793,6 +1144,20 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 		auto_update_cluster_info(cinfo, joined, nroot, nr_nodes);
 }
 
+static void notify_batch_handler(const struct sd_node *sender,
+				 struct vdi_op_message *msg, size_t data_len)
+{
+	char *p = (char *)msg->data, *end = p + msg->req.data_length;
+	uint64_t len;
+
+	sd_assert(sizeof(*msg) + msg->req.data_length <= data_len);
+	while (p < end) {
+		memcpy(&len, p, sizeof(len));
+		sd_notify_handler(sender, p + sizeof(len), len);
+		p += batch_entry_size(len);
+	}
+}
+
 /*
  * Pass on a notification message from the cluster driver.
  *
@@ -807,13 +1172,18 @@ main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
 	int ret = msg->rsp.result;
 	struct request *req = NULL;
 
+	if (msg->req.opcode == SD_OP_CLUSTER_BATCH) {
+		notify_batch_handler(sender, msg, data_len);
+		return;
+	}
+
 	sd_debug("op %s, size: %zu, from: %s", op_name(op), data_len,
 		 node_to_str(sender));
 
 	if (node_is_local(sender)) {
 		if (has_process_work(op))
 			req = list_first_entry(
-					main_thread_get(pending_block_list),
+					main_thread_get(running_block_list),
 					       struct request, pending_list);
 		else
 			req = list_first_entry(
@@ -836,8 +1206,16 @@ main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
 		put_request(req);
 	}
 
-	if (has_process_work(op))
+	if (req && !has_process_work(op) && nr_notify_inflight &&
+	    --nr_notify_inflight == 0)
+		flush_cluster_notify();
+
+	/* the block ends when the results of all its operations arrive */
+	if (req && has_process_work(op) &&
+	    list_empty(main_thread_get(running_block_list))) {
 		cluster_op_running = false;
+		request_cluster_block();
+	}
 }
 
 /*
@@ -906,8 +1284,12 @@ static void requeue_cluster_request(void)
 	struct vdi_op_message *msg;
 	size_t size;
 
+	/* the messages not sent yet are sent to the new session below */
+	nr_notify_inflight = 0;
 	list_for_each_entry(req, main_thread_get(pending_notify_list),
 			    pending_list) {
+		if (req->status != REQUEST_DONE)
+			break;
 		/*
 		 * ->notify() was called and succeeded but after that
 		 * this node session-timeouted and sd_notify_handler
@@ -922,16 +1304,15 @@ static void requeue_cluster_request(void)
 		free(msg);
 	}
 
-	list_for_each_entry(req, main_thread_get(pending_block_list),
+	/*
+	 * The requests in pending_block_list have never been executed, they
+	 * wait for the block we ask the new session for below.
+	 */
+	cluster_block_requested = false;
+
+	list_for_each_entry(req, main_thread_get(running_block_list),
 			    pending_list) {
 		switch (req->status) {
-		case REQUEST_INIT:
-			/* this request has never been executed, re-queue it */
-			sd_debug("requeue a block request, op: %s",
-				 op_name(req->op));
-			list_del(&req->pending_list);
-			queue_cluster_request(req);
-			break;
 		case REQUEST_QUEUED:
 			/*
 			 * This request is being handled by the 'block' thread
@@ -963,6 +1344,9 @@ static void requeue_cluster_request(void)
 			break;
 		}
 	}
+
+	request_cluster_block();
+	flush_cluster_notify();
 }
 
 main_fn int sd_reconnect_handler(void)
@@ -1084,7 +1468,8 @@ static void auto_leave_handler(const struct sd_node *left,
 	 * because of the same reason of update_cluster_info()
 	 */
 	old_vnode_info = main_thread_get(current_vnode_info);
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	main_thread_set(current_vnode_info,
+			alloc_vnode_info_from(old_vnode_info, nroot));
 	if (sys->cinfo.status == SD_STATUS_OK) {
 		if (is_gateway_only_cluster(nroot)) {
 			sd_info("only gateway nodes are remaining, exiting");
@@ -1128,7 +1513,7 @@ main_fn void sd_update_node_handler(struct sd_node *node, struct rb_root *nroot)
 	struct vnode_info *old = main_thread_get(current_vnode_info);
 	int ret;
 
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	main_thread_set(current_vnode_info, alloc_vnode_info_from(old, nroot));
 
 	if (is_cluster_diskmode(&sys->cinfo)) {
 		struct sd_node *n = rb_search(nroot, node, rb, node_cmp);
@@ -1195,6 +1580,9 @@ int create_cluster(int port, int64_t zone, int nr_vnodes,
 	main_thread_set(pending_block_list,
 			xzalloc(sizeof(struct list_head)));
 	INIT_LIST_HEAD(main_thread_get(pending_block_list));
+	main_thread_set(running_block_list,
+			xzalloc(sizeof(struct list_head)));
+	INIT_LIST_HEAD(main_thread_get(running_block_list));
 	main_thread_set(pending_notify_list,
 			xzalloc(sizeof(struct list_head)));
 	INIT_LIST_HEAD(main_thread_get(pending_notify_list));
@@ -0,0 +1,115 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The hottest objects requested through the gateway of this node, so that
+ * each request of a client is counted once in the cluster however many
+ * replicas it touches.  They are kept with the space-saving algorithm:
+ * a fixed table of counters where a new object takes over the counter with
+ * the lowest count and inherits it as its error bound.  Every object
+ * accessed more than 1/NR_HOT_OBJS of the time is guaranteed to be in the
+ * table.  The counts are halved every HOT_DECAY_INTERVAL seconds so that the
+ * table follows the current load.
+ *
+ * All the functions are called in the main thread.
+ */
+
+#include "sheep_priv.h"
+
+#define NR_HOT_OBJS		128
+#define HOT_DECAY_INTERVAL	60
+
+struct hot_obj {
+	struct rb_node rb;
+	struct sd_hot_obj obj;
+};
+
+static struct hot_obj hot_objs[NR_HOT_OBJS];
+static int nr_hot_objs;
+static struct rb_root hot_root = RB_ROOT;
+static struct timer decay_timer;
+
+static int hot_obj_cmp(const struct hot_obj *a, const struct hot_obj *b)
+{
+	return intcmp(a->obj.oid, b->obj.oid);
+}
+
+static struct hot_obj *least_hot_obj(void)
+{
+	struct hot_obj *min = hot_objs;
+
+	for (int i = 1; i < NR_HOT_OBJS; i++)
+		if (hot_objs[i].obj.count < min->obj.count)
+			min = hot_objs + i;
+
+	return min;
+}
+
+main_fn void hotspot_account(uint64_t oid, uint32_t len)
+{
+	struct hot_obj key = { .obj.oid = oid }, *h;
+
+	h = rb_search(&hot_root, &key, rb, hot_obj_cmp);
+	if (!h) {
+		if (nr_hot_objs < NR_HOT_OBJS) {
+			h = hot_objs + nr_hot_objs++;
+			memset(&h->obj, 0, sizeof(h->obj));
+		} else {
+			h = least_hot_obj();
+			rb_erase(&h->rb, &hot_root);
+			h->obj.error = h->obj.count;
+			h->obj.bytes = 0;
+		}
+		h->obj.oid = oid;
+		rb_insert(&hot_root, h, rb, hot_obj_cmp);
+	}
+
+	h->obj.count++;
+	h->obj.bytes += len;
+}
+
+static int hot_obj_count_cmp(const struct sd_hot_obj *a,
+			     const struct sd_hot_obj *b)
+{
+	return -intcmp(a->count, b->count);
+}
+
+/* Fill 'objs' with at most 'nr_max' hottest objects, the hottest first */
+main_fn int hotspot_get(struct sd_hot_obj *objs, int nr_max)
+{
+	struct sd_hot_obj *all = xmalloc(sizeof(*all) * NR_HOT_OBJS);
+	int nr = min(nr_max, nr_hot_objs);
+
+	for (int i = 0; i < nr_hot_objs; i++)
+		all[i] = hot_objs[i].obj;
+	xqsort(all, nr_hot_objs, hot_obj_count_cmp);
+	memcpy(objs, all, sizeof(*objs) * nr);
+	free(all);
+
+	return nr;
+}
+
+static void decay_timer_fn(void *data)
+{
+	for (int i = 0; i < nr_hot_objs; i++) {
+		hot_objs[i].obj.count /= 2;
+		hot_objs[i].obj.error /= 2;
+		hot_objs[i].obj.bytes /= 2;
+	}
+
+	add_timer(&decay_timer, HOT_DECAY_INTERVAL * 1000);
+}
+
+int hotspot_init(void)
+{
+	decay_timer.callback = decay_timer_fn;
+	add_timer(&decay_timer, HOT_DECAY_INTERVAL * 1000);
+
+	return 0;
+}
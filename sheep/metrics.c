@@ -0,0 +1,625 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An HTTP endpoint exporting the statistics of this node in the Prometheus
+ * text format.  It runs its own event loop in a dedicated thread and gathers
+ * the statistics with the same local requests dog uses, so the main thread
+ * and the I/O path only see a few more local requests a scrape.
+ */
+
+#include <netdb.h>
+
+#include "sheep_priv.h"
+#include "option.h"
+#include "strbuf.h"
+
+#define DEFAULT_METRICS_PORT	9780
+#define METRICS_MAX_REQ		4096
+#define NR_METRICS_VDI_STATS	1024
+#define NR_METRICS_WQS		64
+#define NR_METRICS_LISTEN_FDS	8
+
+static char metrics_host[HOST_NAME_MAX + 1];
+static int metrics_port = DEFAULT_METRICS_PORT;
+static int listen_fds[NR_METRICS_LISTEN_FDS];
+static int nr_listen_fds;
+
+/*
+ * vid -> name of the VDIs seen so far.  The entries are looked up by the
+ * metrics thread and dropped by the main thread when the VDI is deleted.
+ */
+struct vdi_name {
+	uint32_t vid;
+	char name[SD_MAX_VDI_LEN];
+	struct rb_node rb;
+};
+
+static struct rb_root vdi_name_root = RB_ROOT;
+static struct sd_mutex vdi_name_lock = SD_MUTEX_INITIALIZER;
+/* bumped on every deletion so that a name read meanwhile isn't cached */
+static uint64_t vdi_name_generation;
+
+static int vdi_name_cmp(const struct vdi_name *a, const struct vdi_name *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+/* Copy the name of the VDI to 'name', or an empty string if unknown */
+static void get_vdi_name(uint32_t vid, char *name)
+{
+	struct vdi_name key = { .vid = vid }, *v;
+	uint64_t generation;
+	int ret;
+
+	sd_mutex_lock(&vdi_name_lock);
+	v = rb_search(&vdi_name_root, &key, rb, vdi_name_cmp);
+	if (v)
+		pstrcpy(name, SD_MAX_VDI_LEN, v->name);
+	generation = vdi_name_generation;
+	sd_mutex_unlock(&vdi_name_lock);
+	if (v)
+		return;
+
+	v = xzalloc(sizeof(*v));
+	ret = sd_read_object(vid_to_vdi_oid(vid), v->name, SD_MAX_VDI_LEN, 0);
+	if (ret != SD_RES_SUCCESS) {
+		/* try again at the next scrape */
+		free(v);
+		*name = '\0';
+		return;
+	}
+	v->vid = vid;
+	v->name[SD_MAX_VDI_LEN - 1] = '\0';
+	pstrcpy(name, SD_MAX_VDI_LEN, v->name);
+
+	sd_mutex_lock(&vdi_name_lock);
+	if (generation != vdi_name_generation ||
+	    rb_insert(&vdi_name_root, v, rb, vdi_name_cmp))
+		free(v);
+	sd_mutex_unlock(&vdi_name_lock);
+}
+
+/* Forget the name of the deleted VDI, its vid may be reused */
+void metrics_delete_vdi(uint32_t vid)
+{
+	struct vdi_name key = { .vid = vid }, *v;
+
+	sd_mutex_lock(&vdi_name_lock);
+	vdi_name_generation++;
+	v = rb_search(&vdi_name_root, &key, rb, vdi_name_cmp);
+	if (v) {
+		rb_erase(&v->rb, &vdi_name_root);
+		free(v);
+	}
+	sd_mutex_unlock(&vdi_name_lock);
+}
+
+/* escape a label value as the text format requires */
+static void add_label_value(struct strbuf *buf, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '\\':
+			strbuf_addstr(buf, "\\\\");
+			break;
+		case '"':
+			strbuf_addstr(buf, "\\\"");
+			break;
+		case '\n':
+			strbuf_addstr(buf, "\\n");
+			break;
+		default:
+			strbuf_addch(buf, *s);
+			break;
+		}
+	}
+}
+
+static void add_header(struct strbuf *buf, const char *name,
+		       const char *type, const char *help)
+{
+	strbuf_addf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+		    type);
+}
+
+static void add_metric(struct strbuf *buf, const char *name,
+		       const char *type, const char *help, uint64_t val)
+{
+	add_header(buf, name, type, help);
+	strbuf_addf(buf, "%s %"PRIu64"\n", name, val);
+}
+
+static void add_request_metrics(struct strbuf *buf, const struct sd_stat *st)
+{
+	const struct s_request *r = &st->r;
+	uint64_t gway_other = r->gway_total_nr - r->gway_total_read_nr -
+		r->gway_total_write_nr - r->gway_total_remove_nr -
+		r->gway_total_flush_nr;
+	uint64_t peer_other = r->peer_total_nr - r->peer_total_read_nr -
+		r->peer_total_write_nr - r->peer_total_remove_nr;
+
+	add_header(buf, "sheepdog_gateway_requests_total", "counter",
+		   "Requests received from the clients");
+	strbuf_addf(buf, "sheepdog_gateway_requests_total{op=\"read\"} "
+		    "%"PRIu64"\n", r->gway_total_read_nr);
+	strbuf_addf(buf, "sheepdog_gateway_requests_total{op=\"write\"} "
+		    "%"PRIu64"\n", r->gway_total_write_nr);
+	strbuf_addf(buf, "sheepdog_gateway_requests_total{op=\"remove\"} "
+		    "%"PRIu64"\n", r->gway_total_remove_nr);
+	strbuf_addf(buf, "sheepdog_gateway_requests_total{op=\"flush\"} "
+		    "%"PRIu64"\n", r->gway_total_flush_nr);
+	strbuf_addf(buf, "sheepdog_gateway_requests_total{op=\"other\"} "
+		    "%"PRIu64"\n", gway_other);
+	add_metric(buf, "sheepdog_gateway_requests_active", "gauge",
+		   "Requests from the clients being processed",
+		   r->gway_active_nr);
+	add_header(buf, "sheepdog_gateway_bytes_total", "counter",
+		   "Bytes transferred with the clients");
+	strbuf_addf(buf, "sheepdog_gateway_bytes_total{direction=\"rx\"} "
+		    "%"PRIu64"\n", r->gway_total_rx);
+	strbuf_addf(buf, "sheepdog_gateway_bytes_total{direction=\"tx\"} "
+		    "%"PRIu64"\n", r->gway_total_tx);
+
+	add_header(buf, "sheepdog_peer_requests_total", "counter",
+		   "Requests received from the other nodes");
+	strbuf_addf(buf, "sheepdog_peer_requests_total{op=\"read\"} "
+		    "%"PRIu64"\n", r->peer_total_read_nr);
+	strbuf_addf(buf, "sheepdog_peer_requests_total{op=\"write\"} "
+		    "%"PRIu64"\n", r->peer_total_write_nr);
+	strbuf_addf(buf, "sheepdog_peer_requests_total{op=\"remove\"} "
+		    "%"PRIu64"\n", r->peer_total_remove_nr);
+	strbuf_addf(buf, "sheepdog_peer_requests_total{op=\"other\"} "
+		    "%"PRIu64"\n", peer_other);
+	add_metric(buf, "sheepdog_peer_requests_active", "gauge",
+		   "Requests from the other nodes being processed",
+		   r->peer_active_nr);
+	add_header(buf, "sheepdog_peer_bytes_total", "counter",
+		   "Bytes transferred with the other nodes");
+	strbuf_addf(buf, "sheepdog_peer_bytes_total{direction=\"rx\"} "
+		    "%"PRIu64"\n", r->peer_total_rx);
+	strbuf_addf(buf, "sheepdog_peer_bytes_total{direction=\"tx\"} "
+		    "%"PRIu64"\n", r->peer_total_tx);
+
+	add_metric(buf, "sheepdog_scrub_objects", "gauge",
+		   "Objects of the latest scrubbing pass", st->s.nr_objs);
+	add_metric(buf, "sheepdog_scrub_scrubbed_objects", "gauge",
+		   "Objects verified so far in the latest scrubbing pass",
+		   st->s.nr_scrubbed);
+	add_metric(buf, "sheepdog_scrub_passes_total", "counter",
+		   "Completed scrubbing passes", st->s.nr_passes);
+	add_metric(buf, "sheepdog_scrub_corrupted_total", "counter",
+		   "Corrupted replicas found by the scrubber",
+		   st->s.nr_corrupted);
+	add_metric(buf, "sheepdog_scrub_repaired_total", "counter",
+		   "Corrupted replicas repaired by the scrubber",
+		   st->s.nr_repaired);
+
+	add_metric(buf, "sheepdog_dedup_shared_objects_total", "counter",
+		   "Objects shared with others of the same content",
+		   st->d.nr_shared);
+	add_metric(buf, "sheepdog_dedup_saved_bytes_total", "counter",
+		   "Disk space freed by sharing the objects", st->d.saved_bytes);
+}
+
+/* render the labels of the VDI, they are shared by all its metrics */
+static char *vdi_labels(uint32_t vid)
+{
+	struct strbuf buf = STRBUF_INIT;
+	char name[SD_MAX_VDI_LEN];
+
+	get_vdi_name(vid, name);
+	strbuf_addf(&buf, "vid=\"%"PRIx32"\",vdi=\"", vid);
+	add_label_value(&buf, name);
+	strbuf_addch(&buf, '"');
+
+	return strbuf_detach(&buf);
+}
+
+static void add_vdi_metrics(struct strbuf *buf,
+			    const struct sd_vdi_stat *stats, int nr)
+{
+	char **labels;
+
+	if (!nr)
+		return;
+
+	labels = xmalloc(sizeof(*labels) * nr);
+	for (int i = 0; i < nr; i++)
+		labels[i] = vdi_labels(stats[i].vid);
+
+	add_header(buf, "sheepdog_vdi_requests_total", "counter",
+		   "Requests of the VDI received by this gateway");
+	for (int i = 0; i < nr; i++) {
+		strbuf_addf(buf, "sheepdog_vdi_requests_total{%s,op=\"read\"} "
+			    "%"PRIu64"\n", labels[i], stats[i].nr_reads);
+		strbuf_addf(buf, "sheepdog_vdi_requests_total{%s,op=\"write\"} "
+			    "%"PRIu64"\n", labels[i], stats[i].nr_writes);
+	}
+
+	add_header(buf, "sheepdog_vdi_bytes_total", "counter",
+		   "Bytes of the VDI transferred by this gateway");
+	for (int i = 0; i < nr; i++) {
+		strbuf_addf(buf, "sheepdog_vdi_bytes_total{%s,op=\"read\"} "
+			    "%"PRIu64"\n", labels[i], stats[i].read_bytes);
+		strbuf_addf(buf, "sheepdog_vdi_bytes_total{%s,op=\"write\"} "
+			    "%"PRIu64"\n", labels[i], stats[i].write_bytes);
+	}
+
+	add_header(buf, "sheepdog_vdi_throttled_total", "counter",
+		   "Times the VDI ran out of its QoS tokens");
+	for (int i = 0; i < nr; i++)
+		strbuf_addf(buf, "sheepdog_vdi_throttled_total{%s} %"PRIu64"\n",
+			    labels[i], stats[i].nr_throttled);
+
+	/* bucket i counts the latencies below SD_LAT_BUCKET_BASE << i */
+	add_header(buf, "sheepdog_vdi_latency_seconds", "histogram",
+		   "Latency of the requests of the VDI");
+	for (int i = 0; i < nr; i++) {
+		const struct sd_vdi_stat *st = stats + i;
+		uint64_t count = 0;
+
+		for (int j = 0; j < SD_NR_LAT_BUCKETS - 1; j++) {
+			count += st->latency_hist[j];
+			strbuf_addf(buf, "sheepdog_vdi_latency_seconds_bucket"
+				    "{%s,le=\"%g\"} %"PRIu64"\n", labels[i],
+				    (double)(SD_LAT_BUCKET_BASE << j) / 1e9,
+				    count);
+		}
+		count += st->latency_hist[SD_NR_LAT_BUCKETS - 1];
+		strbuf_addf(buf, "sheepdog_vdi_latency_seconds_bucket"
+			    "{%s,le=\"+Inf\"} %"PRIu64"\n", labels[i], count);
+		strbuf_addf(buf, "sheepdog_vdi_latency_seconds_sum{%s} %g\n",
+			    labels[i], (double)st->total_latency / 1e9);
+		strbuf_addf(buf, "sheepdog_vdi_latency_seconds_count{%s} "
+			    "%"PRIu64"\n", labels[i], count);
+	}
+
+	for (int i = 0; i < nr; i++)
+		free(labels[i]);
+	free(labels);
+}
+
+static void add_stat_metrics(struct strbuf *buf)
+{
+	size_t len = sizeof(struct sd_stat) +
+		NR_METRICS_VDI_STATS * sizeof(struct sd_vdi_stat);
+	char *data = xmalloc(len);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret, nr = 0;
+
+	sd_init_req(&hdr, SD_OP_STAT);
+	hdr.data_length = len;
+	ret = exec_local_req(&hdr, data);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to get the statistics, %s", sd_strerror(ret));
+		goto out;
+	}
+
+	add_request_metrics(buf, (struct sd_stat *)data);
+	if (rsp->data_length > sizeof(struct sd_stat))
+		nr = (rsp->data_length - sizeof(struct sd_stat)) /
+			sizeof(struct sd_vdi_stat);
+	add_vdi_metrics(buf, (struct sd_vdi_stat *)
+			(data + sizeof(struct sd_stat)), nr);
+out:
+	free(data);
+}
+
+static void add_recovery_metrics(struct strbuf *buf)
+{
+	struct recovery_state rstate;
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_STAT_RECOVERY);
+	hdr.data_length = sizeof(rstate);
+	ret = exec_local_req(&hdr, &rstate);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to get the recovery state, %s",
+		       sd_strerror(ret));
+		return;
+	}
+
+	add_metric(buf, "sheepdog_recovery_active", "gauge",
+		   "Whether this node is in recovery", rstate.in_recovery);
+	add_metric(buf, "sheepdog_recovery_objects", "gauge",
+		   "Objects to be recovered in the current recovery",
+		   rstate.in_recovery ? rstate.nr_total : 0);
+	add_metric(buf, "sheepdog_recovery_recovered_objects", "gauge",
+		   "Objects recovered so far in the current recovery",
+		   rstate.in_recovery ? rstate.nr_finished : 0);
+}
+
+static void add_cache_metrics(struct strbuf *buf)
+{
+	struct object_cache_info *info;
+	struct sd_req hdr;
+	uint64_t dirty = 0, total = 0, count = 0;
+	int ret;
+
+	if (!sys->enable_object_cache)
+		return;
+
+	info = xzalloc(sizeof(*info));
+	sd_init_req(&hdr, SD_OP_GET_CACHE_INFO);
+	hdr.data_length = sizeof(*info);
+	ret = exec_local_req(&hdr, info);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to get the object cache information, %s",
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	for (int i = 0; i < info->count; i++) {
+		dirty += info->caches[i].dirty;
+		total += info->caches[i].total;
+	}
+	add_metric(buf, "sheepdog_object_cache_size_bytes", "gauge",
+		   "Capacity of the object cache", info->size);
+	add_metric(buf, "sheepdog_object_cache_used_bytes", "gauge",
+		   "Space used by the object cache", info->used);
+	add_metric(buf, "sheepdog_object_cache_objects", "gauge",
+		   "Objects in the object cache", total);
+	add_metric(buf, "sheepdog_object_cache_dirty_objects", "gauge",
+		   "Objects in the object cache not flushed yet", dirty);
+	add_metric(buf, "sheepdog_object_cache_writeback_bytes_per_second",
+		   "gauge", "Measured bandwidth of pushing the dirty objects",
+		   info->push_bw);
+
+	/* bucket i counts the latencies below SD_LAT_BUCKET_BASE << i */
+	add_header(buf, "sheepdog_object_cache_flush_latency_seconds",
+		   "histogram", "Latency of the flushes of the guests");
+	for (int i = 0; i < SD_NR_LAT_BUCKETS - 1; i++) {
+		count += info->flush_hist[i];
+		strbuf_addf(buf, "sheepdog_object_cache_flush_latency_seconds_"
+			    "bucket{le=\"%g\"} %"PRIu64"\n",
+			    (double)(SD_LAT_BUCKET_BASE << i) / 1e9, count);
+	}
+	count += info->flush_hist[SD_NR_LAT_BUCKETS - 1];
+	strbuf_addf(buf, "sheepdog_object_cache_flush_latency_seconds_bucket"
+		    "{le=\"+Inf\"} %"PRIu64"\n", count);
+	strbuf_addf(buf, "sheepdog_object_cache_flush_latency_seconds_sum %g\n",
+		    (double)info->flush_latency / 1e9);
+	strbuf_addf(buf, "sheepdog_object_cache_flush_latency_seconds_count "
+		    "%"PRIu64"\n", count);
+out:
+	free(info);
+}
+
+static void add_disk_metrics(struct strbuf *buf)
+{
+	struct sd_md_info *info;
+	struct sd_req hdr;
+	int ret;
+
+	if (sys->gateway_only)
+		return;
+
+	info = xzalloc(sizeof(*info));
+	sd_init_req(&hdr, SD_OP_MD_INFO);
+	hdr.data_length = sizeof(*info);
+	ret = exec_local_req(&hdr, info);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to get the disk information, %s",
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	add_header(buf, "sheepdog_disk_used_bytes", "gauge",
+		   "Space used by the objects on the disk");
+	for (int i = 0; i < info->nr; i++) {
+		strbuf_addstr(buf, "sheepdog_disk_used_bytes{path=\"");
+		add_label_value(buf, info->disk[i].path);
+		strbuf_addf(buf, "\"} %"PRIu64"\n", info->disk[i].used);
+	}
+	add_header(buf, "sheepdog_disk_free_bytes", "gauge",
+		   "Free space of the disk");
+	for (int i = 0; i < info->nr; i++) {
+		strbuf_addstr(buf, "sheepdog_disk_free_bytes{path=\"");
+		add_label_value(buf, info->disk[i].path);
+		strbuf_addf(buf, "\"} %"PRIu64"\n", info->disk[i].free);
+	}
+out:
+	free(info);
+}
+
+static void add_wq_metrics(struct strbuf *buf)
+{
+	struct wq_stat stats[NR_METRICS_WQS];
+	int nr = wq_get_stats(stats, ARRAY_SIZE(stats));
+
+	add_header(buf, "sheepdog_workqueue_queued", "gauge",
+		   "Works queued or running in the work queue");
+	for (int i = 0; i < nr; i++)
+		strbuf_addf(buf, "sheepdog_workqueue_queued{queue=\"%s\"} "
+			    "%zu\n", stats[i].name, stats[i].nr_queued_work);
+	add_header(buf, "sheepdog_workqueue_threads", "gauge",
+		   "Worker threads of the work queue");
+	for (int i = 0; i < nr; i++)
+		strbuf_addf(buf, "sheepdog_workqueue_threads{queue=\"%s\"} "
+			    "%zu\n", stats[i].name, stats[i].nr_threads);
+}
+
+static void collect_metrics(struct strbuf *buf)
+{
+	/* the local requests would wait for the cluster to be back */
+	bool ready = sys->cinfo.status == SD_STATUS_OK;
+
+	add_metric(buf, "sheepdog_up", "gauge",
+		   "Whether the cluster is serving requests", ready);
+	add_metric(buf, "sheepdog_epoch", "gauge",
+		   "Current epoch of the cluster", sys_epoch());
+	add_wq_metrics(buf);
+	if (!ready)
+		return;
+
+	add_stat_metrics(buf);
+	add_recovery_metrics(buf);
+	add_cache_metrics(buf);
+	add_disk_metrics(buf);
+}
+
+static void send_response(int fd, const char *status, struct strbuf *body)
+{
+	struct strbuf buf = STRBUF_INIT;
+
+	strbuf_addf(&buf, "HTTP/1.0 %s\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %zu\r\n"
+		    "Connection: close\r\n\r\n", status, body->len);
+	strbuf_addbuf(&buf, body);
+	if (xwrite(fd, buf.buf, buf.len) != buf.len)
+		sd_debug("failed to send the metrics, %m");
+	strbuf_release(&buf);
+}
+
+/* read the request head, the body of a GET request is ignored */
+static bool read_request(int fd, char *req, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len - 1) {
+		ssize_t ret = read(fd, req + done, len - 1 - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		done += ret;
+		req[done] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			return true;
+	}
+
+	return false;
+}
+
+static void handle_request(int fd)
+{
+	char req[METRICS_MAX_REQ];
+	struct strbuf body = STRBUF_INIT;
+
+	if (!read_request(fd, req, sizeof(req)))
+		return;
+
+	if (strncmp(req, "GET ", 4) != 0) {
+		strbuf_addstr(&body, "only GET is supported\n");
+		send_response(fd, "405 Method Not Allowed", &body);
+	} else if (strncmp(req + 4, "/metrics ", 9) != 0 &&
+		   strncmp(req + 4, "/ ", 2) != 0) {
+		strbuf_addstr(&body, "metrics are at /metrics\n");
+		send_response(fd, "404 Not Found", &body);
+	} else {
+		collect_metrics(&body);
+		send_response(fd, "200 OK", &body);
+	}
+	strbuf_release(&body);
+}
+
+static void metrics_listen_handler(int listen_fd, int events, void *data)
+{
+	struct sockaddr_storage from;
+	socklen_t namesize = sizeof(from);
+	int fd;
+
+	fd = accept(listen_fd, (struct sockaddr *)&from, &namesize);
+	if (fd < 0) {
+		sd_err("failed to accept a new connection: %m");
+		return;
+	}
+
+	/* a stalled client must not block the next scrape for long */
+	if (set_rcv_timeout(fd) < 0 || set_snd_timeout(fd) < 0) {
+		sd_err("failed to set timeouts, %m");
+		close(fd);
+		return;
+	}
+
+	handle_request(fd);
+	close(fd);
+}
+
+static void *metrics_main_loop(void *ignored)
+{
+	if (init_event(NR_METRICS_LISTEN_FDS) < 0)
+		return NULL;
+
+	for (int i = 0; i < nr_listen_fds; i++)
+		if (register_event(listen_fds[i], metrics_listen_handler,
+				   NULL) < 0)
+			return NULL;
+
+	for (;;)
+		event_loop(-1);
+
+	return NULL;
+}
+
+static int metrics_listen_cb(int fd, void *data)
+{
+	if (nr_listen_fds == NR_METRICS_LISTEN_FDS)
+		return -1;
+
+	listen_fds[nr_listen_fds++] = fd;
+	return 0;
+}
+
+static int metrics_opt_host_parser(const char *s)
+{
+	pstrcpy(metrics_host, sizeof(metrics_host), s);
+	return 0;
+}
+
+static int metrics_opt_port_parser(const char *s)
+{
+	char *p;
+	long port = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || port < 1 || port > UINT16_MAX) {
+		sd_err("Invalid metrics port '%s'", s);
+		return -1;
+	}
+
+	metrics_port = port;
+	return 0;
+}
+
+static struct option_parser metrics_opt_parsers[] = {
+	{ "host=", metrics_opt_host_parser },
+	{ "port=", metrics_opt_port_parser },
+	{ NULL, NULL },
+};
+
+int metrics_init(const char *options)
+{
+	sd_thread_t t;
+	char *s;
+	int err;
+
+	s = xstrdup(options);
+	err = option_parse(s, ",", metrics_opt_parsers);
+	free(s);
+	if (err < 0)
+		return -1;
+
+	if (create_listen_ports(strlen(metrics_host) ? metrics_host : NULL,
+				metrics_port, metrics_listen_cb, NULL))
+		return -1;
+
+	err = sd_thread_create("metrics", &t, metrics_main_loop, NULL);
+	if (err) {
+		sd_err("%s", strerror(err));
+		return -1;
+	}
+	sd_info("metrics are exported at port %d", metrics_port);
+
+	return 0;
+}
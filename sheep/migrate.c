@@ -503,6 +503,40 @@ static int migrate_from_v4_to_v5(void)
 	return -1;
 }
 
+static int migrate_from_v5_to_v6(void)
+{
+	sd_err("upgrading the store format 5 isn't supported, recreate the"
+	       " store with this sheep and restore the VDIs from a backup");
+
+	return -1;
+}
+
+static int migrate_from_v6_to_v7(void)
+{
+	int fd, ret;
+	uint16_t version = 7;
+
+	/*
+	 * Nothing to convert, init_epoch_log() imports the epoch files into
+	 * the epoch log when the sheep starts.
+	 */
+	fd = open(config_path, O_WRONLY | O_DSYNC);
+	if (fd < 0) {
+		sd_err("failed to open config file, %m");
+		return -1;
+	}
+
+	ret = xpwrite(fd, &version, sizeof(version),
+		      offsetof(struct sheepdog_config_v2, version));
+	close(fd);
+	if (ret != sizeof(version)) {
+		sd_err("failed to write config data, %m");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int (*migrate[])(void) = {
 	migrate_from_v0_to_v1, /* from 0.4.0 or 0.5.0 to 0.5.1 */
 	migrate_from_v1_to_v2, /* from 0.5.x to 0.6.0 */
@@ -523,13 +557,22 @@ static int (*migrate[])(void) = {
 	 * 2. changing a place of btree_counter in inode object
 	 */
 	migrate_from_v4_to_v5,
+
+	/* the format 5 stores can't be upgraded in place */
+	migrate_from_v5_to_v6,
+
+	/*
+	 * the epochs are kept in one log instead of one file per epoch, so
+	 * that an older sheep doesn't start without any epoch
+	 */
+	migrate_from_v6_to_v7,
 };
 
 int sd_migrate_store(int from, int to)
 {
 	int ver, ret;
 
-	sd_assert(to <= sizeof(migrate));
+	sd_assert(to <= ARRAY_SIZE(migrate));
 
 	ret = backup_store();
 	if (ret != 0) {
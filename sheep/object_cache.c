@@ -12,6 +12,7 @@
  */
 
 #include "sheep_priv.h"
+#include "hmap.h"
 
 /*
  * Object Cache ID
@@ -29,22 +30,44 @@
 
 #define CACHE_INDEX_MASK      (CACHE_CREATE_BIT)
 
-#define CACHE_OBJECT_SIZE (SD_DATA_OBJ_SIZE / 1024 / 1024) /* M */
+/*
+ * Kick background pusher if dirty_count greater than it, until the writeback
+ * bandwidth is measured
+ */
+#define MAX_DIRTY_OBJECT_COUNT	10
+
+/* Latency target of the flushes of the guests in ms */
+#define DEFAULT_FLUSH_TARGET	1000
 
-/* Kick background pusher if dirty_count greater than it */
-#define MAX_DIRTY_OBJECT_COUNT	10 /* Just a random number, no rationale */
+/* The background pushes sleep at most this long at once, in ns */
+#define PUSH_SLEEP_STEP		(UINT64_C(10) * 1000000)
+
+/* Max nr of the dirty objects pushed in a batch, and of their dirty bytes */
+#define PUSH_BATCH_NR		32
+#define PUSH_BATCH_SIZE		(UINT64_C(16) << 20)
 
 struct global_cache {
 	uint32_t capacity; /* The real capacity of object cache of this node */
 	uatomic_bool in_reclaim; /* If the reclaimer is working */
+	uint64_t hits; /* Requests of the objects found in the cache */
+	uint64_t misses; /* Requests of the objects pulled into the cache */
+
+	uint64_t push_bw; /* Measured writeback bandwidth in bytes/s */
+	struct sd_mutex push_lock; /* protects push_bw and push_tat */
+	uint64_t push_tat; /* When the background pushes so far are done */
+	uint64_t flush_latency; /* in ns, of all the guest flushes */
+	uint64_t flush_hist[SD_NR_LAT_BUCKETS]; /* latency of guest flushes */
 };
 
 struct object_cache_entry {
 	uint64_t idx; /* Index of this entry */
 	refcnt_t refcnt; /* Reference count of this entry */
 	uint64_t bmap; /* Each bit represents one dirty block in object */
+	uint32_t size; /* Capacity taken by this object in M */
+	uint32_t *slot; /* Slots of the object if the cache is in a slab */
+	uatomic_bool referenced; /* Read since the reclaimer passed by */
 	struct object_cache *oc; /* Object cache this entry belongs to */
-	struct rb_node node; /* For lru tree of object cache */
+	struct hmap_node node; /* For the entry map of object cache */
 	struct list_node dirty_list; /* For dirty list of object cache */
 	struct list_node lru_list; /* For lru list of object cache */
 
@@ -56,8 +79,10 @@ struct object_cache {
 	uint32_t push_count; /* How many push threads queued in push phase. */
 	uint32_t dirty_count; /* How many dirty object in this cache */
 	uint32_t total_count; /* Count of objects include dirty and clean */
-	struct hlist_node hash; /* VDI is linked to the global hash lists */
-	struct rb_root lru_tree; /* For faster object search */
+	uint32_t flush_waiters; /* Flushes of the guest waiting for a push */
+	uint64_t push_bytes; /* Bytes pushed by the current push */
+	struct hmap_node hash; /* VDI is linked to the global map */
+	struct hmap entries; /* For faster object search */
 	struct list_head lru_head; /* Per VDI LRU list for reclaimer */
 	struct list_head dirty_head; /* Dirty objects linked to this list */
 	int push_efd; /* Used to synchronize between pusher and push threads */
@@ -68,47 +93,56 @@ struct object_cache {
 
 struct push_work {
 	struct work work;
-	struct object_cache_entry *entry;
 	struct object_cache *oc;
+	bool background; /* not pushed for a flush of the guest */
+	int nr; /* nr of the entries pushed together */
+	struct object_cache_entry *entries[PUSH_BATCH_NR];
 };
 
-static struct global_cache gcache;
+static struct global_cache gcache = {
+	.push_lock = SD_MUTEX_INITIALIZER,
+};
 static char object_cache_dir[PATH_MAX];
 static int def_open_flags = O_RDWR;
+static bool cache_in_slab; /* objects are kept in a slab, not in files */
 
-#define HASH_BITS	5
-#define HASH_SIZE	(1 << HASH_BITS)
+#define NR_VDI_LOCKS	32
+#define NR_ENTRY_LOCKS	16
 
-static struct sd_rw_lock hashtable_lock[HASH_SIZE] = {
-	[0 ... HASH_SIZE - 1] = SD_RW_LOCK_INITIALIZER
+static struct hmap cache_map; /* object caches of the VDIs */
+
+/*
+ * The objects being pulled, created or reclaimed.  The requests for them wait
+ * here until the object is in the cache or out of it for good.
+ */
+#define FILL_BITS	5
+#define FILL_SIZE	(1 << FILL_BITS)
+
+struct cache_fill {
+	uint32_t vid;
+	uint64_t idx;
+	struct list_node list;
 };
 
-static struct hlist_head cache_hashtable[HASH_SIZE];
+static struct {
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	struct list_head head;
+} fill_table[FILL_SIZE];
 
-static int object_cache_push(struct object_cache *oc);
+static int object_cache_push(struct object_cache *oc, bool background);
 
 static inline bool entry_is_dirty(const struct object_cache_entry *entry)
 {
 	return !!entry->bmap;
 }
 
-static inline int hash(uint64_t vid)
-{
-	return hash_64(vid, HASH_BITS);
-}
-
 /* We should always use this helper to get entry idx */
 static inline uint64_t entry_idx(const struct object_cache_entry *entry)
 {
 	return entry->idx & ~CACHE_INDEX_MASK;
 }
 
-static int object_cache_cmp(const struct object_cache_entry *a,
-			    const struct object_cache_entry *b)
-{
-	return intcmp(entry_idx(a), entry_idx(b));
-}
-
 static inline uint64_t object_cache_oid_to_idx(uint64_t oid)
 {
 	uint64_t idx = data_oid_to_idx(oid);
@@ -126,7 +160,7 @@ static inline bool idx_has_vdi_bit(uint64_t idx)
 
 static inline size_t get_cache_block_size(uint64_t oid)
 {
-	size_t bsize = DIV_ROUND_UP(get_objsize(oid),
+	size_t bsize = DIV_ROUND_UP(get_vdi_objsize(oid),
 				    sizeof(uint64_t) * BITS_PER_BYTE);
 
 	return round_up(bsize, BLOCK_SIZE); /* To be FS friendly */
@@ -163,17 +197,33 @@ static inline bool entry_in_use(struct object_cache_entry *entry)
 	return refcount_read(&entry->refcnt) > 0;
 }
 
+/* Called with the lock of the entry map held, see hmap_lookup() */
+static void get_cache_entry_node(struct hmap_node *node)
+{
+	get_cache_entry(container_of(node, struct object_cache_entry, node));
+}
+
+static bool entry_is_idle(struct hmap_node *node)
+{
+	return !entry_in_use(container_of(node, struct object_cache_entry,
+					  node));
+}
+
 /*
  * Mutual exclusive protection strategy:
  *
  * reader and writer:          no need to project since it is okay to read
  *                             unacked stale data.
  * reader, writer and pusher:    cache lock and entry lock and refcnt.
- * reader, writer and reclaimer: cache lock and entry refcnt.
+ * reader, writer and reclaimer: entry map lock and entry refcnt.
  * pusher and reclaimer:       cache lock and entry refcnt.
  *
  * entry->bmap is projected by mostly entry lock, sometimes cache lock.
- * dirty list is projected by cache lock.
+ * dirty list and lru list are projected by cache lock.
+ *
+ * The entries are looked up in the entry map without the cache lock.  The
+ * reference is taken under the lock of the map, and the reclaimer removes only
+ * the entries without references from the map before freeing them.
  */
 static inline void read_lock_cache(struct object_cache *oc)
 {
@@ -205,18 +255,65 @@ static inline void unlock_entry(struct object_cache_entry *entry)
 	sd_rw_unlock(&entry->lock);
 }
 
-static struct object_cache_entry *
-lru_tree_insert(struct rb_root *root, struct object_cache_entry *new)
+static inline int fill_hash(uint32_t vid, uint64_t idx)
+{
+	return hash_64(((uint64_t)vid << 32) ^ idx, FILL_BITS);
+}
+
+static struct cache_fill *fill_search(struct list_head *head, uint32_t vid,
+				      uint64_t idx)
 {
-	return rb_insert(root, new, node, object_cache_cmp);
+	struct cache_fill *fill;
+
+	list_for_each_entry(fill, head, list) {
+		if (fill->vid == vid && fill->idx == idx)
+			return fill;
+	}
+	return NULL;
 }
 
-static struct object_cache_entry *lru_tree_search(struct rb_root *root,
-						  uint64_t idx)
+/* Return false if somebody else is adding or removing the object */
+static bool cache_fill_begin(struct object_cache *oc, uint64_t idx)
 {
-	struct object_cache_entry key = { .idx = idx };
+	int h = fill_hash(oc->vid, idx);
+	struct cache_fill *fill;
+
+	sd_mutex_lock(&fill_table[h].lock);
+	if (fill_search(&fill_table[h].head, oc->vid, idx)) {
+		sd_mutex_unlock(&fill_table[h].lock);
+		return false;
+	}
+	fill = xmalloc(sizeof(*fill));
+	fill->vid = oc->vid;
+	fill->idx = idx;
+	list_add_tail(&fill->list, &fill_table[h].head);
+	sd_mutex_unlock(&fill_table[h].lock);
 
-	return rb_search(root, &key, node, object_cache_cmp);
+	return true;
+}
+
+static void cache_fill_end(struct object_cache *oc, uint64_t idx)
+{
+	int h = fill_hash(oc->vid, idx);
+	struct cache_fill *fill;
+
+	sd_mutex_lock(&fill_table[h].lock);
+	fill = fill_search(&fill_table[h].head, oc->vid, idx);
+	list_del(&fill->list);
+	sd_cond_broadcast(&fill_table[h].cond);
+	sd_mutex_unlock(&fill_table[h].lock);
+	free(fill);
+}
+
+/* Wait for the object to be added or removed, instead of doing it again */
+static void cache_fill_wait(struct object_cache *oc, uint64_t idx)
+{
+	int h = fill_hash(oc->vid, idx);
+
+	sd_mutex_lock(&fill_table[h].lock);
+	while (fill_search(&fill_table[h].head, oc->vid, idx))
+		sd_cond_wait(&fill_table[h].cond, &fill_table[h].lock);
+	sd_mutex_unlock(&fill_table[h].lock);
 }
 
 static void do_background_push(struct work *work)
@@ -227,7 +324,7 @@ static void do_background_push(struct work *work)
 	if (sd_mutex_trylock(&oc->push_mutex) == EBUSY)
 		return;
 
-	object_cache_push(oc);
+	object_cache_push(oc, true);
 	sd_mutex_unlock(&oc->push_mutex);
 }
 
@@ -245,7 +342,21 @@ static void kick_background_pusher(struct object_cache *oc)
 	pw->oc = oc;
 	pw->work.fn = do_background_push;
 	pw->work.done = background_push_done;
-	queue_work(sys->oc_push_wqueue, &pw->work);
+	queue_work(sys->oc_bg_push_wqueue, &pw->work);
+}
+
+/*
+ * Push the dirty objects in the background before a flush of the guest would
+ * take longer than the target latency to push them at the measured bandwidth.
+ */
+static uint32_t dirty_threshold(struct object_cache *oc)
+{
+	uint64_t bw = uatomic_read(&gcache.push_bw);
+	size_t size = get_vdi_objsize(vid_to_data_oid(oc->vid, 0));
+
+	if (!bw || !size)
+		return MAX_DIRTY_OBJECT_COUNT;
+	return max(bw * sys->object_cache_flush_ms / 1000 / size, UINT64_C(1));
 }
 
 static void del_from_dirty_list(struct object_cache_entry *entry)
@@ -262,21 +373,26 @@ static void add_to_dirty_list(struct object_cache_entry *entry)
 
 	list_add_tail(&entry->dirty_list, &oc->dirty_head);
 	/* FIXME read sys->status atomically */
-	if (uatomic_add_return(&oc->dirty_count, 1) > MAX_DIRTY_OBJECT_COUNT
+	if (uatomic_add_return(&oc->dirty_count, 1) > dirty_threshold(oc)
 	    && sys->cinfo.status == SD_STATUS_OK)
 		kick_background_pusher(oc);
 }
 
+/* The entry must be out of the entry map already */
 static inline void free_cache_entry(struct object_cache_entry *entry)
 {
 	struct object_cache *oc = entry->oc;
 
-	rb_erase(&entry->node, &oc->lru_tree);
 	list_del(&entry->lru_list);
 	oc->total_count--;
 	if (list_linked(&entry->dirty_list))
 		del_from_dirty_list(entry);
+	if (entry_is_dirty(entry))
+		cache_journal_log(oc->vid, entry_idx(entry), 0, false);
+	mem_cache_drop(oc->vid, entry_idx(entry),
+		       (size_t)entry->size * 1024 * 1024);
 	sd_destroy_rw_lock(&entry->lock);
+	free(entry->slot);
 	free(entry);
 }
 
@@ -288,14 +404,21 @@ static uint64_t idx_to_oid(uint32_t vid, uint64_t idx)
 		return vid_to_data_oid(vid, idx);
 }
 
-static int remove_cache_object(struct object_cache *oc, uint64_t idx)
+static int remove_cache_object(struct object_cache_entry *entry)
 {
+	struct object_cache *oc = entry->oc;
+	uint64_t idx = entry_idx(entry);
 	int ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
 
+	sd_debug("%"PRIx64, idx_to_oid(oc->vid, idx));
+	if (cache_in_slab) {
+		slab_free(entry->slot, entry->size);
+		return SD_RES_SUCCESS;
+	}
+
 	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%016"PRIx64,
 		 object_cache_dir, oc->vid, idx);
-	sd_debug("%"PRIx64, idx_to_oid(oc->vid, idx));
 	if (unlikely(unlink(path) < 0)) {
 		sd_err("failed to remove cached object %m");
 		if (errno == ENOENT)
@@ -307,13 +430,18 @@ out:
 	return ret;
 }
 
-static int read_cache_object_noupdate(uint32_t vid, uint64_t idx, void *buf,
-				      size_t count, off_t offset)
+static int read_cache_object_noupdate(struct object_cache_entry *entry,
+				      void *buf, size_t count, off_t offset)
 {
+	uint32_t vid = entry->oc->vid;
+	uint64_t idx = entry_idx(entry);
 	size_t size;
 	int fd, flags = def_open_flags, ret = SD_RES_SUCCESS;
 	char p[PATH_MAX];
 
+	if (cache_in_slab)
+		return slab_read(entry->slot, buf, count, offset);
+
 	snprintf(p, sizeof(p), "%s/%06"PRIx32"/%016"PRIx64, object_cache_dir,
 		 vid, idx);
 
@@ -344,13 +472,18 @@ out:
 	return ret;
 }
 
-static int write_cache_object_noupdate(uint32_t vid, uint64_t idx, void *buf,
-				       size_t count, off_t offset)
+static int write_cache_object_noupdate(struct object_cache_entry *entry,
+				       void *buf, size_t count, off_t offset)
 {
+	uint32_t vid = entry->oc->vid;
+	uint64_t idx = entry_idx(entry);
 	size_t size;
 	int fd, flags = def_open_flags, ret = SD_RES_SUCCESS;
 	char p[PATH_MAX];
 
+	if (cache_in_slab)
+		return slab_write(entry->slot, buf, count, offset);
+
 	snprintf(p, sizeof(p), "%s/%06"PRIx32"/%016"PRIx64, object_cache_dir,
 		 vid, idx);
 	if (sys->object_cache_directio && !idx_has_vdi_bit(idx)) {
@@ -380,24 +513,58 @@ out:
 	return ret;
 }
 
-static int read_cache_object(struct object_cache_entry *entry, void *buf,
-			     size_t count, off_t offset)
+/*
+ * Read the whole blocks around the request and keep them in memory.  The entry
+ * lock keeps a write from updating the blocks in between.
+ */
+static int read_cache_object_to_mem(struct object_cache_entry *entry,
+				    void *buf, size_t count, off_t offset)
 {
 	uint32_t vid = entry->oc->vid;
 	uint64_t idx = entry_idx(entry);
-	struct object_cache *oc = entry->oc;
+	size_t size = get_vdi_objsize(idx_to_oid(vid, idx));
+	off_t start = round_down(offset, MEM_CACHE_BLOCK_SIZE);
+	size_t len = min(round_up(offset + count, MEM_CACHE_BLOCK_SIZE),
+			 size) - start;
+	void *p = buf;
 	int ret;
 
-	ret = read_cache_object_noupdate(vid, idx, buf, count, offset);
+	if (start != offset || len != count)
+		p = xvalloc(len);
 
-	if (ret == SD_RES_SUCCESS) {
-		write_lock_cache(oc);
-		list_move_tail(&entry->lru_list, &oc->lru_head);
-		unlock_cache(oc);
+	read_lock_entry(entry);
+	ret = read_cache_object_noupdate(entry, p, len, start);
+	if (ret == SD_RES_SUCCESS)
+		mem_cache_fill(vid, idx, p, len, start, size);
+	unlock_entry(entry);
+
+	if (p != buf) {
+		if (ret == SD_RES_SUCCESS)
+			memcpy(buf, (char *)p + (offset - start), count);
+		free(p);
 	}
 	return ret;
 }
 
+static int read_cache_object(struct object_cache_entry *entry, void *buf,
+			     size_t count, off_t offset)
+{
+	struct object_cache *oc = entry->oc;
+	int ret;
+
+	if (!sys->object_cache_mem_size)
+		ret = read_cache_object_noupdate(entry, buf, count, offset);
+	else if (mem_cache_read(oc->vid, entry_idx(entry), buf, count, offset))
+		ret = SD_RES_SUCCESS;
+	else
+		ret = read_cache_object_to_mem(entry, buf, count, offset);
+
+	/* don't serialize the readers on the cache lock to update the lru */
+	if (ret == SD_RES_SUCCESS && !uatomic_is_true(&entry->referenced))
+		uatomic_set_true(&entry->referenced);
+	return ret;
+}
+
 static int write_cache_object(struct object_cache_entry *entry, void *buf,
 			      size_t count, off_t offset, bool create,
 			      bool writeback)
@@ -407,18 +574,27 @@ static int write_cache_object(struct object_cache_entry *entry, void *buf,
 	uint64_t oid = idx_to_oid(vid, idx);
 	struct object_cache *oc = entry->oc;
 	struct sd_req hdr;
+	uint64_t bmap = 0;
 	int ret;
 
 	write_lock_entry(entry);
 
-	ret = write_cache_object_noupdate(vid, idx, buf, count, offset);
+	if (writeback) {
+		bmap = calc_object_bmap(oid, count, offset);
+		/* the blocks must be known dirty before they are written */
+		if ((entry->bmap | bmap) != entry->bmap)
+			cache_journal_log(vid, idx, entry->bmap | bmap,
+					  !!(entry->idx & CACHE_CREATE_BIT));
+	}
+	ret = write_cache_object_noupdate(entry, buf, count, offset);
 	if (ret != SD_RES_SUCCESS) {
 		unlock_entry(entry);
 		return ret;
 	}
+	mem_cache_write(vid, idx, buf, count, offset);
 	write_lock_cache(oc);
 	if (writeback) {
-		entry->bmap |= calc_object_bmap(oid, count, offset);
+		entry->bmap |= bmap;
 		if (!list_linked(&entry->dirty_list))
 			add_to_dirty_list(entry);
 	}
@@ -450,33 +626,44 @@ out:
 	return ret;
 }
 
-static int push_cache_object(uint32_t vid, uint64_t idx, uint64_t bmap,
-			     bool create)
+/* The range of the object from the first dirty block to the last one */
+static size_t push_range(uint64_t oid, uint64_t bmap, off_t *offset)
+{
+	size_t bsize = get_cache_block_size(oid);
+	int first_bit, last_bit;
+
+	first_bit = ffsll(bmap) - 1;
+	last_bit = fls64(bmap) - 1;
+
+	sd_debug("%"PRIx64" bmap(%zd):0x%"PRIx64", first_bit:%d, last_bit:%d",
+		 oid, bsize, bmap, first_bit, last_bit);
+	*offset = first_bit * bsize;
+	return min((last_bit - first_bit + 1) * bsize,
+		   get_vdi_objsize(oid) - (size_t)*offset);
+}
+
+static int push_cache_object(struct object_cache_entry *entry, uint64_t bmap,
+			     bool create, bool background)
 {
 	struct sd_req hdr;
 	void *buf;
 	off_t offset;
-	uint64_t oid = idx_to_oid(vid, idx);
-	size_t data_length, bsize = get_cache_block_size(oid);
+	uint64_t oid = idx_to_oid(entry->oc->vid, entry_idx(entry));
+	size_t data_length;
 	int ret = SD_RES_NO_MEM;
-	int first_bit, last_bit;
 
 	if (!bmap) {
 		sd_debug("WARN: nothing to flush %"PRIx64, oid);
 		return SD_RES_SUCCESS;
 	}
+	/* the objects loaded at startup wait until we know their VDI */
+	if (unlikely(!get_vdi_objsize(oid)))
+		return SD_RES_NO_VDI;
 
-	first_bit = ffsll(bmap) - 1;
-	last_bit = fls64(bmap) - 1;
-
-	sd_debug("%"PRIx64" bmap(%zd):0x%"PRIx64", first_bit:%d, last_bit:%d",
-		 oid, bsize, bmap, first_bit, last_bit);
-	offset = first_bit * bsize;
-	data_length = min((last_bit - first_bit + 1) * bsize,
-			  get_objsize(oid) - (size_t)offset);
+	data_length = push_range(oid, bmap, &offset);
 
 	buf = xvalloc(data_length);
-	ret = read_cache_object_noupdate(vid, idx, buf, data_length, offset);
+	ret = read_cache_object_noupdate(entry, buf, data_length, offset);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
@@ -485,6 +672,8 @@ static int push_cache_object(uint32_t vid, uint64_t idx, uint64_t bmap,
 	else
 		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
 	hdr.flags = SD_FLAG_CMD_WRITE;
+	if (background)
+		hdr.flags |= SD_FLAG_CMD_BACKGROUND;
 	hdr.data_length = data_length;
 	hdr.obj.oid = oid;
 	hdr.obj.offset = offset;
@@ -493,6 +682,79 @@ static int push_cache_object(uint32_t vid, uint64_t idx, uint64_t bmap,
 	if (ret != SD_RES_SUCCESS)
 		sd_err("failed to push object %" PRIx64 ", %s", oid,
 		       sd_strerror(ret));
+	else
+		uatomic_add(&entry->oc->push_bytes, data_length);
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Push the dirty ranges of the entries with one SD_OP_WRITE_BATCH request.  The
+ * gateway sends each target node one request with all the ranges it stores.
+ */
+static int push_cache_batch(struct push_work *pw)
+{
+	struct object_cache *oc = pw->oc;
+	struct object_cache_entry *entries[PUSH_BATCH_NR];
+	struct sd_batch_entry be[PUSH_BATCH_NR];
+	uint32_t nr = 0, len, align = getpagesize();
+	uint64_t bytes = 0;
+	struct sd_req hdr;
+	char *buf;
+	int ret = SD_RES_SUCCESS;
+
+	memset(be, 0, sizeof(be));
+	for (int i = 0; i < pw->nr; i++) {
+		struct object_cache_entry *entry = pw->entries[i];
+		uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry));
+		off_t offset;
+
+		/* see push_entry() about the readonly objects */
+		if (!entry->bmap || oid_is_readonly(oid))
+			continue;
+
+		be[nr].oid = oid;
+		be[nr].length = push_range(oid, entry->bmap, &offset);
+		be[nr].offset = offset;
+		be[nr].create = !!(entry->idx & CACHE_CREATE_BIT);
+		entries[nr++] = entry;
+	}
+	if (!nr)
+		return SD_RES_SUCCESS;
+
+	/* the data of each object is aligned for direct I/O */
+	len = round_up(sizeof(be[0]) * nr, align);
+	for (int i = 0; i < nr; i++) {
+		be[i].data_offset = len;
+		len += round_up(be[i].length, align);
+		bytes += be[i].length;
+	}
+
+	buf = xvalloc(len);
+	memcpy(buf, be, sizeof(be[0]) * nr);
+	for (int i = 0; i < nr; i++) {
+		ret = read_cache_object_noupdate(entries[i],
+						 buf + be[i].data_offset,
+						 be[i].length, be[i].offset);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	sd_init_req(&hdr, SD_OP_WRITE_BATCH);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	if (pw->background)
+		hdr.flags |= SD_FLAG_CMD_BACKGROUND;
+	hdr.data_length = len;
+	hdr.obj.oid = be[0].oid;
+	hdr.obj.length = nr;
+
+	ret = exec_local_req(&hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to push %"PRIu32" objects of %"PRIx32", %s", nr,
+		       oc->vid, sd_strerror(ret));
+	else
+		uatomic_add(&oc->push_bytes, bytes);
 out:
 	free(buf);
 	return ret;
@@ -503,6 +765,8 @@ out:
  *  - only tries to reclaim 'clean' object, which doesn't has any dirty updates,
  *    in a LRU list.
  *  - skip the object when it is in R/W operation.
+ *  - skip the object read since the last pass and clear its referenced bit,
+ *    the readers don't move the objects in the LRU list.
  *  - skip the dirty object if it is not in push(writeback) phase.
  *  - wait on the dirty object if it is in push phase.
  */
@@ -515,16 +779,22 @@ out:
 static void do_reclaim_object(struct object_cache *oc)
 {
 	struct object_cache_entry *entry;
-	uint64_t oid;
-	uint32_t cap;
+	uint64_t oid, idx;
+	uint32_t cap, size;
 
 	write_lock_cache(oc);
 	list_for_each_entry(entry, &oc->lru_head, lru_list) {
-		oid = idx_to_oid(oc->vid, entry_idx(entry));
+		idx = entry_idx(entry);
+		oid = idx_to_oid(oc->vid, idx);
 		if (entry_in_use(entry)) {
 			sd_debug("%"PRIx64" is in use, skip...", oid);
 			continue;
 		}
+		if (uatomic_is_true(&entry->referenced)) {
+			sd_debug("%"PRIx64" is referenced, skip...", oid);
+			uatomic_set_false(&entry->referenced);
+			continue;
+		}
 
 		/*
 		 * The shared snapshot objects won't be released after being
@@ -536,10 +806,22 @@ static void do_reclaim_object(struct object_cache *oc)
 			sd_debug("%"PRIx64" is dirty, skip...", oid);
 			continue;
 		}
-		if (remove_cache_object(oc, entry_idx(entry)) != SD_RES_SUCCESS)
+		if (!cache_fill_begin(oc, idx))
+			continue;
+		/* new readers can't get the entry once it is out of the map */
+		if (!hmap_remove_if(&oc->entries, &entry->node, entry_is_idle)) {
+			cache_fill_end(oc, idx);
+			continue;
+		}
+		if (remove_cache_object(entry) != SD_RES_SUCCESS) {
+			hmap_insert(&oc->entries, &entry->node);
+			cache_fill_end(oc, idx);
 			continue;
+		}
+		size = entry->size;
 		free_cache_entry(entry);
-		cap = uatomic_sub_return(&gcache.capacity, CACHE_OBJECT_SIZE);
+		cache_fill_end(oc, idx);
+		cap = uatomic_sub_return(&gcache.capacity, size);
 		sd_debug("%"PRIx64" reclaimed. capacity:%"PRId32, oid, cap);
 		if (cap <= HIGH_WATERMARK)
 			break;
@@ -552,35 +834,29 @@ struct reclaim_work {
 	int delay;
 };
 
+static bool reclaim_vdi(struct hmap_node *node, void *arg)
+{
+	struct object_cache *cache = container_of(node, struct object_cache,
+						  hash);
+	uint32_t cap;
+
+	do_reclaim_object(cache);
+	cap = uatomic_read(&gcache.capacity);
+	if (cap <= HIGH_WATERMARK) {
+		sd_debug("complete, capacity %"PRIu32, cap);
+		return false;
+	}
+	return true;
+}
+
 static void do_reclaim(struct work *work)
 {
 	struct reclaim_work *rw = container_of(work, struct reclaim_work, work);
-	struct object_cache *cache;
-	struct hlist_node *node;
-	int i, j;
 
 	if (rw->delay)
 		sleep(rw->delay);
 	/* We choose a random victim to avoid reclaim the same one every time */
-	j = random();
-	for (i = 0; i < HASH_SIZE; i++) {
-		int idx = (i + j) % HASH_SIZE;
-		struct hlist_head *head = cache_hashtable + idx;
-
-		sd_read_lock(&hashtable_lock[idx]);
-		hlist_for_each_entry(cache, node, head, hash) {
-			uint32_t cap;
-
-			do_reclaim_object(cache);
-			cap = uatomic_read(&gcache.capacity);
-			if (cap <= HIGH_WATERMARK) {
-				sd_rw_unlock(&hashtable_lock[idx]);
-				sd_debug("complete, capacity %"PRIu32, cap);
-				return;
-			}
-		}
-		sd_rw_unlock(&hashtable_lock[idx]);
-	}
+	hmap_for_each(&cache_map, random(), reclaim_vdi, NULL);
 	sd_debug("finished");
 }
 
@@ -596,6 +872,9 @@ static int create_dir_for(uint32_t vid)
 	int ret = 0;
 	char p[PATH_MAX];
 
+	if (cache_in_slab)
+		return 0;
+
 	snprintf(p, sizeof(p), "%s/%06"PRIx32, object_cache_dir, vid);
 	if (xmkdir(p, sd_def_dmode) < 0) {
 		sd_err("%s, %m", p);
@@ -604,45 +883,45 @@ static int create_dir_for(uint32_t vid)
 	return ret;
 }
 
-static struct object_cache *find_object_cache(uint32_t vid, bool create)
+static void free_object_cache(struct object_cache *cache)
 {
-	int h = hash(vid);
-	struct hlist_head *head = cache_hashtable + h;
-	struct object_cache *cache = NULL;
-	struct hlist_node *node;
+	hmap_destroy(&cache->entries);
+	sd_destroy_rw_lock(&cache->lock);
+	sd_destroy_mutex(&cache->push_mutex);
+	close(cache->push_efd);
+	free(cache);
+}
 
-	if (create)
-		sd_write_lock(&hashtable_lock[h]);
-	else
-		sd_read_lock(&hashtable_lock[h]);
+static struct object_cache *find_object_cache(uint32_t vid, bool create)
+{
+	struct object_cache *cache;
+	struct hmap_node *node;
 
-	if (hlist_empty(head))
-		goto not_found;
+	node = hmap_lookup(&cache_map, vid, NULL);
+	if (node)
+		return container_of(node, struct object_cache, hash);
+	if (!create)
+		return NULL;
 
-	hlist_for_each_entry(cache, node, head, hash) {
-		if (cache->vid == vid)
-			goto out;
-	}
-not_found:
-	if (create) {
-		cache = xzalloc(sizeof(*cache));
-		cache->vid = vid;
-		INIT_RB_ROOT(&cache->lru_tree);
-		create_dir_for(vid);
-		cache->push_efd = eventfd(0, 0);
+	cache = xzalloc(sizeof(*cache));
+	cache->vid = vid;
+	cache->hash.key = vid;
+	hmap_init(&cache->entries, NR_ENTRY_LOCKS);
+	create_dir_for(vid);
+	cache->push_efd = eventfd(0, 0);
 
-		INIT_LIST_HEAD(&cache->dirty_head);
-		INIT_LIST_HEAD(&cache->lru_head);
+	INIT_LIST_HEAD(&cache->dirty_head);
+	INIT_LIST_HEAD(&cache->lru_head);
 
-		sd_init_rw_lock(&cache->lock);
-		hlist_add_head(&cache->hash, head);
+	sd_init_rw_lock(&cache->lock);
+	sd_init_mutex(&cache->push_mutex);
 
-		sd_init_mutex(&cache->push_mutex);
-	} else {
-		cache = NULL;
+	/* somebody else might have added it in the meantime */
+	node = hmap_insert(&cache_map, &cache->hash);
+	if (node) {
+		free_object_cache(cache);
+		return container_of(node, struct object_cache, hash);
 	}
-out:
-	sd_rw_unlock(&hashtable_lock[h]);
 	return cache;
 }
 
@@ -675,6 +954,7 @@ alloc_cache_entry(struct object_cache *oc, uint64_t idx)
 	entry = xzalloc(sizeof(*entry));
 	entry->oc = oc;
 	entry->idx = idx;
+	entry->node.key = idx & ~CACHE_INDEX_MASK;
 	sd_init_rw_lock(&entry->lock);
 	INIT_LIST_NODE(&entry->dirty_list);
 	INIT_LIST_NODE(&entry->lru_list);
@@ -682,25 +962,80 @@ alloc_cache_entry(struct object_cache *oc, uint64_t idx)
 	return entry;
 }
 
-static void add_to_lru_cache(struct object_cache *oc, uint64_t idx, bool create)
+/*
+ * Add the object with the dirty blocks in bmap, idx has CACHE_CREATE_BIT if
+ * the object is not created in the backend yet.
+ *
+ * The entry takes over the slots of the object.  Two requests might pull the
+ * same object into the slab at the same time, the loser gets SD_RES_OID_EXIST
+ * and keeps its slots.
+ */
+static int add_to_lru_cache(struct object_cache *oc, uint64_t idx,
+			    uint64_t bmap, size_t size, uint32_t *slot)
 {
 	struct object_cache_entry *entry = alloc_cache_entry(oc, idx);
 
-	sd_debug("oid %"PRIx64" added", idx_to_oid(oc->vid, idx));
+	entry->size = DIV_ROUND_UP(size, 1024 * 1024);
+
+	sd_debug("oid %"PRIx64" added", idx_to_oid(oc->vid, entry_idx(entry)));
 
 	write_lock_cache(oc);
-	if (unlikely(lru_tree_insert(&oc->lru_tree, entry)))
-		panic("the object already exist");
-	uatomic_add(&gcache.capacity, CACHE_OBJECT_SIZE);
+	if (unlikely(hmap_insert(&oc->entries, &entry->node))) {
+		if (!slot)
+			panic("the object already exist");
+		unlock_cache(oc);
+		sd_destroy_rw_lock(&entry->lock);
+		free(entry);
+		return SD_RES_OID_EXIST;
+	}
+	if (slot) {
+		/* under the lock, so that it is not reclaimed before that */
+		entry->slot = slot;
+		if (slab_commit(slot, entry->size, oc->vid, entry_idx(entry)) !=
+		    SD_RES_SUCCESS)
+			sd_err("the slots of %"PRIx64" are lost at restart",
+			       idx_to_oid(oc->vid, entry_idx(entry)));
+	}
+	uatomic_add(&gcache.capacity, entry->size);
 	list_add_tail(&entry->lru_list, &oc->lru_head);
 	oc->total_count++;
-	if (create) {
+	if (bmap) {
 		/* Cache lock assure it is not raced with pusher */
-		entry->bmap = UINT64_MAX;
-		entry->idx |= CACHE_CREATE_BIT;
+		entry->bmap = bmap;
 		add_to_dirty_list(entry);
 	}
 	unlock_cache(oc);
+
+	return SD_RES_SUCCESS;
+}
+
+/* A new object to be written back is dirty as a whole until it is pushed */
+static void add_new_object(struct object_cache *oc, uint64_t idx,
+			   bool writeback, size_t size, uint32_t *slot)
+{
+	if (!writeback) {
+		add_to_lru_cache(oc, idx, 0, size, slot);
+		return;
+	}
+	cache_journal_log(oc->vid, idx, UINT64_MAX, true);
+	add_to_lru_cache(oc, idx | CACHE_CREATE_BIT, UINT64_MAX, size, slot);
+}
+
+/*
+ * Add the object found at start-up with the dirty blocks in the journal.  If
+ * there was no journal, we don't know VM's cache type after restarting, so we
+ * assume that it is writeback and mark all the objects dirty to avoid false
+ * reclaim.
+ */
+static void load_object(struct object_cache *oc, uint64_t idx, size_t size,
+			uint32_t *slot)
+{
+	bool create;
+	uint64_t bmap = cache_journal_replay(oc->vid, idx, &create);
+
+	add_to_lru_cache(oc, create ? idx | CACHE_CREATE_BIT : idx, bmap, size,
+			 slot);
+	sd_debug("%"PRIx64" dirty 0x%"PRIx64, idx_to_oid(oc->vid, idx), bmap);
 }
 
 static inline int lookup_path(char *path)
@@ -718,11 +1053,47 @@ static inline int lookup_path(char *path)
 	return ret;
 }
 
+static int slab_object_lookup(struct object_cache *oc, uint64_t idx,
+			      bool create, bool writeback)
+{
+	uint32_t *slot;
+	size_t size;
+	int nr;
+
+	if (!create)
+		return hmap_lookup(&oc->entries, idx, NULL) ?
+			SD_RES_SUCCESS : SD_RES_NO_CACHE;
+
+	size = get_vdi_objsize(idx_to_oid(oc->vid, idx));
+	nr = DIV_ROUND_UP(size, SLAB_SLOT_SIZE);
+	slot = slab_alloc(nr);
+	if (unlikely(!slot)) {
+		sd_err("no free slot for %"PRIx64, idx_to_oid(oc->vid, idx));
+		object_cache_try_to_reclaim(0);
+		return SD_RES_NO_SPACE;
+	}
+	/* the zeros must be durable before the slots are recorded */
+	if (unlikely(slab_zero(slot, nr) != SD_RES_SUCCESS ||
+		     slab_sync() != SD_RES_SUCCESS)) {
+		slab_free(slot, nr);
+		free(slot);
+		return SD_RES_EIO;
+	}
+	add_new_object(oc, idx, writeback, size, slot);
+	object_cache_try_to_reclaim(0);
+
+	return SD_RES_SUCCESS;
+}
+
 static int object_cache_lookup(struct object_cache *oc, uint64_t idx,
 			       bool create, bool writeback)
 {
 	int fd, ret, flags = def_open_flags;
 	char path[PATH_MAX];
+	size_t size;
+
+	if (cache_in_slab)
+		return slab_object_lookup(oc, idx, create, writeback);
 
 	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%016"PRIx64,
 		 object_cache_dir, oc->vid, idx);
@@ -736,12 +1107,13 @@ static int object_cache_lookup(struct object_cache *oc, uint64_t idx,
 		ret = SD_RES_EIO;
 		goto out;
 	}
-	ret = prealloc(fd, get_objsize(idx_to_oid(oc->vid, idx)));
+	size = get_vdi_objsize(idx_to_oid(oc->vid, idx));
+	ret = prealloc(fd, size);
 	if (unlikely(ret < 0)) {
 		ret = SD_RES_EIO;
 		goto out_close;
 	}
-	add_to_lru_cache(oc, idx, writeback);
+	add_new_object(oc, idx, writeback, size, NULL);
 	object_cache_try_to_reclaim(0);
 out_close:
 	close(fd);
@@ -749,6 +1121,31 @@ out:
 	return ret;
 }
 
+static int create_slab_object(struct object_cache *oc, uint64_t idx,
+			      void *buffer, size_t buf_size)
+{
+	int nr = DIV_ROUND_UP(buf_size, SLAB_SLOT_SIZE), ret;
+	uint32_t *slot;
+
+	slot = slab_alloc(nr);
+	if (unlikely(!slot)) {
+		sd_err("no free slot for %"PRIx64, idx_to_oid(oc->vid, idx));
+		return SD_RES_NO_SPACE;
+	}
+
+	ret = slab_write(slot, buffer, buf_size, 0);
+	if (ret == SD_RES_SUCCESS)
+		ret = slab_sync();
+	if (ret == SD_RES_SUCCESS)
+		ret = add_to_lru_cache(oc, idx, 0, buf_size, slot);
+	if (ret != SD_RES_SUCCESS) {
+		slab_free(slot, nr);
+		free(slot);
+	}
+	return ret;
+}
+
+/* Write the object to the cache and add it in the clean state */
 static int create_cache_object(struct object_cache *oc, uint64_t idx,
 			       void *buffer, size_t buf_size)
 {
@@ -756,6 +1153,9 @@ static int create_cache_object(struct object_cache *oc, uint64_t idx,
 	int ret = SD_RES_OID_EXIST;
 	char path[PATH_MAX], tmp_path[PATH_MAX];
 
+	if (cache_in_slab)
+		return create_slab_object(oc, idx, buffer, buf_size);
+
 	snprintf(tmp_path, sizeof(tmp_path), "%s/%06"PRIx32"/%016"PRIx64".tmp",
 		object_cache_dir, oc->vid, idx);
 	fd = open(tmp_path, flags, sd_def_fmode);
@@ -789,6 +1189,7 @@ static int create_cache_object(struct object_cache *oc, uint64_t idx,
 		ret = SD_RES_EIO;
 		goto out_close;
 	}
+	add_to_lru_cache(oc, idx, 0, buf_size, NULL);
 	ret = SD_RES_SUCCESS;
 	sd_debug("%016"PRIx64" size %zu", idx, buf_size);
 out_close:
@@ -804,7 +1205,7 @@ static int object_cache_pull(struct object_cache *oc, uint64_t idx)
 	struct sd_req hdr;
 	int ret;
 	uint64_t oid = idx_to_oid(oc->vid, idx);
-	uint32_t data_length = get_objsize(oid);
+	uint32_t data_length = get_vdi_objsize(oid);
 	void *buf;
 
 	buf = xvalloc(data_length);
@@ -827,7 +1228,6 @@ static int object_cache_pull(struct object_cache *oc, uint64_t idx)
 	 */
 	switch (ret) {
 	case SD_RES_SUCCESS:
-		add_to_lru_cache(oc, idx, false);
 		object_cache_try_to_reclaim(1);
 		break;
 	case SD_RES_OID_EXIST:
@@ -841,38 +1241,90 @@ err:
 	return ret;
 }
 
-static void do_push_object(struct work *work)
+/*
+ * Pace the background pushes to sys->object_cache_push_bw bytes per second, in
+ * the same way as the QoS of the gateway.  The pushes of a VDI whose guest is
+ * waiting for a flush go at full speed.
+ */
+static void throttle_push(struct object_cache *oc, size_t len)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	struct object_cache_entry *entry = pw->entry;
-	struct object_cache *oc = entry->oc;
-	uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry));
+	uint64_t bw = sys->object_cache_push_bw, now, tat;
 
-	sd_debug("%"PRIx64, oid);
+	if (!bw)
+		return;
 
-	read_lock_entry(entry);
+	sd_mutex_lock(&gcache.push_lock);
+	now = clock_get_time();
+	gcache.push_tat = max(gcache.push_tat, now) + len * 1000000000ULL / bw;
+	tat = gcache.push_tat;
+	sd_mutex_unlock(&gcache.push_lock);
+
+	/* start the push when the ones before it would be done */
+	tat -= len * 1000000000ULL / bw;
+	while (tat > now && !uatomic_read(&oc->flush_waiters)) {
+		usleep(min(tat - now, PUSH_SLEEP_STEP) / 1000);
+		now = clock_get_time();
+	}
+}
+
+static void push_entry(struct object_cache_entry *entry, bool background)
+{
 	/*
 	 * We might happen to push readonly object in following scenario
 	 * 1. sheep pulled some read-only objects
 	 * 2. sheep crashed
 	 * 3. sheep restarted and marked all the objects in cache dirty blindly
 	 */
-	if (oid_is_readonly(idx_to_oid(oc->vid, entry_idx(entry))))
-		goto clean;
+	if (oid_is_readonly(idx_to_oid(entry->oc->vid, entry_idx(entry))))
+		return;
 
-	if (unlikely(push_cache_object(oc->vid, entry_idx(entry), entry->bmap,
-				       !!(entry->idx & CACHE_CREATE_BIT))
-		     != SD_RES_SUCCESS))
+	if (unlikely(push_cache_object(entry, entry->bmap,
+				       !!(entry->idx & CACHE_CREATE_BIT),
+				       background) != SD_RES_SUCCESS))
 		panic("push failed but should never fail");
-clean:
-	if (uatomic_sub_return(&oc->push_count, 1) == 0)
-		eventfd_xwrite(oc->push_efd, 1);
-	entry->idx &= ~CACHE_CREATE_BIT;
-	entry->bmap = 0;
-	unlock_entry(entry);
+}
 
-	sd_debug("%"PRIx64" done", oid);
-	put_cache_entry(entry);
+static void do_push_object(struct work *work)
+{
+	struct push_work *pw = container_of(work, struct push_work, work);
+	struct object_cache *oc = pw->oc;
+	size_t len = 0;
+	off_t offset;
+
+	sd_debug("%"PRIx32", %d objects from %"PRIx64, oc->vid, pw->nr,
+		 entry_idx(pw->entries[0]));
+
+	for (int i = 0; i < pw->nr; i++) {
+		struct object_cache_entry *entry = pw->entries[i];
+
+		if (entry->bmap)
+			len += push_range(idx_to_oid(oc->vid, entry_idx(entry)),
+					  entry->bmap, &offset);
+	}
+	if (pw->background && len)
+		throttle_push(oc, len);
+
+	for (int i = 0; i < pw->nr; i++)
+		read_lock_entry(pw->entries[i]);
+
+	/* the writes are idempotent, so push them one by one if it fails */
+	if (pw->nr == 1 || push_cache_batch(pw) != SD_RES_SUCCESS)
+		for (int i = 0; i < pw->nr; i++)
+			push_entry(pw->entries[i], pw->background);
+
+	for (int i = 0; i < pw->nr; i++) {
+		struct object_cache_entry *entry = pw->entries[i];
+
+		if (uatomic_sub_return(&oc->push_count, 1) == 0)
+			eventfd_xwrite(oc->push_efd, 1);
+		entry->idx &= ~CACHE_CREATE_BIT;
+		entry->bmap = 0;
+		cache_journal_log(oc->vid, entry_idx(entry), 0, false);
+		unlock_entry(entry);
+		put_cache_entry(entry);
+	}
+
+	sd_debug("%"PRIx32", %d objects done", oc->vid, pw->nr);
 }
 
 static void push_object_done(struct work *work)
@@ -881,6 +1333,49 @@ static void push_object_done(struct work *work)
 	free(pw);
 }
 
+static int dirty_idx_cmp(void *priv, struct list_node *a, struct list_node *b)
+{
+	struct object_cache_entry *ea, *eb;
+
+	ea = list_entry(a, struct object_cache_entry, dirty_list);
+	eb = list_entry(b, struct object_cache_entry, dirty_list);
+	return intcmp(entry_idx(ea), entry_idx(eb));
+}
+
+/* Keep the moving average of the writeback bandwidth */
+static void update_push_bw(uint64_t bytes, uint64_t ns)
+{
+	uint64_t bw;
+
+	if (!bytes || !ns)
+		return;
+	bw = bytes * 1000000000ULL / ns;
+
+	sd_mutex_lock(&gcache.push_lock);
+	gcache.push_bw = gcache.push_bw ? (gcache.push_bw * 3 + bw) / 4 : bw;
+	sd_mutex_unlock(&gcache.push_lock);
+}
+
+/* Whether the dirty entry can be pushed in a batch with the others */
+static bool push_in_batch(const struct object_cache_entry *entry)
+{
+	uint64_t oid = idx_to_oid(entry->oc->vid, entry_idx(entry));
+
+	/*
+	 * The writes of the inode update the references of the COW objects,
+	 * and the strips of the erasure coded objects differ from node to node.
+	 */
+	return is_data_obj(oid) && !is_erasure_oid(oid) &&
+		get_vdi_objsize(oid);
+}
+
+static void queue_push_work(struct work_queue *wq, struct push_work *pw)
+{
+	pw->work.fn = do_push_object;
+	pw->work.done = push_object_done;
+	queue_work(wq, &pw->work);
+}
+
 /*
  * Push back all the dirty objects before the FLUSH request to sheep replicated
  * storage synchronously.
@@ -889,10 +1384,20 @@ static void push_object_done(struct work *work)
  *    It is okay for allow subsequent RW after FLUSH because we only need to
  *    grantee the dirty objects before FLUSH to be pushed.
  * 2. Use threaded AIO to boost push performance, such as fsync(2) from VM.
+ * 3. Push the data objects in batches of the neighbouring dirty objects, up to
+ *    PUSH_BATCH_NR of them and PUSH_BATCH_SIZE dirty bytes.  The gateway
+ *    coalesces the writes of a batch into one request to each target node.
+ *    The inode and the erasure coded objects are pushed one by one.
+ * 4. The background pushes have their own queue, so they don't delay the
+ *    flushes of the guests.
  */
-static int object_cache_push(struct object_cache *oc)
+static int object_cache_push(struct object_cache *oc, bool background)
 {
 	struct object_cache_entry *entry;
+	struct work_queue *wq = background ? sys->oc_bg_push_wqueue :
+		sys->oc_push_wqueue;
+	uint64_t start = clock_get_time(), batch_size = 0;
+	struct push_work *pw = NULL;
 
 	write_lock_cache(oc);
 	if (list_empty(&oc->dirty_head)) {
@@ -900,22 +1405,50 @@ static int object_cache_push(struct object_cache *oc)
 		return SD_RES_SUCCESS;
 	}
 
+	list_sort(NULL, &oc->dirty_head, dirty_idx_cmp);
+	uatomic_set(&oc->push_bytes, 0);
 	uatomic_set(&oc->push_count, uatomic_read(&oc->dirty_count));
 	list_for_each_entry(entry, &oc->dirty_head, dirty_list) {
-		struct push_work *pw;
+		uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry));
+		bool batch = push_in_batch(entry);
+		size_t len = 0;
+		off_t offset;
+
+		if (entry->bmap)
+			len = push_range(oid, entry->bmap, &offset);
+		if (pw && (!batch || pw->nr == PUSH_BATCH_NR ||
+			   batch_size + len > PUSH_BATCH_SIZE)) {
+			queue_push_work(wq, pw);
+			pw = NULL;
+		}
+		if (!pw) {
+			pw = xzalloc(sizeof(struct push_work));
+			pw->oc = oc;
+			pw->background = background;
+			batch_size = 0;
+		}
 
 		get_cache_entry(entry);
-		pw = xzalloc(sizeof(struct push_work));
-		pw->work.fn = do_push_object;
-		pw->work.done = push_object_done;
-		pw->entry = entry;
-		queue_work(sys->oc_push_wqueue, &pw->work);
+		pw->entries[pw->nr++] = entry;
+		batch_size += len;
 		del_from_dirty_list(entry);
+
+		if (!batch) {
+			queue_push_work(wq, pw);
+			pw = NULL;
+		}
 	}
+	if (pw)
+		queue_push_work(wq, pw);
 	unlock_cache(oc);
 
 	eventfd_xread(oc->push_efd);
 
+	/* the paced pushes don't tell how fast they could be */
+	if (!background || !sys->object_cache_push_bw)
+		update_push_bw(uatomic_read(&oc->push_bytes),
+			       clock_get_time() - start);
+
 	sd_debug("%"PRIx32" completed", oc->vid);
 	return SD_RES_SUCCESS;
 }
@@ -936,7 +1469,6 @@ bool object_is_cached(uint64_t oid)
 void object_cache_delete(uint32_t vid)
 {
 	struct object_cache *cache;
-	int h = hash(vid);
 	struct object_cache_entry *entry;
 	char path[PATH_MAX];
 
@@ -945,21 +1477,22 @@ void object_cache_delete(uint32_t vid)
 		return;
 
 	/* Firstly we free memory */
-	sd_write_lock(&hashtable_lock[h]);
-	hlist_del(&cache->hash);
-	sd_rw_unlock(&hashtable_lock[h]);
+	hmap_remove(&cache_map, &cache->hash);
 
 	write_lock_cache(cache);
 	list_for_each_entry(entry, &cache->lru_head, lru_list) {
+		uatomic_sub(&gcache.capacity, entry->size);
+		if (cache_in_slab)
+			slab_free(entry->slot, entry->size);
+		hmap_remove(&cache->entries, &entry->node);
 		free_cache_entry(entry);
-		uatomic_sub(&gcache.capacity, CACHE_OBJECT_SIZE);
 	}
 	unlock_cache(cache);
-	sd_destroy_rw_lock(&cache->lock);
-	close(cache->push_efd);
-	free(cache);
+	free_object_cache(cache);
 
 	/* Then we free disk */
+	if (cache_in_slab)
+		return;
 	snprintf(path, sizeof(path), "%s/%06"PRIx32, object_cache_dir, vid);
 	rmdir_r(path);
 }
@@ -967,18 +1500,13 @@ void object_cache_delete(uint32_t vid)
 static struct object_cache_entry *
 get_cache_entry_from(struct object_cache *cache, uint64_t idx)
 {
-	struct object_cache_entry *entry;
+	struct hmap_node *node;
 
-	read_lock_cache(cache);
-	entry = lru_tree_search(&cache->lru_tree, idx);
-	if (!entry) {
+	node = hmap_lookup(&cache->entries, idx, get_cache_entry_node);
+	if (!node)
 		/* The cache entry may be reclaimed, so try again. */
-		unlock_cache(cache);
 		return NULL;
-	}
-	get_cache_entry(entry);
-	unlock_cache(cache);
-	return entry;
+	return container_of(node, struct object_cache_entry, node);
 }
 
 /* This helper increases the refcount */
@@ -1000,48 +1528,23 @@ static struct object_cache_entry *oid_to_entry(uint64_t oid)
 
 static int object_cache_flush_and_delete(struct object_cache *oc)
 {
-	DIR *dir;
-	struct dirent *d;
+	struct object_cache_entry *entry;
 	uint32_t vid = oc->vid;
-	uint64_t idx;
 	uint64_t all = UINT64_MAX;
-	int ret = 0;
-	char p[PATH_MAX];
 
 	sd_debug("%"PRIx32, vid);
-	snprintf(p, sizeof(p), "%s/%06"PRIx32, object_cache_dir, vid);
-	dir = opendir(p);
-	if (!dir) {
-		sd_debug("%m");
-		ret = -1;
-		goto out;
-	}
-
-	while ((d = readdir(dir))) {
-		if (!strncmp(d->d_name, ".", 1))
-			continue;
-		if (strcmp(d->d_name + 8, ".tmp") == 0) {
-			sd_debug("try to del %s", d->d_name);
-			if (unlinkat(dirfd(dir), d->d_name, 0) < 0)
-				sd_err("%m");
-			continue;
-		}
-
-		idx = strtoull(d->d_name, NULL, 16);
-		if (idx == ULLONG_MAX)
-			continue;
-		if (push_cache_object(vid, idx, all, true) !=
+	read_lock_cache(oc);
+	list_for_each_entry(entry, &oc->lru_head, lru_list) {
+		if (push_cache_object(entry, all, true, false) !=
 		    SD_RES_SUCCESS) {
-			ret = -1;
-			goto out_close_dir;
+			unlock_cache(oc);
+			return -1;
 		}
 	}
+	unlock_cache(oc);
 
 	object_cache_delete(vid);
-out_close_dir:
-	closedir(dir);
-out:
-	return ret;
+	return 0;
 }
 
 bool bypass_object_cache(const struct request *req)
@@ -1098,31 +1601,55 @@ int object_cache_handle_request(struct request *req)
 
 	if (req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ)
 		create = true;
+	else {
+		/* The entry is there as long as the object, no need to look */
+		entry = get_cache_entry_from(cache, idx);
+		if (entry) {
+			uatomic_inc(&gcache.hits);
+			goto found;
+		}
+	}
 retry:
-	ret = object_cache_lookup(cache, idx, create,
-				  hdr->flags & SD_FLAG_CMD_CACHE);
-	switch (ret) {
-	case SD_RES_NO_CACHE:
-		ret = object_cache_pull(cache, idx);
-		if (ret != SD_RES_SUCCESS)
+	if (!create) {
+		ret = object_cache_lookup(cache, idx, false, false);
+		switch (ret) {
+		case SD_RES_SUCCESS:
+			uatomic_inc(&gcache.hits);
+			goto get;
+		case SD_RES_NO_CACHE:
+			break;
+		default:
 			return ret;
-		break;
-	case SD_RES_EIO:
-		return ret;
+		}
 	}
 
+	/* Only one request pulls or creates the object, the others wait */
+	if (!cache_fill_begin(cache, idx)) {
+		cache_fill_wait(cache, idx);
+		goto retry;
+	}
+	if (create)
+		ret = object_cache_lookup(cache, idx, true,
+					  hdr->flags & SD_FLAG_CMD_CACHE);
+	else {
+		uatomic_inc(&gcache.misses);
+		ret = object_cache_pull(cache, idx);
+	}
+	cache_fill_end(cache, idx);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+get:
 	entry = get_cache_entry_from(cache, idx);
 	if (!entry) {
 		sd_debug("retry oid %"PRIx64, oid);
 		/*
-		 * For the case that object exists but isn't added to object
-		 * list yet, we call pthread_yield() to expect other thread can
-		 * add object to list ASAP.
+		 * The object exists but isn't added to the entry map yet, or
+		 * is being reclaimed.  Wait for that to finish.
 		 */
-		pthread_yield();
+		cache_fill_wait(cache, idx);
 		goto retry;
 	}
-
+found:
 	if (hdr->flags & SD_FLAG_CMD_WRITE) {
 		ret = write_cache_object(entry, req->data, hdr->data_length,
 					 hdr->obj.offset, create,
@@ -1178,6 +1705,7 @@ int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 int object_cache_flush_vdi(uint32_t vid)
 {
 	struct object_cache *cache;
+	uint64_t start = clock_get_time(), latency;
 	int ret;
 
 	cache = find_object_cache(vid, false);
@@ -1191,10 +1719,16 @@ int object_cache_flush_vdi(uint32_t vid)
 	 * that dirty bits produced while it is waiting are guaranteed
 	 * to be pushed back
 	 */
+	uatomic_inc(&cache->flush_waiters);
 	sd_mutex_lock(&cache->push_mutex);
-	ret = object_cache_push(cache);
+	ret = object_cache_push(cache, false);
 	sd_mutex_unlock(&cache->push_mutex);
+	uatomic_dec(&cache->flush_waiters);
 
+	latency = clock_get_time() - start;
+	uatomic_add(&gcache.flush_latency, latency);
+	uatomic_inc(&gcache.flush_hist[min(fls64(latency / SD_LAT_BUCKET_BASE),
+					   SD_NR_LAT_BUCKETS - 1)]);
 	return ret;
 }
 
@@ -1217,6 +1751,7 @@ static int load_cache_object(struct object_cache *cache)
 	struct dirent *d;
 	uint64_t idx;
 	char path[PATH_MAX];
+	struct stat st;
 	int ret = 0;
 
 	snprintf(path, sizeof(path), "%s/%06"PRIx32, object_cache_dir,
@@ -1243,14 +1778,17 @@ static int load_cache_object(struct object_cache *cache)
 		if (idx == ULLONG_MAX)
 			continue;
 
+		/* the objects are cached as a whole, so they tell their size */
+		if (fstatat(dirfd(dir), d->d_name, &st, 0) < 0) {
+			sd_err("failed to stat %s, %m", d->d_name);
+			continue;
+		}
+
 		/*
-		 * We don't know VM's cache type after restarting, so we assume
-		 * that it is writeback and mark all the objects dirty to avoid
-		 * false reclaim. Don't try to reclaim at loading phase because
-		 * cluster isn't fully working.
+		 * Don't try to reclaim at loading phase because cluster isn't
+		 * fully working.
 		 */
-		add_to_lru_cache(cache, idx, true);
-		sd_debug("%"PRIx64, idx_to_oid(cache->vid, idx));
+		load_object(cache, idx, st.st_size, NULL);
 	}
 
 	closedir(dir);
@@ -1313,23 +1851,59 @@ int object_cache_remove(uint64_t oid)
 	 * requests.
 	 */
 	sd_assert(refcount_read(&entry->refcnt) == 1);
-	ret = remove_cache_object(oc, entry_idx(entry));
+	hmap_remove(&oc->entries, &entry->node);
+	ret = remove_cache_object(entry);
 	if (ret != SD_RES_SUCCESS) {
+		hmap_insert(&oc->entries, &entry->node);
 		unlock_cache(oc);
 		return ret;
 	}
+	uatomic_sub(&gcache.capacity, entry->size);
 	free_cache_entry(entry);
 	unlock_cache(oc);
 
-	uatomic_sub(&gcache.capacity, CACHE_OBJECT_SIZE);
-
 	return SD_RES_SUCCESS;
 }
 
-int object_cache_init(const char *p)
+static void load_slab_object(uint32_t vid, uint64_t idx, uint32_t *slot, int nr)
+{
+	load_object(find_object_cache(vid, true), idx, nr * SLAB_SLOT_SIZE,
+		    slot);
+}
+
+static int init_slab(const char *path)
+{
+	uint64_t size;
+
+	cache_in_slab = true;
+	size = slab_init(path, (uint64_t)sys->object_cache_size * 1024 * 1024,
+			 load_slab_object);
+	if (!size)
+		return -1;
+
+	/* reclaim before the slab is full */
+	sys->object_cache_size = min(sys->object_cache_size,
+				     (uint32_t)(size / 1024 / 1024));
+	return 0;
+}
+
+int object_cache_init(const char *p, const char *slab)
 {
 	int ret = 0;
 	struct strbuf buf = STRBUF_INIT;
+	char path[PATH_MAX];
+
+	uatomic_set(&gcache.capacity, 0);
+	uatomic_set_false(&gcache.in_reclaim);
+	if (!sys->object_cache_flush_ms)
+		sys->object_cache_flush_ms = DEFAULT_FLUSH_TARGET;
+	hmap_init(&cache_map, NR_VDI_LOCKS);
+	for (int i = 0; i < FILL_SIZE; i++) {
+		sd_init_mutex(&fill_table[i].lock);
+		sd_cond_init(&fill_table[i].cond);
+		INIT_LIST_HEAD(&fill_table[i].head);
+	}
+	mem_cache_init((uint64_t)sys->object_cache_mem_size * 1024 * 1024);
 
 	strbuf_addstr(&buf, p);
 	if (xmkdir(buf.buf, sd_def_dmode) < 0) {
@@ -1337,6 +1911,14 @@ int object_cache_init(const char *p)
 		ret = -1;
 		goto err;
 	}
+	snprintf(path, sizeof(path), "%s/cache_journal", p);
+	cache_journal_init(path);
+
+	if (slab) {
+		ret = init_slab(slab);
+		goto replayed;
+	}
+
 	strbuf_addstr(&buf, "/cache");
 	if (xmkdir(buf.buf, sd_def_dmode) < 0) {
 		sd_err("%s %m", buf.buf);
@@ -1345,56 +1927,79 @@ int object_cache_init(const char *p)
 	}
 	strbuf_copyout(&buf, object_cache_dir, sizeof(object_cache_dir));
 
-	uatomic_set(&gcache.capacity, 0);
-	uatomic_set_false(&gcache.in_reclaim);
-
 	ret = load_cache();
+replayed:
+	if (ret == 0)
+		cache_journal_replayed();
 err:
 	strbuf_release(&buf);
 	return ret;
 }
 
+struct vid_array {
+	uint32_t *vids;
+	int nr;
+};
+
+static bool collect_vid(struct hmap_node *node, void *arg)
+{
+	struct vid_array *array = arg;
+
+	array->vids = xrealloc(array->vids,
+			       sizeof(*array->vids) * (array->nr + 1));
+	array->vids[array->nr++] = node->key;
+	return true;
+}
+
 void object_cache_format(void)
 {
-	struct object_cache *cache;
-	struct hlist_node *node;
-	int i;
+	struct vid_array array = {};
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		struct hlist_head *head = cache_hashtable + i;
-		hlist_for_each_entry(cache, node, head, hash) {
-			object_cache_delete(cache->vid);
-		}
-	}
+	/* object_cache_delete() can't be called while walking the map */
+	hmap_for_each(&cache_map, 0, collect_vid, &array);
+	for (int i = 0; i < array.nr; i++)
+		object_cache_delete(array.vids[i]);
+	free(array.vids);
 	uatomic_set(&gcache.capacity, 0);
 }
 
-int object_cache_get_info(struct object_cache_info *info)
+static bool get_vdi_info(struct hmap_node *node, void *arg)
 {
-	int j = 0;
+	struct object_cache *cache = container_of(node, struct object_cache,
+						  hash);
+	struct object_cache_info *info = arg;
+	int j = info->count;
 
+	if (j >= CACHE_MAX)
+		return false;
+
+	read_lock_cache(cache);
+	info->caches[j].vid = cache->vid;
+	info->caches[j].dirty = cache->dirty_count;
+	info->caches[j].total = cache->total_count;
+	info->count++;
+	unlock_cache(cache);
+	return true;
+}
+
+int object_cache_get_info(struct object_cache_info *info)
+{
 	memset(info, 0, sizeof(*info));
 	info->used = (uint64_t)gcache.capacity * 1024 * 1024;
 	info->size = (uint64_t)sys->object_cache_size * 1024 * 1024;
 
-	for (int i = 0; i < HASH_SIZE; i++) {
-		struct hlist_head *head = cache_hashtable + i;
-		struct object_cache *cache;
-		struct hlist_node *node;
-
-		sd_read_lock(&hashtable_lock[i]);
-		hlist_for_each_entry(cache, node, head, hash) {
-			read_lock_cache(cache);
-			info->caches[j].vid = cache->vid;
-			info->caches[j].dirty = cache->dirty_count;
-			info->caches[j].total = cache->total_count;
-			j++;
-			unlock_cache(cache);
-		}
-		sd_rw_unlock(&hashtable_lock[i]);
-	}
-	info->count = j;
-	info->directio = sys->object_cache_directio;
+	hmap_for_each(&cache_map, 0, get_vdi_info, info);
+	info->directio = sys->object_cache_directio || cache_in_slab;
+	info->slab = cache_in_slab;
+	info->disk_hits = uatomic_read(&gcache.hits);
+	info->disk_misses = uatomic_read(&gcache.misses);
+	info->push_bw = uatomic_read(&gcache.push_bw);
+	info->push_bw_limit = sys->object_cache_push_bw;
+	info->flush_target = sys->object_cache_flush_ms;
+	info->flush_latency = uatomic_read(&gcache.flush_latency);
+	for (int i = 0; i < SD_NR_LAT_BUCKETS; i++)
+		info->flush_hist[i] = uatomic_read(&gcache.flush_hist[i]);
+	mem_cache_get_info(info);
 
 	return sizeof(*info);
 }
@@ -15,6 +15,7 @@
 
 struct objlist_cache_entry {
 	uint64_t oid;
+	uint64_t seq; /* value of objlist_cache.seq when last inserted */
 	struct rb_node node;
 };
 
@@ -22,6 +23,7 @@ struct objlist_cache {
 	int tree_version;
 	int buf_version;
 	int cache_size;
+	uint64_t seq;
 	uint64_t *buf;
 	struct rb_root root;
 	struct sd_rw_lock lock;
@@ -43,6 +45,47 @@ static struct objlist_migrate_cache migrate_cache = {
 	.lock		= SD_RW_LOCK_INITIALIZER,
 };
 
+/*
+ * The object list is saved to the meta store periodically and on shutdown so
+ * that the next startup doesn't have to walk every object directory.
+ *
+ * A snapshot is trusted only if its generation matches the one in the
+ * generation file.  Before an object is added to or removed from the store
+ * while the on-disk snapshot is up to date, the generation is bumped
+ * synchronously, so a crash can never leave a valid snapshot which misses an
+ * object or lists a deleted one.
+ */
+#define OBJLIST_SNAPSHOT_MAGIC		0x6f626a6c /* "objl" */
+#define OBJLIST_SNAPSHOT_INTERVAL	60 /* seconds */
+
+struct objlist_snapshot_header {
+	uint32_t magic;
+	uint32_t nr_oids;
+	uint64_t generation;
+	uint64_t checksum; /* sd_hash() of the oid array */
+};
+
+static struct objlist_snapshot {
+	char *path;
+	char *gen_path;
+	bool enabled;
+	/* generation in gen_path, protected by lock */
+	uint64_t generation;
+	/* objlist_cache.seq when the last snapshot was taken */
+	uint64_t saved_seq;
+	/* true if the snapshot on disk matches the object list */
+	uatomic_bool valid;
+	/* number of objlist_cache_begin/end_insert() calls */
+	unsigned long started;
+	unsigned long finished;
+	uatomic_bool saving;
+	struct sd_mutex lock;
+	struct timer timer;
+	struct work save_work;
+} snapshot = {
+	.lock = SD_MUTEX_INITIALIZER,
+};
+
 static int objlist_cache_cmp(const struct objlist_cache_entry *a,
 			     const struct objlist_cache_entry *b)
 {
@@ -69,14 +112,19 @@ static int objlist_cache_rb_remove(struct rb_root *root, uint64_t oid)
 	return 0;
 }
 
+/* Must be called before the object is removed from the store */
 void objlist_cache_remove(uint64_t oid)
 {
+	/* Make a concurrent objlist_cache_save() give up as an insert does */
+	objlist_cache_begin_insert();
 	sd_write_lock(&obj_list_cache.lock);
 	if (!objlist_cache_rb_remove(&obj_list_cache.root, oid)) {
 		obj_list_cache.cache_size--;
 		obj_list_cache.tree_version++;
+		obj_list_cache.seq++;
 	}
 	sd_rw_unlock(&obj_list_cache.lock);
+	objlist_cache_end_insert();
 }
 
 int objlist_cache_insert(uint64_t oid)
@@ -88,10 +136,12 @@ int objlist_cache_insert(uint64_t oid)
 	rb_init_node(&entry->node);
 
 	sd_write_lock(&obj_list_cache.lock);
+	entry->seq = ++obj_list_cache.seq;
 	p = objlist_cache_rb_insert(&obj_list_cache.root, entry);
-	if (p)
+	if (p) {
+		p->seq = entry->seq;
 		free(entry);
-	else {
+	} else {
 		obj_list_cache.cache_size++;
 		obj_list_cache.tree_version++;
 	}
@@ -100,6 +150,73 @@ int objlist_cache_insert(uint64_t oid)
 	return 0;
 }
 
+/* Return the sequence number of the latest change of the object list */
+uint64_t objlist_cache_seq(void)
+{
+	uint64_t seq;
+
+	sd_read_lock(&obj_list_cache.lock);
+	seq = obj_list_cache.seq;
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	return seq;
+}
+
+static bool hash_in_ranges(uint64_t hash, const struct vnode_range *ranges,
+			   int nr_ranges)
+{
+	int lo = 0, hi = nr_ranges - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (hash < ranges[mid].start)
+			hi = mid - 1;
+		else if (hash > ranges[mid].end)
+			lo = mid + 1;
+		else
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Return the cached oids which are placed in one of the sorted hash 'ranges'
+ * or were inserted after objlist_cache_seq() returned 'seq'.  The caller must
+ * free the returned array.
+ */
+uint64_t *objlist_cache_collect(const struct vnode_range *ranges,
+				int nr_ranges, uint64_t seq, int *nr_oids)
+{
+	struct objlist_cache_entry *entry;
+	uint64_t *oids;
+	int nr = 0;
+
+	sd_read_lock(&obj_list_cache.lock);
+	oids = xmalloc(sizeof(*oids) * obj_list_cache.cache_size);
+	rb_for_each_entry(entry, &obj_list_cache.root, node) {
+		if (entry->seq > seq ||
+		    hash_in_ranges(sd_hash_oid(entry->oid), ranges, nr_ranges))
+			oids[nr++] = entry->oid;
+	}
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	*nr_oids = nr;
+	return oids;
+}
+
+static bool objlist_cache_exist(uint64_t oid)
+{
+	struct objlist_cache_entry *entry, key = { .oid = oid };
+
+	sd_read_lock(&obj_list_cache.lock);
+	entry = rb_search(&obj_list_cache.root, &key, node, objlist_cache_cmp);
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	return entry != NULL;
+}
+
 int objlist_migrate_cache_insert(uint64_t oid)
 {
 	struct objlist_cache_entry *entry, *p;
@@ -200,6 +317,281 @@ out:
 	return SD_RES_SUCCESS;
 }
 
+void init_objlist_path(const char *base_path)
+{
+	int len = strlen(base_path) + strlen("/objlist.gen") + 1;
+
+	snapshot.path = xzalloc(len);
+	snprintf(snapshot.path, len, "%s/objlist", base_path);
+	snapshot.gen_path = xzalloc(len);
+	snprintf(snapshot.gen_path, len, "%s/objlist.gen", base_path);
+}
+
+static int write_generation(uint64_t generation)
+{
+	if (atomic_create_and_write(snapshot.gen_path, (char *)&generation,
+				    sizeof(generation), true) < 0) {
+		sd_err("failed to update %s", snapshot.gen_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint64_t read_generation(void)
+{
+	uint64_t generation;
+	int fd;
+
+	fd = open(snapshot.gen_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_err("failed to open %s, %m", snapshot.gen_path);
+		return 0;
+	}
+
+	if (xread(fd, &generation, sizeof(generation)) != sizeof(generation))
+		generation = 0;
+	close(fd);
+
+	return generation;
+}
+
+/* Make sure the snapshot on disk is not trusted any more */
+static void invalidate_snapshot(void)
+{
+	if (!uatomic_is_true(&snapshot.valid))
+		return;
+
+	sd_mutex_lock(&snapshot.lock);
+	if (uatomic_is_true(&snapshot.valid)) {
+		if (write_generation(snapshot.generation + 1) < 0 &&
+		    unlink(snapshot.path) < 0 && errno != ENOENT)
+			panic("failed to invalidate %s, %m", snapshot.path);
+		snapshot.generation++;
+		uatomic_set_false(&snapshot.valid);
+	}
+	sd_mutex_unlock(&snapshot.lock);
+}
+
+/*
+ * Must be called before a new object is stored, and
+ * objlist_cache_end_insert() after it is inserted into the object list (or
+ * has failed to be stored).
+ */
+void objlist_cache_begin_insert(void)
+{
+	uatomic_add_return(&snapshot.started, 1);
+	invalidate_snapshot();
+}
+
+void objlist_cache_end_insert(void)
+{
+	uatomic_add_return(&snapshot.finished, 1);
+}
+
+void objlist_cache_save(void)
+{
+	struct objlist_snapshot_header *hdr;
+	struct objlist_cache_entry *entry;
+	unsigned long started;
+	uint64_t *oids, seq;
+	size_t len;
+	int nr = 0;
+
+	if (!snapshot.enabled)
+		return;
+
+	sd_mutex_lock(&snapshot.lock);
+	started = uatomic_read(&snapshot.started);
+	if (uatomic_read(&snapshot.finished) != started) {
+		sd_debug("objects are being stored, try later");
+		goto out;
+	}
+
+	sd_read_lock(&obj_list_cache.lock);
+	seq = obj_list_cache.seq;
+	if (uatomic_is_true(&snapshot.valid) && seq == snapshot.saved_seq) {
+		sd_rw_unlock(&obj_list_cache.lock);
+		goto out;
+	}
+	len = sizeof(*hdr) + sizeof(*oids) * obj_list_cache.cache_size;
+	hdr = xmalloc(len);
+	oids = (uint64_t *)(hdr + 1);
+	rb_for_each_entry(entry, &obj_list_cache.root, node) {
+		oids[nr++] = entry->oid;
+	}
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	hdr->magic = OBJLIST_SNAPSHOT_MAGIC;
+	hdr->nr_oids = nr;
+	hdr->generation = snapshot.generation;
+	hdr->checksum = sd_hash(oids, sizeof(*oids) * nr);
+
+	/*
+	 * Publish 'valid' before checking 'started' so that an object stored
+	 * concurrently either makes us give up here or bumps the generation
+	 * after we are done.
+	 */
+	uatomic_set_true(&snapshot.valid);
+	if (uatomic_read(&snapshot.started) != started ||
+	    atomic_create_and_write(snapshot.path, (char *)hdr, len, true) < 0) {
+		uatomic_set_false(&snapshot.valid);
+		free(hdr);
+		goto out;
+	}
+	snapshot.saved_seq = seq;
+	free(hdr);
+	sd_debug("saved %d objects, generation %"PRIu64, nr,
+		 snapshot.generation);
+out:
+	sd_mutex_unlock(&snapshot.lock);
+}
+
+static void save_snapshot_work(struct work *work)
+{
+	objlist_cache_save();
+}
+
+static void save_snapshot_done(struct work *work)
+{
+	uatomic_set_false(&snapshot.saving);
+}
+
+static void snapshot_timer_fn(void *data)
+{
+	if (uatomic_set_true(&snapshot.saving))
+		queue_work(sys->md_wqueue, &snapshot.save_work);
+
+	add_timer(&snapshot.timer, OBJLIST_SNAPSHOT_INTERVAL * 1000);
+}
+
+static void *read_snapshot(uint64_t generation)
+{
+	struct objlist_snapshot_header *hdr = NULL;
+	struct stat st;
+	int fd;
+
+	fd = open(snapshot.path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_err("failed to open %s, %m", snapshot.path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+		goto invalid;
+
+	hdr = xmalloc(st.st_size);
+	if (xread(fd, hdr, st.st_size) != st.st_size)
+		goto invalid;
+
+	if (hdr->magic != OBJLIST_SNAPSHOT_MAGIC ||
+	    hdr->generation != generation ||
+	    st.st_size != sizeof(*hdr) + sizeof(uint64_t) * hdr->nr_oids ||
+	    hdr->checksum != sd_hash(hdr + 1, sizeof(uint64_t) * hdr->nr_oids))
+		goto invalid;
+
+	close(fd);
+	return hdr;
+invalid:
+	sd_info("%s is outdated or corrupted", snapshot.path);
+	free(hdr);
+	close(fd);
+	return NULL;
+}
+
+struct verify_work {
+	struct work work;
+	unsigned long nr_missing;
+};
+
+static int verify_object(uint64_t oid, const char *wd, uint32_t epoch,
+			 uint8_t ec_index, struct vnode_info *vinfo, void *arg)
+{
+	struct verify_work *vw = arg;
+
+	if (objlist_cache_exist(oid))
+		return SD_RES_SUCCESS;
+
+	sd_debug("%"PRIx64" at %s is not in the snapshot", oid, wd);
+	objlist_cache_insert(oid);
+	if (is_vdi_obj(oid))
+		atomic_set_bit(oid_to_vid(oid), sys->vdi_inuse);
+	uatomic_inc(&vw->nr_missing);
+
+	return SD_RES_SUCCESS;
+}
+
+static void verify_snapshot_work(struct work *work)
+{
+	struct verify_work *vw = container_of(work, struct verify_work, work);
+
+	for_each_object_in_stale(verify_object, vw);
+	for_each_object_in_wd_vinfo(verify_object, false, NULL, vw);
+}
+
+static void verify_snapshot_done(struct work *work)
+{
+	struct verify_work *vw = container_of(work, struct verify_work, work);
+
+	if (vw->nr_missing)
+		sd_warn("%lu objects were missing in the object list snapshot",
+			vw->nr_missing);
+	else
+		sd_info("object list snapshot verified");
+	free(vw);
+}
+
+/*
+ * Load the object list and the VDI bitmap from the snapshot.  Returns false if
+ * there is no valid snapshot and the caller has to scan the object
+ * directories.  Otherwise the directories are verified in the background.
+ */
+bool objlist_cache_load(void)
+{
+	struct objlist_snapshot_header *hdr;
+	struct verify_work *vw;
+	uint64_t generation, *oids;
+
+	if (snapshot.enabled)
+		return false;
+	snapshot.enabled = true;
+	snapshot.save_work.fn = save_snapshot_work;
+	snapshot.save_work.done = save_snapshot_done;
+	snapshot.timer.callback = snapshot_timer_fn;
+	add_timer(&snapshot.timer, OBJLIST_SNAPSHOT_INTERVAL * 1000);
+
+	generation = read_generation();
+	hdr = read_snapshot(generation);
+
+	/* From now on, the snapshot is not trusted if we crash */
+	snapshot.generation = generation + 1;
+	if (write_generation(snapshot.generation) < 0 &&
+	    unlink(snapshot.path) < 0 && errno != ENOENT)
+		panic("failed to invalidate %s, %m", snapshot.path);
+
+	if (!hdr)
+		return false;
+
+	oids = (uint64_t *)(hdr + 1);
+	for (uint32_t i = 0; i < hdr->nr_oids; i++) {
+		objlist_cache_insert(oids[i]);
+		if (is_vdi_obj(oids[i]))
+			atomic_set_bit(oid_to_vid(oids[i]), sys->vdi_inuse);
+	}
+	sd_info("loaded %"PRIu32" objects from %s", hdr->nr_oids,
+		snapshot.path);
+	free(hdr);
+
+	vw = xzalloc(sizeof(*vw));
+	vw->work.fn = verify_snapshot_work;
+	vw->work.done = verify_snapshot_done;
+	queue_work(sys->md_wqueue, &vw->work);
+
+	return true;
+}
+
 void objlist_cache_format(void)
 {
 	sd_write_lock(&obj_list_cache.lock);
@@ -212,8 +604,11 @@ void objlist_cache_format(void)
 		obj_list_cache.buf = NULL;
 	}
 	obj_list_cache.cache_size = 0;
+	obj_list_cache.seq++;
 	sd_rw_unlock(&obj_list_cache.lock);
 
+	invalidate_snapshot();
+
 	sd_write_lock(&migrate_cache.lock);
 	rb_destroy(&migrate_cache.root, struct objlist_cache_entry, node);
 	INIT_RB_ROOT(&migrate_cache.root);
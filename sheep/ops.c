@@ -88,6 +88,8 @@ static int cluster_new_vdi(struct request *req)
 		.copy_policy = hdr->vdi.copy_policy,
 		.store_policy = hdr->vdi.store_policy,
 		.nr_copies = hdr->vdi.copies,
+		.compression = hdr->vdi.compression,
+		.block_size_shift = hdr->vdi.block_size_shift,
 		.time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000,
 	};
 
@@ -103,6 +105,15 @@ static int cluster_new_vdi(struct request *req)
 	if (hdr->data_length != SD_MAX_VDI_LEN)
 		return SD_RES_INVALID_PARMS;
 
+	if (iocb.compression != SD_COMPRESS_NONE &&
+	    !compression_supported(iocb.compression))
+		return SD_RES_NO_SUPPORT;
+
+	if (iocb.block_size_shift &&
+	    (iocb.block_size_shift < SD_MIN_BLOCK_SIZE_SHIFT ||
+	     iocb.block_size_shift > SD_MAX_BLOCK_SIZE_SHIFT))
+		return SD_RES_INVALID_PARMS;
+
 	if (iocb.create_snapshot)
 		ret = vdi_snapshot(&iocb, &vid);
 	else
@@ -110,6 +121,25 @@ static int cluster_new_vdi(struct request *req)
 
 	rsp->vdi.vdi_id = vid;
 	rsp->vdi.copies = iocb.nr_copies;
+	rsp->vdi.compression = iocb.compression;
+	rsp->vdi.block_size_shift = iocb.block_size_shift ?:
+		SD_DEFAULT_BLOCK_SIZE_SHIFT;
+
+	/* the new vdi may have inherited the attributes of its parent */
+	if (ret == SD_RES_SUCCESS && iocb.base_vid) {
+		struct sd_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
+
+		if (sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+				   SD_INODE_HEADER_SIZE, 0) == SD_RES_SUCCESS) {
+			rsp->vdi.compression = inode->compression;
+			rsp->vdi.block_size_shift = inode->block_size_shift;
+		} else {
+			/* better unknown than wrong, see get_vdi_objsize() */
+			sd_err("failed to read the inode of %"PRIx32, vid);
+			rsp->vdi.block_size_shift = 0;
+		}
+		free(inode);
+	}
 
 	return ret;
 }
@@ -148,6 +178,10 @@ static int post_cluster_new_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 		 * avoid vdi states sync-up.
 		 */
 		vdi_mark_snapshot(req->vdi.base_vdi_id);
+		if (rsp->vdi.compression != SD_COMPRESS_NONE)
+			vdi_set_compression(nr, rsp->vdi.compression);
+		if (rsp->vdi.block_size_shift)
+			vdi_set_block_size_shift(nr, rsp->vdi.block_size_shift);
 		atomic_set_bit(nr, sys->vdi_inuse);
 	}
 
@@ -224,6 +258,7 @@ static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 		node_to_str(sender));
 
 	vdi_delete_state(vid);
+	qos_delete_vdi(vid);
 
 	if (!sys->enable_object_cache)
 		return ret;
@@ -272,27 +307,10 @@ static int cluster_get_vdi_info(struct request *req)
 	return ret;
 }
 
-static int remove_epoch(uint32_t epoch)
-{
-	int ret;
-	char path[PATH_MAX];
-
-	sd_debug("remove epoch %"PRIu32, epoch);
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	ret = unlink(path);
-	if (ret && errno != ENOENT) {
-		sd_err("failed to remove %s: %m", path);
-		return SD_RES_EIO;
-	}
-
-	return SD_RES_SUCCESS;
-}
-
 static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data, const struct sd_node *sender)
 {
-	int i, ret = SD_RES_SUCCESS;
-	uint32_t latest_epoch;
+	int ret = SD_RES_SUCCESS;
 	struct store_driver *driver;
 	char *store_name = data;
 
@@ -305,8 +323,6 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	pstrcpy((char *)sys->cinfo.store, sizeof(sys->cinfo.store),
 		store_name);
 	sd_store = driver;
-	latest_epoch = get_latest_epoch();
-
 	ret = sd_store->format();
 	if (ret != SD_RES_SUCCESS)
 		goto out;
@@ -323,8 +339,10 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	sys->cinfo.ctime = req->cluster.ctime;
 	set_cluster_config(&sys->cinfo);
 
-	for (i = 1; i <= latest_epoch; i++)
-		remove_epoch(i);
+	if (epoch_log_reset() < 0) {
+		ret = SD_RES_EIO;
+		goto out;
+	}
 
 	memset(sys->vdi_inuse, 0, sizeof(sys->vdi_inuse));
 	clean_vdi_state();
@@ -396,6 +414,16 @@ static int cluster_get_vdi_attr(struct request *req)
 	return ret;
 }
 
+static int post_cluster_get_vdi_attr(const struct sd_req *req,
+				     struct sd_rsp *rsp, void *data,
+				     const struct sd_node *sender)
+{
+	if (req->flags & (SD_FLAG_CMD_CREAT | SD_FLAG_CMD_DEL))
+		qos_update_limit(data, !!(req->flags & SD_FLAG_CMD_DEL));
+
+	return SD_RES_SUCCESS;
+}
+
 static int local_release_vdi(struct request *req)
 {
 	uint32_t vid = req->rq.vdi.base_vdi_id;
@@ -624,7 +652,7 @@ static int cluster_force_recover_main(const struct sd_req *req,
 		rb_insert(&nroot, &nodes[i], rb, node_cmp);
 
 	vnode_info = get_vnode_info();
-	old_vnode_info = alloc_vnode_info(&nroot);
+	old_vnode_info = alloc_vnode_info_from(vnode_info, &nroot);
 	start_recovery(vnode_info, old_vnode_info, true);
 	put_vnode_info(vnode_info);
 	put_vnode_info(old_vnode_info);
@@ -638,6 +666,10 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 {
 	if (req->vdi_state.set_bitmap)
 		atomic_set_bit(req->vdi_state.new_vid, sys->vdi_inuse);
+	/* the inodes of the older sheep have 0 for the default size */
+	vdi_set_block_size_shift(req->vdi_state.new_vid,
+				 req->vdi_state.block_size_shift ?:
+				 SD_DEFAULT_BLOCK_SIZE_SHIFT);
 
 	return SD_RES_SUCCESS;
 }
@@ -733,8 +765,10 @@ out:
 			sd_notice("all nodes are recovered, epoch %d", epoch);
 			/* sd_store can be NULL if this node is a gateway */
 			if (vnode_info->nr_zones >= ec_max_data_strip() &&
-			    sd_store && sd_store->cleanup)
-				sd_store->cleanup();
+			    sd_store && sd_store->cleanup &&
+			    sd_store->cleanup() == SD_RES_SUCCESS)
+				/* no stale object refers to the old epochs */
+				compact_epoch_log(epoch);
 		}
 	}
 
@@ -802,9 +836,16 @@ static int cluster_reconfig(const struct sd_req *req, struct sd_rsp *rsp,
 static int local_md_info(struct request *request)
 {
 	struct sd_rsp *rsp = &request->rp;
+	struct sd_md_info *info = (struct sd_md_info *)request->data;
 
 	sd_assert(request->rq.data_length == sizeof(struct sd_md_info));
-	rsp->data_length = md_get_info((struct sd_md_info *)request->data);
+	rsp->data_length = md_get_info(info);
+
+	for (int i = 0; sd_store && sd_store->compressed_size && i < info->nr;
+	     i++)
+		sd_store->compressed_size(info->disk[i].path,
+					  &info->disk[i].compressed,
+					  &info->disk[i].compressed_used);
 
 	return rsp->data_length ? SD_RES_SUCCESS : SD_RES_UNKNOWN;
 }
@@ -837,6 +878,45 @@ static int local_get_hash(struct request *request)
 				  rsp->hash.digest);
 }
 
+struct get_hashes_arg {
+	struct sd_oid_hash *entries;
+	uint32_t epoch;
+};
+
+static void get_hash_entry(int i, void *arg)
+{
+	struct get_hashes_arg *garg = arg;
+	struct sd_oid_hash *e = garg->entries + i;
+
+	e->result = sd_store->get_hash(e->oid, garg->epoch, e->digest);
+}
+
+static int local_get_hashes(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+	struct sd_rsp *rsp = &request->rp;
+	struct get_hashes_arg arg = {
+		.entries = request->data,
+		.epoch = req->obj.tgt_epoch,
+	};
+	int nr = req->data_length / sizeof(struct sd_oid_hash);
+	uint64_t *oids;
+
+	if (!sd_store->get_hash)
+		return SD_RES_NO_SUPPORT;
+	if (req->data_length % sizeof(struct sd_oid_hash))
+		return SD_RES_INVALID_PARMS;
+
+	oids = xmalloc(sizeof(*oids) * nr);
+	for (int i = 0; i < nr; i++)
+		oids[i] = arg.entries[i].oid;
+	md_for_each_oid(oids, nr, get_hash_entry, &arg);
+	free(oids);
+
+	rsp->data_length = req->data_length;
+	return SD_RES_SUCCESS;
+}
+
 static int local_get_cache_info(struct request *request)
 {
 	struct sd_rsp *rsp = &request->rp;
@@ -865,8 +945,45 @@ out:
 static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
 			 void *data, const struct sd_node *sender)
 {
-	memcpy(data, &sys->stat, sizeof(struct sd_stat));
-	rsp->data_length = sizeof(struct sd_stat);
+	int nr;
+
+	/* older clients know only the leading part of struct sd_stat */
+	rsp->data_length = min(req->data_length,
+			       (uint32_t)sizeof(struct sd_stat));
+	memcpy(data, &sys->stat, rsp->data_length);
+	if (req->data_length <= sizeof(struct sd_stat))
+		return SD_RES_SUCCESS;
+
+	/* followed by the statistics of the VDIs if there is room */
+	nr = qos_get_stats((struct sd_vdi_stat *)((char *)data +
+						  sizeof(struct sd_stat)),
+			   (req->data_length - sizeof(struct sd_stat)) /
+			   sizeof(struct sd_vdi_stat));
+	rsp->data_length += nr * sizeof(struct sd_vdi_stat);
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_vdi_state(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	int nr;
+
+	nr = get_vdi_state_list(data, req->data_length /
+				sizeof(struct sd_vdi_state));
+	if (nr < 0)
+		return SD_RES_BUFFER_SMALL;
+
+	rsp->data_length = nr * sizeof(struct sd_vdi_state);
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_hot_objs(const struct sd_req *req, struct sd_rsp *rsp,
+			      void *data, const struct sd_node *sender)
+{
+	int nr;
+
+	nr = hotspot_get(data, req->data_length / sizeof(struct sd_hot_obj));
+	rsp->data_length = nr * sizeof(struct sd_hot_obj);
 	return SD_RES_SUCCESS;
 }
 
@@ -883,19 +1000,59 @@ static int local_flush_vdi(struct request *req)
 	return ret;
 }
 
+/*
+ * Punch the range of the object on all the replicas, and return true in
+ * 'empty' if the object holds no data afterwards.  Nothing is done if the
+ * object isn't ours, it belongs to a snapshot then.
+ */
+static int discard_range(const struct sd_inode *inode, uint64_t oid,
+			 uint32_t offset, uint32_t length, bool *empty)
+{
+	int ret;
+
+	*empty = false;
+	if (sd_inode_get_vid(inode, data_oid_to_idx(oid)) != oid_to_vid(oid))
+		return SD_RES_SUCCESS;
+
+	ret = sd_punch_object(oid, offset, length, empty);
+	if (ret == SD_RES_NO_SUPPORT) {
+		/* discard is advisory, the data is just kept */
+		*empty = false;
+		ret = SD_RES_SUCCESS;
+	}
+
+	return ret;
+}
+
+/*
+ * Discard the range obj.offset and obj.length of the object, or the whole
+ * object if obj.length is zero.  If the object doesn't hold any data after
+ * its range is punched, it is removed as a whole.  Like the whole object
+ * discard, the client must not access the object during the discard.
+ */
 static int local_discard_obj(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
 	uint32_t vid = oid_to_vid(oid), tmp_vid;
+	uint32_t offset = req->rq.obj.offset, length = req->rq.obj.length;
 	int ret, idx = data_oid_to_idx(oid);
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
+	bool empty;
 
-	sd_debug("%"PRIx64, oid);
+	sd_debug("%"PRIx64", %"PRIu32", %"PRIu32, oid, offset, length);
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(struct sd_inode), 0);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
+	if (length && (offset ||
+		       length < get_objsize(oid, inode->block_size_shift))) {
+		ret = discard_range(inode, oid, offset, length, &empty);
+		if (ret != SD_RES_SUCCESS || !empty)
+			goto out;
+		sd_debug("%"PRIx64" is empty", oid);
+	}
+
 	tmp_vid = sd_inode_get_vid(inode, idx);
 	/* if vid in idx is not exist, we don't need to remove it */
 	if (tmp_vid) {
@@ -903,7 +1060,8 @@ static int local_discard_obj(struct request *req)
 		ret = sd_inode_write_vid(inode, idx, vid, 0, 0, false, false);
 		if (ret != SD_RES_SUCCESS)
 			goto out;
-		if (sd_remove_object(oid) != SD_RES_SUCCESS)
+		req->rp.obj.empty = 1;
+		if (sd_remove_object(oid, false) != SD_RES_SUCCESS)
 			sd_err("failed to remove %"PRIx64, oid);
 	}
 	/*
@@ -1023,6 +1181,29 @@ out:
 	return ret;
 }
 
+static int peer_punch_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct siocb iocb = { };
+	bool empty;
+	int ret;
+
+	if (!sd_store->punch)
+		return SD_RES_NO_SUPPORT;
+
+	iocb.epoch = hdr->epoch;
+	iocb.length = hdr->obj.length;
+	iocb.offset = hdr->obj.offset;
+	iocb.ec_index = hdr->obj.ec_index;
+	iocb.copy_policy = hdr->obj.copy_policy;
+
+	ret = sd_store->punch(hdr->obj.oid, &iocb, &empty);
+	if (ret == SD_RES_SUCCESS)
+		req->rp.obj.empty = empty;
+
+	return ret;
+}
+
 static int peer_write_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
@@ -1039,6 +1220,32 @@ static int peer_write_obj(struct request *req)
 	return sd_store->write(oid, &iocb);
 }
 
+/*
+ * Create a COW object with a partial write by cloning the parent object on
+ * this node.  We must not read the parent from other nodes here because this
+ * request holds a peer I/O slot, so if it isn't here, or the store can't clone
+ * it, return SD_RES_NO_OBJ and let the gateway send the whole object.
+ */
+static int peer_cow_obj(struct request *req, struct siocb *iocb)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t oid = hdr->obj.oid, cow_oid = hdr->obj.cow_oid;
+	int ret;
+
+	if (hdr->data_length == get_vdi_objsize(oid))
+		return sd_store->create_and_write(oid, iocb);
+
+	if (!sd_store->clone)
+		return SD_RES_NO_OBJ;
+
+	ret = sd_store->clone(oid, cow_oid, iocb);
+	if (ret == SD_RES_NO_SUPPORT)
+		ret = SD_RES_NO_OBJ;
+	if (ret == SD_RES_NO_OBJ)
+		sd_debug("can't clone %"PRIx64" from %"PRIx64, oid, cow_oid);
+	return ret;
+}
+
 static int peer_create_and_write_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
@@ -1051,9 +1258,53 @@ static int peer_create_and_write_obj(struct request *req)
 	iocb.copy_policy = hdr->obj.copy_policy;
 	iocb.offset = hdr->obj.offset;
 
+	if (hdr->flags & SD_FLAG_CMD_COW)
+		return peer_cow_obj(req, &iocb);
+
 	return sd_store->create_and_write(hdr->obj.oid, &iocb);
 }
 
+/* Write the entries of a batch in turn, see gateway_write_batch() */
+static int peer_write_batch(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	const struct sd_batch_entry *be = req->data;
+	int ret = SD_RES_SUCCESS;
+
+	if (!write_batch_valid(hdr, req->data))
+		return SD_RES_INVALID_PARMS;
+
+	for (uint32_t i = 0; i < hdr->obj.length; i++) {
+		struct siocb iocb = { };
+		char *buf = (char *)req->data + be[i].data_offset;
+
+		/* direct I/O needs the buffer aligned to the page size */
+		if (!is_aligned_to_pagesize(buf)) {
+			buf = xvalloc(be[i].length);
+			memcpy(buf, (char *)req->data + be[i].data_offset,
+			       be[i].length);
+		}
+
+		iocb.epoch = hdr->epoch;
+		iocb.buf = buf;
+		iocb.length = be[i].length;
+		iocb.offset = be[i].offset;
+		if (be[i].create)
+			ret = sd_store->create_and_write(be[i].oid, &iocb);
+		else
+			ret = sd_store->write(be[i].oid, &iocb);
+
+		if (buf != (char *)req->data + be[i].data_offset)
+			free(buf);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to write %"PRIx64", %s", be[i].oid,
+			       sd_strerror(ret));
+			break;
+		}
+	}
+	return ret;
+}
+
 static int local_get_loglevel(struct request *req)
 {
 	int32_t current_level;
@@ -1263,6 +1514,7 @@ static struct sd_op_template sd_ops[] = {
 		.name = "GET_VDI_ATTR",
 		.type = SD_OP_TYPE_CLUSTER,
 		.process_work = cluster_get_vdi_attr,
+		.process_main = post_cluster_get_vdi_attr,
 	},
 
 	[SD_OP_FORCE_RECOVER] = {
@@ -1500,6 +1752,19 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_sd_stat,
 	},
 
+	[SD_OP_GET_VDI_STATE] = {
+		.name = "GET_VDI_STATE",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_vdi_state,
+	},
+
+	[SD_OP_GET_HOT_OBJS] = {
+		.name = "GET_HOT_OBJS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_get_hot_objs,
+	},
+
 	[SD_OP_GET_LOGLEVEL] = {
 		.name = "GET_LOGLEVEL",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1521,6 +1786,12 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_oid_exist,
 	},
 
+	[SD_OP_GET_HASHES] = {
+		.name = "GET_HASHES",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_hashes,
+	},
+
 	[SD_OP_OIDS_EXIST] =  {
 		.name = "OIDS_EXIST",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1595,6 +1866,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = gateway_unref_object,
 	},
 
+	[SD_OP_PUNCH_OBJ] = {
+		.name = "PUNCH_OBJ",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_punch_object,
+	},
+
+	[SD_OP_WRITE_BATCH] = {
+		.name = "WRITE_BATCH",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_write_batch,
+	},
+
 	/* peer I/O operations */
 	[SD_OP_CREATE_AND_WRITE_PEER] = {
 		.name = "CREATE_AND_WRITE_PEER",
@@ -1619,6 +1902,18 @@ static struct sd_op_template sd_ops[] = {
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_remove_obj,
 	},
+
+	[SD_OP_PUNCH_PEER] = {
+		.name = "PUNCH_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_punch_obj,
+	},
+
+	[SD_OP_WRITE_BATCH_PEER] = {
+		.name = "WRITE_BATCH_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_write_batch,
+	},
 };
 
 const struct sd_op_template *get_sd_op(uint8_t opcode)
@@ -1718,6 +2013,8 @@ static int map_table[] = {
 	[SD_OP_READ_OBJ] = SD_OP_READ_PEER,
 	[SD_OP_WRITE_OBJ] = SD_OP_WRITE_PEER,
 	[SD_OP_REMOVE_OBJ] = SD_OP_REMOVE_PEER,
+	[SD_OP_PUNCH_OBJ] = SD_OP_PUNCH_PEER,
+	[SD_OP_WRITE_BATCH] = SD_OP_WRITE_BATCH_PEER,
 };
 
 int gateway_to_peer_opcode(int opcode)
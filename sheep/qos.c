@@ -0,0 +1,610 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Quality of service of the gateway and peer requests.
+ *
+ * Gateway requests are queued per VDI and handed to the gateway workers by a
+ * deficit round robin scheduler, at most sys->qos_depth of them at a time, so
+ * that a VDI with a deep queue of large requests can't starve the others.
+ *
+ * Peer I/O requests are scheduled the same way in front of the io workers,
+ * queued by their priority class instead, and the classes are weighted so
+ * that recovery and background work can't starve the I/O of the guests.
+ *
+ * A VDI can be limited in IOPS and bandwidth by setting the attributes
+ * QOS_IOPS_KEY and QOS_BPS_KEY with 'dog vdi setattr'.  The limits are kept
+ * by every gateway on its own, so they apply to each client node separately.
+ * They are enforced with token buckets which hold a second worth of tokens.
+ */
+
+#include "sheep_priv.h"
+#include "option.h"
+
+#define QOS_IOPS_KEY	"sheepdog.qos.iops"
+#define QOS_BPS_KEY	"sheepdog.qos.bps"
+
+/* bytes a VDI is allowed to send in a round */
+#define QOS_QUANTUM	(256 * 1024)
+/* fixed cost of a request in bytes, so that small ones aren't free */
+#define QOS_REQ_COST	4096
+/* the token buckets can hold a second worth of requests */
+#define QOS_BURST	1000000000ULL
+/* max delay of the timer which wakes up the throttled VDIs, in ms */
+#define QOS_TICK	10
+/* delay before the limits which failed to be read are read again, in ns */
+#define QOS_RELOAD_DELAY	(5 * 1000000000ULL)
+
+/* share of the io workers each priority class gets under contention */
+static const uint32_t io_prio_weights[NR_IO_PRIOS] = {
+	[IO_PRIO_FOREGROUND] = 8,
+	[IO_PRIO_RECOVERY] = 2,
+	[IO_PRIO_BACKGROUND] = 1,
+};
+
+/* best effort I/O priority levels of the classes, 4 is the default */
+static const int io_prio_levels[NR_IO_PRIOS] = {
+	[IO_PRIO_FOREGROUND] = 4,
+	[IO_PRIO_RECOVERY] = 6,
+	[IO_PRIO_BACKGROUND] = 7,
+};
+
+struct qos_sched {
+	struct list_head active_classes;
+	uint32_t nr_inflight;
+	uint32_t depth; /* max nr_inflight, 0 for no limit */
+	struct work_queue *wq;
+};
+
+enum qos_state {
+	QOS_IDLE,	/* no queued requests */
+	QOS_ACTIVE,	/* on active_classes */
+	QOS_THROTTLED,	/* on throttled_classes, out of tokens */
+};
+
+struct qos_class {
+	uint32_t vid;
+	uint32_t family; /* sd_hash_vdi() of the VDI name, 0 if unknown */
+	bool loaded;
+	bool loading;
+	bool deleted; /* freed when it has no requests any more */
+	uint64_t next_load; /* when to read the limits again if they failed */
+	uint32_t nr_inflight;
+
+	struct rb_node rb;
+	struct qos_sched *sched;
+	struct list_head reqs;
+	struct list_node list;
+	enum qos_state state;
+	uint64_t deficit;
+	uint32_t weight;
+
+	uint64_t iops_limit;
+	uint64_t bps_limit;
+	/* theoretical arrival times of the token buckets, in ns */
+	uint64_t iops_tat;
+	uint64_t bps_tat;
+	uint64_t wakeup; /* when to retry if throttled */
+
+	struct sd_vdi_stat stat;
+};
+
+struct qos_load_work {
+	uint32_t vid;
+	uint32_t family;
+	uint64_t iops_limit;
+	uint64_t bps_limit;
+	uint64_t generation;
+	int ret;
+
+	struct work work;
+};
+
+static struct qos_sched gateway_sched = {
+	.active_classes = LIST_HEAD_INIT(gateway_sched.active_classes),
+};
+static struct qos_sched io_sched = {
+	.active_classes = LIST_HEAD_INIT(io_sched.active_classes),
+};
+static struct qos_class io_classes[NR_IO_PRIOS];
+
+static struct rb_root qos_root = RB_ROOT;
+static LIST_HEAD(throttled_classes);
+static struct timer qos_timer;
+static bool qos_timer_armed;
+static struct work_queue *qos_wqueue;
+/* bumped on every limit update so that a stale load is retried */
+static uint64_t qos_generation;
+
+static int qos_class_cmp(const struct qos_class *a, const struct qos_class *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int parse_limit(const char *key, const char *value, uint64_t *limit)
+{
+	char *p;
+
+	if (strcmp(key, QOS_BPS_KEY) == 0)
+		return option_parse_size(value, limit);
+
+	*limit = strtoull(value, &p, 10);
+	if (p == value || *p != '\0')
+		return -1;
+
+	return 0;
+}
+
+static bool is_qos_key(const char *key)
+{
+	return strcmp(key, QOS_IOPS_KEY) == 0 || strcmp(key, QOS_BPS_KEY) == 0;
+}
+
+/* Returns the limit in the attribute, 0 if it is unset or malformed */
+static uint64_t attr_to_limit(const struct sheepdog_vdi_attr *vattr)
+{
+	char value[64];
+	uint64_t limit;
+
+	if (vattr->value_len == 0 || vattr->value_len >= sizeof(value))
+		return 0;
+
+	memcpy(value, vattr->value, vattr->value_len);
+	value[vattr->value_len] = '\0';
+	if (parse_limit(vattr->key, value, &limit) < 0) {
+		sd_err("invalid %s of %s, %s", vattr->key, vattr->name, value);
+		return 0;
+	}
+
+	return limit;
+}
+
+static worker_fn uint64_t read_limit(const char *name, uint32_t family,
+				     const char *key)
+{
+	struct sheepdog_vdi_attr *vattr = xzalloc(SD_ATTR_OBJ_SIZE);
+	uint32_t attrid;
+	uint64_t limit = 0;
+	int ret;
+
+	pstrcpy(vattr->name, SD_MAX_VDI_LEN, name);
+	pstrcpy(vattr->key, SD_MAX_VDI_ATTR_KEY_LEN, key);
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, family, &attrid, 0, false,
+			   false, false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = sd_read_object(vid_to_attr_oid(family, attrid), (char *)vattr,
+			     SD_ATTR_OBJ_SIZE, 0);
+	if (ret == SD_RES_SUCCESS)
+		limit = attr_to_limit(vattr);
+out:
+	free(vattr);
+	return limit;
+}
+
+static void qos_load_work(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	char name[SD_MAX_VDI_LEN];
+
+	lw->ret = sd_read_object(vid_to_vdi_oid(lw->vid), name, sizeof(name),
+				 0);
+	if (lw->ret != SD_RES_SUCCESS)
+		return;
+
+	lw->family = sd_hash_vdi(name);
+	lw->iops_limit = read_limit(name, lw->family, QOS_IOPS_KEY);
+	lw->bps_limit = read_limit(name, lw->family, QOS_BPS_KEY);
+}
+
+static void qos_dispatch(struct qos_sched *s);
+
+static void set_limits(struct qos_class *c, uint64_t iops, uint64_t bps)
+{
+	uint64_t now = clock_get_time();
+
+	if (c->iops_limit != iops || c->bps_limit != bps)
+		sd_info("%"PRIx32": %"PRIu64" iops, %"PRIu64" bytes/s",
+			c->vid, iops, bps);
+
+	c->iops_limit = iops;
+	c->bps_limit = bps;
+	c->iops_tat = c->bps_tat = now;
+	c->stat.iops_limit = iops;
+	c->stat.bps_limit = bps;
+
+	/* let the scheduler check the new limits */
+	if (c->state == QOS_THROTTLED) {
+		list_move_tail(&c->list, &c->sched->active_classes);
+		c->state = QOS_ACTIVE;
+	}
+}
+
+/* Free the class of a deleted VDI once nothing refers to it */
+static void put_qos_class(struct qos_class *c)
+{
+	if (!c->deleted || c->state != QOS_IDLE || c->nr_inflight ||
+	    c->loading)
+		return;
+
+	rb_erase(&c->rb, &qos_root);
+	free(c);
+}
+
+static void qos_load_done(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct qos_class key = { .vid = lw->vid }, *c;
+
+	c = rb_search(&qos_root, &key, rb, qos_class_cmp);
+	sd_assert(c);
+
+	if (lw->generation != qos_generation) {
+		/* the limits were changed while we were reading them */
+		lw->generation = qos_generation;
+		queue_work(qos_wqueue, &lw->work);
+		return;
+	}
+
+	c->loading = false;
+	if (lw->ret != SD_RES_SUCCESS) {
+		/* keep it unloaded so that a later request reads it again */
+		sd_debug("failed to load qos of %"PRIx32", %s", lw->vid,
+			 sd_strerror(lw->ret));
+		c->next_load = clock_get_time() + QOS_RELOAD_DELAY;
+	} else {
+		c->loaded = true;
+		c->family = lw->family;
+		set_limits(c, lw->iops_limit, lw->bps_limit);
+		qos_dispatch(c->sched);
+	}
+	free(lw);
+	put_qos_class(c);
+}
+
+static void load_qos_class(struct qos_class *c)
+{
+	struct qos_load_work *lw;
+
+	c->loading = true;
+	lw = xzalloc(sizeof(*lw));
+	lw->vid = c->vid;
+	lw->generation = qos_generation;
+	lw->work.fn = qos_load_work;
+	lw->work.done = qos_load_done;
+	queue_work(qos_wqueue, &lw->work);
+}
+
+/*
+ * The requests of a VDI whose limits are not known yet are scheduled
+ * without limits until they are read from the attributes.
+ */
+static struct qos_class *get_qos_class(uint32_t vid)
+{
+	struct qos_class key = { .vid = vid }, *c;
+
+	c = rb_search(&qos_root, &key, rb, qos_class_cmp);
+	if (c) {
+		if (c->deleted) {
+			/* the vid is used by a new VDI */
+			c->deleted = false;
+			c->loaded = false;
+			c->next_load = 0;
+			set_limits(c, 0, 0);
+		}
+		if (!c->loaded && !c->loading &&
+		    clock_get_time() >= c->next_load)
+			load_qos_class(c);
+		return c;
+	}
+
+	c = xzalloc(sizeof(*c));
+	c->vid = vid;
+	c->stat.vid = vid;
+	c->sched = &gateway_sched;
+	c->weight = 1;
+	INIT_LIST_HEAD(&c->reqs);
+	INIT_LIST_NODE(&c->list);
+	rb_insert(&qos_root, c, rb, qos_class_cmp);
+	load_qos_class(c);
+
+	return c;
+}
+
+static uint64_t request_cost(const struct request *req)
+{
+	return req->rq.data_length + QOS_REQ_COST;
+}
+
+/* Returns how long the next request of 'c' has to wait for tokens, in ns */
+static uint64_t throttle_time(const struct qos_class *c, uint64_t now)
+{
+	uint64_t tat = max(c->iops_tat, c->bps_tat);
+
+	return tat > now + QOS_BURST ? tat - now - QOS_BURST : 0;
+}
+
+static void consume_tokens(struct qos_class *c, uint64_t cost, uint64_t now)
+{
+	if (c->iops_limit)
+		c->iops_tat = max(c->iops_tat, now) +
+			1000000000ULL / c->iops_limit;
+	if (c->bps_limit)
+		c->bps_tat = max(c->bps_tat, now) +
+			cost * 1000000000ULL / c->bps_limit;
+}
+
+static void qos_timer_fn(void *data);
+
+static void arm_qos_timer(uint64_t wait)
+{
+	unsigned int ms = min(wait / 1000000 + 1, (uint64_t)QOS_TICK);
+
+	if (qos_timer_armed)
+		return;
+
+	qos_timer.callback = qos_timer_fn;
+	add_timer(&qos_timer, ms);
+	qos_timer_armed = true;
+}
+
+static void throttle_class(struct qos_class *c, uint64_t wait, uint64_t now)
+{
+	list_move_tail(&c->list, &throttled_classes);
+	c->state = QOS_THROTTLED;
+	c->wakeup = now + wait;
+	c->stat.nr_throttled++;
+	arm_qos_timer(wait);
+}
+
+static void qos_timer_fn(void *data)
+{
+	uint64_t now = clock_get_time(), wait = UINT64_MAX;
+	struct qos_class *c;
+
+	qos_timer_armed = false;
+	list_for_each_entry(c, &throttled_classes, list) {
+		if (c->wakeup <= now) {
+			list_move_tail(&c->list, &c->sched->active_classes);
+			c->state = QOS_ACTIVE;
+		} else
+			wait = min(wait, c->wakeup - now);
+	}
+	if (wait != UINT64_MAX)
+		arm_qos_timer(wait);
+
+	qos_dispatch(&gateway_sched);
+}
+
+static void qos_dispatch(struct qos_sched *s)
+{
+	uint64_t now = clock_get_time(), cost, wait;
+	struct qos_class *c;
+	struct request *req;
+
+	while (!list_empty(&s->active_classes) &&
+	       (!s->depth || s->nr_inflight < s->depth)) {
+		c = list_first_entry(&s->active_classes, struct qos_class,
+				     list);
+		req = list_first_entry(&c->reqs, struct request, qos_list);
+		cost = request_cost(req);
+
+		if (c->deficit < cost) {
+			c->deficit += QOS_QUANTUM * c->weight;
+			list_move_tail(&c->list, &s->active_classes);
+			continue;
+		}
+
+		wait = throttle_time(c, now);
+		if (wait) {
+			throttle_class(c, wait, now);
+			continue;
+		}
+
+		consume_tokens(c, cost, now);
+		c->deficit -= cost;
+		list_del(&req->qos_list);
+		if (list_empty(&c->reqs)) {
+			list_del(&c->list);
+			c->state = QOS_IDLE;
+			c->deficit = 0;
+		}
+
+		s->nr_inflight++;
+		c->nr_inflight++;
+		queue_work(s->wq, &req->work);
+	}
+}
+
+static void qos_queue_request(struct qos_class *c, struct request *req)
+{
+	req->qos = c;
+	list_add_tail(&req->qos_list, &c->reqs);
+	if (c->state == QOS_IDLE) {
+		list_add_tail(&c->list, &c->sched->active_classes);
+		c->state = QOS_ACTIVE;
+	}
+
+	qos_dispatch(c->sched);
+}
+
+main_fn void qos_queue_gateway_request(struct request *req)
+{
+	/*
+	 * Internal requests are never held back, they can be issued by the
+	 * workers of the requests holding the slots.
+	 */
+	if (req->local) {
+		queue_work(sys->gateway_wqueue, &req->work);
+		return;
+	}
+
+	if (!req->qos_start)
+		req->qos_start = clock_get_time();
+
+	qos_queue_request(get_qos_class(oid_to_vid(req->rq.obj.oid)), req);
+}
+
+main_fn void qos_queue_peer_request(struct request *req)
+{
+	switch (req->rq.opcode) {
+	case SD_OP_READ_PEER:
+	case SD_OP_WRITE_PEER:
+	case SD_OP_CREATE_AND_WRITE_PEER:
+	case SD_OP_REMOVE_PEER:
+	case SD_OP_PUNCH_PEER:
+	case SD_OP_WRITE_BATCH_PEER:
+		qos_queue_request(&io_classes[req_io_prio(&req->rq)], req);
+		break;
+	default:
+		/* the other peer requests are rare and may wait on peer I/O */
+		queue_work(sys->io_wqueue, &req->work);
+		break;
+	}
+}
+
+/* Called when a worker has finished with the request */
+main_fn void qos_request_done(struct request *req)
+{
+	struct qos_class *c = req->qos;
+	struct qos_sched *s;
+
+	if (!c)
+		return;
+
+	s = c->sched;
+	req->qos = NULL;
+	s->nr_inflight--;
+	c->nr_inflight--;
+	qos_dispatch(s);
+	put_qos_class(c);
+}
+
+/* Apply the I/O priority of the class to the calling worker */
+worker_fn void qos_set_thread_prio(enum io_prio prio)
+{
+	static __thread int thread_prio = -1;
+
+	if (thread_prio == prio)
+		return;
+
+	if (set_thread_ioprio(io_prio_levels[prio]) < 0)
+		sd_debug("failed to set I/O priority, %m");
+	thread_prio = prio;
+}
+
+/* Called when the request is completed and is not retried anymore */
+main_fn void qos_account_request(struct request *req)
+{
+	struct qos_class *c;
+	struct qos_class key;
+	uint64_t latency;
+
+	if (!req->qos_start)
+		return;
+
+	key.vid = oid_to_vid(req->rq.obj.oid);
+	c = rb_search(&qos_root, &key, rb, qos_class_cmp);
+	if (!c)
+		return;
+
+	latency = clock_get_time() - req->qos_start;
+	if (req->rq.flags & SD_FLAG_CMD_WRITE) {
+		c->stat.nr_writes++;
+		c->stat.write_bytes += req->rq.data_length;
+	} else {
+		c->stat.nr_reads++;
+		c->stat.read_bytes += req->rq.data_length;
+	}
+	c->stat.total_latency += latency;
+	c->stat.max_latency = max(c->stat.max_latency, latency);
+	c->stat.latency_hist[min(fls64(latency / SD_LAT_BUCKET_BASE),
+				 SD_NR_LAT_BUCKETS - 1)]++;
+}
+
+/* Apply the limits set with 'dog vdi setattr' to the VDIs of the family */
+main_fn void qos_update_limit(const struct sheepdog_vdi_attr *vattr,
+			      bool delete)
+{
+	uint32_t family = sd_hash_vdi(vattr->name);
+	uint64_t limit = delete ? 0 : attr_to_limit(vattr);
+	struct qos_class *c;
+
+	if (!is_qos_key(vattr->key))
+		return;
+
+	qos_generation++;
+	rb_for_each_entry(c, &qos_root, rb) {
+		if (!c->loaded || c->family != family)
+			continue;
+		if (strcmp(vattr->key, QOS_IOPS_KEY) == 0)
+			set_limits(c, limit, c->bps_limit);
+		else
+			set_limits(c, c->iops_limit, limit);
+	}
+
+	qos_dispatch(&gateway_sched);
+}
+
+/* Drop the limits and the statistics of the deleted VDI */
+main_fn void qos_delete_vdi(uint32_t vid)
+{
+	struct qos_class key = { .vid = vid }, *c;
+
+	c = rb_search(&qos_root, &key, rb, qos_class_cmp);
+	if (!c)
+		return;
+
+	c->deleted = true;
+	put_qos_class(c);
+}
+
+/* Fill 'stats' with the statistics of at most 'nr_max' VDIs */
+main_fn int qos_get_stats(struct sd_vdi_stat *stats, int nr_max)
+{
+	struct qos_class *c;
+	int nr = 0;
+
+	rb_for_each_entry(c, &qos_root, rb) {
+		if (nr == nr_max)
+			break;
+		stats[nr++] = c->stat;
+	}
+
+	return nr;
+}
+
+int qos_init(void)
+{
+	qos_wqueue = create_ordered_work_queue("qos");
+	if (!qos_wqueue)
+		return -1;
+
+	gateway_sched.depth = sys->qos_depth;
+	gateway_sched.wq = sys->gateway_wqueue;
+	io_sched.depth = sys->qos_io_depth;
+	io_sched.wq = sys->io_wqueue;
+
+	for (int i = 0; i < NR_IO_PRIOS; i++) {
+		struct qos_class *c = io_classes + i;
+
+		c->sched = &io_sched;
+		c->weight = io_prio_weights[i];
+		INIT_LIST_HEAD(&c->reqs);
+		INIT_LIST_NODE(&c->list);
+	}
+
+	sd_info("max %"PRIu32" gateway and %"PRIu32" peer requests in flight",
+		sys->qos_depth, sys->qos_io_depth);
+
+	return 0;
+}
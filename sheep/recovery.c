@@ -117,7 +117,8 @@ rollback:
 		if (rinfo->vinfo_array[*epoch] == NULL) {
 			for (int i = 0; i < nr_nodes; i++)
 				rb_insert(&nroot, &nodes[i], rb, node_cmp);
-			rinfo->vinfo_array[*epoch] = alloc_vnode_info(&nroot);
+			rinfo->vinfo_array[*epoch] =
+				alloc_vnode_info_from(cur, &nroot);
 		}
 		sd_mutex_unlock(&rinfo->vinfo_lock);
 	}
@@ -476,7 +477,7 @@ static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 	}
 
 	/* Rebuild the lost replica */
-	ec_decode_buffer(ctx, bufs, idxs, lost, idx);
+	ec_decode_buffer(ctx, bufs, idxs, lost, idx, len);
 out:
 	ec_destroy(ctx);
 	for (i = 0; i < ed; i++)
@@ -553,6 +554,10 @@ static int do_recover_object(struct recovery_obj_work *row)
 
 	sd_debug("try recover object %"PRIx64, oid);
 
+	/* never recreate the object with a guessed size */
+	if (!get_store_objsize(oid))
+		return SD_RES_NO_VDI;
+
 	if (is_erasure_oid(oid))
 		return recover_erasure_object(row);
 	else
@@ -570,6 +575,7 @@ static void recover_object_work(struct work *work)
 	struct vnode_info *cur = rw->cur_vinfo;
 	int ret;
 
+	qos_set_thread_prio(IO_PRIO_RECOVERY);
 	if (sd_store->exist(oid, local_ec_index(cur, oid))) {
 		sd_debug("the object is already recovered");
 		return;
@@ -40,8 +40,13 @@ static void io_op_done(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	qos_request_done(req);
+
 	switch (req->rp.result) {
 	case SD_RES_EIO:
+		/* with disks left, only the object itself is corrupted */
+		if (md_nr_disks() > 0)
+			break;
 		req->rp.result = SD_RES_NETWORK_ERROR;
 
 		sd_err("leaving sheepdog cluster");
@@ -92,6 +97,8 @@ static void gateway_op_done(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	qos_request_done(req);
+
 	switch (req->rp.result) {
 	case SD_RES_OLD_NODE_VER:
 		if (req->rp.epoch > sys->cinfo.epoch) {
@@ -113,7 +120,7 @@ static void gateway_op_done(struct work *work)
 			 req->rp.result, req->rq.epoch, sys->cinfo.epoch);
 		goto retry;
 	case SD_RES_EIO:
-		if (is_access_local(req, hdr->obj.oid)) {
+		if (is_access_local(req, hdr->obj.oid) && md_nr_disks() == 0) {
 			sd_err("leaving sheepdog cluster");
 			leave_cluster();
 			goto retry;
@@ -132,6 +139,7 @@ static void gateway_op_done(struct work *work)
 		break;
 	}
 
+	qos_account_request(req);
 	put_request(req);
 	return;
 retry:
@@ -273,22 +281,79 @@ void wakeup_all_requests(void)
 	}
 }
 
+static void do_peer_work(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+
+	qos_set_thread_prio(req_io_prio(&req->rq));
+	do_process_work(work);
+}
+
+/* The I/O of a data object needs the object size of its VDI */
+static bool objsize_unknown(const struct sd_req *hdr)
+{
+	switch (hdr->opcode) {
+	case SD_OP_READ_OBJ:
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+	case SD_OP_READ_PEER:
+	case SD_OP_WRITE_PEER:
+	case SD_OP_CREATE_AND_WRITE_PEER:
+	case SD_OP_WRITE_BATCH:
+	case SD_OP_WRITE_BATCH_PEER:
+		return is_data_obj(hdr->obj.oid) &&
+			!get_vdi_objsize(hdr->obj.oid);
+	default:
+		return false;
+	}
+}
+
+/*
+ * A batch waits for the objects being recovered one by one, and is checked
+ * from the start again when it is woken up.
+ */
+static bool batch_in_recovery(struct request *req)
+{
+	const struct sd_batch_entry *be = req->data;
+
+	/* peer_write_batch() rejects it */
+	if (!write_batch_valid(&req->rq, req->data))
+		return false;
+
+	for (uint32_t i = 0; i < req->rq.obj.length; i++) {
+		/* the same as the CREATE requests in request_in_recovery() */
+		if (be[i].create)
+			continue;
+		req->local_oid = be[i].oid;
+		if (request_in_recovery(req))
+			return true;
+	}
+	return false;
+}
+
 static void queue_peer_request(struct request *req)
 {
 	req->local_oid = req->rq.obj.oid;
 	if (req->local_oid) {
 		if (check_request_epoch(req) < 0)
 			return;
-		if (request_in_recovery(req))
+		if (req->rq.opcode == SD_OP_WRITE_BATCH_PEER ?
+		    batch_in_recovery(req) : request_in_recovery(req))
 			return;
 	}
 
+	if (unlikely(objsize_unknown(&req->rq))) {
+		req->rp.result = SD_RES_NO_VDI;
+		put_request(req);
+		return;
+	}
+
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
 		req->rq.epoch = req->rq.obj.tgt_epoch;
 
-	req->work.fn = do_process_work;
+	req->work.fn = do_peer_work;
 	req->work.done = io_op_done;
-	queue_work(sys->io_wqueue, &req->work);
+	qos_queue_peer_request(req);
 }
 
 /*
@@ -311,6 +376,12 @@ static void queue_gateway_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 
+	if (unlikely(objsize_unknown(hdr))) {
+		req->rp.result = SD_RES_NO_VDI;
+		put_request(req);
+		return;
+	}
+
 	if (is_access_local(req, hdr->obj.oid))
 		req->local_oid = hdr->obj.oid;
 
@@ -337,7 +408,8 @@ queue_work:
 	}
 	if (sys->cinfo.flags & SD_CLUSTER_FLAG_STRICT &&
 	    (hdr->opcode == SD_OP_CREATE_AND_WRITE_OBJ ||
-	     hdr->opcode == SD_OP_WRITE_OBJ) &&
+	     hdr->opcode == SD_OP_WRITE_OBJ ||
+	     hdr->opcode == SD_OP_WRITE_BATCH) &&
 	    !has_enough_zones(req)) {
 		sd_err("not enough zones available");
 		goto end_request;
@@ -345,7 +417,7 @@ queue_work:
 
 	req->work.fn = do_process_work;
 	req->work.done = gateway_op_done;
-	queue_work(sys->gateway_wqueue, &req->work);
+	qos_queue_gateway_request(req);
 	return;
 
 end_request:
@@ -367,6 +439,17 @@ static main_fn inline void stat_request_begin(struct request *req)
 
 	req->stat = true;
 
+	/* the peer requests are the replicas of gateway ones, don't count them */
+	if (hdr->opcode == SD_OP_WRITE_BATCH) {
+		const struct sd_batch_entry *be = req->data;
+
+		if (write_batch_valid(hdr, req->data))
+			for (uint32_t i = 0; i < hdr->obj.length; i++)
+				hotspot_account(be[i].oid, be[i].length);
+	} else if (is_gateway_op(req->op)) {
+		hotspot_account(hdr->obj.oid, hdr->data_length);
+	}
+
 	if (is_peer_op(req->op)) {
 		sys->stat.r.peer_total_nr++;
 		sys->stat.r.peer_active_nr++;
@@ -381,9 +464,11 @@ static main_fn inline void stat_request_begin(struct request *req)
 			break;
 		case SD_OP_WRITE_PEER:
 		case SD_OP_CREATE_AND_WRITE_PEER:
+		case SD_OP_WRITE_BATCH_PEER:
 			sys->stat.r.peer_total_write_nr++;
 			break;
 		case SD_OP_REMOVE_PEER:
+		case SD_OP_PUNCH_PEER:
 			sys->stat.r.peer_total_remove_nr++;
 			break;
 		}
@@ -401,6 +486,7 @@ static main_fn inline void stat_request_begin(struct request *req)
 			break;
 		case SD_OP_WRITE_OBJ:
 		case SD_OP_CREATE_AND_WRITE_OBJ:
+		case SD_OP_WRITE_BATCH:
 			sys->stat.r.gway_total_write_nr++;
 			break;
 		case SD_OP_DISCARD_OBJ:
@@ -1189,18 +1275,12 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 			     void *buf)
 {
 	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
-	struct sockfd *sfd;
 	int ret;
 
-	sfd = sockfd_cache_get(nid);
-	if (!sfd)
-		return SD_RES_NETWORK_ERROR;
-
-	ret = exec_req(sfd->fd, hdr, buf, sheep_need_retry, hdr->epoch,
-		       MAX_RETRY_COUNT);
+	ret = sockfd_cache_exec(nid, hdr, buf, sheep_need_retry, hdr->epoch,
+				MAX_RETRY_COUNT);
 	if (ret) {
 		sd_debug("remote node might have gone away");
-		sockfd_cache_del(nid, sfd);
 		return SD_RES_NETWORK_ERROR;
 	}
 	ret = rsp->result;
@@ -1210,7 +1290,6 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 			 addr_to_str(nid->addr, nid->port),
 			 op_name(get_sd_op(hdr->opcode)));
 
-	sockfd_cache_put(nid, sfd);
 	return ret;
 }
 
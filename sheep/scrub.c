@@ -0,0 +1,164 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The scrubber periodically walks the objects stored on this node, see walk.c,
+ * and verifies them against the digests kept alongside them.  Each disk is
+ * read at most sys->scrub_iops objects a second.  A corrupted replica is rewritten from the copy the other replicas agree on
+ * with REPAIR_REPLICA.  If they agree on what the local data reads, only the
+ * cached digest was stale and is refreshed.
+ */
+
+#include "sheep_priv.h"
+
+/* delay before the first pass after start-up, in seconds */
+#define SCRUB_START_DELAY	60
+
+/*
+ * Rewrite the local replica of 'oid' from the node whose digest most of the
+ * other replicas agree on.  'sha1' is the digest of the local data, or NULL if
+ * it can't be read.
+ */
+static int repair_object(uint64_t oid, const uint8_t *sha1,
+			 const struct oid_walk *walk)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	uint8_t digests[SD_MAX_COPIES][SHA1_DIGEST_SIZE];
+	int nr_copies, nr = 0, best = -1, best_votes = 0, ret;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+
+	nr_copies = get_obj_copy_number(oid, walk->vinfo->nr_zones);
+	oid_to_vnodes(oid, &walk->vinfo->vroot, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++) {
+		if (vnode_is_local(vnodes[i]))
+			continue;
+
+		sd_init_req(&hdr, SD_OP_GET_HASH);
+		hdr.obj.oid = oid;
+		hdr.obj.tgt_epoch = walk->epoch;
+		ret = sheep_exec_req(&vnodes[i]->node->nid, &hdr, NULL);
+		if (ret != SD_RES_SUCCESS)
+			continue;
+
+		memcpy(digests[nr], rsp->hash.digest, SHA1_DIGEST_SIZE);
+		nodes[nr++] = vnodes[i]->node;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		int votes = 0;
+
+		for (int j = 0; j < nr; j++)
+			if (memcmp(digests[i], digests[j],
+				   SHA1_DIGEST_SIZE) == 0)
+				votes++;
+		if (votes > best_votes) {
+			best = i;
+			best_votes = votes;
+		}
+	}
+
+	if (best < 0) {
+		sd_err("no replica of %016"PRIx64" to repair from", oid);
+		return SD_RES_NO_OBJ;
+	}
+
+	if (sha1 && memcmp(sha1, digests[best], SHA1_DIGEST_SIZE) == 0) {
+		sd_info("cached digest of %016"PRIx64" is stale", oid);
+		return sd_store->set_hash(oid, sha1);
+	}
+
+	sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+	hdr.epoch = walk->epoch;
+	memcpy(hdr.forw.addr, nodes[best]->nid.addr, sizeof(hdr.forw.addr));
+	hdr.forw.port = nodes[best]->nid.port;
+	hdr.forw.oid = oid;
+
+	return exec_local_req(&hdr, NULL);
+}
+
+static void scrub_object(uint64_t oid, struct oid_walk *walk)
+{
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	bool computed;
+	int ret;
+
+	/* only replicas can be verified on their own */
+	if (is_erasure_oid(oid))
+		return;
+
+	ret = sd_store->verify(oid, sha1, &computed);
+	switch (ret) {
+	case SD_RES_SUCCESS:
+	case SD_RES_NO_OBJ:
+		break;
+	case SD_RES_EIO:
+		uatomic_inc(&sys->stat.s.nr_corrupted);
+		if (repair_object(oid, computed ? sha1 : NULL, walk) ==
+		    SD_RES_SUCCESS) {
+			sd_info("repaired %016"PRIx64, oid);
+			uatomic_inc(&sys->stat.s.nr_repaired);
+		} else
+			sd_err("failed to repair %016"PRIx64, oid);
+		break;
+	default:
+		sd_err("failed to verify %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+		break;
+	}
+	uatomic_inc(&sys->stat.s.nr_scrubbed);
+}
+
+static bool scrub_prepare(struct oid_walk *walk)
+{
+	if (!sd_store->verify) {
+		sd_err("%s store doesn't support scrubbing", sd_store->name);
+		return false;
+	}
+
+	sys->stat.s.nr_objs = walk->nr_oids;
+	uatomic_set(&sys->stat.s.nr_scrubbed, 0);
+	return true;
+}
+
+static void scrub_finish(struct oid_walk *walk, bool done)
+{
+	if (!done)
+		return;
+	uatomic_inc(&sys->stat.s.nr_passes);
+	sd_info("scrubbing is done");
+}
+
+static struct oid_walker scrubber = {
+	.name = "scrub",
+	.start_delay = SCRUB_START_DELAY,
+	.prepare = scrub_prepare,
+	.object_fn = scrub_object,
+	.finish = scrub_finish,
+};
+
+int scrub_init(void)
+{
+	if (!sys->scrub_iops || sys->gateway_only)
+		return 0;
+
+	sys->scrub_wqueue = create_ordered_work_queue("scrub");
+	if (!sys->scrub_wqueue)
+		return -1;
+
+	scrubber.iops = sys->scrub_iops;
+	scrubber.interval = sys->scrub_interval;
+	scrubber.wqueue = sys->scrub_wqueue;
+	start_oid_walker(&scrubber);
+	sd_info("scrubbing at %"PRIu32" iops per disk every %"PRIu32
+		" seconds", sys->scrub_iops, sys->scrub_interval);
+
+	return 0;
+}
@@ -20,6 +20,8 @@
 #define EPOLL_SIZE 4096
 #define DEFAULT_OBJECT_DIR "/tmp"
 #define LOG_FILE_NAME "sheep.log"
+#define DEFAULT_QOS_DEPTH 256
+#define DEFAULT_QOS_IO_DEPTH 128
 
 LIST_HEAD(cluster_drivers);
 static const char program_name[] = "sheep";
@@ -46,6 +48,14 @@ static const char http_help[] =
 "This tries to enable Swift API and use localhost:7001 to\n"
 "communicate with http server, using 64MB buffer.\n";
 
+static const char metrics_help[] =
+"Available arguments:\n"
+"\thost=: specify the address to listen on (default: all addresses)\n"
+"\tport=: specify the port to listen on (default: 9780)\n"
+"Example:\n\t$ sheep -m port=9100 ...\n"
+"This exports the statistics of the node in the Prometheus text format at\n"
+"http://<node>:9100/metrics\n";
+
 static const char myaddr_help[] =
 "Example:\n\t$ sheep -y 192.168.1.1:7000 ...\n"
 "This tries to tell other nodes through what address they can talk to this\n"
@@ -76,9 +86,61 @@ static const char cache_help[] =
 "\tdir=: path to the location of the cache (default: $STORE/cache)\n"
 "\tdirectio: use directio mode for cache IO, "
 "if not specified use buffered IO\n"
+"\tslab=: keep the objects in the fixed-size slots of a block device or\n"
+"\t       of a file preallocated to the cache size, in directio mode,\n"
+"\t       instead of a file per object in dir\n"
+"\tmem=: size of the memory to keep the hot blocks of the cached objects,\n"
+"\t      in front of the cache on disk (default: 0, disabled)\n"
+"\tbw=: bandwidth per second of the background pushes of the dirty objects\n"
+"\t     (default: 0, unlimited), the flushes of the guests are not limited\n"
+"\tflush=: latency target of a flush of the guest in milliseconds, the\n"
+"\t        dirty objects are pushed in the background before a flush would\n"
+"\t        take longer (default: 1000)\n"
 "\nExample:\n\t$ sheep -w size=200G,dir=/my_ssd,directio ...\n"
 "This tries to use /my_ssd as the cache storage with 200G allocted to the\n"
-"cache in directio mode\n";
+"cache in directio mode\n"
+"\t$ sheep -w size=200G,slab=/dev/nvme0n1p2 ...\n"
+"This tries to use the first 200G of the partition as the cache storage\n"
+"\t$ sheep -w size=200G,dir=/my_ssd,mem=4G ...\n"
+"This also keeps 4G of the hottest blocks of the cache in memory\n"
+"\t$ sheep -w size=200G,bw=100M,flush=500 ...\n"
+"This pushes the dirty objects at 100M/s at most in the background and\n"
+"keeps the flushes of the guests under 500 milliseconds\n";
+
+static const char scrub_help[] =
+"Available arguments:\n"
+"\tiops=: max number of objects verified a second on each disk "
+"(default: 20)\n"
+"\tinterval=: seconds between two scrubbing passes (default: 86400)\n"
+"\nExample:\n\t$ sheep -s iops=50,interval=3600 ...\n"
+"This verifies at most 50 objects a second on each disk and starts the next\n"
+"pass an hour after the previous one finished\n";
+
+static const char dedup_help[] =
+"Available arguments:\n"
+"\tage=: seconds without writes before an object is deduplicated "
+"(default: 3600)\n"
+"\tiops=: max number of objects checked a second on each disk "
+"(default: 20)\n"
+"\tinterval=: seconds between two deduplication passes (default: 86400)\n"
+"\nExample:\n\t$ sheep -e age=86400,interval=3600 ...\n"
+"This shares the objects which were not written for a day with the objects\n"
+"of the same content on their disk, and starts the next pass an hour after\n"
+"the previous one finished\n";
+
+static const char qos_help[] =
+"Available arguments:\n"
+"\tdepth=: max number of gateway requests in flight, 0 for no limit "
+"(default: 256)\n"
+"\tio_depth=: max number of peer I/O requests in flight, 0 for no limit "
+"(default: 128)\n"
+"\nExample:\n\t$ sheep -q depth=64,io_depth=32 ...\n"
+"The gateway requests beyond the depth are queued per VDI and dispatched in\n"
+"turn, the peer requests are queued by priority and the I/O of the guests\n"
+"is dispatched ahead of recovery and background work\n"
+"The IOPS and bandwidth of a VDI can be limited with\n"
+"\t$ dog vdi setattr <vdi> sheepdog.qos.iops <iops>\n"
+"\t$ dog vdi setattr <vdi> sheepdog.qos.bps <bytes per second>\n";
 
 static const char log_help[] =
 "Example:\n\t$ sheep -l dir=/var/log/,level=debug,format=server ...\n"
@@ -117,6 +179,8 @@ static struct sd_option sheep_options[] = {
 	 "specify the cluster driver (default: "DEFAULT_CLUSTER_DRIVER")",
 	 cluster_help},
 	{'D', "directio", false, "use direct IO for backend store"},
+	{'e', "dedup", true, "enable background deduplication of cold objects",
+	 dedup_help},
 	{'f', "foreground", false, "make the program run in foreground"},
 	{'g', "gateway", false, "make the program run as a gateway mode"},
 	{'h', "help", false, "display this help and exit"},
@@ -125,12 +189,17 @@ static struct sd_option sheep_options[] = {
 	{'l', "log", true,
 	 "specify the log level, the log directory and the log format"
 	 "(log level default: 6 [SDOG_INFO])", log_help},
+	{'m', "metrics", true, "enable the metrics endpoint (default: disabled)",
+	 metrics_help},
 	{'n', "nosync", false, "drop O_SYNC for write of backend"},
 	{'p', "port", true, "specify the TCP port on which to listen "
 	 "(default: 7000)"},
 	{'P', "pidfile", true, "create a pid file"},
 	{'r', "http", true, "enable http service. (default: disabled)",
 	 http_help},
+	{'q', "qos", true, "specify the fair queuing of gateway requests",
+	 qos_help},
+	{'s', "scrub", true, "enable background scrubbing", scrub_help},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
 	{'v', "version", false, "show the version"},
 	{'w', "cache", true, "enable object cache", cache_help},
@@ -292,6 +361,47 @@ static int cache_size_parser(const char *s)
 	return 0;
 }
 
+static int cache_mem_parser(const char *s)
+{
+	uint64_t mem_size;
+
+	if (option_parse_size(s, &mem_size) < 0)
+		return -1;
+	if (mem_size / 1024 / 1024 > UINT32_MAX) {
+		sd_err("Invalid cache option '%s': too large memory", s);
+		return -1;
+	}
+
+	sys->object_cache_mem_size = mem_size / 1024 / 1024;
+	return 0;
+}
+
+static int cache_bw_parser(const char *s)
+{
+	uint64_t bw;
+
+	if (option_parse_size(s, &bw) < 0)
+		return -1;
+
+	sys->object_cache_push_bw = bw;
+	return 0;
+}
+
+static int cache_flush_parser(const char *s)
+{
+	char *p;
+	long ms = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || ms < 1 || ms > UINT32_MAX) {
+		sd_err("Invalid cache option '%s': flush latency target must "
+		       "be a positive number of milliseconds", s);
+		return -1;
+	}
+
+	sys->object_cache_flush_ms = ms;
+	return 0;
+}
+
 static int cache_directio_parser(const char *s)
 {
 	sys->object_cache_directio = true;
@@ -306,10 +416,139 @@ static int cache_dir_parser(const char *s)
 	return 0;
 }
 
+static char ocslab[PATH_MAX];
+
+static int cache_slab_parser(const char *s)
+{
+	snprintf(ocslab, sizeof(ocslab), "%s", s);
+	return 0;
+}
+
 static struct option_parser cache_parsers[] = {
 	{ "size=", cache_size_parser },
 	{ "directio", cache_directio_parser },
 	{ "dir=", cache_dir_parser },
+	{ "slab=", cache_slab_parser },
+	{ "mem=", cache_mem_parser },
+	{ "bw=", cache_bw_parser },
+	{ "flush=", cache_flush_parser },
+	{ NULL, NULL },
+};
+
+static int scrub_iops_parser(const char *s)
+{
+	char *p;
+	long iops = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || iops < 1 || iops > UINT32_MAX) {
+		sd_err("Invalid scrub iops '%s'", s);
+		return -1;
+	}
+
+	sys->scrub_iops = iops;
+	return 0;
+}
+
+static int scrub_interval_parser(const char *s)
+{
+	char *p;
+	long interval = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || interval < 0 || interval > UINT32_MAX) {
+		sd_err("Invalid scrub interval '%s'", s);
+		return -1;
+	}
+
+	sys->scrub_interval = interval;
+	return 0;
+}
+
+static struct option_parser scrub_parsers[] = {
+	{ "iops=", scrub_iops_parser },
+	{ "interval=", scrub_interval_parser },
+	{ NULL, NULL },
+};
+
+static int dedup_age_parser(const char *s)
+{
+	char *p;
+	long age = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || age < 1 || age > UINT32_MAX) {
+		sd_err("Invalid dedup age '%s'", s);
+		return -1;
+	}
+
+	sys->dedup_age = age;
+	return 0;
+}
+
+static int dedup_iops_parser(const char *s)
+{
+	char *p;
+	long iops = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || iops < 1 || iops > UINT32_MAX) {
+		sd_err("Invalid dedup iops '%s'", s);
+		return -1;
+	}
+
+	sys->dedup_iops = iops;
+	return 0;
+}
+
+static int dedup_interval_parser(const char *s)
+{
+	char *p;
+	long interval = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || interval < 0 || interval > UINT32_MAX) {
+		sd_err("Invalid dedup interval '%s'", s);
+		return -1;
+	}
+
+	sys->dedup_interval = interval;
+	return 0;
+}
+
+static struct option_parser dedup_parsers[] = {
+	{ "age=", dedup_age_parser },
+	{ "iops=", dedup_iops_parser },
+	{ "interval=", dedup_interval_parser },
+	{ NULL, NULL },
+};
+
+static int qos_depth_parser(const char *s)
+{
+	char *p;
+	long depth = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || depth < 0 || depth > UINT32_MAX) {
+		sd_err("Invalid qos depth '%s'", s);
+		return -1;
+	}
+
+	sys->qos_depth = depth;
+	return 0;
+}
+
+static int qos_io_depth_parser(const char *s)
+{
+	char *p;
+	long depth = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || depth < 0 || depth > UINT32_MAX) {
+		sd_err("Invalid qos io depth '%s'", s);
+		return -1;
+	}
+
+	sys->qos_io_depth = depth;
+	return 0;
+}
+
+static struct option_parser qos_parsers[] = {
+	{ "depth=", qos_depth_parser },
+	{ "io_depth=", qos_io_depth_parser },
 	{ NULL, NULL },
 };
 
@@ -410,14 +649,17 @@ static int create_work_queues(void)
 	sys->io_wqueue = create_work_queue("io", WQ_UNLIMITED);
 	sys->recovery_wqueue = create_work_queue("rw", WQ_UNLIMITED);
 	sys->deletion_wqueue = create_work_queue("delete", WQ_DYNAMIC);
-	sys->block_wqueue = create_ordered_work_queue("block");
+	sys->block_wqueue = create_work_queue("block", WQ_UNLIMITED);
 	sys->md_wqueue = create_ordered_work_queue("md");
 	sys->areq_wqueue = create_work_queue("async_req", WQ_UNLIMITED);
 	if (sys->enable_object_cache) {
 		sys->oc_reclaim_wqueue =
 			create_ordered_work_queue("oc_reclaim");
 		sys->oc_push_wqueue = create_work_queue("oc_push", WQ_DYNAMIC);
-		if (!sys->oc_reclaim_wqueue || !sys->oc_push_wqueue)
+		sys->oc_bg_push_wqueue = create_work_queue("oc_bg_push",
+							   WQ_DYNAMIC);
+		if (!sys->oc_reclaim_wqueue || !sys->oc_push_wqueue ||
+		    !sys->oc_bg_push_wqueue)
 			return -1;
 	}
 	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
@@ -590,7 +832,7 @@ int main(int argc, char **argv)
 	int64_t zone = -1;
 	struct cluster_driver *cdrv;
 	struct option *long_options;
-	const char *http_options = NULL;
+	const char *http_options = NULL, *metrics_options = NULL;
 	static struct logger_user_info sheep_info;
 	struct stat logdir_st;
 	enum log_dst_type log_dst_type;
@@ -601,6 +843,9 @@ int main(int argc, char **argv)
 
 	install_sighandler(SIGHUP, sighup_handler, false);
 
+	sys->qos_depth = DEFAULT_QOS_DEPTH;
+	sys->qos_io_depth = DEFAULT_QOS_IO_DEPTH;
+
 	long_options = build_long_options(sheep_options);
 	short_options = build_short_options(sheep_options);
 	while ((ch = getopt_long(argc, argv, short_options, long_options,
@@ -620,6 +865,9 @@ int main(int argc, char **argv)
 		case 'r':
 			http_options = optarg;
 			break;
+		case 'm':
+			metrics_options = optarg;
+			break;
 		case 'l':
 			if (option_parse(optarg, ",", log_parsers) < 0)
 				exit(1);
@@ -655,6 +903,25 @@ int main(int argc, char **argv)
 			}
 			sys->this_node.zone = zone;
 			break;
+		case 's':
+			sys->scrub_iops = 20;
+			sys->scrub_interval = 86400;
+
+			if (option_parse(optarg, ",", scrub_parsers) < 0)
+				exit(1);
+			break;
+		case 'e':
+			sys->dedup_age = 3600;
+			sys->dedup_iops = 20;
+			sys->dedup_interval = 86400;
+
+			if (option_parse(optarg, ",", dedup_parsers) < 0)
+				exit(1);
+			break;
+		case 'q':
+			if (option_parse(optarg, ",", qos_parsers) < 0)
+				exit(1);
+			break;
 		case 'u':
 			sys->upgrade = true;
 			break;
@@ -817,6 +1084,10 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_log;
 
+	ret = init_epoch_log();
+	if (ret)
+		goto cleanup_log;
+
 	ret = create_listen_port(bindaddr, port);
 	if (ret)
 		goto cleanup_log;
@@ -865,10 +1136,6 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_cluster;
 
-	ret = sockfd_init();
-	if (ret)
-		goto cleanup_cluster;
-
 	ret = init_store_driver(sys->gateway_only);
 	if (ret)
 		goto cleanup_cluster;
@@ -877,11 +1144,28 @@ int main(int argc, char **argv)
 		if (!strlen(ocpath))
 			/* use object cache internally */
 			memcpy(ocpath, dir, strlen(dir));
-		ret = object_cache_init(ocpath);
+		ret = object_cache_init(ocpath,
+					strlen(ocslab) ? ocslab : NULL);
 		if (ret)
 			goto cleanup_cluster;
 	}
 
+	ret = scrub_init();
+	if (ret)
+		goto cleanup_cluster;
+
+	ret = dedup_init();
+	if (ret)
+		goto cleanup_cluster;
+
+	ret = qos_init();
+	if (ret)
+		goto cleanup_cluster;
+
+	ret = hotspot_init();
+	if (ret)
+		goto cleanup_cluster;
+
 	ret = trace_init();
 	if (ret)
 		goto cleanup_cluster;
@@ -897,6 +1181,9 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_cluster;
 
+	if (metrics_options && metrics_init(metrics_options) != 0)
+		goto cleanup_cluster;
+
 	if (pid_file && (create_pidfile(pid_file) != 0)) {
 		sd_err("failed to pid file '%s' - %m", pid_file);
 		goto cleanup_cluster;
@@ -916,6 +1203,7 @@ int main(int argc, char **argv)
 		event_loop(-1);
 
 	rc = 0;
+	objlist_cache_save();
 	sd_info("shutdown");
 
 cleanup_pid_file:
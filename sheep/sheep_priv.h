@@ -120,6 +120,10 @@ struct request {
 	struct work work;
 	enum REQUST_STATUS status;
 	bool stat; /* true if this request is during stat */
+
+	struct list_node qos_list; /* on the queue of its VDI in qos.c */
+	struct qos_class *qos; /* set while the request is held by qos.c */
+	uint64_t qos_start; /* when the gateway received the request */
 };
 
 struct system_info {
@@ -153,6 +157,7 @@ struct system_info {
 	struct work_queue *block_wqueue;
 	struct work_queue *oc_reclaim_wqueue;
 	struct work_queue *oc_push_wqueue;
+	struct work_queue *oc_bg_push_wqueue;
 	struct work_queue *md_wqueue;
 	struct work_queue *areq_wqueue;
 #ifdef HAVE_HTTP
@@ -162,8 +167,22 @@ struct system_info {
 
 	uint32_t object_cache_size;
 	bool object_cache_directio;
+	uint32_t object_cache_mem_size; /* in M, 0 without the memory tier */
+	uint64_t object_cache_push_bw; /* bytes/s of the background pushes */
+	uint32_t object_cache_flush_ms; /* latency target of a guest flush */
 
 	bool backend_dio;
+	/* objects verified a second per disk by the scrubber, 0 to disable */
+	uint32_t scrub_iops;
+	uint32_t scrub_interval; /* seconds between two scrubbing passes */
+	struct work_queue *scrub_wqueue;
+	/* seconds without writes before an object is deduplicated, 0 to disable */
+	uint32_t dedup_age;
+	uint32_t dedup_iops; /* objects checked a second per disk */
+	uint32_t dedup_interval; /* seconds between two deduplication passes */
+	struct work_queue *dedup_wqueue;
+	uint32_t qos_depth; /* max gateway requests in flight, 0 for no limit */
+	uint32_t qos_io_depth; /* max peer I/O requests in flight */
 	/* upgrade data layout before starting service if necessary*/
 	bool upgrade;
 	struct sd_stat stat;
@@ -193,6 +212,12 @@ extern struct md md;
 
 void update_node_disks(void);
 
+/* An inclusive range of the vnode hash ring */
+struct vnode_range {
+	uint64_t start;
+	uint64_t end;
+};
+
 struct siocb {
 	uint32_t epoch;
 	void *buf;
@@ -214,6 +239,8 @@ struct vdi_iocb {
 	uint8_t copy_policy;
 	uint8_t store_policy;
 	uint8_t nr_copies;
+	uint8_t compression;
+	uint8_t block_size_shift;
 	uint64_t time;
 };
 
@@ -233,17 +260,36 @@ struct store_driver {
 	bool (*exist)(uint64_t oid, uint8_t ec_index);
 	/* create_and_write must be an atomic operation*/
 	int (*create_and_write)(uint64_t oid, const struct siocb *);
+	/*
+	 * Create oid from the local object src_oid and write to it, return
+	 * SD_RES_NO_OBJ or SD_RES_NO_SUPPORT if it can't be done locally
+	 */
+	int (*clone)(uint64_t oid, uint64_t src_oid, const struct siocb *);
 	int (*write)(uint64_t oid, const struct siocb *);
 	int (*read)(uint64_t oid, const struct siocb *);
+	/*
+	 * Deallocate the range of the object, which then reads as zeros.
+	 * 'empty' is set if the object holds no data afterwards.
+	 */
+	int (*punch)(uint64_t oid, const struct siocb *, bool *empty);
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid, uint8_t ec_index);
 	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	/* Operations for scrubbing */
+	int (*verify)(uint64_t oid, uint8_t *sha1, bool *computed);
+	int (*set_hash)(uint64_t oid, const uint8_t *sha1);
 	/* Operations in recovery */
 	int (*link)(uint64_t oid, uint32_t tgt_epoch);
 	int (*update_epoch)(uint32_t epoch);
 	int (*purge_obj)(void);
 	/* Operations for snapshot */
 	int (*cleanup)(void);
+	/* Operations for deduplication */
+	int (*dedup)(uint64_t oid, time_t cold, uint64_t *saved);
+	int (*purge_dedup)(void);
+	/* logical and stored size of the compressed objects on the disk */
+	int (*compressed_size)(const char *path, uint64_t *size,
+			       uint64_t *used);
 };
 
 /* backend store */
@@ -252,15 +298,36 @@ int peer_read_obj(struct request *req);
 int default_init(void);
 bool default_exist(uint64_t oid, uint8_t ec_index);
 int default_create_and_write(uint64_t oid, const struct siocb *iocb);
+int default_clone(uint64_t oid, uint64_t src_oid, const struct siocb *iocb);
 int default_write(uint64_t oid, const struct siocb *iocb);
 int default_read(uint64_t oid, const struct siocb *iocb);
+int default_punch(uint64_t oid, const struct siocb *iocb, bool *empty);
 int default_link(uint64_t oid, uint32_t tgt_epoch);
 int default_update_epoch(uint32_t epoch);
 int default_cleanup(void);
 int default_format(void);
 int default_remove_object(uint64_t oid, uint8_t ec_index);
 int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int default_verify(uint64_t oid, uint8_t *sha1, bool *computed);
+int default_set_hash(uint64_t oid, const uint8_t *sha1);
 int default_purge_obj(void);
+int default_dedup(uint64_t oid, time_t cold, uint64_t *saved);
+int default_purge_dedup(void);
+int default_compressed_size(const char *path, uint64_t *size,
+			    uint64_t *used);
+
+/*
+ * The compression algorithm of a compressed object is kept in this xattr,
+ * which must go along with the object wherever the object is moved.
+ */
+#define COMPRESSNAME "user.obj.compress"
+
+bool compression_supported(uint8_t algo);
+int cobj_create(int fd, uint64_t oid, uint8_t algo, const struct siocb *iocb);
+int cobj_read(int fd, uint64_t oid, const struct siocb *iocb);
+int cobj_write(int fd, uint64_t oid, const struct siocb *iocb, bool *compact);
+int cobj_compact(int fd, int new_fd, uint64_t oid);
+bool cobj_empty(int fd, uint64_t oid);
 
 int tree_init(void);
 bool tree_exist(uint64_t oid, uint8_t ec_index);
@@ -278,6 +345,10 @@ int tree_purge_obj(void);
 int for_each_object_in_wd(int (*func)(uint64_t, const char *, uint32_t,
 				      uint8_t, struct vnode_info *, void *),
 			  bool, void *);
+int for_each_object_in_wd_vinfo(int (*func)(uint64_t, const char *, uint32_t,
+					    uint8_t, struct vnode_info *,
+					    void *),
+				bool, struct vnode_info *, void *);
 int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 uint32_t epoch, uint8_t,
 					 struct vnode_info *, void *arg),
@@ -342,6 +413,13 @@ int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid);
 int vdi_delete(uint32_t vid, bool);
 int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info);
 void vdi_mark_snapshot(uint32_t vid);
+void vdi_set_compression(uint32_t vid, uint8_t compression);
+uint8_t get_vdi_compression(uint32_t vid);
+void vdi_set_block_size_shift(uint32_t vid, uint8_t block_size_shift);
+uint8_t get_vdi_block_size_shift(uint32_t vid);
+size_t get_vdi_objsize(uint64_t oid);
+int get_vdi_state_list(struct sd_vdi_state *vs, size_t max);
+void apply_vdi_state_list(const struct sd_vdi_state *vs, int nr);
 void vdi_delete_state(uint32_t vid);
 void clean_vdi_state(void);
 int sd_delete_vdi(const char *name);
@@ -365,10 +443,14 @@ struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info);
 struct vnode_info *get_vnode_info(void);
 void put_vnode_info(struct vnode_info *vinfo);
 struct vnode_info *alloc_vnode_info(const struct rb_root *);
+struct vnode_info *alloc_vnode_info_from(const struct vnode_info *prev,
+					 const struct rb_root *nroot);
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo);
 int get_nodes_epoch(uint32_t epoch, struct vnode_info *cur_vinfo,
 		    struct sd_node *nodes, int len);
+int get_changed_vnode_ranges(struct vnode_info *old, struct vnode_info *cur,
+			     int nr_copies, struct vnode_range **ranges);
 
 void wait_get_vdi_bitmap_done(void);
 
@@ -388,7 +470,7 @@ int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create);
 int err_to_sderr(const char *path, uint64_t oid, int err);
 
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes,
-		      size_t nr_nodes, time_t timestamp, bool force_create);
+		      size_t nr_nodes, time_t timestamp);
 int inc_and_log_epoch(void);
 
 extern char *config_path;
@@ -410,6 +492,9 @@ int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes,
 				int len, int *nr_nodes, time_t *timestamp,
 				struct vnode_info *vinfo);
 uint32_t get_latest_epoch(void);
+int init_epoch_log(void);
+int epoch_log_reset(void);
+void compact_epoch_log(uint32_t epoch);
 void init_config_path(const char *base_path);
 int init_config_file(void);
 int get_obj_list(const struct sd_req *, struct sd_rsp *, void *);
@@ -427,10 +512,12 @@ int sd_write_object(uint64_t oid, char *data, unsigned int datalen,
 		    uint64_t offset, bool create);
 int sd_read_object(uint64_t oid, char *data, unsigned int datalen,
 		   uint64_t offset);
-int sd_remove_object(uint64_t oid);
+int sd_remove_object(uint64_t oid, bool background);
 int sd_discard_object(uint64_t oid);
+int sd_punch_object(uint64_t oid, uint32_t offset, uint32_t length,
+		    bool *empty);
 int sd_unref_object(uint64_t data_oid, uint32_t generation,
-			 uint32_t refcnt);
+			 uint32_t refcnt, bool background);
 
 struct request_iocb *local_req_init(void);
 int exec_local_req(struct sd_req *rq, void *data);
@@ -441,6 +528,14 @@ void local_request_init(void);
 
 int objlist_cache_insert(uint64_t oid);
 void objlist_cache_remove(uint64_t oid);
+uint64_t objlist_cache_seq(void);
+void objlist_cache_begin_insert(void);
+void objlist_cache_end_insert(void);
+void init_objlist_path(const char *base_path);
+bool objlist_cache_load(void);
+void objlist_cache_save(void);
+uint64_t *objlist_cache_collect(const struct vnode_range *ranges,
+				int nr_ranges, uint64_t seq, int *nr_oids);
 void objlist_migrate_cache_retire(void);
 
 void put_request(struct request *req);
@@ -488,9 +583,12 @@ int gateway_read_object(struct request *req);
 int gateway_write_object(struct request *req);
 int gateway_create_object(struct request *req);
 int gateway_remove_object(struct request *req);
+int gateway_punch_object(struct request *req);
+int gateway_write_batch(struct request *req);
 int gateway_unref_object(struct request *req);
 
 bool is_erasure_oid(uint64_t oid);
+bool write_batch_valid(const struct sd_req *hdr, const void *data);
 uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid);
 
 /*
@@ -521,16 +619,125 @@ int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 int object_cache_flush_vdi(uint32_t vid);
 int object_cache_flush_and_del(const struct request *req);
 void object_cache_delete(uint32_t vid);
-int object_cache_init(const char *p);
+int object_cache_init(const char *p, const char *slab);
 int object_cache_remove(uint64_t oid);
 int object_cache_get_info(struct object_cache_info *info);
 
+/* cache_slab.c */
+
+#define SLAB_SLOT_SIZE (UINT64_C(1) << SD_MIN_BLOCK_SIZE_SHIFT)
+
+uint64_t slab_init(const char *path, uint64_t size,
+		   void (*fn)(uint32_t vid, uint64_t idx, uint32_t *slot,
+			      int nr));
+uint32_t *slab_alloc(int nr);
+int slab_sync(void);
+int slab_commit(const uint32_t *slot, int nr, uint32_t vid, uint64_t idx);
+void slab_free(const uint32_t *slot, int nr);
+int slab_read(const uint32_t *slot, void *buf, size_t count, off_t offset);
+int slab_write(const uint32_t *slot, const void *buf, size_t count,
+	       off_t offset);
+int slab_zero(const uint32_t *slot, int nr);
+
+/* cache_mem.c */
+
+#define MEM_CACHE_BLOCK_SIZE (64 * 1024)
+
+void mem_cache_init(uint64_t size);
+bool mem_cache_read(uint32_t vid, uint64_t idx, void *buf, size_t count,
+		    off_t offset);
+void mem_cache_fill(uint32_t vid, uint64_t idx, const void *buf, size_t count,
+		    off_t offset, size_t size);
+void mem_cache_write(uint32_t vid, uint64_t idx, const void *buf, size_t count,
+		     off_t offset);
+void mem_cache_drop(uint32_t vid, uint64_t idx, size_t size);
+void mem_cache_get_info(struct object_cache_info *info);
+
+/* cache_journal.c */
+
+void cache_journal_init(const char *path);
+uint64_t cache_journal_replay(uint32_t vid, uint64_t idx, bool *create);
+int cache_journal_replayed(void);
+void cache_journal_log(uint32_t vid, uint64_t idx, uint64_t bmap, bool create);
+
+/* walk.c */
+struct oid_walk;
+
+struct oid_walker {
+	const char *name;	/* of the passes, for the logs */
+	uint32_t iops;		/* objects handled a second per disk at most */
+	uint32_t start_delay;	/* seconds before the first pass */
+	uint32_t interval;	/* seconds between two passes */
+	struct work_queue *wqueue;
+
+	/* called in the main thread before a pass, false to stop walking */
+	bool (*prepare)(struct oid_walk *walk);
+	/* called by the thread of the disk the object is stored on */
+	void (*object_fn)(uint64_t oid, struct oid_walk *walk);
+	/* called after a pass, 'done' is false if it was interrupted */
+	void (*finish)(struct oid_walk *walk, bool done);
+
+	struct timer timer;
+};
+
+struct oid_walk {
+	struct oid_walker *walker;
+	uint32_t epoch;
+	struct vnode_info *vinfo;
+	uint64_t *oids;
+	int nr_oids;
+
+	struct work work;
+};
+
+void start_oid_walker(struct oid_walker *walker);
+bool oid_walk_should_stop(const struct oid_walk *walk);
+
+/* scrub.c */
+int scrub_init(void);
+
+/* dedup.c */
+int dedup_init(void);
+
+/* qos.c */
+enum io_prio {
+	IO_PRIO_FOREGROUND,	/* I/O of the guests */
+	IO_PRIO_RECOVERY,
+	IO_PRIO_BACKGROUND,	/* object cache push, VDI deletion */
+	NR_IO_PRIOS,
+};
+
+static inline enum io_prio req_io_prio(const struct sd_req *hdr)
+{
+	if (hdr->flags & SD_FLAG_CMD_RECOVERY)
+		return IO_PRIO_RECOVERY;
+	if (hdr->flags & SD_FLAG_CMD_BACKGROUND)
+		return IO_PRIO_BACKGROUND;
+	return IO_PRIO_FOREGROUND;
+}
+
+void qos_queue_gateway_request(struct request *req);
+void qos_queue_peer_request(struct request *req);
+void qos_request_done(struct request *req);
+void qos_set_thread_prio(enum io_prio prio);
+void qos_account_request(struct request *req);
+void qos_update_limit(const struct sheepdog_vdi_attr *vattr, bool delete);
+void qos_delete_vdi(uint32_t vid);
+int qos_get_stats(struct sd_vdi_stat *stats, int nr_max);
+int qos_init(void);
+
+/* hotspot.c */
+void hotspot_account(uint64_t oid, uint32_t len);
+int hotspot_get(struct sd_hot_obj *objs, int nr_max);
+int hotspot_init(void);
+
+/* metrics.c */
+int metrics_init(const char *options);
+void metrics_delete_vdi(uint32_t vid);
+
 /* store layout migration */
 int sd_migrate_store(int from, int to);
 
-struct sockfd *sheep_get_sockfd(const struct node_id *);
-void sheep_put_sockfd(const struct node_id *, struct sockfd *);
-void sheep_del_sockfd(const struct node_id *, struct sockfd *);
 int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data);
 bool sheep_need_retry(uint32_t epoch);
 
@@ -546,6 +753,8 @@ int md_plug_disks(char *disks);
 int md_unplug_disks(char *disks);
 uint64_t md_get_size(uint64_t *used);
 uint32_t md_nr_disks(void);
+void md_for_each_oid(const uint64_t *oids, int nr,
+		     void (*func)(int i, void *arg), void *arg);
 
 static inline bool is_stale_path(const char *path)
 {
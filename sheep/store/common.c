@@ -81,143 +81,6 @@ int err_to_sderr(const char *path, uint64_t oid, int err)
 	}
 }
 
-int update_epoch_log(uint32_t epoch, struct sd_node *nodes,
-		      size_t nr_nodes, time_t timestamp, bool force_create)
-{
-	int ret, len, nodes_len;
-	time_t t;
-	char path[PATH_MAX], *buf;
-
-	sd_debug("update epoch: %d, %zu", epoch, nr_nodes);
-
-	/* Piggyback the epoch creation time for 'dog cluster info' */
-    if (!timestamp)
-        time(&t);
-    else
-        t = timestamp;
-	nodes_len = nr_nodes * sizeof(struct sd_node);
-	len = nodes_len + sizeof(time_t);
-	buf = xmalloc(len);
-	memcpy(buf, nodes, nodes_len);
-	memcpy(buf + nodes_len, &t, sizeof(time_t));
-
-	/*
-	 * rb field is unused in epoch file, zero-filling it
-	 * is good for epoch file recovery because it is unified
-	 */
-	for (int i = 0; i < nr_nodes; i++)
-		memset(buf + i * sizeof(struct sd_node)
-				+ offsetof(struct sd_node, rb),
-				0, sizeof(struct rb_node));
-
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-
-	ret = atomic_create_and_write(path, buf, len, force_create);
-
-	free(buf);
-	return ret;
-}
-
-static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
-			     int *nr_nodes, time_t *timestamp)
-{
-	int fd, ret, buf_len;
-	char path[PATH_MAX];
-	struct stat epoch_stat;
-
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		sd_debug("failed to open epoch %"PRIu32" log, %m", epoch);
-		goto err;
-	}
-
-	memset(&epoch_stat, 0, sizeof(epoch_stat));
-	ret = fstat(fd, &epoch_stat);
-	if (ret < 0) {
-		sd_err("failed to stat epoch %"PRIu32" log, %m", epoch);
-		goto err;
-	}
-
-	buf_len = epoch_stat.st_size - sizeof(*timestamp);
-	if (buf_len < 0) {
-		sd_err("invalid epoch %"PRIu32" log", epoch);
-		goto err;
-	}
-	if (len < buf_len) {
-		close(fd);
-		return SD_RES_BUFFER_SMALL;
-	}
-
-	ret = xread(fd, nodes, buf_len);
-	if (ret < 0) {
-		sd_err("failed to read epoch %"PRIu32" log, %m", epoch);
-		goto err;
-	}
-
-	/* Broken epoch, just ignore */
-	if (ret % sizeof(struct sd_node) != 0) {
-		sd_err("invalid epoch %"PRIu32" log", epoch);
-		goto err;
-	}
-
-	*nr_nodes = ret / sizeof(struct sd_node);
-
-	if (timestamp) {
-		ret = xread(fd, timestamp, sizeof(*timestamp));
-		if (ret != sizeof(*timestamp)) {
-			sd_err("invalid epoch %"PRIu32" log", epoch);
-			goto err;
-		}
-	}
-
-	close(fd);
-	return SD_RES_SUCCESS;
-err:
-	if (fd >= 0)
-		close(fd);
-	return SD_RES_NO_TAG;
-}
-
-int epoch_log_read(uint32_t epoch, struct sd_node *nodes,
-				int len, int *nr_nodes)
-{
-	return do_epoch_log_read(epoch, nodes, len, nr_nodes, NULL);
-}
-
-int epoch_log_read_with_timestamp(uint32_t epoch, struct sd_node *nodes,
-				int len, int *nr_nodes, time_t *timestamp)
-{
-	return do_epoch_log_read(epoch, nodes, len, nr_nodes, timestamp);
-}
-
-uint32_t get_latest_epoch(void)
-{
-	DIR *dir;
-	struct dirent *d;
-	uint32_t e, epoch = 0;
-	char *p;
-
-	dir = opendir(epoch_path);
-	if (!dir)
-		panic("failed to get the latest epoch: %m");
-
-	while ((d = readdir(dir))) {
-		e = strtol(d->d_name, &p, 10);
-		if (d->d_name == p)
-			continue;
-
-		if (strlen(d->d_name) != 8)
-			continue;
-
-		if (e > epoch)
-			epoch = e;
-	}
-	closedir(dir);
-
-	return epoch;
-}
-
 int lock_base_dir(const char *d)
 {
 #define LOCK_PATH "/lock"
@@ -430,6 +293,7 @@ int init_global_pathnames(const char *d, char *argp)
 		return ret;
 
 	init_config_path(d);
+	init_objlist_path(d);
 
 	return 0;
 }
@@ -509,7 +373,7 @@ forward_read:
 	return read_backend_object(oid, data, datalen, offset);
 }
 
-int sd_remove_object(uint64_t oid)
+int sd_remove_object(uint64_t oid, bool background)
 {
 	struct sd_req hdr;
 	int ret;
@@ -522,6 +386,8 @@ int sd_remove_object(uint64_t oid)
 
 	sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
 	hdr.obj.oid = oid;
+	if (background)
+		hdr.flags = SD_FLAG_CMD_BACKGROUND;
 
 	ret = exec_local_req(&hdr, NULL);
 	if (ret != SD_RES_SUCCESS)
@@ -547,6 +413,40 @@ int sd_discard_object(uint64_t oid)
 	return ret;
 }
 
+/* Punch the range of all the replicas of the object */
+int sd_punch_object(uint64_t oid, uint32_t offset, uint32_t length,
+		    bool *empty)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	/* the cache may have dirty data in the rest of the object */
+	if (sys->enable_object_cache && object_is_cached(oid)) {
+		ret = object_cache_flush_vdi(oid_to_vid(oid));
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		ret = object_cache_remove(oid);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	sd_init_req(&hdr, SD_OP_PUNCH_OBJ);
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+	hdr.obj.length = length;
+
+	ret = exec_local_req(&hdr, NULL);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to punch object %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		return ret;
+	}
+
+	*empty = rsp->obj.empty;
+	return SD_RES_SUCCESS;
+}
+
 
 /*
  * Cow object: shared by more than one vdi. None-cow object is not shared by
@@ -560,7 +460,8 @@ int sd_discard_object(uint64_t oid)
  * the object along with its ledger object, which bookkeeps the references of
  * this object.
  */
-int sd_unref_object(uint64_t data_oid, uint32_t generation, uint32_t refcnt)
+int sd_unref_object(uint64_t data_oid, uint32_t generation, uint32_t refcnt,
+		    bool background)
 {
 	struct sd_req hdr;
 	int ret;
@@ -570,9 +471,11 @@ int sd_unref_object(uint64_t data_oid, uint32_t generation, uint32_t refcnt)
 
 	/* No ledger created, so just remove data object */
 	if (generation == 0 && refcnt == 0)
-		return sd_remove_object(data_oid);
+		return sd_remove_object(data_oid, background);
 
 	sd_init_req(&hdr, SD_OP_UNREF_OBJ);
+	if (background)
+		hdr.flags = SD_FLAG_CMD_BACKGROUND;
 	hdr.ref.oid = data_oid;
 	hdr.ref.generation = generation;
 	hdr.ref.count = refcnt;
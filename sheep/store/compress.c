@@ -0,0 +1,485 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compressed objects
+ *
+ * The data objects of a VDI with compression are split into COBJ_BLOCK_SIZE
+ * blocks which are compressed separately, so a read only decompresses the
+ * blocks it covers.  The file starts with a header and the map of the blocks,
+ * and the blocks follow in the order they were written:
+ *
+ *   | header | map[0] ... map[n - 1] |   | block | block | ... |
+ *   0                                    cobj_data_start()
+ *
+ * A block which doesn't shrink is stored as is, and a block of zeros is not
+ * stored at all.  A write appends the new version of the blocks it changes to
+ * the file and only points the map at them once they are on the disk, so a
+ * power loss leaves either the old or the new blocks mapped.  The space taken by the old
+ * versions is counted in the header and reclaimed by cobj_compact().
+ */
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define COBJ_MAGIC		0x636f626a /* "cobj" */
+#define COBJ_BLOCK_SHIFT	16
+#define COBJ_BLOCK_SIZE		(1U << COBJ_BLOCK_SHIFT)
+/* zstd levels above 3 cost much more CPU for little gain on disk images */
+#define ZSTD_LEVEL		1
+
+struct cobj_header {
+	uint32_t magic;
+	uint8_t algo;
+	uint8_t block_shift;
+	uint16_t __pad;
+	uint32_t nr_blocks;
+	/* bytes taken by the old versions of the blocks */
+	uint32_t garbage;
+};
+
+struct cobj_block {
+	uint32_t offset;	/* zero for a block of zeros */
+	uint32_t len;		/* the block length if not compressed */
+	uint32_t crc;		/* CRC32C of the stored data */
+};
+
+struct cobj_map {
+	struct cobj_header hdr;
+	struct cobj_block blocks[];
+};
+
+struct compressor {
+	const char *name;
+	/* return the compressed length, or 0 if it is larger than 'size' */
+	size_t (*compress)(const void *src, size_t len, void *dst, size_t size);
+	/* return 0 if 'src' is decompressed into exactly 'len' bytes */
+	int (*decompress)(const void *src, size_t size, void *dst, size_t len);
+};
+
+#ifdef HAVE_LZ4
+static size_t lz4_compress(const void *src, size_t len, void *dst,
+			   size_t size)
+{
+	int ret = LZ4_compress_default(src, dst, len, size);
+
+	return ret > 0 ? ret : 0;
+}
+
+static int lz4_decompress(const void *src, size_t size, void *dst,
+			  size_t len)
+{
+	return LZ4_decompress_safe(src, dst, size, len) == len ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t zstd_compress(const void *src, size_t len, void *dst,
+			    size_t size)
+{
+	size_t ret = ZSTD_compress(dst, size, src, len, ZSTD_LEVEL);
+
+	return ZSTD_isError(ret) ? 0 : ret;
+}
+
+static int zstd_decompress(const void *src, size_t size, void *dst,
+			   size_t len)
+{
+	return ZSTD_decompress(dst, len, src, size) == len ? 0 : -1;
+}
+#endif
+
+static const struct compressor compressors[] = {
+#ifdef HAVE_LZ4
+	[SD_COMPRESS_LZ4] = { "lz4", lz4_compress, lz4_decompress },
+#endif
+#ifdef HAVE_ZSTD
+	[SD_COMPRESS_ZSTD] = { "zstd", zstd_compress, zstd_decompress },
+#endif
+	[SD_COMPRESS_NONE] = { NULL },
+};
+
+bool compression_supported(uint8_t algo)
+{
+	return algo < ARRAY_SIZE(compressors) && compressors[algo].name;
+}
+
+static inline size_t cobj_map_size(uint64_t oid)
+{
+	return sizeof(struct cobj_header) + sizeof(struct cobj_block) *
+		DIV_ROUND_UP(get_store_objsize(oid), COBJ_BLOCK_SIZE);
+}
+
+static inline off_t cobj_data_start(uint64_t oid)
+{
+	return round_up(cobj_map_size(oid), BLOCK_SIZE);
+}
+
+static inline uint32_t cobj_block_len(uint64_t oid, uint32_t blk)
+{
+	return min((uint64_t)COBJ_BLOCK_SIZE, get_store_objsize(oid) -
+		   ((uint64_t)blk << COBJ_BLOCK_SHIFT));
+}
+
+static bool is_zero_block(const char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+static struct cobj_map *read_map(int fd, uint64_t oid)
+{
+	size_t size = cobj_map_size(oid);
+	struct cobj_map *map = xmalloc(size);
+	uint32_t nr_blocks = DIV_ROUND_UP(get_store_objsize(oid),
+					  COBJ_BLOCK_SIZE);
+
+	if (xpread(fd, map, size, 0) != size)
+		goto err;
+
+	if (map->hdr.magic != COBJ_MAGIC ||
+	    map->hdr.block_shift != COBJ_BLOCK_SHIFT ||
+	    map->hdr.nr_blocks != nr_blocks ||
+	    !compression_supported(map->hdr.algo)) {
+		sd_err("invalid compressed object %016"PRIx64, oid);
+		errno = EINVAL;
+		goto err;
+	}
+
+	return map;
+err:
+	free(map);
+	return NULL;
+}
+
+/*
+ * Read the stored data of the blocks map->blocks[first..last] into 'buf' with
+ * one read for each run of blocks which are adjacent in the file.
+ */
+static int read_stored_blocks(int fd, const struct cobj_map *map,
+			      uint32_t first, uint32_t last, char *buf)
+{
+	const struct cobj_block *b = map->blocks;
+	uint32_t i = first, j;
+	size_t len;
+
+	while (i <= last) {
+		if (!b[i].offset) {
+			i++;
+			continue;
+		}
+
+		len = b[i].len;
+		for (j = i + 1; j <= last && b[j].offset == b[i].offset + len;
+		     j++)
+			len += b[j].len;
+		if (xpread(fd, buf, len, b[i].offset) != len)
+			return -1;
+		buf += len;
+		i = j;
+	}
+
+	return 0;
+}
+
+/*
+ * Restore the block 'blk' whose stored data is in 'src' into 'dst'.  Return
+ * SD_RES_EIO if the stored data is corrupted.
+ */
+static int restore_block(uint64_t oid, const struct cobj_map *map,
+			 uint32_t blk, const char *src, char *dst)
+{
+	const struct compressor *c = compressors + map->hdr.algo;
+	const struct cobj_block *b = map->blocks + blk;
+	uint32_t len = cobj_block_len(oid, blk);
+
+	if (!b->offset) {
+		memset(dst, 0, len);
+		return SD_RES_SUCCESS;
+	}
+
+	if (crc32c(src, b->len) != b->crc) {
+		sd_err("checksum mismatch of %016"PRIx64" at %"PRIu64, oid,
+		       (uint64_t)blk << COBJ_BLOCK_SHIFT);
+		return SD_RES_EIO;
+	}
+
+	if (b->len == len)
+		memcpy(dst, src, len);
+	else if (c->decompress(src, b->len, dst, len)) {
+		sd_err("failed to decompress %016"PRIx64" at %"PRIu64, oid,
+		       (uint64_t)blk << COBJ_BLOCK_SHIFT);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static size_t stored_len(const struct cobj_map *map, uint32_t first,
+			 uint32_t last)
+{
+	size_t len = 0;
+
+	for (uint32_t i = first; i <= last; i++)
+		len += map->blocks[i].len;
+
+	return len;
+}
+
+/*
+ * Read the object data of iocb from the compressed object.  Return 0 on
+ * success, SD_RES_EIO if the data is corrupted, or -1 on an I/O error.
+ */
+int cobj_read(int fd, uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t first = iocb->offset >> COBJ_BLOCK_SHIFT,
+		 last = (iocb->offset + iocb->length - 1) >> COBJ_BLOCK_SHIFT;
+	char *stored = NULL, *src, block[COBJ_BLOCK_SIZE];
+	struct cobj_map *map;
+	int ret = -1;
+
+	if (!iocb->length)
+		return 0;
+
+	map = read_map(fd, oid);
+	if (!map)
+		return -1;
+
+	stored = xmalloc(stored_len(map, first, last) ?: 1);
+	if (read_stored_blocks(fd, map, first, last, stored) < 0)
+		goto out;
+
+	src = stored;
+	for (uint32_t blk = first; blk <= last; blk++) {
+		uint64_t start = (uint64_t)blk << COBJ_BLOCK_SHIFT,
+			 from = max(start, (uint64_t)iocb->offset),
+			 to = min(start + cobj_block_len(oid, blk),
+				  (uint64_t)iocb->offset + iocb->length);
+		char *dst = (char *)iocb->buf + from - iocb->offset;
+		bool covered = from == start &&
+			to == start + cobj_block_len(oid, blk);
+
+		ret = restore_block(oid, map, blk, src,
+				    covered ? dst : block);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		if (!covered)
+			memcpy(dst, block + from - start, to - from);
+		src += map->blocks[blk].len;
+	}
+	ret = 0;
+out:
+	free(stored);
+	free(map);
+	return ret;
+}
+
+/* Make the appended blocks durable before the map points at them */
+static int sync_blocks(int fd)
+{
+	/* with O_DSYNC they are on the disk already */
+	if (sys->nosync || (fcntl(fd, F_GETFL) & O_DSYNC) == O_DSYNC)
+		return 0;
+	return fdatasync(fd);
+}
+
+/*
+ * Apply the write of iocb to the blocks of 'map' and append the new blocks to
+ * the file at 'end'.  The map is written back after the blocks are synced.
+ */
+static int write_blocks(int fd, uint64_t oid, struct cobj_map *map, off_t end,
+			const struct siocb *iocb)
+{
+	const struct compressor *c = compressors + map->hdr.algo;
+	uint32_t first = iocb->offset >> COBJ_BLOCK_SHIFT,
+		 last = (iocb->offset + iocb->length - 1) >> COBJ_BLOCK_SHIFT;
+	char *out = NULL, stored[COBJ_BLOCK_SIZE], block[COBJ_BLOCK_SIZE];
+	size_t pos = 0, size;
+	int ret = -1;
+
+	if (!iocb->length)
+		goto write_map;
+
+	out = xmalloc((size_t)(last - first + 1) << COBJ_BLOCK_SHIFT);
+	for (uint32_t blk = first; blk <= last; blk++) {
+		uint64_t start = (uint64_t)blk << COBJ_BLOCK_SHIFT,
+			 from = max(start, (uint64_t)iocb->offset),
+			 to = min(start + cobj_block_len(oid, blk),
+				  (uint64_t)iocb->offset + iocb->length);
+		uint32_t len = cobj_block_len(oid, blk);
+		struct cobj_block *b = map->blocks + blk;
+		const char *data;
+
+		if (from == start && to == start + len)
+			data = (char *)iocb->buf + start - iocb->offset;
+		else {
+			/* only the blocks at both ends need the old data */
+			if (b->offset &&
+			    xpread(fd, stored, b->len, b->offset) != b->len)
+				goto out;
+			ret = restore_block(oid, map, blk, stored, block);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+			ret = -1;
+			memcpy(block + from - start,
+			       (char *)iocb->buf + from - iocb->offset,
+			       to - from);
+			data = block;
+		}
+
+		if (b->offset)
+			map->hdr.garbage += b->len;
+
+		if (is_zero_block(data, len)) {
+			memset(b, 0, sizeof(*b));
+			continue;
+		}
+
+		size = c->compress(data, len, out + pos, len - 1);
+		if (!size) {
+			memcpy(out + pos, data, len);
+			size = len;
+		}
+		b->offset = end + pos;
+		b->len = size;
+		b->crc = crc32c(out + pos, size);
+		pos += size;
+	}
+
+	if (xpwrite(fd, out, pos, end) != pos || (pos && sync_blocks(fd) < 0))
+		goto out;
+write_map:
+	size = cobj_map_size(oid);
+	if (xpwrite(fd, map, size, 0) != size)
+		goto out;
+	ret = 0;
+out:
+	free(out);
+	return ret;
+}
+
+/*
+ * Write the data of iocb to the new file 'fd' as a compressed object.  The
+ * rest of the object is zero.
+ */
+int cobj_create(int fd, uint64_t oid, uint8_t algo, const struct siocb *iocb)
+{
+	struct cobj_map *map = xzalloc(cobj_map_size(oid));
+	int ret;
+
+	map->hdr.magic = COBJ_MAGIC;
+	map->hdr.algo = algo;
+	map->hdr.block_shift = COBJ_BLOCK_SHIFT;
+	map->hdr.nr_blocks = DIV_ROUND_UP(get_store_objsize(oid),
+					  COBJ_BLOCK_SIZE);
+
+	ret = write_blocks(fd, oid, map, cobj_data_start(oid), iocb);
+	free(map);
+	return ret;
+}
+
+/*
+ * Apply the write of iocb to the compressed object.  'compact' is set if the
+ * object should be rewritten by cobj_compact() to reclaim space.
+ *
+ * Return 0 on success, SD_RES_EIO if the data is corrupted, or -1 on an I/O
+ * error.  The caller must serialize the writes to the object.
+ */
+int cobj_write(int fd, uint64_t oid, const struct siocb *iocb, bool *compact)
+{
+	struct cobj_map *map;
+	struct stat st;
+	int ret;
+
+	*compact = false;
+	if (!iocb->length)
+		return 0;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	map = read_map(fd, oid);
+	if (!map)
+		return -1;
+
+	ret = write_blocks(fd, oid, map, max(st.st_size, cobj_data_start(oid)),
+			   iocb);
+	if (ret == 0)
+		*compact = (uint64_t)map->hdr.garbage * 2 >
+			st.st_size - cobj_data_start(oid);
+
+	free(map);
+	return ret;
+}
+
+/*
+ * Copy the compressed object 'fd' to the new file 'new_fd' without the old
+ * versions of the blocks.
+ */
+int cobj_compact(int fd, int new_fd, uint64_t oid)
+{
+	uint32_t last = DIV_ROUND_UP(get_store_objsize(oid),
+				     COBJ_BLOCK_SIZE) - 1;
+	off_t end = cobj_data_start(oid);
+	struct cobj_map *map;
+	char *stored;
+	size_t len;
+	int ret = -1;
+
+	map = read_map(fd, oid);
+	if (!map)
+		return -1;
+
+	len = stored_len(map, 0, last);
+	stored = xmalloc(len ?: 1);
+	if (read_stored_blocks(fd, map, 0, last, stored) < 0 ||
+	    xpwrite(new_fd, stored, len, end) != len || sync_blocks(new_fd) < 0)
+		goto out;
+
+	for (uint32_t blk = 0; blk <= last; blk++) {
+		if (!map->blocks[blk].offset)
+			continue;
+		map->blocks[blk].offset = end;
+		end += map->blocks[blk].len;
+	}
+	map->hdr.garbage = 0;
+	len = cobj_map_size(oid);
+	if (xpwrite(new_fd, map, len, 0) != len)
+		goto out;
+	ret = 0;
+out:
+	free(stored);
+	free(map);
+	return ret;
+}
+
+/* Return true if no block of the compressed object is stored */
+bool cobj_empty(int fd, uint64_t oid)
+{
+	struct cobj_map *map = read_map(fd, oid);
+	bool empty = true;
+
+	if (!map)
+		return false;
+
+	for (uint32_t blk = 0; blk < map->hdr.nr_blocks; blk++) {
+		if (map->blocks[blk].offset) {
+			empty = false;
+			break;
+		}
+	}
+
+	free(map);
+	return empty;
+}
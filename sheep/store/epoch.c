@@ -0,0 +1,564 @@
+/*
+ * Copyright (C) 2009-2011 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Epoch log
+ *
+ * The node lists of all the epochs are appended to one file, epoch/log. Each
+ * record carries its epoch, the creation time and the nodes without their rb
+ * field, and is protected by a crc32c. A record for an existing epoch
+ * supersedes the older one.
+ *
+ * The file is mapped in memory and an index from epoch to record offset is
+ * built when sheep starts, so reading an epoch is a lookup plus a copy. A torn
+ * record at the end of the file, left by a crash in the middle of an append,
+ * is cut off at startup.
+ *
+ * Once all the nodes are recovered and the stale objects are purged, no
+ * object refers to the old epochs any more, and the log is rewritten without
+ * the records older than the last EPOCH_LOG_KEEP epochs.
+ */
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define EPOCH_LOG_NAME		"log"
+#define EPOCH_LOG_MAGIC		0x5d0e90c4
+#define EPOCH_LOG_KEEP		256	/* epochs kept by compaction */
+#define EPOCH_LOG_MAP_STEP	(1UL << 20)
+
+struct epoch_record {
+	uint32_t magic;
+	uint32_t crc;		/* crc32c of the record after this field */
+	uint32_t epoch;
+	uint32_t nr_nodes;
+	uint64_t timestamp;
+	uint8_t nodes[0];	/* nr_nodes of EPOCH_NODE_SIZE */
+};
+
+/* nodes are stored from sd_node.nid on, the rb field is meaningless on disk */
+#define EPOCH_NODE_SIZE	(sizeof(struct sd_node) - \
+			 offsetof(struct sd_node, nid))
+
+static struct epoch_log_file {
+	int fd;
+	char *map;
+	size_t map_len;
+	size_t size;		/* end of the last valid record */
+	size_t dead;		/* bytes of superseded and dropped records */
+	uint64_t *index;	/* record offset + 1 by epoch, 0 if missing */
+	uint32_t nr_index;
+	uint32_t latest;
+	struct sd_rw_lock lock;
+} elog = {
+	.fd = -1,
+	.lock = SD_RW_LOCK_INITIALIZER,
+};
+
+static inline size_t record_size(uint32_t nr_nodes)
+{
+	return sizeof(struct epoch_record) + nr_nodes * EPOCH_NODE_SIZE;
+}
+
+static inline uint32_t record_crc(const struct epoch_record *rec)
+{
+	return crc32c(&rec->epoch, record_size(rec->nr_nodes) -
+		      offsetof(struct epoch_record, epoch));
+}
+
+static inline struct epoch_record *record_at(uint64_t offset)
+{
+	return (struct epoch_record *)(elog.map + offset);
+}
+
+static void make_log_path(char *path, size_t len, const char *suffix)
+{
+	snprintf(path, len, "%s" EPOCH_LOG_NAME "%s", epoch_path, suffix);
+}
+
+/* Make the creation, rename and removal of the files in epoch_path durable */
+static int sync_epoch_dir(void)
+{
+	int fd, ret;
+
+	fd = open(epoch_path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", epoch_path);
+		return -1;
+	}
+	ret = fsync(fd);
+	if (ret < 0)
+		sd_err("failed to sync %s, %m", epoch_path);
+	close(fd);
+	return ret;
+}
+
+static int map_log(void)
+{
+	size_t len = round_up(elog.size + 1, EPOCH_LOG_MAP_STEP);
+	char *map;
+
+	if (elog.map && len <= elog.map_len)
+		return 0;
+
+	/* reserve some room beyond the end for the following appends */
+	map = mmap(NULL, len * 2, PROT_READ, MAP_SHARED, elog.fd, 0);
+	if (map == MAP_FAILED) {
+		sd_err("failed to map the epoch log, %m");
+		return -1;
+	}
+	if (elog.map)
+		munmap(elog.map, elog.map_len);
+	elog.map = map;
+	elog.map_len = len * 2;
+	return 0;
+}
+
+static void index_record(uint64_t offset)
+{
+	const struct epoch_record *rec = record_at(offset);
+	uint32_t epoch = rec->epoch;
+
+	if (epoch >= elog.nr_index) {
+		uint32_t nr = max(epoch + 1, elog.nr_index * 2);
+
+		elog.index = xrealloc(elog.index, nr * sizeof(*elog.index));
+		memset(elog.index + elog.nr_index, 0,
+		       (nr - elog.nr_index) * sizeof(*elog.index));
+		elog.nr_index = nr;
+	}
+
+	if (elog.index[epoch])
+		elog.dead += record_size(record_at(elog.index[epoch] -
+						   1)->nr_nodes);
+	elog.index[epoch] = offset + 1;
+	elog.latest = max(elog.latest, epoch);
+}
+
+static int append_record(const struct epoch_record *rec)
+{
+	size_t len = record_size(rec->nr_nodes);
+
+	if (xpwrite(elog.fd, rec, len, elog.size) != len) {
+		sd_err("failed to append epoch %"PRIu32", %m", rec->epoch);
+		goto err;
+	}
+	if (fdatasync(elog.fd) < 0) {
+		sd_err("failed to sync epoch %"PRIu32", %m", rec->epoch);
+		goto err;
+	}
+
+	elog.size += len;
+	if (map_log() < 0)
+		return -1;
+	index_record(elog.size - len);
+	return 0;
+err:
+	/* don't leave a partial record behind */
+	if (xftruncate(elog.fd, elog.size) < 0)
+		sd_err("failed to truncate the epoch log, %m");
+	return -1;
+}
+
+static struct epoch_record *alloc_record(uint32_t epoch,
+					 const struct sd_node *nodes,
+					 size_t nr_nodes, time_t timestamp)
+{
+	struct epoch_record *rec = xzalloc(record_size(nr_nodes));
+
+	rec->magic = EPOCH_LOG_MAGIC;
+	rec->epoch = epoch;
+	rec->nr_nodes = nr_nodes;
+	rec->timestamp = timestamp;
+	for (int i = 0; i < nr_nodes; i++)
+		memcpy(rec->nodes + i * EPOCH_NODE_SIZE, &nodes[i].nid,
+		       EPOCH_NODE_SIZE);
+	rec->crc = record_crc(rec);
+	return rec;
+}
+
+int update_epoch_log(uint32_t epoch, struct sd_node *nodes,
+		     size_t nr_nodes, time_t timestamp)
+{
+	struct epoch_record *rec;
+	int ret;
+
+	sd_debug("update epoch: %d, %zu", epoch, nr_nodes);
+
+	/* Piggyback the epoch creation time for 'dog cluster info' */
+	if (!timestamp)
+		time(&timestamp);
+
+	rec = alloc_record(epoch, nodes, nr_nodes, timestamp);
+	sd_write_lock(&elog.lock);
+	ret = append_record(rec);
+	sd_rw_unlock(&elog.lock);
+	free(rec);
+
+	return ret;
+}
+
+static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
+			     int *nr_nodes, time_t *timestamp)
+{
+	const struct epoch_record *rec;
+	int ret = SD_RES_SUCCESS;
+
+	sd_read_lock(&elog.lock);
+	if (epoch >= elog.nr_index || !elog.index[epoch]) {
+		sd_debug("no epoch %"PRIu32" log", epoch);
+		ret = SD_RES_NO_TAG;
+		goto out;
+	}
+
+	rec = record_at(elog.index[epoch] - 1);
+	if (record_crc(rec) != rec->crc) {
+		sd_err("invalid epoch %"PRIu32" log", epoch);
+		ret = SD_RES_NO_TAG;
+		goto out;
+	}
+	if (len < rec->nr_nodes * sizeof(struct sd_node)) {
+		ret = SD_RES_BUFFER_SMALL;
+		goto out;
+	}
+
+	for (int i = 0; i < rec->nr_nodes; i++) {
+		memset(&nodes[i].rb, 0, sizeof(nodes[i].rb));
+		memcpy(&nodes[i].nid, rec->nodes + i * EPOCH_NODE_SIZE,
+		       EPOCH_NODE_SIZE);
+	}
+	*nr_nodes = rec->nr_nodes;
+	if (timestamp)
+		*timestamp = rec->timestamp;
+out:
+	sd_rw_unlock(&elog.lock);
+	return ret;
+}
+
+int epoch_log_read(uint32_t epoch, struct sd_node *nodes,
+				int len, int *nr_nodes)
+{
+	return do_epoch_log_read(epoch, nodes, len, nr_nodes, NULL);
+}
+
+int epoch_log_read_with_timestamp(uint32_t epoch, struct sd_node *nodes,
+				int len, int *nr_nodes, time_t *timestamp)
+{
+	return do_epoch_log_read(epoch, nodes, len, nr_nodes, timestamp);
+}
+
+uint32_t get_latest_epoch(void)
+{
+	uint32_t epoch;
+
+	sd_read_lock(&elog.lock);
+	epoch = elog.latest;
+	sd_rw_unlock(&elog.lock);
+
+	return epoch;
+}
+
+/* Drop all the epochs, used when the cluster is formatted */
+int epoch_log_reset(void)
+{
+	int ret = 0;
+
+	sd_write_lock(&elog.lock);
+	if (xftruncate(elog.fd, 0) < 0) {
+		sd_err("failed to truncate the epoch log, %m");
+		ret = -1;
+		goto out;
+	}
+	elog.size = 0;
+	elog.dead = 0;
+	elog.latest = 0;
+	memset(elog.index, 0, elog.nr_index * sizeof(*elog.index));
+out:
+	sd_rw_unlock(&elog.lock);
+	return ret;
+}
+
+/*
+ * Rewrite the log with the records of the epochs from 'oldest' on. The caller
+ * must hold the write lock.
+ */
+static int rewrite_log(uint32_t oldest)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	const struct epoch_record *rec;
+	uint64_t *index;
+	uint32_t nr_index = elog.nr_index;
+	size_t size = 0, len;
+	int fd;
+
+	make_log_path(path, sizeof(path), "");
+	make_log_path(tmp_path, sizeof(tmp_path), ".tmp");
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", tmp_path);
+		return -1;
+	}
+
+	index = xcalloc(nr_index, sizeof(*index));
+	for (uint32_t e = oldest; e < nr_index; e++) {
+		if (!elog.index[e])
+			continue;
+		rec = record_at(elog.index[e] - 1);
+		len = record_size(rec->nr_nodes);
+		if (xpwrite(fd, rec, len, size) != len) {
+			sd_err("failed to write %s, %m", tmp_path);
+			goto err;
+		}
+		index[e] = size + 1;
+		size += len;
+	}
+	if (fdatasync(fd) < 0 || rename(tmp_path, path) < 0) {
+		sd_err("failed to replace %s, %m", path);
+		goto err;
+	}
+	/* the old log is gone after a crash from here on */
+	if (sync_epoch_dir() < 0)
+		sd_warn("the compacted epoch log may be lost on a crash");
+
+	close(elog.fd);
+	munmap(elog.map, elog.map_len);
+	elog.fd = fd;
+	elog.map = NULL;
+	elog.size = size;
+	elog.dead = 0;
+	free(elog.index);
+	elog.index = index;
+	if (map_log() < 0)
+		panic("failed to map the compacted epoch log");
+	return 0;
+err:
+	free(index);
+	close(fd);
+	unlink(tmp_path);
+	return -1;
+}
+
+struct compact_work {
+	struct work work;
+	uint32_t oldest;
+};
+
+static void compact_epoch_log_work(struct work *work)
+{
+	struct compact_work *cw = container_of(work, struct compact_work,
+					       work);
+	size_t dropped = 0;
+
+	sd_write_lock(&elog.lock);
+	for (uint32_t e = 0; e < min(cw->oldest, elog.nr_index); e++)
+		if (elog.index[e])
+			dropped += record_size(record_at(elog.index[e] -
+							 1)->nr_nodes);
+
+	/* not worth a rewrite until half of the log is garbage */
+	if ((elog.dead + dropped) * 2 < elog.size)
+		goto out;
+
+	sd_info("compact the epoch log, drop epochs before %"PRIu32
+		", %zu of %zu bytes", cw->oldest, elog.dead + dropped,
+		elog.size);
+	rewrite_log(cw->oldest);
+out:
+	sd_rw_unlock(&elog.lock);
+}
+
+static void compact_epoch_log_done(struct work *work)
+{
+	struct compact_work *cw = container_of(work, struct compact_work,
+					       work);
+	free(cw);
+}
+
+/*
+ * Called when all the nodes have recovered to 'epoch' and the stale objects
+ * are purged.
+ */
+main_fn void compact_epoch_log(uint32_t epoch)
+{
+	struct compact_work *cw;
+
+	if (epoch <= EPOCH_LOG_KEEP)
+		return;
+
+	cw = xzalloc(sizeof(*cw));
+	cw->oldest = epoch - EPOCH_LOG_KEEP;
+	cw->work.fn = compact_epoch_log_work;
+	cw->work.done = compact_epoch_log_done;
+	queue_work(sys->recovery_wqueue, &cw->work);
+}
+
+/*
+ * Import the epoch files of the older sheep, one file per epoch.  If we crash
+ * before all of them are removed, they are imported again at the next start,
+ * and the new records supersede the ones of the same epochs.
+ */
+static int import_epoch_files(void)
+{
+	struct sd_node *nodes = xmalloc(sizeof(struct sd_node) * SD_MAX_NODES);
+	char path[PATH_MAX], *p;
+	struct epoch_record *rec;
+	struct dirent *d;
+	DIR *dir;
+	uint32_t e;
+	int ret = 0, fd, len, nr = 0;
+	time_t t;
+
+	dir = opendir(epoch_path);
+	if (!dir) {
+		sd_err("failed to open %s, %m", epoch_path);
+		free(nodes);
+		return -1;
+	}
+
+	while ((d = readdir(dir))) {
+		e = strtol(d->d_name, &p, 10);
+		if (d->d_name == p || *p != '\0' || strlen(d->d_name) != 8)
+			continue;
+
+		snprintf(path, sizeof(path), "%s%s", epoch_path, d->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			sd_err("failed to open %s, %m", path);
+			continue;
+		}
+		len = xread(fd, nodes, sizeof(struct sd_node) * SD_MAX_NODES +
+			    sizeof(t));
+		close(fd);
+		len -= sizeof(t);
+		if (len < 0 || len % sizeof(struct sd_node) != 0) {
+			sd_err("invalid epoch %"PRIu32" log", e);
+			continue;
+		}
+		memcpy(&t, (char *)nodes + len, sizeof(t));
+
+		rec = alloc_record(e, nodes, len / sizeof(struct sd_node), t);
+		ret = append_record(rec);
+		free(rec);
+		if (ret < 0)
+			goto out;
+		nr++;
+	}
+
+	if (!nr)
+		goto out;
+
+	/* the records are synced, the log must be found before the files go */
+	ret = sync_epoch_dir();
+	if (ret < 0)
+		goto out;
+	rewinddir(dir);
+	while ((d = readdir(dir))) {
+		strtol(d->d_name, &p, 10);
+		if (d->d_name == p || *p != '\0' || strlen(d->d_name) != 8)
+			continue;
+		snprintf(path, sizeof(path), "%s%s", epoch_path, d->d_name);
+		unlink(path);
+	}
+	sd_info("imported %d epoch files into the epoch log", nr);
+out:
+	closedir(dir);
+	free(nodes);
+	return ret;
+}
+
+/* Return the length of the intact record at offset, 0 if there is none */
+static size_t intact_record(size_t offset, size_t end)
+{
+	const struct epoch_record *rec = record_at(offset);
+	size_t len;
+
+	if (offset + sizeof(*rec) > end || rec->magic != EPOCH_LOG_MAGIC ||
+	    rec->nr_nodes > SD_MAX_NODES)
+		return 0;
+	len = record_size(rec->nr_nodes);
+	if (offset + len > end || record_crc(rec) != rec->crc)
+		return 0;
+	return len;
+}
+
+/*
+ * Build the index of the log.  The records are 8 byte aligned, so we skip a
+ * corrupted one by looking for the next intact record.  Only the garbage after
+ * the last intact record is a torn append, and is cut off.
+ */
+static int scan_log(void)
+{
+	struct stat st;
+	size_t offset = 0, next, len;
+
+	BUILD_BUG_ON(sizeof(struct epoch_record) % 8 || EPOCH_NODE_SIZE % 8);
+
+	if (fstat(elog.fd, &st) < 0) {
+		sd_err("failed to stat the epoch log, %m");
+		return -1;
+	}
+	elog.size = st.st_size;
+	if (map_log() < 0)
+		return -1;
+
+	while (offset < st.st_size) {
+		len = intact_record(offset, st.st_size);
+		if (len) {
+			index_record(offset);
+			offset += len;
+			continue;
+		}
+
+		for (next = offset + 8; next < st.st_size; next += 8)
+			if (intact_record(next, st.st_size))
+				break;
+		if (next >= st.st_size)
+			break;
+		sd_err("skip the corrupted epoch log at %zu, %zu bytes",
+		       offset, next - offset);
+		elog.dead += next - offset;
+		offset = next;
+	}
+
+	if (offset < st.st_size) {
+		sd_warn("cut off the torn tail of the epoch log at %zu",
+			offset);
+		if (xftruncate(elog.fd, offset) < 0) {
+			sd_err("failed to truncate the epoch log, %m");
+			return -1;
+		}
+	}
+	elog.size = offset;
+	return 0;
+}
+
+int init_epoch_log(void)
+{
+	char path[PATH_MAX];
+
+	make_log_path(path, sizeof(path), ".tmp");
+	unlink(path);
+
+	make_log_path(path, sizeof(path), "");
+	elog.fd = open(path, O_RDWR | O_CREAT, sd_def_fmode);
+	if (elog.fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return -1;
+	}
+
+	if (scan_log() < 0)
+		return -1;
+	if (import_epoch_files() < 0)
+		return -1;
+
+	sd_debug("latest epoch %"PRIu32", %zu bytes", elog.latest, elog.size);
+	return 0;
+}
@@ -148,9 +148,9 @@ size_t get_store_objsize(uint64_t oid)
 		uint8_t policy = get_vdi_copy_policy(oid_to_vid(oid));
 		int d;
 		ec_policy_to_dp(policy, &d, NULL);
-		return SD_DATA_OBJ_SIZE / d;
+		return get_vdi_objsize(oid) / d;
 	}
-	return get_objsize(oid);
+	return get_vdi_objsize(oid);
 }
 
 static int get_total_object_size(uint64_t oid, const char *wd, uint32_t epoch,
@@ -414,15 +414,17 @@ static void *thread_process_path(void *arg)
 	return arg;
 }
 
-main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
-				      uint32_t epoch, uint8_t ec_index,
-				      struct vnode_info *vinfo, void *arg),
-				  bool cleanup, void *arg)
+/* Same as for_each_object_in_wd() but can be called from any thread */
+int for_each_object_in_wd_vinfo(int (*func)(uint64_t oid, const char *path,
+					    uint32_t epoch, uint8_t ec_index,
+					    struct vnode_info *vinfo,
+					    void *arg),
+				bool cleanup, struct vnode_info *vinfo,
+				void *arg)
 {
 	int ret = SD_RES_SUCCESS;
 	const struct disk *disk;
 	struct process_path_arg *thread_args, *path_arg;
-	struct vnode_info *vinfo;
 	void *ret_arg;
 	sd_thread_t *thread_array;
 	int nr_thread = 0, idx = 0;
@@ -436,8 +438,6 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 	thread_args = xmalloc(nr_thread * sizeof(struct process_path_arg));
 	thread_array = xmalloc(nr_thread * sizeof(sd_thread_t));
 
-	vinfo = get_vnode_info();
-
 	rb_for_each_entry(disk, &md.root, rb) {
 		thread_args[idx].path = disk->path;
 		thread_args[idx].vinfo = vinfo;
@@ -475,7 +475,6 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 		}
 	}
 
-	put_vnode_info(vinfo);
 	sd_rw_unlock(&md.lock);
 
 	free(thread_args);
@@ -483,6 +482,20 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 	return ret;
 }
 
+main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
+				      uint32_t epoch, uint8_t ec_index,
+				      struct vnode_info *vinfo, void *arg),
+				  bool cleanup, void *arg)
+{
+	struct vnode_info *vinfo = get_vnode_info();
+	int ret;
+
+	ret = for_each_object_in_wd_vinfo(func, cleanup, vinfo, arg);
+	put_vnode_info(vinfo);
+
+	return ret;
+}
+
 int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 uint32_t epoch, uint8_t,
 					 struct vnode_info *, void *arg),
@@ -504,6 +517,99 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 }
 
 
+struct process_oids_arg {
+	const struct disk *disk;
+	int nr;
+	int *idx;
+	void (*func)(int i, void *arg);
+	void *opaque;
+};
+
+static void *thread_process_oids(void *arg)
+{
+	struct process_oids_arg *parg = arg;
+
+	for (int i = 0; i < parg->nr; i++)
+		parg->func(parg->idx[i], parg->opaque);
+
+	return arg;
+}
+
+/*
+ * Call func(i, arg) for each of the oids in parallel across the disks.  The
+ * oids stored on the same disk are handled one by one by a dedicated thread.
+ */
+void md_for_each_oid(const uint64_t *oids, int nr,
+		     void (*func)(int i, void *arg), void *arg)
+{
+	struct process_oids_arg *thread_args;
+	sd_thread_t *thread_array;
+	const struct disk *disk;
+	int *disk_of, nr_disks = 0;
+
+	sd_read_lock(&md.lock);
+	if (md.nr_disks <= 1) {
+		sd_rw_unlock(&md.lock);
+		for (int i = 0; i < nr; i++)
+			func(i, arg);
+		return;
+	}
+
+	thread_args = xzalloc(md.nr_disks * sizeof(*thread_args));
+	thread_array = xzalloc(md.nr_disks * sizeof(*thread_array));
+	rb_for_each_entry(disk, &md.root, rb) {
+		thread_args[nr_disks].disk = disk;
+		thread_args[nr_disks].func = func;
+		thread_args[nr_disks].opaque = arg;
+		nr_disks++;
+	}
+
+	disk_of = xmalloc(nr * sizeof(*disk_of));
+	for (int i = 0; i < nr; i++) {
+		disk = oid_to_vdisk(oids[i])->disk;
+		for (int j = 0; j < nr_disks; j++)
+			if (thread_args[j].disk == disk) {
+				disk_of[i] = j;
+				thread_args[j].nr++;
+				break;
+			}
+	}
+	for (int j = 0; j < nr_disks; j++) {
+		thread_args[j].idx = xmalloc(thread_args[j].nr * sizeof(int));
+		thread_args[j].nr = 0;
+	}
+	for (int i = 0; i < nr; i++) {
+		struct process_oids_arg *parg = thread_args + disk_of[i];
+
+		parg->idx[parg->nr++] = i;
+	}
+
+	for (int j = 0; j < nr_disks; j++) {
+		if (!thread_args[j].nr)
+			continue;
+		if (sd_thread_create_with_idx("md oids", thread_array + j,
+					      thread_process_oids,
+					      thread_args + j) != 0) {
+			sd_err("failed to create thread for %s",
+			       thread_args[j].disk->path);
+			thread_process_oids(thread_args + j);
+			thread_args[j].nr = 0;
+		}
+	}
+
+	for (int j = 0; j < nr_disks; j++) {
+		if (thread_args[j].nr &&
+		    sd_thread_join(thread_array[j], NULL) != 0)
+			sd_err("failed to join thread");
+		free(thread_args[j].idx);
+	}
+	sd_rw_unlock(&md.lock);
+
+	free(disk_of);
+	free(thread_args);
+	free(thread_array);
+}
+
 int for_each_obj_path(int (*func)(const char *path))
 {
 	int ret = SD_RES_SUCCESS;
@@ -651,11 +757,45 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	return 0;
 }
 
+/*
+ * Create 'path' with the content of 'buf' atomically.  The compression xattr
+ * of a compressed object is set before the object shows up.
+ */
+static int create_object_file(const char *path, const struct strbuf *buf,
+			      const uint8_t *algo)
+{
+	char tmp_path[PATH_MAX];
+	int fd, ret = -1;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_SYNC | O_EXCL, sd_def_fmode);
+	if (fd < 0)
+		return -1;
+
+	if (xwrite(fd, buf->buf, buf->len) != buf->len ||
+	    (algo && fsetxattr(fd, COMPRESSNAME, algo, sizeof(*algo), 0) < 0) ||
+	    rename(tmp_path, path) < 0) {
+		sd_err("failed to create %s, %m", path);
+		unlink(tmp_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
 static int md_move_object(uint64_t oid, const char *old, const char *new)
 {
 	struct strbuf buf = STRBUF_INIT;
 	int fd, ret = -1;
 	size_t sz = get_store_objsize(oid);
+	uint8_t algo;
+	bool compressed;
 
 	fd = open(old, O_RDONLY);
 	if (fd < 0) {
@@ -663,14 +803,20 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 		goto out;
 	}
 
+	/*
+	 * the object may be followed by the table of its block checksums, and
+	 * a compressed object is smaller than the object size
+	 */
+	compressed = fgetxattr(fd, COMPRESSNAME, &algo, sizeof(algo)) ==
+		sizeof(algo);
 	ret = strbuf_read(&buf, fd, sz);
-	if (ret != sz) {
+	if (ret < 0 || (!compressed && (size_t)ret < sz)) {
 		sd_err("failed to read %s, size %zu, %d, %m", old, sz, ret);
 		ret = -1;
 		goto out_close;
 	}
 
-	if (atomic_create_and_write(new, buf.buf, buf.len, false) < 0) {
+	if (create_object_file(new, &buf, compressed ? &algo : NULL) < 0) {
 		if (errno != EEXIST) {
 			sd_err("failed to create %s", new);
 			ret = -1;
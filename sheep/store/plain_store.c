@@ -12,6 +12,7 @@
 #include <libgen.h>
 
 #include "sheep_priv.h"
+#include "crc32c.h"
 
 static int get_store_path(uint64_t oid, uint8_t ec_index, char *path)
 {
@@ -58,9 +59,564 @@ bool default_exist(uint64_t oid, uint8_t ec_index)
 	return md_exist(oid, ec_index, path);
 }
 
+#define SHA1NAME "user.obj.sha1"
+
+/*
+ * The SHA1 digest of an object is cached in its xattr and removed by writes.
+ * Writers bump write_begin of the object's bucket before touching it and
+ * write_end afterwards, so default_get_hash() can tell whether a write raced
+ * with the computation of the digest it is going to cache.
+ */
+#define NR_WRITE_BUCKETS 1024
+
+static unsigned long write_begin[NR_WRITE_BUCKETS];
+static unsigned long write_end[NR_WRITE_BUCKETS];
+
+static inline int write_bucket(uint64_t oid)
+{
+	return sd_hash_oid(oid) % NR_WRITE_BUCKETS;
+}
+
+/*
+ * Deduplication of cold objects
+ *
+ * The objects with the same content on a disk are hard links of one file.
+ * The fingerprint index is the directory .dedup of the disk, laid out like
+ * the sha1 files of farm: .dedup/ab/cdef... is one more link of the file
+ * whose SHA1 digest is abcdef..., so the link count of the file minus one is
+ * the number of the objects sharing it.  The digest is also kept in the
+ * DEDUPNAME xattr of the file to tell a shared object from an object linked
+ * to the stale directory.
+ *
+ * An object is shared by the dedup worker after it has not been written for
+ * a while, and a write to a shared object gives it its own copy first, see
+ * unshare_object().  Writers hold the share lock of the object for read so
+ * that the worker never replaces an object under an open file.
+ */
+#define DEDUPNAME "user.obj.dedup"
+#define DEDUP_DIR ".dedup"
+#define NR_DEDUP_LOCKS 1024
+
+static struct sd_rw_lock share_locks[NR_WRITE_BUCKETS] = {
+	[0 ... NR_WRITE_BUCKETS - 1] = SD_RW_LOCK_INITIALIZER
+};
+
+/* serialize the sharing and unsharing of the objects with the same digest */
+static struct sd_mutex dedup_locks[NR_DEDUP_LOCKS] = {
+	[0 ... NR_DEDUP_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
+static inline bool dedup_enabled(void)
+{
+	return sys->dedup_age != 0;
+}
+
+/*
+ * With SD_CLUSTER_FLAG_CHECKSUM, the CRC32C of each CSUM_BLOCK_SIZE block of
+ * an object is kept in a table right after the object data, so that it moves
+ * along with the object on rename and link.  A zero entry, as in a hole,
+ * means that the block has no checksum yet.
+ *
+ * The data and the table can't be updated atomically, so a write clears the
+ * entries of its blocks before it touches the data and stores the new ones
+ * afterwards, all with O_DSYNC.  A write torn by a power loss then leaves
+ * blocks without checksums rather than mismatching ones on every replica.
+ * With -n (nosync) the page cache may reorder the updates, just as it may
+ * lose them.  The writes to an object are serialized by its csum lock while
+ * they update the table, so that overlapping writes can't store the checksum
+ * of data another one has overwritten.
+ */
+#define CSUM_BLOCK_SHIFT 12
+#define CSUM_BLOCK_SIZE (1U << CSUM_BLOCK_SHIFT)
+#define NR_CSUM_LOCKS 1024
+/* times to read again if a racing write made the checksums look stale */
+#define CSUM_READ_RETRIES 3
+
+static struct sd_mutex csum_locks[NR_CSUM_LOCKS] = {
+	[0 ... NR_CSUM_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
+static inline struct sd_mutex *csum_lock(uint64_t oid)
+{
+	return csum_locks + sd_hash_oid(oid) % NR_CSUM_LOCKS;
+}
+
+static inline bool csum_enabled(void)
+{
+	return sys->cinfo.flags & SD_CLUSTER_FLAG_CHECKSUM;
+}
+
+static inline off_t csum_offset(uint64_t oid, uint32_t blk)
+{
+	return get_store_objsize(oid) + (off_t)blk * sizeof(uint32_t);
+}
+
+static inline uint32_t block_len(uint64_t oid, uint32_t blk)
+{
+	return min((uint64_t)CSUM_BLOCK_SIZE, get_store_objsize(oid) -
+		   ((uint64_t)blk << CSUM_BLOCK_SHIFT));
+}
+
+static inline uint32_t block_csum(const void *buf, uint32_t len)
+{
+	/* zero is reserved for blocks without a checksum */
+	return crc32c(buf, len) ?: 1;
+}
+
+static bool block_covered(uint64_t oid, uint32_t blk, const struct siocb *iocb)
+{
+	uint64_t start = (uint64_t)blk << CSUM_BLOCK_SHIFT;
+
+	return start >= iocb->offset &&
+		start + block_len(oid, blk) <= iocb->offset + iocb->length;
+}
+
+/* The checksums are accessed with buffered I/O even for direct I/O objects */
+static int open_csum_fd(const char *path, int fd, int flags)
+{
+	if (!(flags & O_DIRECT))
+		return fd;
+
+	return open(path, flags & ~(O_DIRECT | O_CREAT | O_EXCL));
+}
+
+static inline void close_csum_fd(int cfd, int fd)
+{
+	if (cfd != fd)
+		close(cfd);
+}
+
+/*
+ * Checksum the block as it is on disk now, other writes may share it.  The
+ * caller holds the csum lock of the object unless the file is its own.
+ */
+static int update_block_csum(int cfd, uint64_t oid, uint32_t blk)
+{
+	uint32_t len = block_len(oid, blk), csum;
+	char buf[CSUM_BLOCK_SIZE];
+
+	if (xpread(cfd, buf, len, (off_t)blk << CSUM_BLOCK_SHIFT) != len)
+		return -1;
+
+	csum = block_csum(buf, len);
+	if (xpwrite(cfd, &csum, sizeof(csum), csum_offset(oid, blk))
+	    != sizeof(csum))
+		return -1;
+
+	return 0;
+}
+
+/* Drop the checksums of the blocks iocb is going to change */
+static int clear_csums(int cfd, uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t first = iocb->offset >> CSUM_BLOCK_SHIFT,
+		 last = (iocb->offset + iocb->length - 1) >> CSUM_BLOCK_SHIFT,
+		 *csums;
+	size_t size;
+	int ret = 0;
+
+	if (!iocb->length)
+		return 0;
+
+	size = sizeof(*csums) * (last - first + 1);
+	csums = xzalloc(size);
+	if (xpwrite(cfd, csums, size, csum_offset(oid, first)) != size)
+		ret = -1;
+	free(csums);
+
+	return ret;
+}
+
+/* Update the checksums of the blocks written by iocb */
+static int update_csums(int cfd, uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t first = iocb->offset >> CSUM_BLOCK_SHIFT,
+		 last = (iocb->offset + iocb->length - 1) >> CSUM_BLOCK_SHIFT,
+		 *csums;
+	size_t size;
+	int ret = 0;
+
+	if (!iocb->length)
+		return 0;
+
+	if (!block_covered(oid, first, iocb)) {
+		if (update_block_csum(cfd, oid, first) < 0)
+			return -1;
+		first++;
+	}
+	if (first <= last && !block_covered(oid, last, iocb)) {
+		if (update_block_csum(cfd, oid, last) < 0)
+			return -1;
+		last--;
+	}
+	if (first > last)
+		return 0;
+
+	size = sizeof(*csums) * (last - first + 1);
+	csums = xmalloc(size);
+	for (uint32_t blk = first; blk <= last; blk++) {
+		uint64_t start = (uint64_t)blk << CSUM_BLOCK_SHIFT;
+
+		csums[blk - first] = block_csum((char *)iocb->buf + start -
+						iocb->offset,
+						block_len(oid, blk));
+	}
+	if (xpwrite(cfd, csums, size, csum_offset(oid, first)) != size)
+		ret = -1;
+	free(csums);
+
+	return ret;
+}
+
+/*
+ * Check the blocks read into iocb against their checksums.  Return
+ * SD_RES_EIO on a mismatch, or -1 if the checksums can't be read.
+ */
+static int verify_csums(int cfd, uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t first = iocb->offset >> CSUM_BLOCK_SHIFT,
+		 last = (iocb->offset + iocb->length - 1) >> CSUM_BLOCK_SHIFT,
+		 *csums;
+	size_t size = sizeof(*csums) * (last - first + 1);
+	char buf[CSUM_BLOCK_SIZE];
+	ssize_t ret;
+
+	if (!iocb->length)
+		return SD_RES_SUCCESS;
+
+	csums = xzalloc(size);
+	/* the table may be shorter than the object, e.g. after a move */
+	ret = xpread(cfd, csums, size, csum_offset(oid, first));
+	if (ret < 0)
+		goto out;
+
+	ret = SD_RES_SUCCESS;
+	for (uint32_t blk = first; blk <= last; blk++) {
+		uint64_t start = (uint64_t)blk << CSUM_BLOCK_SHIFT;
+		uint32_t len = block_len(oid, blk);
+		const char *data;
+
+		if (!csums[blk - first])
+			continue;
+
+		if (block_covered(oid, blk, iocb))
+			data = (char *)iocb->buf + start - iocb->offset;
+		else if (xpread(cfd, buf, len, start) == len)
+			data = buf;
+		else {
+			ret = -1;
+			goto out;
+		}
+
+		if (block_csum(data, len) != csums[blk - first]) {
+			sd_err("checksum mismatch of %016"PRIx64" at %"PRIu64,
+			       oid, start);
+			ret = SD_RES_EIO;
+			goto out;
+		}
+	}
+out:
+	free(csums);
+	return ret;
+}
+
+/*
+ * The data objects of the VDIs with compression are kept in the format of
+ * store/compress.c and marked with the COMPRESSNAME xattr.  Their blocks have
+ * checksums of their own, so they don't have the checksum table.  A write
+ * rewrites the block map and may replace the file to reclaim space, so the
+ * accesses to a compressed object are serialized by its cobj lock.
+ */
+static struct sd_rw_lock cobj_locks[NR_WRITE_BUCKETS] = {
+	[0 ... NR_WRITE_BUCKETS - 1] = SD_RW_LOCK_INITIALIZER
+};
+
+static inline bool may_be_compressed(uint64_t oid)
+{
+	return is_data_obj(oid) && !is_erasure_oid(oid);
+}
+
+/* Return the compression algorithm of the object opened as fd */
+static uint8_t object_compression(int fd, uint64_t oid)
+{
+	uint8_t algo;
+
+	if (!may_be_compressed(oid) ||
+	    fgetxattr(fd, COMPRESSNAME, &algo, sizeof(algo)) != sizeof(algo))
+		return SD_COMPRESS_NONE;
+
+	return algo;
+}
+
+/* Return the compression algorithm for a new object */
+static uint8_t new_object_compression(uint64_t oid)
+{
+	uint8_t algo;
+
+	if (!may_be_compressed(oid))
+		return SD_COMPRESS_NONE;
+
+	algo = get_vdi_compression(oid_to_vid(oid));
+	return compression_supported(algo) ? algo : SD_COMPRESS_NONE;
+}
+
+/* The compressed objects are accessed with buffered I/O */
+static int read_compressed(uint64_t oid, const char *path, int flags,
+			   const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = cobj_locks + write_bucket(oid);
+	int fd, ret;
+
+	sd_read_lock(lock);
+	/* the file may have been replaced since the caller opened it */
+	fd = open(path, flags & ~O_DIRECT);
+	if (fd < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	ret = cobj_read(fd, oid, iocb);
+	if (ret < 0) {
+		sd_err("failed to read object %"PRIx64", path=%s, offset=%"
+		       PRId32", size=%"PRId32", %m", oid, path, iocb->offset,
+		       iocb->length);
+		ret = err_to_sderr(path, oid, errno);
+	}
+	close(fd);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+/* Rewrite the compressed object without the old versions of its blocks */
+static void compact_object(uint64_t oid, const char *path, int fd, int flags)
+{
+	uint8_t algo = object_compression(fd, oid);
+	char tmp_path[PATH_MAX];
+	int tmp_fd;
+
+	get_store_tmp_path(oid, 0, tmp_path);
+	tmp_fd = open(tmp_path, flags | O_CREAT | O_EXCL, sd_def_fmode);
+	if (tmp_fd < 0) {
+		sd_err("failed to open %s, %m", tmp_path);
+		return;
+	}
+
+	if (cobj_compact(fd, tmp_fd, oid) < 0 ||
+	    fsetxattr(tmp_fd, COMPRESSNAME, &algo, sizeof(algo), 0) < 0 ||
+	    rename(tmp_path, path) < 0) {
+		/* the garbage is just kept until the next write */
+		sd_err("failed to compact %s, %m", path);
+		unlink(tmp_path);
+	} else
+		sd_debug("compacted %s", path);
+	close(tmp_fd);
+}
+
+static int write_compressed(uint64_t oid, const char *path, int flags,
+			    const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = cobj_locks + write_bucket(oid);
+	bool compact;
+	int fd, ret;
+
+	flags &= ~O_DIRECT;
+	sd_write_lock(lock);
+	fd = open(path, flags);
+	if (fd < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	ret = cobj_write(fd, oid, iocb, &compact);
+	if (ret < 0) {
+		sd_err("failed to write object %"PRIx64", path=%s, offset=%"
+		       PRId32", size=%"PRId32", %m", oid, path, iocb->offset,
+		       iocb->length);
+		ret = err_to_sderr(path, oid, errno);
+	} else if (ret == SD_RES_SUCCESS && compact)
+		compact_object(oid, path, fd, flags);
+	close(fd);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+static void get_dedup_path(uint64_t oid, const uint8_t *sha1, char *path)
+{
+	const char *hex = sha1_to_hex(sha1);
+
+	snprintf(path, PATH_MAX, "%s/" DEDUP_DIR "/%.2s/%s",
+		 md_get_object_dir(oid), hex, hex + 2);
+}
+
+static inline struct sd_mutex *dedup_lock(const uint8_t *sha1)
+{
+	uint32_t h;
+
+	memcpy(&h, sha1, sizeof(h));
+	return dedup_locks + h % NR_DEDUP_LOCKS;
+}
+
+/* Return true if the object opened as fd shares its file with others */
+static bool object_shared(int fd)
+{
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || st.st_nlink == 1)
+		return false;
+
+	return fgetxattr(fd, DEDUPNAME, sha1, sizeof(sha1)) == sizeof(sha1);
+}
+
+/* Copy the file of a shared object, checksums included, to 'path' */
+static int copy_object_file(const char *path, const char *src_path)
+{
+	int fd, src_fd, ret = -1;
+	struct stat st;
+	char *buf = NULL;
+	uint8_t algo;
+
+	src_fd = open(src_path, O_RDONLY);
+	if (src_fd < 0)
+		return -1;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0)
+		goto out_src;
+
+	if (fstat(src_fd, &st) < 0)
+		goto out;
+	if (clone_file(fd, src_fd, st.st_size) < 0) {
+		buf = xmalloc(st.st_size);
+		if (xpread(src_fd, buf, st.st_size, 0) != st.st_size ||
+		    xpwrite(fd, buf, st.st_size, 0) != st.st_size)
+			goto out;
+	}
+
+	/* a compressed object can't be read without its xattr */
+	if (fgetxattr(src_fd, COMPRESSNAME, &algo, sizeof(algo)) ==
+	    sizeof(algo) &&
+	    fsetxattr(fd, COMPRESSNAME, &algo, sizeof(algo), 0) < 0)
+		goto out;
+	ret = 0;
+out:
+	free(buf);
+	close(fd);
+out_src:
+	close(src_fd);
+	return ret;
+}
+
+/*
+ * Give the object its own file before it is written.  If only the index refers
+ * to the file besides the object, the index entry is dropped instead.
+ */
+static int unshare_object(uint64_t oid, const char *path)
+{
+	char dedup_path[PATH_MAX], tmp_path[PATH_MAX];
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	struct sd_mutex *lock;
+	struct stat st, dst;
+	int ret = SD_RES_SUCCESS;
+
+	if (getxattr(path, DEDUPNAME, sha1, sizeof(sha1)) != sizeof(sha1))
+		return SD_RES_SUCCESS;
+
+	lock = dedup_lock(sha1);
+	sd_mutex_lock(lock);
+	/* a racing write may have done it */
+	if (getxattr(path, DEDUPNAME, sha1, sizeof(sha1)) != sizeof(sha1))
+		goto out;
+	if (stat(path, &st) < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	get_dedup_path(oid, sha1, dedup_path);
+	if (st.st_nlink > 2 || (st.st_nlink == 2 &&
+	    (stat(dedup_path, &dst) < 0 || dst.st_ino != st.st_ino))) {
+		sd_debug("unshare %016"PRIx64, oid);
+		get_store_tmp_path(oid, 0, tmp_path);
+		if (copy_object_file(tmp_path, path) < 0 ||
+		    rename(tmp_path, path) < 0) {
+			sd_err("failed to unshare %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+			unlink(tmp_path);
+		}
+		goto out;
+	}
+
+	if (st.st_nlink == 2 && unlink(dedup_path) < 0) {
+		sd_err("failed to unlink %s, %m", dedup_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	if (removexattr(path, DEDUPNAME) < 0 && errno != ENODATA) {
+		sd_err("failed to remove %s of %s, %m", DEDUPNAME, path);
+		ret = err_to_sderr(path, oid, errno);
+	}
+out:
+	sd_mutex_unlock(lock);
+	return ret;
+}
+
+static inline void begin_write(uint64_t oid)
+{
+	int bucket = write_bucket(oid);
+
+	uatomic_add_return(&write_begin[bucket], 1);
+	if (dedup_enabled())
+		sd_read_lock(&share_locks[bucket]);
+}
+
+static inline void end_write(uint64_t oid)
+{
+	int bucket = write_bucket(oid);
+
+	if (dedup_enabled())
+		sd_rw_unlock(&share_locks[bucket]);
+	uatomic_add_return(&write_end[bucket], 1);
+}
+
+/*
+ * Open the object to change its data.  A shared object gets its own file
+ * first, and the cached digest is dropped.  Must be called between
+ * begin_write() and end_write().
+ */
+static int open_for_write(uint64_t oid, const char *path, int flags, int *fdp)
+{
+	int fd, ret;
+
+	fd = open(path, flags, sd_def_fmode);
+	if (unlikely(fd < 0))
+		return err_to_sderr(path, oid, errno);
+
+	if (unlikely(object_shared(fd))) {
+		close(fd);
+		ret = unshare_object(oid, path);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		fd = open(path, flags, sd_def_fmode);
+		if (unlikely(fd < 0))
+			return err_to_sderr(path, oid, errno);
+	}
+
+	/* drop the cached digest before the data changes */
+	if (unlikely(fremovexattr(fd, SHA1NAME) < 0) && errno != ENODATA) {
+		sd_err("failed to remove sha1 of %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		close(fd);
+		return ret;
+	}
+
+	*fdp = fd;
+	return SD_RES_SUCCESS;
+}
+
 int default_write(uint64_t oid, const struct siocb *iocb)
 {
-	int flags = prepare_iocb(oid, iocb, false), fd,
+	int flags = prepare_iocb(oid, iocb, false), fd, cfd = -1,
 	    ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
 	ssize_t size;
@@ -80,9 +636,30 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 	if (!default_exist(oid, iocb->ec_index))
 		return err_to_sderr(path, oid, ENOENT);
 
-	fd = open(path, flags, sd_def_fmode);
-	if (unlikely(fd < 0))
-		return err_to_sderr(path, oid, errno);
+	begin_write(oid);
+	ret = open_for_write(oid, path, flags, &fd);
+	if (ret != SD_RES_SUCCESS)
+		goto out_end;
+
+	if (object_compression(fd, oid) != SD_COMPRESS_NONE) {
+		ret = write_compressed(oid, path, flags, iocb);
+		goto out;
+	}
+
+	if (csum_enabled()) {
+		cfd = open_csum_fd(path, fd, flags);
+		if (cfd < 0) {
+			sd_err("failed to open %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+			goto out;
+		}
+		sd_mutex_lock(csum_lock(oid));
+		if (clear_csums(cfd, oid, iocb) < 0) {
+			sd_err("failed to clear checksums of %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+			goto out_unlock;
+		}
+	}
 
 	size = xpwrite(fd, iocb->buf, iocb->length, iocb->offset);
 	if (unlikely(size != iocb->length)) {
@@ -90,10 +667,140 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
 		       iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
+		goto out_unlock;
+	}
+
+	if (csum_enabled() && update_csums(cfd, oid, iocb) < 0) {
+		sd_err("failed to update checksums of %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+	}
+out_unlock:
+	if (cfd >= 0) {
+		sd_mutex_unlock(csum_lock(oid));
+		close_csum_fd(cfd, fd);
+	}
+out:
+	close(fd);
+out_end:
+	end_write(oid);
+	return ret;
+}
+
+/*
+ * Checksum the blocks partially punched again, they still have data.  The
+ * checksums of the punched blocks are already cleared, a hole has none.
+ */
+static int punch_csums(int cfd, uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t first = iocb->offset >> CSUM_BLOCK_SHIFT,
+		 last = (iocb->offset + iocb->length - 1) >> CSUM_BLOCK_SHIFT;
+
+	if (!iocb->length)
+		return 0;
+
+	if (!block_covered(oid, first, iocb) &&
+	    update_block_csum(cfd, oid, first) < 0)
+		return -1;
+	if (last != first && !block_covered(oid, last, iocb) &&
+	    update_block_csum(cfd, oid, last) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Return true if the object data is all holes */
+static bool object_sparse(int fd, uint64_t oid)
+{
+	off_t off = lseek(fd, 0, SEEK_DATA);
+
+	/* the checksum table after the data doesn't count */
+	if (off < 0)
+		return errno == ENXIO;
+	return off >= get_store_objsize(oid);
+}
+
+/* Punch the range of the compressed object by writing zero blocks to it */
+static int punch_compressed(uint64_t oid, const char *path, int flags,
+			    const struct siocb *iocb, bool *empty)
+{
+	struct siocb zero = *iocb;
+	int fd, ret;
+
+	zero.buf = xzalloc(iocb->length ?: 1);
+	ret = write_compressed(oid, path, flags, &zero);
+	free(zero.buf);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* the file may have been replaced by the compaction */
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return err_to_sderr(path, oid, errno);
+	*empty = cobj_empty(fd, oid);
+	close(fd);
+
+	return SD_RES_SUCCESS;
+}
+
+int default_punch(uint64_t oid, const struct siocb *iocb, bool *empty)
+{
+	/* no data goes through the file */
+	int flags = prepare_iocb(oid, iocb, false) & ~O_DIRECT, fd,
+	    ret = SD_RES_SUCCESS;
+	char path[PATH_MAX];
+
+	*empty = false;
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	get_store_path(oid, iocb->ec_index, path);
+	if (!default_exist(oid, iocb->ec_index))
+		return err_to_sderr(path, oid, ENOENT);
+
+	begin_write(oid);
+	ret = open_for_write(oid, path, flags, &fd);
+	if (ret != SD_RES_SUCCESS)
+		goto out_end;
+
+	if (object_compression(fd, oid) != SD_COMPRESS_NONE) {
+		ret = punch_compressed(oid, path, flags, iocb, empty);
 		goto out;
 	}
+
+	if (csum_enabled()) {
+		sd_mutex_lock(csum_lock(oid));
+		if (clear_csums(fd, oid, iocb) < 0) {
+			sd_err("failed to clear checksums of %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+			goto out_unlock;
+		}
+	}
+
+	if (iocb->length &&
+	    unlikely(punch_hole(fd, iocb->offset, iocb->length) < 0)) {
+		sd_err("failed to punch object %"PRIx64", path=%s, offset=%"
+		       PRId32", size=%"PRId32", %m", oid, path, iocb->offset,
+		       iocb->length);
+		ret = err_to_sderr(path, oid, errno);
+		goto out_unlock;
+	}
+
+	if (csum_enabled() && punch_csums(fd, oid, iocb) < 0) {
+		sd_err("failed to update checksums of %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out_unlock;
+	}
+
+	*empty = object_sparse(fd, oid);
+out_unlock:
+	if (csum_enabled())
+		sd_mutex_unlock(csum_lock(oid));
 out:
 	close(fd);
+out_end:
+	end_write(oid);
 	return ret;
 }
 
@@ -158,6 +865,10 @@ static int init_vdi_state(uint64_t oid, const char *wd, uint32_t epoch)
 		goto out;
 	}
 	atomic_set_bit(oid_to_vid(oid), sys->vdi_inuse);
+	if (inode->compression != SD_COMPRESS_NONE)
+		vdi_set_compression(oid_to_vid(oid), inode->compression);
+	vdi_set_block_size_shift(oid_to_vid(oid), inode->block_size_shift ?:
+				 SD_DEFAULT_BLOCK_SIZE_SHIFT);
 
 	ret = SD_RES_SUCCESS;
 out:
@@ -192,6 +903,9 @@ int default_init(void)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
+	if (objlist_cache_load())
+		return SD_RES_SUCCESS;
+
 	ret = for_each_object_in_stale(init_objlist_and_vdi_bitmap, NULL);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
@@ -202,8 +916,10 @@ int default_init(void)
 static int default_read_from_path(uint64_t oid, const char *path,
 				  const struct siocb *iocb)
 {
-	int flags = prepare_iocb(oid, iocb, false), fd,
-	    ret = SD_RES_SUCCESS;
+	int flags = prepare_iocb(oid, iocb, false), fd, cfd,
+	    ret = SD_RES_SUCCESS, bucket = write_bucket(oid);
+	unsigned long begin;
+	bool busy;
 	ssize_t size;
 
 	/*
@@ -220,13 +936,49 @@ static int default_read_from_path(uint64_t oid, const char *path,
 	if (fd < 0)
 		return err_to_sderr(path, oid, errno);
 
-	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
-	if (size < 0) {
-		sd_err("failed to read object %"PRIx64", path=%s, offset=%"
-		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
-		       iocb->offset, iocb->length, size);
+	if (object_compression(fd, oid) != SD_COMPRESS_NONE) {
+		close(fd);
+		return read_compressed(oid, path, flags, iocb);
+	}
+
+	cfd = csum_enabled() ? open_csum_fd(path, fd, flags) : fd;
+	if (cfd < 0) {
 		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	for (int retry = 0;; retry++) {
+		begin = uatomic_add_return(&write_begin[bucket], 0);
+		busy = uatomic_read(&write_end[bucket]) != begin;
+
+		size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
+		if (size < 0) {
+			sd_err("failed to read object %"PRIx64", path=%s, "
+			       "offset=%"PRId32", size=%"PRId32", result=%zd,"
+			       " %m", oid, path, iocb->offset, iocb->length,
+			       size);
+			ret = err_to_sderr(path, oid, errno);
+			break;
+		}
+
+		if (!csum_enabled())
+			break;
+
+		ret = verify_csums(cfd, oid, iocb);
+		if (ret < 0) {
+			sd_err("failed to read checksums of %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+			break;
+		}
+
+		/* a racing write can make the checksums look stale */
+		if (ret != SD_RES_EIO || retry == CSUM_READ_RETRIES ||
+		    (!busy &&
+		     uatomic_add_return(&write_begin[bucket], 0) == begin))
+			break;
 	}
+	close_csum_fd(cfd, fd);
+out:
 	close(fd);
 	return ret;
 }
@@ -252,17 +1004,20 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	return ret;
 }
 
-int default_create_and_write(uint64_t oid, const struct siocb *iocb)
+static int create_and_write(uint64_t oid, const struct siocb *iocb)
 {
 	char path[PATH_MAX], tmp_path[PATH_MAX];
 	int flags = prepare_iocb(oid, iocb, true);
 	int ret, fd;
 	uint32_t len = iocb->length;
+	uint8_t algo = new_object_compression(oid);
 	size_t obj_size;
 
 	sd_debug("%"PRIx64, oid);
 	get_store_path(oid, iocb->ec_index, path);
 	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
+	if (algo != SD_COMPRESS_NONE)
+		flags &= ~O_DIRECT;
 	fd = open(tmp_path, flags, sd_def_fmode);
 	if (fd < 0) {
 		if (errno == EEXIST) {
@@ -281,6 +1036,16 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		return err_to_sderr(path, oid, errno);
 	}
 
+	if (algo != SD_COMPRESS_NONE) {
+		if (cobj_create(fd, oid, algo, iocb) < 0 ||
+		    fsetxattr(fd, COMPRESSNAME, &algo, sizeof(algo), 0) < 0) {
+			sd_err("failed to write compressed object. %m");
+			ret = err_to_sderr(path, oid, errno);
+			goto out;
+		}
+		goto commit;
+	}
+
 	obj_size = get_store_objsize(oid);
 	ret = prealloc(fd, obj_size);
 	if (ret < 0) {
@@ -295,6 +1060,20 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		goto out;
 	}
 
+	if (csum_enabled()) {
+		int cfd = open_csum_fd(tmp_path, fd, flags);
+
+		ret = cfd < 0 ? -1 : update_csums(cfd, oid, iocb);
+		if (ret < 0) {
+			sd_err("failed to write checksums of %s, %m", tmp_path);
+			ret = err_to_sderr(path, oid, errno);
+			if (cfd >= 0)
+				close_csum_fd(cfd, fd);
+			goto out;
+		}
+		close_csum_fd(cfd, fd);
+	}
+commit:
 	/*
 	 * Modern FS like ext4, xfs defaults to automatic syncing of files after
 	 * replace-via-rename and replace-via-truncate operations. So rename
@@ -316,7 +1095,125 @@ out:
 	return ret;
 }
 
-int default_link(uint64_t oid, uint32_t tgt_epoch)
+int default_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	int ret;
+
+	objlist_cache_begin_insert();
+	ret = create_and_write(oid, iocb);
+	objlist_cache_end_insert();
+
+	return ret;
+}
+
+/*
+ * Create oid as a copy of the local object src_oid, sharing its extents if the
+ * file system supports reflink, and apply the write of iocb to it.  The
+ * checksum table is copied along with the data.
+ */
+static int clone_and_write(uint64_t oid, uint64_t src_oid,
+			   const struct siocb *iocb)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX], src_path[PATH_MAX];
+	int flags = prepare_iocb(oid, iocb, true);
+	int ret, fd, src_fd;
+	struct stat st;
+
+	/* compressed objects are written block by block instead */
+	if (is_erasure_oid(oid) ||
+	    new_object_compression(oid) != SD_COMPRESS_NONE)
+		return SD_RES_NO_SUPPORT;
+
+	get_store_path(src_oid, 0, src_path);
+	if (!default_exist(src_oid, 0))
+		return SD_RES_NO_OBJ;
+	src_fd = open(src_path, O_RDONLY);
+	if (src_fd < 0) {
+		sd_debug("failed to open %s, %m", src_path);
+		return errno == ENOENT ? SD_RES_NO_OBJ :
+			err_to_sderr(src_path, src_oid, errno);
+	}
+	if (fstat(src_fd, &st) < 0) {
+		ret = err_to_sderr(src_path, src_oid, errno);
+		close(src_fd);
+		return ret;
+	}
+	if (object_compression(src_fd, src_oid) != SD_COMPRESS_NONE) {
+		close(src_fd);
+		return SD_RES_NO_SUPPORT;
+	}
+
+	sd_debug("%"PRIx64" from %"PRIx64, oid, src_oid);
+	get_store_path(oid, iocb->ec_index, path);
+	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
+	fd = open(tmp_path, flags, sd_def_fmode);
+	if (fd < 0) {
+		close(src_fd);
+		if (errno == EEXIST) {
+			/* see create_and_write() */
+			sd_debug("%s exists", tmp_path);
+			return SD_RES_SUCCESS;
+		}
+		sd_err("failed to open %s: %m", tmp_path);
+		return err_to_sderr(path, oid, errno);
+	}
+
+	ret = clone_file(fd, src_fd, st.st_size);
+	close(src_fd);
+	if (ret < 0) {
+		sd_debug("failed to clone %s, %m", src_path);
+		ret = SD_RES_NO_SUPPORT;
+		goto out;
+	}
+
+	ret = xpwrite(fd, iocb->buf, iocb->length, iocb->offset);
+	if (ret != iocb->length) {
+		sd_err("failed to write object. %m");
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	if (csum_enabled()) {
+		int cfd = open_csum_fd(tmp_path, fd, flags);
+
+		ret = cfd < 0 ? -1 : update_csums(cfd, oid, iocb);
+		if (ret < 0) {
+			sd_err("failed to write checksums of %s, %m", tmp_path);
+			ret = err_to_sderr(path, oid, errno);
+			if (cfd >= 0)
+				close_csum_fd(cfd, fd);
+			goto out;
+		}
+		close_csum_fd(cfd, fd);
+	}
+
+	if (rename(tmp_path, path) < 0) {
+		sd_err("failed to rename %s to %s: %m", tmp_path, path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	ret = SD_RES_SUCCESS;
+	objlist_cache_insert(oid);
+out:
+	if (ret != SD_RES_SUCCESS && unlink(tmp_path) != 0)
+		sd_err("failed to unlink %s: %m", tmp_path);
+	close(fd);
+	return ret;
+}
+
+int default_clone(uint64_t oid, uint64_t src_oid, const struct siocb *iocb)
+{
+	int ret;
+
+	objlist_cache_begin_insert();
+	ret = clone_and_write(oid, src_oid, iocb);
+	objlist_cache_end_insert();
+
+	return ret;
+}
+
+static int link_stale_object(uint64_t oid, uint32_t tgt_epoch)
 {
 	char path[PATH_MAX], stale_path[PATH_MAX];
 
@@ -338,9 +1235,22 @@ int default_link(uint64_t oid, uint32_t tgt_epoch)
 		return err_to_sderr(path, oid, errno);
 	}
 out:
+	/* let the next default_update_epoch() check it */
+	objlist_cache_insert(oid);
 	return SD_RES_SUCCESS;
 }
 
+int default_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	int ret;
+
+	objlist_cache_begin_insert();
+	ret = link_stale_object(oid, tgt_epoch);
+	objlist_cache_end_insert();
+
+	return ret;
+}
+
 /*
  * For replicated object, if any of the replica belongs to this node, we
  * consider it not stale.
@@ -418,10 +1328,98 @@ static int check_stale_objects(uint64_t oid, const char *wd, uint32_t epoch,
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * The ring and objlist sequence the objects in the working directory were
+ * last checked against.  Objects which were in the working directory at that
+ * time are known to belong to this node in that ring.
+ */
+static main_thread(struct vnode_info *) checked_vinfo;
+static uint64_t checked_seq;
+
+static int check_stale_object(uint64_t oid, struct vnode_info *vinfo,
+			      uint32_t *epoch)
+{
+	const char *wd = md_get_object_dir(oid);
+	char path[PATH_MAX];
+	int ret, nr_copies;
+
+	if (!is_erasure_oid(oid)) {
+		snprintf(path, PATH_MAX, "%s/%016"PRIx64, wd, oid);
+		if (access(path, F_OK) < 0)
+			return SD_RES_SUCCESS;
+		return check_stale_objects(oid, wd, 0, SD_MAX_COPIES, vinfo,
+					   epoch);
+	}
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	for (int i = 0; i < nr_copies; i++) {
+		snprintf(path, PATH_MAX, "%s/%016"PRIx64"_%d", wd, oid, i);
+		if (access(path, F_OK) < 0)
+			continue;
+		ret = check_stale_objects(oid, wd, 0, i, vinfo, epoch);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Only the objects placed in the part of the ring where this node's role has
+ * changed, and the ones stored since the last check, can have become stale.
+ * The VDIs can have their own copy number and the erasure coded objects span
+ * more nodes, so compare the roles as deep as the ring allows.
+ */
+static int update_epoch_incremental(struct vnode_info *old,
+				    struct vnode_info *cur, uint32_t epoch)
+{
+	struct vnode_range *ranges;
+	uint64_t *oids;
+	int nr_ranges, nr_oids, ret = SD_RES_SUCCESS;
+
+	nr_ranges = get_changed_vnode_ranges(old, cur, SD_MAX_COPIES, &ranges);
+	if (nr_ranges < 0)
+		return for_each_object_in_wd(check_stale_objects, false,
+					     &epoch);
+
+	oids = objlist_cache_collect(ranges, nr_ranges, checked_seq, &nr_oids);
+	sd_debug("%d changed ranges, %d objects to check", nr_ranges, nr_oids);
+	for (int i = 0; i < nr_oids; i++) {
+		ret = check_stale_object(oids[i], cur, &epoch);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+
+	free(oids);
+	free(ranges);
+	return ret;
+}
+
 int default_update_epoch(uint32_t epoch)
 {
+	struct vnode_info *old = main_thread_get(checked_vinfo);
+	struct vnode_info *cur = get_vnode_info();
+	uint64_t seq = objlist_cache_seq();
+	int ret;
+
 	sd_assert(epoch);
-	return for_each_object_in_wd(check_stale_objects, false, &epoch);
+	if (old)
+		ret = update_epoch_incremental(old, cur, epoch);
+	else
+		ret = for_each_object_in_wd(check_stale_objects, false,
+					    &epoch);
+
+	put_vnode_info(old);
+	if (ret == SD_RES_SUCCESS) {
+		main_thread_set(checked_vinfo, cur);
+		checked_seq = seq;
+	} else {
+		/* fall back to a full scan next time */
+		main_thread_set(checked_vinfo, NULL);
+		put_vnode_info(cur);
+	}
+
+	return ret;
 }
 
 int default_format(void)
@@ -456,8 +1454,6 @@ int default_remove_object(uint64_t oid, uint8_t ec_index)
 	return SD_RES_SUCCESS;
 }
 
-#define SHA1NAME "user.obj.sha1"
-
 static int get_object_sha1(const char *path, uint8_t *sha1)
 {
 	if (getxattr(path, SHA1NAME, sha1, SHA1_DIGEST_SIZE)
@@ -502,28 +1498,14 @@ static int get_object_path(uint64_t oid, uint32_t epoch, char *path,
 	return SD_RES_SUCCESS;
 }
 
-int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+static int compute_object_sha1(uint64_t oid, const char *path, uint32_t epoch,
+			       uint8_t *sha1)
 {
-	int ret;
-	void *buf;
 	struct siocb iocb = {};
-	uint32_t length;
-	bool is_readonly_obj = oid_is_readonly(oid);
-	char path[PATH_MAX];
-
-	ret = get_object_path(oid, epoch, path, sizeof(path));
-	if (ret != SD_RES_SUCCESS)
-		return ret;
-
-	if (is_readonly_obj) {
-		if (get_object_sha1(path, sha1) == 0) {
-			sd_debug("use cached sha1 digest %s",
-				 sha1_to_hex(sha1));
-			return SD_RES_SUCCESS;
-		}
-	}
+	uint32_t length = get_store_objsize(oid);
+	void *buf;
+	int ret;
 
-	length = get_store_objsize(oid);
 	buf = valloc(length);
 	if (buf == NULL)
 		return SD_RES_NO_MEM;
@@ -533,23 +1515,132 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	iocb.length = length;
 
 	ret = default_read_from_path(oid, path, &iocb);
-	if (ret != SD_RES_SUCCESS) {
-		free(buf);
+	if (ret == SD_RES_SUCCESS)
+		get_buffer_sha1(buf, length, sha1);
+	free(buf);
+
+	return ret;
+}
+
+int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	int ret, bucket = write_bucket(oid);
+	unsigned long begin;
+	bool cacheable;
+	char path[PATH_MAX];
+
+	ret = get_object_path(oid, epoch, path, sizeof(path));
+	if (ret != SD_RES_SUCCESS)
 		return ret;
+
+	if (get_object_sha1(path, sha1) == 0) {
+		sd_debug("use cached sha1 digest %s", sha1_to_hex(sha1));
+		return SD_RES_SUCCESS;
 	}
 
-	get_buffer_sha1(buf, length, sha1);
-	free(buf);
+	/* don't cache what a write in progress may be changing */
+	begin = uatomic_add_return(&write_begin[bucket], 0);
+	cacheable = uatomic_read(&write_end[bucket]) == begin;
+
+	ret = compute_object_sha1(oid, path, epoch, sha1);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
 	sd_debug("the message digest of %"PRIx64" at epoch %d is %s", oid,
 		 epoch, sha1_to_hex(sha1));
 
-	if (is_readonly_obj)
-		set_object_sha1(path, sha1);
+	if (cacheable && set_object_sha1(path, sha1) == 0) {
+		/* a write started meanwhile might have missed our xattr */
+		if (uatomic_add_return(&write_begin[bucket], 0) != begin &&
+		    removexattr(path, SHA1NAME) < 0 && errno != ENODATA)
+			sd_err("failed to remove sha1 of %s, %m", path);
+	}
 
 	return ret;
 }
 
+/*
+ * Check the data of the replicated object in the working directory against
+ * its cached digest.  If no digest is cached yet, the current one is cached
+ * for the next verification.  'sha1' is set to the digest of the data and
+ * 'computed' to true if the data could be read.
+ *
+ * Return SD_RES_EIO if the data doesn't match the cached digest or the
+ * block checksums.
+ */
+int default_verify(uint64_t oid, uint8_t *sha1, bool *computed)
+{
+	int ret, bucket = write_bucket(oid);
+	uint8_t cached[SHA1_DIGEST_SIZE];
+	unsigned long begin;
+	bool has_cached;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, md_get_object_dir(oid),
+		 oid);
+
+	begin = uatomic_add_return(&write_begin[bucket], 0);
+	if (uatomic_read(&write_end[bucket]) != begin)
+		/* being written, try again next time */
+		return SD_RES_SUCCESS;
+
+	*computed = false;
+	has_cached = get_object_sha1(path, cached) == 0;
+	ret = compute_object_sha1(oid, path, sys_epoch(), sha1);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	*computed = true;
+
+	/* the digest is only meaningful if no write raced with us */
+	if (uatomic_add_return(&write_begin[bucket], 0) != begin)
+		return SD_RES_SUCCESS;
+
+	if (!has_cached) {
+		set_object_sha1(path, sha1);
+		if (uatomic_add_return(&write_begin[bucket], 0) != begin &&
+		    removexattr(path, SHA1NAME) < 0 && errno != ENODATA)
+			sd_err("failed to remove sha1 of %s, %m", path);
+		return SD_RES_SUCCESS;
+	}
+
+	if (memcmp(cached, sha1, SHA1_DIGEST_SIZE) != 0) {
+		sd_err("%016"PRIx64" is corrupted, expected %s", oid,
+		       sha1_to_hex(cached));
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Replace the cached digest of the replicated object in the working directory
+ * with 'sha1', which the caller has found to be the right one.  Nothing is
+ * cached if the object is being written.
+ */
+int default_set_hash(uint64_t oid, const uint8_t *sha1)
+{
+	int bucket = write_bucket(oid);
+	unsigned long begin;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, md_get_object_dir(oid),
+		 oid);
+
+	begin = uatomic_add_return(&write_begin[bucket], 0);
+	if (uatomic_read(&write_end[bucket]) != begin)
+		return SD_RES_SUCCESS;
+
+	if (set_object_sha1(path, sha1) < 0)
+		return SD_RES_EIO;
+
+	/* a write started meanwhile might have missed our xattr */
+	if (uatomic_add_return(&write_begin[bucket], 0) != begin &&
+	    removexattr(path, SHA1NAME) < 0 && errno != ENODATA)
+		sd_err("failed to remove sha1 of %s, %m", path);
+
+	return SD_RES_SUCCESS;
+}
+
 int default_purge_obj(void)
 {
 	uint32_t tgt_epoch = get_latest_epoch();
@@ -558,21 +1649,277 @@ int default_purge_obj(void)
 				     &tgt_epoch);
 }
 
+static bool same_content(const char *path1, const char *path2, off_t size)
+{
+	const size_t chunk = 1024 * 1024;
+	char *buf1 = xmalloc(chunk), *buf2 = xmalloc(chunk);
+	int fd1 = open(path1, O_RDONLY), fd2 = open(path2, O_RDONLY);
+	bool ret = fd1 >= 0 && fd2 >= 0;
+
+	for (off_t off = 0; ret && off < size; off += chunk) {
+		size_t len = min((off_t)chunk, size - off);
+
+		ret = xpread(fd1, buf1, len, off) == len &&
+			xpread(fd2, buf2, len, off) == len &&
+			memcmp(buf1, buf2, len) == 0;
+	}
+
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+	free(buf1);
+	free(buf2);
+	return ret;
+}
+
+/* Add the object to the index as the first one with its content */
+static int add_dedup_entry(uint64_t oid, const char *path,
+			   const char *dedup_path, const uint8_t *sha1)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s/" DEDUP_DIR, md_get_object_dir(oid));
+	if (xmkdir(dir, sd_def_dmode) < 0)
+		goto err;
+	snprintf(dir, sizeof(dir), "%s/" DEDUP_DIR "/%.2s",
+		 md_get_object_dir(oid), sha1_to_hex(sha1));
+	if (xmkdir(dir, sd_def_dmode) < 0)
+		goto err;
+
+	if (setxattr(path, DEDUPNAME, sha1, SHA1_DIGEST_SIZE, 0) < 0)
+		goto err;
+	if (link(path, dedup_path) < 0) {
+		removexattr(path, DEDUPNAME);
+		goto err;
+	}
+
+	return SD_RES_SUCCESS;
+err:
+	sd_err("failed to index %s, %m", path);
+	return err_to_sderr(path, oid, errno);
+}
+
+/* The object is cold and unshared, and is still the file we looked at */
+static bool dedup_candidate(const struct stat *st, const struct stat *old,
+			    time_t cold)
+{
+	/* shared already or linked to the stale directory, or still hot */
+	if (st->st_nlink > 1 || st->st_mtime > cold)
+		return false;
+	return !old || (st->st_ino == old->st_ino &&
+			st->st_size == old->st_size &&
+			st->st_mtime == old->st_mtime);
+}
+
+/*
+ * Share the file of the object with the other objects of the same content on
+ * its disk if it hasn't been written since 'cold'.  The bytes freed by it are
+ * returned in 'saved'.
+ *
+ * The digest and the contents are compared without any lock, which would
+ * stall the writers of the bucket.  The share lock is taken only to see that
+ * neither file has changed meanwhile and to replace the object.
+ */
+int default_dedup(uint64_t oid, time_t cold, uint64_t *saved)
+{
+	char path[PATH_MAX], dedup_path[PATH_MAX], tmp_path[PATH_MAX];
+	int bucket = write_bucket(oid), ret = SD_RES_SUCCESS;
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	struct sd_mutex *lock;
+	struct stat st, dst, now;
+	bool indexed;
+
+	*saved = 0;
+	/* inodes are updated all the time, and strips hardly match */
+	if (is_erasure_oid(oid) || !is_data_obj(oid))
+		return SD_RES_SUCCESS;
+
+	get_store_path(oid, 0, path);
+	if (stat(path, &st) < 0)
+		return errno == ENOENT ? SD_RES_NO_OBJ :
+			err_to_sderr(path, oid, errno);
+	if (!dedup_candidate(&st, NULL, cold))
+		return SD_RES_SUCCESS;
+
+	ret = default_get_hash(oid, 0, sha1);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	get_dedup_path(oid, sha1, dedup_path);
+	indexed = stat(dedup_path, &dst) == 0;
+	if (!indexed && errno != ENOENT)
+		return err_to_sderr(dedup_path, oid, errno);
+	/* the digest may collide, and the checksums must match too */
+	if (indexed && (dst.st_size != st.st_size ||
+			!same_content(path, dedup_path, st.st_size)))
+		return SD_RES_SUCCESS;
+
+	/* same order as the writers which unshare the object */
+	sd_write_lock(&share_locks[bucket]);
+	lock = dedup_lock(sha1);
+	sd_mutex_lock(lock);
+	if (stat(path, &now) < 0) {
+		ret = errno == ENOENT ? SD_RES_NO_OBJ :
+			err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	if (!dedup_candidate(&now, &st, cold))
+		goto out;
+
+	if (!indexed) {
+		/* someone may have indexed the content meanwhile, next time */
+		if (stat(dedup_path, &dst) == 0)
+			goto out;
+		if (errno == ENOENT)
+			ret = add_dedup_entry(oid, path, dedup_path, sha1);
+		else
+			ret = err_to_sderr(dedup_path, oid, errno);
+		goto out;
+	}
+
+	/* the entry we compared with may have been unshared and purged */
+	if (stat(dedup_path, &now) < 0 || now.st_ino != dst.st_ino ||
+	    now.st_mtime != dst.st_mtime)
+		goto out;
+
+	get_store_tmp_path(oid, 0, tmp_path);
+	if (link(dedup_path, tmp_path) < 0 || rename(tmp_path, path) < 0) {
+		sd_err("failed to share %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		unlink(tmp_path);
+		goto out;
+	}
+	sd_debug("%016"PRIx64" shares %s", oid, dedup_path);
+	*saved = (uint64_t)st.st_blocks * 512;
+out:
+	sd_mutex_unlock(lock);
+	sd_rw_unlock(&share_locks[bucket]);
+	return ret;
+}
+
+static int hex_to_sha1(const char *hex, uint8_t *sha1)
+{
+	for (int i = 0; i < SHA1_DIGEST_SIZE; i++)
+		if (sscanf(hex + i * 2, "%2hhx", sha1 + i) != 1)
+			return -1;
+	return 0;
+}
+
+/* Remove the index entries which no object refers to any more */
+static int purge_dedup_dir(const char *path)
+{
+	char entry_path[PATH_MAX], hex[SHA1_DIGEST_SIZE * 2 + 1];
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	struct dirent *d, *e;
+	struct sd_mutex *lock;
+	struct stat st;
+	DIR *dir, *sub;
+
+	snprintf(entry_path, sizeof(entry_path), "%s/" DEDUP_DIR, path);
+	dir = opendir(entry_path);
+	if (!dir)
+		return SD_RES_SUCCESS;
+
+	while ((d = readdir(dir))) {
+		if (strlen(d->d_name) != 2)
+			continue;
+		snprintf(entry_path, sizeof(entry_path), "%s/" DEDUP_DIR "/%s",
+			 path, d->d_name);
+		sub = opendir(entry_path);
+		if (!sub)
+			continue;
+		while ((e = readdir(sub))) {
+			if (strlen(e->d_name) != sizeof(hex) - 3)
+				continue;
+			memcpy(hex, d->d_name, 2);
+			memcpy(hex + 2, e->d_name, sizeof(hex) - 2);
+			if (hex_to_sha1(hex, sha1) < 0)
+				continue;
+			snprintf(entry_path, sizeof(entry_path),
+				 "%s/" DEDUP_DIR "/%.2s/%s", path, hex, hex + 2);
+
+			lock = dedup_lock(sha1);
+			sd_mutex_lock(lock);
+			if (stat(entry_path, &st) == 0 && st.st_nlink == 1 &&
+			    unlink(entry_path) < 0)
+				sd_err("failed to unlink %s, %m", entry_path);
+			sd_mutex_unlock(lock);
+		}
+		closedir(sub);
+	}
+	closedir(dir);
+
+	return SD_RES_SUCCESS;
+}
+
+int default_purge_dedup(void)
+{
+	return for_each_obj_path(purge_dedup_dir);
+}
+
+/*
+ * Sum up the logical size of the compressed objects in the working directory
+ * 'path' and the space they take.
+ */
+int default_compressed_size(const char *path, uint64_t *size, uint64_t *used)
+{
+	char p[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	uint64_t oid;
+	uint8_t algo;
+	char *end;
+	DIR *dir;
+
+	*size = *used = 0;
+	dir = opendir(path);
+	if (!dir) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_EIO;
+	}
+
+	while ((d = readdir(dir))) {
+		/* only the objects themselves, not the temporary ones */
+		oid = strtoull(d->d_name, &end, 16);
+		if (*end || !may_be_compressed(oid))
+			continue;
+
+		snprintf(p, sizeof(p), "%s/%s", path, d->d_name);
+		if (getxattr(p, COMPRESSNAME, &algo, sizeof(algo)) !=
+		    sizeof(algo) || stat(p, &st) < 0)
+			continue;
+
+		*size += get_store_objsize(oid);
+		*used += (uint64_t)st.st_blocks * 512;
+	}
+	closedir(dir);
+
+	return SD_RES_SUCCESS;
+}
+
 static struct store_driver plain_store = {
 	.id = PLAIN_STORE,
 	.name = "plain",
 	.init = default_init,
 	.exist = default_exist,
 	.create_and_write = default_create_and_write,
+	.clone = default_clone,
 	.write = default_write,
 	.read = default_read,
+	.punch = default_punch,
 	.link = default_link,
 	.update_epoch = default_update_epoch,
 	.cleanup = default_cleanup,
 	.format = default_format,
 	.remove_object = default_remove_object,
 	.get_hash = default_get_hash,
+	.verify = default_verify,
+	.set_hash = default_set_hash,
 	.purge_obj = default_purge_obj,
+	.dedup = default_dedup,
+	.purge_dedup = default_purge_dedup,
+	.compressed_size = default_compressed_size,
 };
 
 add_store_driver(plain_store);
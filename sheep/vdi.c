@@ -14,6 +14,8 @@
 struct vdi_state_entry {
 	uint32_t vid;
 	bool snapshot;
+	uint8_t compression;
+	uint8_t block_size_shift;
 	struct rb_node node;
 };
 
@@ -122,37 +124,127 @@ int get_req_copy_number(struct request *req)
 	return nr_copies;
 }
 
-void vdi_mark_snapshot(uint32_t vid)
+/* Return the state entry of the VDI, called with vdi_state_lock held */
+static struct vdi_state_entry *vdi_state_get(uint32_t vid)
 {
 	struct vdi_state_entry *entry, *old;
 
 	entry = xzalloc(sizeof(*entry));
 	entry->vid = vid;
-	entry->snapshot = true;
-
-	sd_debug("%" PRIx32, vid);
 
-	sd_write_lock(&vdi_state_lock);
 	old = vdi_state_insert(&vdi_state_root, entry);
 	if (old) {
 		free(entry);
 		entry = old;
-		entry->snapshot = true;
 	}
 
+	return entry;
+}
+
+void vdi_mark_snapshot(uint32_t vid)
+{
+	sd_debug("%" PRIx32, vid);
+
+	sd_write_lock(&vdi_state_lock);
+	vdi_state_get(vid)->snapshot = true;
 	sd_rw_unlock(&vdi_state_lock);
 }
 
-void vdi_delete_state(uint32_t vid)
+void vdi_set_compression(uint32_t vid, uint8_t compression)
+{
+	sd_debug("%" PRIx32 " %" PRIu8, vid, compression);
+
+	sd_write_lock(&vdi_state_lock);
+	vdi_state_get(vid)->compression = compression;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+void vdi_set_block_size_shift(uint32_t vid, uint8_t block_size_shift)
+{
+	sd_debug("%" PRIx32 " %" PRIu8, vid, block_size_shift);
+
+	sd_write_lock(&vdi_state_lock);
+	vdi_state_get(vid)->block_size_shift = block_size_shift;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+/* Return how the new data objects of the VDI are to be compressed */
+uint8_t get_vdi_compression(uint32_t vid)
 {
 	struct vdi_state_entry *entry;
+	uint8_t compression = SD_COMPRESS_NONE;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry)
+		compression = entry->compression;
+	sd_rw_unlock(&vdi_state_lock);
+
+	return compression;
+}
+
+/*
+ * Return the block_size_shift of the VDI, which is fixed at its creation, or 0
+ * if we don't know the VDI.
+ *
+ * Every node learns it from the new VDI notification, from the local inodes at
+ * startup and from the other nodes when it joins, see get_vdi_state_from().
+ */
+uint8_t get_vdi_block_size_shift(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+	uint8_t shift = 0;
 
-	sd_debug("%"PRIx32, vid);
 	sd_read_lock(&vdi_state_lock);
 	entry = vdi_state_search(&vdi_state_root, vid);
 	if (entry)
+		shift = entry->block_size_shift;
+	sd_rw_unlock(&vdi_state_lock);
+
+	return shift;
+}
+
+/*
+ * Return the size of the object, data objects are sized by their VDI.  Return
+ * 0 if the size of the VDI is unknown, guessing it would lose data.
+ */
+size_t get_vdi_objsize(uint64_t oid)
+{
+	uint8_t shift;
+
+	if (!is_data_obj(oid))
+		return get_objsize(oid, 0);
+
+	shift = get_vdi_block_size_shift(oid_to_vid(oid));
+	if (unlikely(!shift)) {
+		sd_err("unknown object size of %016"PRIx64, oid);
+		return 0;
+	}
+
+	return get_objsize(oid, shift);
+}
+
+/*
+ * The data objects of a deleted VDI can still be shared by its clones, so we
+ * keep its object size.
+ */
+void vdi_delete_state(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+
+	sd_debug("%"PRIx32, vid);
+	sd_write_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry && entry->block_size_shift) {
+		entry->snapshot = false;
+		entry->compression = SD_COMPRESS_NONE;
+	} else if (entry) {
 		rb_erase(&entry->node, &vdi_state_root);
+		free(entry);
+	}
 	sd_rw_unlock(&vdi_state_lock);
+
+	metrics_delete_vdi(vid);
 }
 
 static inline bool vdi_is_deleted(struct sd_inode *inode)
@@ -184,10 +276,10 @@ out:
 	return ret;
 }
 
+/* Allocate the inode of a new vdi, which is based on 'base' if given */
 static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 				    uint32_t new_snapid, uint32_t new_vid,
-				    uint32_t *data_vdi_id,
-				    struct generation_reference *gref)
+				    struct sd_inode *base)
 {
 	struct sd_inode *new = xzalloc(sizeof(*new));
 
@@ -198,26 +290,32 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 	new->copy_policy = iocb->copy_policy;
 	new->store_policy = iocb->store_policy;
 	new->nr_copies = iocb->nr_copies;
-	new->block_size_shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	new->block_size_shift = iocb->block_size_shift ?:
+		SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	new->compression = iocb->compression;
 	new->snap_id = new_snapid;
 	new->parent_vdi_id = iocb->base_vid;
-	if (data_vdi_id)
+	if (base) {
 		sd_inode_copy_vdis(sheep_bnode_writer, sheep_bnode_reader,
-				   data_vdi_id, iocb->store_policy,
+				   base->data_vdi_id, iocb->store_policy,
 				   iocb->nr_copies, iocb->copy_policy, new);
-	else if (new->store_policy)
-		sd_inode_init(new->data_vdi_id, 1);
-
-	if (gref) {
-		sd_assert(data_vdi_id);
 
 		for (int i = 0; i < SD_INODE_DATA_INDEX; i++) {
-			if (!data_vdi_id[i])
+			if (!base->data_vdi_id[i])
 				continue;
 
-			new->gref[i].generation = gref[i].generation + 1;
+			new->gref[i].generation = base->gref[i].generation + 1;
 		}
-	}
+
+		/* clones and snapshots compress like their parent by default */
+		if (new->compression == SD_COMPRESS_NONE)
+			new->compression = base->compression;
+
+		/* they share the data objects of the parent, so their size too */
+		new->block_size_shift = base->block_size_shift ?:
+			SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	} else if (new->store_policy)
+		sd_inode_init(new->data_vdi_id, 1);
 
 	return new;
 }
@@ -226,8 +324,7 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 static int create_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		      uint32_t new_vid)
 {
-	struct sd_inode *new = alloc_inode(iocb, new_snapid, new_vid, NULL,
-					   NULL);
+	struct sd_inode *new = alloc_inode(iocb, new_snapid, new_vid, NULL);
 	int ret;
 
 	sd_debug("%s: size %" PRIu64 ", new_vid %" PRIx32 ", copies %d, "
@@ -244,6 +341,18 @@ static int create_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 	return ret;
 }
 
+/*
+ * The clones of a base VDI can be created concurrently in a block of the
+ * cluster, see cluster_op_keys().  All the operations of a block are executed
+ * by the node which has issued it, so a local lock is enough to serialize
+ * the read-modify-write of the gref of the base.
+ */
+#define NR_BASE_LOCKS 64
+
+static struct sd_mutex base_locks[NR_BASE_LOCKS] = {
+	[0 ... NR_BASE_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
 /*
  * Create a clone vdi from the existing snapshot
  *
@@ -265,15 +374,18 @@ static int clone_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		     uint32_t new_vid, uint32_t base_vid)
 {
 	struct sd_inode *new = NULL, *base = xzalloc(sizeof(*base));
+	struct sd_mutex *lock = base_locks + base_vid % NR_BASE_LOCKS;
 	int ret;
 
 	sd_debug("%s: size %" PRIu64 ", vid %" PRIx32 ", base %" PRIx32 ", "
 		 "copies %d, snapid %" PRIu32, iocb->name, iocb->size, new_vid,
 		 base_vid, iocb->nr_copies, new_snapid);
 
+	sd_mutex_lock(lock);
 	ret = sd_read_object(vid_to_vdi_oid(base_vid), (char *)base,
 			     sizeof(*base), 0);
 	if (ret != SD_RES_SUCCESS) {
+		sd_mutex_unlock(lock);
 		ret = SD_RES_BASE_VDI_READ;
 		goto out;
 	}
@@ -288,14 +400,14 @@ static int clone_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 	ret = sd_write_object(vid_to_vdi_oid(base_vid), (char *)base->gref,
 			      sizeof(base->gref),
 			      offsetof(struct sd_inode, gref), false);
+	sd_mutex_unlock(lock);
 	if (ret != SD_RES_SUCCESS) {
 		ret = SD_RES_BASE_VDI_WRITE;
 		goto out;
 	}
 
 	/* create a new vdi */
-	new = alloc_inode(iocb, new_snapid, new_vid, base->data_vdi_id,
-			  base->gref);
+	new = alloc_inode(iocb, new_snapid, new_vid, base);
 	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
 			      sizeof(*new), 0, true);
 	if (ret != SD_RES_SUCCESS)
@@ -359,8 +471,7 @@ static int snapshot_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 	}
 
 	/* create a new vdi */
-	new = alloc_inode(iocb, new_snapid, new_vid, base->data_vdi_id,
-			  base->gref);
+	new = alloc_inode(iocb, new_snapid, new_vid, base);
 	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
 			      sizeof(*new), 0, true);
 	if (ret != SD_RES_SUCCESS)
@@ -434,8 +545,7 @@ static int rebase_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 	}
 
 	/* create a new vdi */
-	new = alloc_inode(iocb, new_snapid, new_vid, base->data_vdi_id,
-			  base->gref);
+	new = alloc_inode(iocb, new_snapid, new_vid, base);
 	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
 			      sizeof(*new), 0, true);
 	if (ret != SD_RES_SUCCESS)
@@ -709,7 +819,7 @@ static void delete_cb(struct sd_index *idx, void *arg, int ignore)
 			sd_debug("object %" PRIx64 " is base's data, would"
 				 " not be deleted.", oid);
 		else {
-			ret = sd_remove_object(oid);
+			ret = sd_remove_object(oid, true);
 			if (ret != SD_RES_SUCCESS)
 				sd_err("remove object %" PRIx64 " fail, %d",
 				       oid, ret);
@@ -753,7 +863,7 @@ static int vdi_delete_horse(int32_t vid)
 
 			oid = vid_to_data_oid(vdi_id, i);
 			ret = sd_unref_object(oid, inode->gref[i].generation,
-					      inode->gref[i].count);
+					      inode->gref[i].count, true);
 			/*
 			 * Return error if we fail to remove any object.
 			 *
@@ -911,6 +1021,47 @@ out:
 	return ret;
 }
 
+/*
+ * Fill vs with the object size and compression of the VDIs we know, return -1
+ * if there are more than max.  The snapshot mark stays private to the node.
+ */
+int get_vdi_state_list(struct sd_vdi_state *vs, size_t max)
+{
+	struct vdi_state_entry *entry;
+	int nr = 0;
+
+	sd_read_lock(&vdi_state_lock);
+	rb_for_each_entry(entry, &vdi_state_root, node) {
+		if (nr == max) {
+			nr = -1;
+			break;
+		}
+		vs[nr].vid = entry->vid;
+		vs[nr].block_size_shift = entry->block_size_shift;
+		vs[nr].compression = entry->compression;
+		nr++;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+
+	return nr;
+}
+
+/* Learn the VDIs that another node knows */
+void apply_vdi_state_list(const struct sd_vdi_state *vs, int nr)
+{
+	struct vdi_state_entry *entry;
+
+	sd_write_lock(&vdi_state_lock);
+	for (int i = 0; i < nr; i++) {
+		entry = vdi_state_get(vs[i].vid);
+		if (vs[i].block_size_shift)
+			entry->block_size_shift = vs[i].block_size_shift;
+		if (vs[i].compression != SD_COMPRESS_NONE)
+			entry->compression = vs[i].compression;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+}
+
 void clean_vdi_state(void)
 {
 	sd_write_lock(&vdi_state_lock);
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2009-2011 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The vnode ring of a membership.
+ *
+ * A vnode_info is immutable once published, so every membership change
+ * allocates a new one. The nodes and the vnodes of a vnode_info live in two
+ * arrays, and the vnode array is kept sorted by hash. That lets us derive the
+ * ring of the next membership from the previous one: the vnodes of the nodes
+ * whose placement didn't change are merged with the vnodes of the new nodes
+ * in one pass, and the rb tree is built from the sorted array without any
+ * rebalancing. A join or leave in a cluster of thousands of nodes then costs
+ * a linear copy instead of hashing and inserting every vnode again.
+ */
+
+#include "sheep_priv.h"
+
+static int get_zones_nr_from(struct rb_root *nroot)
+{
+	int nr_zones = 0, j;
+	uint32_t zones[SD_MAX_COPIES];
+	struct sd_node *n;
+
+	rb_for_each_entry(n, nroot, rb) {
+		/*
+		 * Only count zones that actually store data, pure gateways
+		 * don't contribute to the redundancy level.
+		 */
+		if (!n->nr_vnodes)
+			continue;
+
+		for (j = 0; j < nr_zones; j++) {
+			if (n->zone == zones[j])
+				break;
+		}
+
+		if (j == nr_zones) {
+			zones[nr_zones] = n->zone;
+			if (++nr_zones == ARRAY_SIZE(zones))
+				break;
+		}
+	}
+
+	return nr_zones;
+}
+
+/*
+ * Grab an additional reference to the passed in vnode info.
+ *
+ * The caller must already hold a reference to vnode_info, this function must
+ * only be used to grab an additional reference from code that wants the
+ * vnode information to outlive the request structure.
+ */
+struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info)
+{
+	refcount_inc(&vnode_info->refcnt);
+	return vnode_info;
+}
+
+/* Release a reference to the current vnode information. */
+void put_vnode_info(struct vnode_info *vnode_info)
+{
+	if (vnode_info) {
+		if (refcount_dec(&vnode_info->refcnt) == 0) {
+			free(vnode_info->vnodes);
+			free(vnode_info->nodes);
+			free(vnode_info);
+		}
+	}
+}
+
+static void recalculate_vnodes(struct rb_root *nroot)
+{
+	int nr_non_gateway_nodes = 0;
+	uint64_t avg_size = 0;
+	struct sd_node *n;
+	float factor;
+
+	rb_for_each_entry(n, nroot, rb) {
+		if (n->space) {
+			avg_size += n->space;
+			nr_non_gateway_nodes++;
+		}
+	}
+
+	if (!nr_non_gateway_nodes)
+		return;
+
+	avg_size /= nr_non_gateway_nodes;
+
+	rb_for_each_entry(n, nroot, rb) {
+		factor = (float)n->space / (float)avg_size;
+		n->nr_vnodes = rintf(SD_DEFAULT_VNODES * factor);
+		sd_debug("node %s has %d vnodes, free space %" PRIu64,
+			 node_to_str(n), n->nr_vnodes, n->space);
+	}
+}
+
+/* Return the number of vnodes of 'n', same as node_(disk_)to_vnodes() */
+static int node_nr_vnodes(const struct sd_node *n, bool diskmode)
+{
+	int nr = 0;
+
+	if (!diskmode)
+		return n->nr_vnodes;
+
+	for (int j = 0; j < DISK_MAX; j++) {
+		if (!n->disks[j].disk_id)
+			continue;
+		nr += DIV_ROUND_UP(n->disks[j].disk_space, WEIGHT_MIN);
+	}
+	return nr;
+}
+
+/* Fill 'v' with the vnodes of 'n' and return the number of them */
+static int node_fill_vnodes(const struct sd_node *n, struct sd_vnode *v,
+			    bool diskmode)
+{
+	uint64_t node_hval = sd_hash(&n->nid, offsetof(typeof(n->nid),
+						       io_addr));
+	uint64_t hval, disk_vnodes;
+	int nr = 0;
+
+	if (!diskmode) {
+		hval = node_hval;
+		for (int i = 0; i < n->nr_vnodes; i++) {
+			hval = sd_hash_next(hval);
+			v[nr].hash = hval;
+			v[nr++].node = n;
+		}
+		return nr;
+	}
+
+	for (int j = 0; j < DISK_MAX; j++) {
+		if (!n->disks[j].disk_id)
+			continue;
+		hval = fnv_64a_64(node_hval, n->disks[j].disk_id);
+		disk_vnodes = DIV_ROUND_UP(n->disks[j].disk_space, WEIGHT_MIN);
+		for (int k = 0; k < disk_vnodes; k++) {
+			hval = sd_hash_next(hval);
+			v[nr].hash = hval;
+			v[nr++].node = n;
+		}
+	}
+	return nr;
+}
+
+/* Whether 'a' and 'b' own the same vnodes on the ring */
+static bool same_placement(const struct sd_node *a, const struct sd_node *b,
+			   bool diskmode)
+{
+	if (!node_eq(a, b))
+		return false;
+	if (diskmode)
+		return !memcmp(a->disks, b->disks,
+			       sizeof(struct disk_info) * DISK_MAX);
+	return a->nr_vnodes == b->nr_vnodes;
+}
+
+/*
+ * Build a red-black tree of v[start..end) which is sorted. The tree is as
+ * balanced as possible, so all the nodes are black except for the ones at the
+ * deepest level 'red_depth', which are red.
+ */
+static struct rb_node *build_vnode_tree(struct sd_vnode *v, int start,
+					int end, int depth, int red_depth,
+					struct rb_node *parent)
+{
+	struct rb_node *rb;
+	int mid;
+
+	if (start >= end)
+		return NULL;
+
+	mid = start + (end - start) / 2;
+	rb = &v[mid].rb;
+	rb->rb_parent_color = (unsigned long)parent;
+	rb_set_color(rb, depth == red_depth ? RB_RED : RB_BLACK);
+	rb->rb_left = build_vnode_tree(v, start, mid, depth + 1, red_depth,
+				       rb);
+	rb->rb_right = build_vnode_tree(v, mid + 1, end, depth + 1, red_depth,
+					rb);
+	return rb;
+}
+
+static void vnode_ring_init(struct rb_root *vroot, struct sd_vnode *v, int nr)
+{
+	int red_depth = 0;
+
+	/* depth of the deepest level, which is never the root */
+	while ((2 << red_depth) <= nr)
+		red_depth++;
+	if (red_depth == 0)
+		red_depth = -1;
+
+	vroot->rb_node = build_vnode_tree(v, 0, nr, 0, red_depth, NULL);
+	vroot->nr = nr;
+}
+
+/*
+ * Allocate the vnode info of the membership 'nroot'.
+ *
+ * If 'prev' is given, the vnodes of the nodes which have the same placement in
+ * 'prev' are taken from it instead of being hashed again. The result is the
+ * same as alloc_vnode_info(nroot).
+ */
+struct vnode_info *alloc_vnode_info_from(const struct vnode_info *prev,
+					 const struct rb_root *nroot)
+{
+	bool diskmode = is_cluster_diskmode(&sys->cinfo);
+	struct vnode_info *vnode_info;
+	const struct sd_node **map = NULL;
+	struct sd_vnode *fresh, *v;
+	struct sd_node *n, *o;
+	bool *kept;
+	int nr_nodes = 0, nr_fresh = 0, nr_vnodes = 0, i, j, k;
+
+	vnode_info = xzalloc(sizeof(*vnode_info));
+	INIT_RB_ROOT(&vnode_info->vroot);
+	INIT_RB_ROOT(&vnode_info->nroot);
+
+	rb_for_each_entry(n, nroot, rb)
+		nr_nodes++;
+	vnode_info->nodes = xcalloc(nr_nodes, sizeof(struct sd_node));
+	rb_for_each_entry(n, nroot, rb) {
+		struct sd_node *new = vnode_info->nodes + vnode_info->nr_nodes;
+
+		*new = *n;
+		if (unlikely(rb_insert(&vnode_info->nroot, new, rb, node_cmp)))
+			panic("node hash collision");
+		vnode_info->nr_nodes++;
+	}
+
+	recalculate_vnodes(&vnode_info->nroot);
+
+	/* map the nodes of 'prev' which keep their vnodes to our copies */
+	if (prev)
+		map = xcalloc(prev->nr_nodes, sizeof(*map));
+	kept = xcalloc(nr_nodes, sizeof(*kept));
+	for (i = 0; i < nr_nodes; i++) {
+		n = vnode_info->nodes + i;
+		o = prev ? rb_search(&prev->nroot, n, rb, node_cmp) : NULL;
+		if (o && same_placement(o, n, diskmode)) {
+			map[o - prev->nodes] = n;
+			n->nr_vnodes = o->nr_vnodes;
+			nr_vnodes += o->nr_vnodes;
+			kept[i] = true;
+		} else {
+			nr_fresh += node_nr_vnodes(n, diskmode);
+		}
+	}
+
+	fresh = xcalloc(nr_fresh, sizeof(*fresh));
+	nr_fresh = 0;
+	for (i = 0; i < nr_nodes; i++) {
+		n = vnode_info->nodes + i;
+		if (kept[i])
+			continue;
+		k = node_fill_vnodes(n, fresh + nr_fresh, diskmode);
+		if (diskmode)
+			n->nr_vnodes = k;
+		nr_fresh += k;
+	}
+	xqsort(fresh, nr_fresh, vnode_cmp);
+	nr_vnodes += nr_fresh;
+
+	/* merge the surviving vnodes of 'prev' with the fresh ones */
+	v = vnode_info->vnodes = xcalloc(nr_vnodes, sizeof(*v));
+	i = j = k = 0;
+	while (prev && i < prev->nr_vnodes) {
+		const struct sd_vnode *pv = prev->vnodes + i;
+		const struct sd_node *to = map[pv->node - prev->nodes];
+
+		if (!to) {
+			i++;
+			continue;
+		}
+		if (j < nr_fresh && fresh[j].hash < pv->hash) {
+			v[k++] = fresh[j++];
+			continue;
+		}
+		v[k].hash = pv->hash;
+		v[k++].node = to;
+		i++;
+	}
+	while (j < nr_fresh)
+		v[k++] = fresh[j++];
+	sd_assert(k == nr_vnodes);
+	for (i = 1; i < nr_vnodes; i++)
+		if (unlikely(v[i - 1].hash == v[i].hash))
+			panic("vdisk hash collison");
+
+	vnode_info->nr_vnodes = nr_vnodes;
+	vnode_ring_init(&vnode_info->vroot, v, nr_vnodes);
+	vnode_info->nr_zones = get_zones_nr_from(&vnode_info->nroot);
+	refcount_set(&vnode_info->refcnt, 1);
+
+	free(fresh);
+	free(kept);
+	free(map);
+	return vnode_info;
+}
+
+struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
+{
+	return alloc_vnode_info_from(NULL, nroot);
+}
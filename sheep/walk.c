@@ -0,0 +1,131 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The background passes over the objects stored on this node, e.g. scrubbing
+ * and deduplication, share the walker here.  A pass starts when the cluster is
+ * in a steady state and walks the objects of the object list cache disk by
+ * disk.  Each disk is read at most walker->iops objects a second on average;
+ * the objects of a batch are handled at full speed with the md lock held, and
+ * the walker sleeps out the rest of the budget of the batch after dropping
+ * the lock.  The pass gives up as soon as the epoch changes, and the next one
+ * starts walker->interval seconds after it ends.
+ */
+
+#include "sheep_priv.h"
+
+/* max nr of objects handled with the md lock held */
+#define WALK_BATCH	1024
+
+struct walk_batch {
+	struct oid_walk *walk;
+	const uint64_t *oids;
+};
+
+bool oid_walk_should_stop(const struct oid_walk *walk)
+{
+	return sys_epoch() != walk->epoch ||
+		sys->cinfo.status != SD_STATUS_OK;
+}
+
+/* called by the thread of the disk the object is stored on */
+static void walk_object(int i, void *arg)
+{
+	struct walk_batch *batch = arg;
+
+	if (oid_walk_should_stop(batch->walk))
+		return;
+	batch->walk->walker->object_fn(batch->oids[i], batch->walk);
+}
+
+static void walk_work(struct work *work)
+{
+	struct oid_walk *walk = container_of(work, struct oid_walk, work);
+	struct oid_walker *walker = walk->walker;
+	uint32_t nr_disks = max(md_nr_disks(), 1U);
+	/* about a second worth of objects of all the disks */
+	int size = min((uint64_t)WALK_BATCH, (uint64_t)walker->iops * nr_disks);
+	bool done = true;
+
+	sd_info("start a %s pass over %d objects", walker->name,
+		walk->nr_oids);
+	for (int i = 0; i < walk->nr_oids; i += size) {
+		struct walk_batch batch = { walk, walk->oids + i };
+		int nr = min(size, walk->nr_oids - i);
+		uint64_t start, elapsed, budget;
+
+		if (oid_walk_should_stop(walk)) {
+			sd_info("%s pass is interrupted at epoch %"PRIu32,
+				walker->name, walk->epoch);
+			done = false;
+			break;
+		}
+
+		start = clock_get_time();
+		md_for_each_oid(batch.oids, nr, walk_object, &batch);
+
+		/* stay within the iops budget of the disks */
+		budget = 1000000000ULL * nr / walker->iops / nr_disks;
+		elapsed = clock_get_time() - start;
+		if (elapsed < budget)
+			usleep((budget - elapsed) / 1000);
+	}
+
+	walker->finish(walk, done);
+}
+
+static void walk_done(struct work *work)
+{
+	struct oid_walk *walk = container_of(work, struct oid_walk, work);
+	struct oid_walker *walker = walk->walker;
+
+	put_vnode_info(walk->vinfo);
+	free(walk->oids);
+	free(walk);
+
+	add_timer(&walker->timer, walker->interval * 1000);
+}
+
+static void walk_timer_fn(void *data)
+{
+	struct oid_walker *walker = data;
+	struct oid_walk *walk;
+
+	/* the objects are moving around, try again later */
+	if (!sd_store || sys->cinfo.status != SD_STATUS_OK ||
+	    node_in_recovery()) {
+		add_timer(&walker->timer, walker->start_delay * 1000);
+		return;
+	}
+
+	walk = xzalloc(sizeof(*walk));
+	walk->walker = walker;
+	walk->epoch = sys->cinfo.epoch;
+	walk->vinfo = get_vnode_info();
+	/* every cached oid has a sequence number above zero */
+	walk->oids = objlist_cache_collect(NULL, 0, 0, &walk->nr_oids);
+
+	if (!walker->prepare(walk)) {
+		put_vnode_info(walk->vinfo);
+		free(walk->oids);
+		free(walk);
+		return;
+	}
+
+	walk->work.fn = walk_work;
+	walk->work.done = walk_done;
+	queue_work(walker->wqueue, &walk->work);
+}
+
+void start_oid_walker(struct oid_walker *walker)
+{
+	walker->timer.callback = walk_timer_fn;
+	walker->timer.data = walker;
+	add_timer(&walker->timer, walker->start_delay * 1000);
+}
@@ -197,14 +197,22 @@ static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
 			    off_t offset, int rw)
 {
 	uint32_t vid;
-	uint64_t oid;
+	uint64_t oid, obj_size;
 	unsigned long idx;
 	off_t start;
 	size_t len, ret, vdi_size, sz;
+	struct vdi_inode *vdi;
 
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -1;
 
+	sd_read_lock(&vdi_inode_tree_lock);
+	vdi = vdi_inode_tree_search(vid);
+	sd_rw_unlock(&vdi_inode_tree_lock);
+	if (!vdi)
+		return -1;
+	obj_size = sd_data_obj_size(vdi->inode->block_size_shift);
+
 	if (shadow_file_getxattr(path, SH_SIZE_NAME, &vdi_size, SH_SIZE_SIZE)
 	    < 0)
 		return -1;
@@ -216,11 +224,11 @@ static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
 		size = vdi_size - offset;
 
 	sz = size;
-	idx = offset / SD_DATA_OBJ_SIZE;
+	idx = offset / obj_size;
 	oid = vid_to_data_oid(vid, idx);
-	start = offset % SD_DATA_OBJ_SIZE;
+	start = offset % obj_size;
 
-	len = SD_DATA_OBJ_SIZE - start;
+	len = obj_size - start;
 	if (size < len)
 		len = size;
 
@@ -238,9 +246,9 @@ static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
 
 		oid++;
 		size -= len;
-		start = (start + len) % SD_DATA_OBJ_SIZE;
+		start = (start + len) % obj_size;
 		buf += len;
-		len = size > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : size;
+		len = size > obj_size ? obj_size : size;
 	} while (size > 0);
 
 	return sz - size;
@@ -16,3 +16,4 @@
 
 MOCK_METHOD(exec_local_req, int, 0, struct sd_req *rq, void *data)
 MOCK_VOID_METHOD(put_request, struct request *req)
+MOCK_VOID_METHOD(metrics_delete_vdi, uint32_t vid)
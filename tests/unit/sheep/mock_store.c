@@ -22,4 +22,4 @@ MOCK_METHOD(sd_write_object, int, 0,
 MOCK_METHOD(read_backend_object, int, 0,
 	    uint64_t oid, char *data, unsigned int datalen, uint64_t offset)
 MOCK_METHOD(sd_remove_object, int, 0,
-	    uint64_t oid)
+	    uint64_t oid, bool background)
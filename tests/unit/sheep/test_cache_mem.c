@@ -0,0 +1,103 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include "sheep_priv.h"
+
+#define BS		MEM_CACHE_BLOCK_SIZE
+#define OBJ_SIZE	(4 * 1024 * 1024)
+#define NR_BLOCKS	8
+
+static char obj[OBJ_SIZE], buf[OBJ_SIZE];
+
+static void gen_obj(void)
+{
+	for (int i = 0; i < OBJ_SIZE; i++)
+		obj[i] = i * 13;
+}
+
+START_TEST(test_read_write)
+{
+	gen_obj();
+	mem_cache_init(NR_BLOCKS * BS);
+
+	ck_assert(!mem_cache_read(1, 0, buf, 4096, 100));
+	mem_cache_fill(1, 0, obj, 2 * BS, 0, OBJ_SIZE);
+	ck_assert(mem_cache_read(1, 0, buf, 4096, 100));
+	ck_assert(!memcmp(buf, obj + 100, 4096));
+	ck_assert(mem_cache_read(1, 0, buf, BS, BS - 5));
+	ck_assert(!memcmp(buf, obj + BS - 5, BS));
+	/* the third block is not there */
+	ck_assert(!mem_cache_read(1, 0, buf, BS, BS + 5));
+
+	/* the blocks in memory are written through */
+	memset(obj + 50, 'x', 100);
+	mem_cache_write(1, 0, obj + 50, 100, 50);
+	ck_assert(mem_cache_read(1, 0, buf, 200, 0));
+	ck_assert(!memcmp(buf, obj, 200));
+
+	/* the last block of an object can be short */
+	mem_cache_fill(2, 1, obj, 100000, 0, 100000);
+	ck_assert(mem_cache_read(2, 1, buf, 1000, 99000));
+	ck_assert(!memcmp(buf, obj + 99000, 1000));
+
+	mem_cache_drop(1, 0, OBJ_SIZE);
+	ck_assert(!mem_cache_read(1, 0, buf, 200, 0));
+	mem_cache_drop(2, 1, 100000);
+}
+END_TEST
+
+START_TEST(test_scan_resistance)
+{
+	struct object_cache_info info = {};
+
+	gen_obj();
+	mem_cache_init(NR_BLOCKS * BS);
+
+	/* read twice, the blocks are protected */
+	mem_cache_fill(3, 0, obj, 2 * BS, 0, OBJ_SIZE);
+	ck_assert(mem_cache_read(3, 0, buf, 200, 0));
+	ck_assert(mem_cache_read(3, 0, buf, 200, BS));
+
+	/* a scan much larger than the budget */
+	mem_cache_fill(4, 0, obj, OBJ_SIZE, 0, OBJ_SIZE);
+
+	ck_assert(mem_cache_read(3, 0, buf, 200, 0));
+	ck_assert(mem_cache_read(3, 0, buf, 200, BS));
+	ck_assert(!mem_cache_read(4, 0, buf, 200, 0));
+
+	mem_cache_get_info(&info);
+	ck_assert_int_eq(info.mem_used, NR_BLOCKS * BS);
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test cache mem");
+
+	TCase *tc_mem = tcase_create("mem");
+	tcase_add_test(tc_mem, test_read_write);
+	tcase_add_test(tc_mem, test_scan_resistance);
+
+	suite_add_tcase(s, tc_mem);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,283 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include "sheep_priv.h"
+
+#define OBJ_SIZE	SD_DATA_OBJ_SIZE
+/* the block size of store/compress.c */
+#define BS		(64 * 1024)
+
+static uint64_t oid;
+static char obj[OBJ_SIZE], buf[OBJ_SIZE];
+
+size_t get_store_objsize(uint64_t id)
+{
+	return OBJ_SIZE;
+}
+
+static void setup(void)
+{
+	sys = xzalloc(sizeof(*sys));
+	oid = vid_to_data_oid(1, 0);
+	memset(obj, 0, sizeof(obj));
+}
+
+static void teardown(void)
+{
+	free(sys);
+	sys = NULL;
+}
+
+/* compressible data which differs from block to block */
+static void gen_data(char *p, size_t len, int seed)
+{
+	for (size_t i = 0; i < len; i++)
+		p[i] = "sheepdog"[(i / 64 + seed) % 8];
+}
+
+static int new_file(void)
+{
+	char path[] = "/tmp/test_compress.XXXXXX";
+	int fd = mkstemp(path);
+
+	ck_assert(fd >= 0);
+	unlink(path);
+	return fd;
+}
+
+static int do_create(int fd, uint8_t algo, uint32_t offset, uint32_t len)
+{
+	struct siocb iocb = {
+		.buf = obj + offset,
+		.offset = offset,
+		.length = len,
+	};
+
+	return cobj_create(fd, oid, algo, &iocb);
+}
+
+static bool do_write(int fd, uint32_t offset, uint32_t len)
+{
+	struct siocb iocb = {
+		.buf = obj + offset,
+		.offset = offset,
+		.length = len,
+	};
+	bool compact;
+
+	ck_assert_int_eq(cobj_write(fd, oid, &iocb, &compact), 0);
+	return compact;
+}
+
+/* the whole object reads the same as 'obj' */
+static void check_object(int fd)
+{
+	struct siocb iocb = {
+		.buf = buf,
+		.length = OBJ_SIZE,
+	};
+
+	memset(buf, 'x', sizeof(buf));
+	ck_assert_int_eq(cobj_read(fd, oid, &iocb), 0);
+	ck_assert(!memcmp(buf, obj, OBJ_SIZE));
+}
+
+static off_t file_size(int fd)
+{
+	struct stat st;
+
+	ck_assert_int_eq(fstat(fd, &st), 0);
+	return st.st_size;
+}
+
+/* The loop tests run for every algorithm, which is skipped if not built in */
+
+START_TEST(test_create_read)
+{
+	struct siocb iocb = { .buf = buf };
+	int fd = new_file();
+
+	if (!compression_supported(_i))
+		return;
+
+	gen_data(obj + 100000, 300000, 0);
+	ck_assert_int_eq(do_create(fd, _i, 100000, 300000), 0);
+	check_object(fd);
+	/* the blocks of zeros are not stored, and the data shrinks */
+	ck_assert(file_size(fd) < 300000);
+
+	/* reads which don't start or end at a block boundary */
+	iocb.offset = BS - 10;
+	iocb.length = BS + 20;
+	ck_assert_int_eq(cobj_read(fd, oid, &iocb), 0);
+	ck_assert(!memcmp(buf, obj + BS - 10, BS + 20));
+	iocb.offset = 99990;
+	iocb.length = 20;
+	ck_assert_int_eq(cobj_read(fd, oid, &iocb), 0);
+	ck_assert(!memcmp(buf, obj + 99990, 20));
+
+	close(fd);
+}
+END_TEST
+
+START_TEST(test_partial_write)
+{
+	int fd = new_file();
+
+	if (!compression_supported(_i))
+		return;
+
+	gen_data(obj, OBJ_SIZE, 0);
+	ck_assert_int_eq(do_create(fd, _i, 0, OBJ_SIZE), 0);
+
+	/* across a block boundary */
+	gen_data(obj + BS - 10, 20, 3);
+	do_write(fd, BS - 10, 20);
+	check_object(fd);
+
+	/* inside one block */
+	gen_data(obj + 5 * BS + 7, 100, 5);
+	do_write(fd, 5 * BS + 7, 100);
+	check_object(fd);
+
+	/* data which doesn't compress is stored as is */
+	for (int i = 0; i < BS; i++)
+		obj[2 * BS + i] = random();
+	do_write(fd, 2 * BS, BS);
+	check_object(fd);
+
+	/* the last byte of the object */
+	obj[OBJ_SIZE - 1] = 'z';
+	do_write(fd, OBJ_SIZE - 1, 1);
+	check_object(fd);
+
+	close(fd);
+}
+END_TEST
+
+START_TEST(test_zero_blocks)
+{
+	int fd = new_file();
+
+	if (!compression_supported(_i))
+		return;
+
+	ck_assert_int_eq(do_create(fd, _i, 0, OBJ_SIZE), 0);
+	ck_assert(cobj_empty(fd, oid));
+	check_object(fd);
+
+	gen_data(obj + 3 * BS, 2 * BS, 0);
+	do_write(fd, 3 * BS, 2 * BS);
+	ck_assert(!cobj_empty(fd, oid));
+
+	/* zeroing a part of a block keeps it */
+	memset(obj + 3 * BS, 0, BS + 100);
+	do_write(fd, 3 * BS, BS + 100);
+	ck_assert(!cobj_empty(fd, oid));
+	check_object(fd);
+
+	memset(obj + 4 * BS, 0, BS);
+	do_write(fd, 4 * BS, BS);
+	ck_assert(cobj_empty(fd, oid));
+	check_object(fd);
+
+	close(fd);
+}
+END_TEST
+
+START_TEST(test_compact)
+{
+	int fd = new_file(), new_fd = new_file(), nr;
+	bool compact = false;
+
+	if (!compression_supported(_i))
+		return;
+
+	gen_data(obj, 4 * BS, 0);
+	ck_assert_int_eq(do_create(fd, _i, 0, 4 * BS), 0);
+
+	/* the old versions of the blocks pile up */
+	for (nr = 1; !compact; nr++) {
+		ck_assert(nr < 100);
+		gen_data(obj + BS, 2 * BS, nr);
+		compact = do_write(fd, BS, 2 * BS);
+	}
+	check_object(fd);
+
+	ck_assert_int_eq(cobj_compact(fd, new_fd, oid), 0);
+	check_object(new_fd);
+	ck_assert(file_size(new_fd) < file_size(fd));
+
+	/* no garbage is left, so the next write doesn't ask for compaction */
+	gen_data(obj + BS, BS, 0);
+	ck_assert(!do_write(new_fd, BS, BS));
+	check_object(new_fd);
+
+	close(fd);
+	close(new_fd);
+}
+END_TEST
+
+START_TEST(test_corruption)
+{
+	struct siocb iocb = { .buf = buf, .length = OBJ_SIZE };
+	int fd = new_file();
+	char c;
+
+	if (!compression_supported(_i))
+		return;
+
+	gen_data(obj, BS, 0);
+	ck_assert_int_eq(do_create(fd, _i, 0, BS), 0);
+
+	/* flip a byte of the only stored block */
+	ck_assert_int_eq(xpread(fd, &c, 1, file_size(fd) - 1), 1);
+	c = ~c;
+	ck_assert_int_eq(xpwrite(fd, &c, 1, file_size(fd) - 1), 1);
+	ck_assert_int_eq(cobj_read(fd, oid, &iocb), SD_RES_EIO);
+
+	close(fd);
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test compress");
+
+	TCase *tc_cobj = tcase_create("compressed object");
+
+	tcase_add_checked_fixture(tc_cobj, setup, teardown);
+	tcase_add_loop_test(tc_cobj, test_create_read, SD_COMPRESS_LZ4,
+			    SD_COMPRESS_ZSTD + 1);
+	tcase_add_loop_test(tc_cobj, test_partial_write, SD_COMPRESS_LZ4,
+			    SD_COMPRESS_ZSTD + 1);
+	tcase_add_loop_test(tc_cobj, test_zero_blocks, SD_COMPRESS_LZ4,
+			    SD_COMPRESS_ZSTD + 1);
+	tcase_add_loop_test(tc_cobj, test_compact, SD_COMPRESS_LZ4,
+			    SD_COMPRESS_ZSTD + 1);
+	tcase_add_loop_test(tc_cobj, test_corruption, SD_COMPRESS_LZ4,
+			    SD_COMPRESS_ZSTD + 1);
+
+	suite_add_tcase(s, tc_cobj);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
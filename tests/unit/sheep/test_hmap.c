@@ -0,0 +1,210 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <time.h>
+
+#include "sheep_priv.h"
+#include "hmap.h"
+
+#define NR_OBJS		10000
+#define NR_THREADS	8
+#define NR_LOOKUPS	1000000
+
+struct obj {
+	struct hmap_node node;
+	struct rb_node rb;
+	uint64_t idx;
+	refcnt_t refcnt;
+};
+
+static struct obj objs[NR_OBJS];
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void get_obj(struct hmap_node *node)
+{
+	refcount_inc(&container_of(node, struct obj, node)->refcnt);
+}
+
+static bool obj_is_idle(struct hmap_node *node)
+{
+	return refcount_read(&container_of(node, struct obj, node)->refcnt) == 0;
+}
+
+static bool count_obj(struct hmap_node *node, void *arg)
+{
+	(*(int *)arg)++;
+	return true;
+}
+
+static void gen_objs(void)
+{
+	for (int i = 0; i < NR_OBJS; i++) {
+		memset(objs + i, 0, sizeof(objs[i]));
+		objs[i].idx = i * 4;
+		objs[i].node.key = objs[i].idx;
+	}
+}
+
+START_TEST(test_insert_lookup)
+{
+	struct hmap map;
+	int nr = 0;
+
+	gen_objs();
+	hmap_init(&map, 16);
+
+	for (int i = 0; i < NR_OBJS; i++)
+		ck_assert_ptr_eq(hmap_insert(&map, &objs[i].node), NULL);
+	/* the map has grown */
+	ck_assert(map.nr_buckets > 16);
+	ck_assert_int_eq(hmap_count(&map), NR_OBJS);
+	ck_assert_ptr_eq(hmap_insert(&map, &objs[5].node), &objs[5].node);
+
+	for (int i = 0; i < NR_OBJS; i++) {
+		ck_assert_ptr_eq(hmap_lookup(&map, i * 4, NULL), &objs[i].node);
+		ck_assert_ptr_eq(hmap_lookup(&map, i * 4 + 1, NULL), NULL);
+	}
+	hmap_for_each(&map, 3, count_obj, &nr);
+	ck_assert_int_eq(nr, NR_OBJS);
+
+	/* the nodes with references are kept */
+	hmap_lookup(&map, 8, get_obj);
+	ck_assert(!hmap_remove_if(&map, &objs[2].node, obj_is_idle));
+	ck_assert(hmap_remove_if(&map, &objs[3].node, obj_is_idle));
+	ck_assert_ptr_eq(hmap_lookup(&map, 12, NULL), NULL);
+
+	for (int i = 0; i < NR_OBJS; i++)
+		if (i != 3)
+			hmap_remove(&map, &objs[i].node);
+	ck_assert_int_eq(hmap_count(&map), 0);
+	hmap_destroy(&map);
+}
+END_TEST
+
+/* The lookups of the object cache before, a tree under one lock */
+static struct rb_root tree = RB_ROOT;
+static struct sd_rw_lock tree_lock = SD_RW_LOCK_INITIALIZER;
+static struct hmap map;
+
+static int obj_cmp(const struct obj *a, const struct obj *b)
+{
+	return intcmp(a->idx, b->idx);
+}
+
+static void *tree_lookup_thread(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+
+	for (int i = 0; i < NR_LOOKUPS; i++) {
+		struct obj key = { .idx = rand_r(&seed) % NR_OBJS * 4 }, *obj;
+
+		sd_read_lock(&tree_lock);
+		obj = rb_search(&tree, &key, rb, obj_cmp);
+		refcount_inc(&obj->refcnt);
+		sd_rw_unlock(&tree_lock);
+		refcount_dec(&obj->refcnt);
+	}
+	return NULL;
+}
+
+static void *hmap_lookup_thread(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+
+	for (int i = 0; i < NR_LOOKUPS; i++) {
+		struct hmap_node *node;
+
+		node = hmap_lookup(&map, rand_r(&seed) % NR_OBJS * 4, get_obj);
+		refcount_dec(&container_of(node, struct obj, node)->refcnt);
+	}
+	return NULL;
+}
+
+static uint64_t run_threads(int nr, void *(*fn)(void *))
+{
+	pthread_t threads[NR_THREADS];
+	uint64_t start = now_usec();
+
+	for (int i = 0; i < nr; i++)
+		pthread_create(threads + i, NULL, fn, (void *)(uintptr_t)i);
+	for (int i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	return now_usec() - start;
+}
+
+/*
+ * Look up the objects from 1 to NR_THREADS threads, taking a reference like the
+ * object cache does, and compare the map with a tree under a single lock.
+ */
+START_TEST(test_lookup_benchmark)
+{
+	gen_objs();
+	hmap_init(&map, 16);
+	for (int i = 0; i < NR_OBJS; i++) {
+		rb_insert(&tree, &objs[i], rb, obj_cmp);
+		hmap_insert(&map, &objs[i].node);
+	}
+
+	for (int nr = 1; nr <= NR_THREADS; nr *= 2) {
+		uint64_t tree_usec = run_threads(nr, tree_lookup_thread);
+		uint64_t map_usec = run_threads(nr, hmap_lookup_thread);
+
+		printf("%d threads: rwlock and tree %"PRIu64" lookups/s, "
+		       "hmap %"PRIu64" lookups/s\n", nr,
+		       (uint64_t)nr * NR_LOOKUPS * 1000000 / tree_usec,
+		       (uint64_t)nr * NR_LOOKUPS * 1000000 / map_usec);
+	}
+
+	for (int i = 0; i < NR_OBJS; i++) {
+		/* every lookup has dropped its reference */
+		ck_assert(obj_is_idle(&objs[i].node));
+		hmap_remove(&map, &objs[i].node);
+	}
+	hmap_destroy(&map);
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test hmap");
+
+	TCase *tc_map = tcase_create("map");
+	TCase *tc_bench = tcase_create("benchmark");
+
+	tcase_add_test(tc_map, test_insert_lookup);
+	tcase_add_test(tc_bench, test_lookup_benchmark);
+	tcase_set_timeout(tc_bench, 600);
+
+	suite_add_tcase(s, tc_map);
+	/* the benchmark takes minutes, run it on demand */
+	if (getenv("SD_UNIT_BENCHMARK"))
+		suite_add_tcase(s, tc_bench);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -27,12 +27,53 @@ START_TEST(test_vdi)
 }
 END_TEST
 
+START_TEST(test_vdi_objsize)
+{
+	vdi_set_block_size_shift(4, 20);
+	vdi_set_block_size_shift(5, 26);
+
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(4, 1)), 1 << 20);
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(5, 1)), 1 << 26);
+	/* an unknown VDI has no size rather than the default one */
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(6, 1)), 0);
+	ck_assert_int_eq(get_vdi_objsize(vid_to_vdi_oid(6)), SD_INODE_SIZE);
+	ck_assert_int_eq(sd_max_vdi_size(1, 20), SD_MAX_VDI_SIZE >> 2);
+
+	/* the clones of a deleted VDI may still share its objects */
+	vdi_delete_state(4);
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(4, 1)), 1 << 20);
+}
+END_TEST
+
+/* A joining node learns the object sizes from the others */
+START_TEST(test_vdi_state_list)
+{
+	struct sd_vdi_state vs[8];
+	int nr;
+
+	clean_vdi_state();
+	vdi_set_block_size_shift(7, 24);
+	vdi_set_block_size_shift(8, 22);
+	ck_assert_int_eq(get_vdi_state_list(vs, 1), -1);
+	nr = get_vdi_state_list(vs, ARRAY_SIZE(vs));
+	ck_assert_int_eq(nr, 2);
+
+	clean_vdi_state();
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(7, 0)), 0);
+	apply_vdi_state_list(vs, nr);
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(7, 0)), 1 << 24);
+	ck_assert_int_eq(get_vdi_objsize(vid_to_data_oid(8, 0)), 1 << 22);
+}
+END_TEST
+
 static Suite *test_suite(void)
 {
 	Suite *s = suite_create("test vdi");
 
 	TCase *tc_vdi = tcase_create("vdi");
 	tcase_add_test(tc_vdi, test_vdi);
+	tcase_add_test(tc_vdi, test_vdi_objsize);
+	tcase_add_test(tc_vdi, test_vdi_state_list);
 
 	suite_add_tcase(s, tc_vdi);
 
@@ -0,0 +1,290 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sheep_priv.h"
+
+#define NR_NODES	1000
+#define NR_ZONES	8
+#define CHECK_STEP	97	/* compare with a full rebuild every CHECK_STEP */
+#define NR_FULL_REBUILD	20
+
+static struct sd_node nodes[NR_NODES];
+
+/*
+ * With 'mixed', the nodes have 1 to 7 TB of space, so the number of vnodes of
+ * every node is rescaled whenever the average space changes.
+ */
+static void gen_nodes(bool mixed)
+{
+	memset(nodes, 0, sizeof(nodes));
+
+	for (int i = 0; i < NR_NODES; i++) {
+		/* IPv4 10.0.x.y */
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[14] = i / 256;
+		nodes[i].nid.addr[15] = i % 256;
+		nodes[i].nid.port = 7000;
+		nodes[i].zone = i % NR_ZONES;
+		nodes[i].space = (mixed ? 1 + i % 7 : 1) * (1ULL << 40);
+	}
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Return the black height of the subtree, or -1 if it is not a valid rbtree */
+static int black_height(const struct rb_node *rb)
+{
+	int l, r;
+
+	if (!rb)
+		return 1;
+	if (rb_is_red(rb) &&
+	    ((rb->rb_left && rb_is_red(rb->rb_left)) ||
+	     (rb->rb_right && rb_is_red(rb->rb_right))))
+		return -1;
+	l = black_height(rb->rb_left);
+	r = black_height(rb->rb_right);
+	if (l < 0 || l != r)
+		return -1;
+	return l + rb_is_black(rb);
+}
+
+/* The ring of 'vinfo' must be the same as the one built from scratch */
+static void check_ring(struct vnode_info *vinfo, const struct rb_root *nroot)
+{
+	struct vnode_info *full = alloc_vnode_info(nroot);
+	struct rb_node *a = rb_first(&vinfo->vroot);
+	struct rb_node *b = rb_first(&full->vroot);
+	const struct sd_vnode *va, *vb;
+	int nr_copies;
+
+	ck_assert_int_eq(vinfo->vroot.nr, full->vroot.nr);
+	ck_assert_int_eq(vinfo->nr_zones, full->nr_zones);
+	ck_assert(!vinfo->vroot.rb_node || rb_is_black(vinfo->vroot.rb_node));
+	ck_assert(black_height(vinfo->vroot.rb_node) > 0);
+
+	while (a && b) {
+		va = rb_entry(a, struct sd_vnode, rb);
+		vb = rb_entry(b, struct sd_vnode, rb);
+		ck_assert(va->hash == vb->hash);
+		ck_assert(node_eq(va->node, vb->node));
+		/* vnodes must point to the nodes of their own vnode_info */
+		ck_assert(va->node >= vinfo->nodes &&
+			  va->node < vinfo->nodes + vinfo->nr_nodes);
+		a = rb_next(a);
+		b = rb_next(b);
+	}
+	ck_assert(!a && !b);
+
+	nr_copies = min(vinfo->nr_zones, 3);
+	for (uint64_t oid = 0; nr_copies && oid < 1000; oid++) {
+		const struct sd_node *na[SD_MAX_COPIES], *nb[SD_MAX_COPIES];
+
+		oid_to_nodes(oid, &vinfo->vroot, nr_copies, na);
+		oid_to_nodes(oid, &full->vroot, nr_copies, nb);
+		for (int i = 0; i < nr_copies; i++)
+			ck_assert(node_eq(na[i], nb[i]));
+	}
+
+	put_vnode_info(full);
+}
+
+static struct vnode_info *update_ring(struct vnode_info *prev,
+				     const struct rb_root *nroot)
+{
+	struct vnode_info *vinfo = alloc_vnode_info_from(prev, nroot);
+
+	put_vnode_info(prev);
+	return vinfo;
+}
+
+/* Nodes join and leave, and the ring of each event must be right */
+static void test_ring_update(bool mixed)
+{
+	struct rb_root nroot = RB_ROOT;
+	struct vnode_info *vinfo = NULL;
+
+	gen_nodes(mixed);
+	for (int i = 0; i < 300; i++) {
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+		vinfo = update_ring(vinfo, &nroot);
+		if (i < 10 || i % CHECK_STEP == 0)
+			check_ring(vinfo, &nroot);
+	}
+
+	/* a node whose space changes gets new vnodes */
+	rb_erase(&nodes[7].rb, &nroot);
+	nodes[7].space = 1ULL << 41;
+	rb_insert(&nroot, &nodes[7], rb, node_cmp);
+	vinfo = update_ring(vinfo, &nroot);
+	check_ring(vinfo, &nroot);
+
+	for (int i = 0; i < 300; i += 2) {
+		rb_erase(&nodes[i].rb, &nroot);
+		vinfo = update_ring(vinfo, &nroot);
+		if (i % CHECK_STEP == 0)
+			check_ring(vinfo, &nroot);
+	}
+	check_ring(vinfo, &nroot);
+	put_vnode_info(vinfo);
+}
+
+START_TEST(test_vnode_ring_update)
+{
+	test_ring_update(false);
+}
+END_TEST
+
+START_TEST(test_vnode_ring_update_mixed)
+{
+	test_ring_update(true);
+}
+END_TEST
+
+#ifdef HAVE_DISKVNODES
+/* The vnodes of the disks of a node follow the disks */
+START_TEST(test_vnode_ring_update_diskmode)
+{
+	struct rb_root nroot = RB_ROOT;
+	struct vnode_info *vinfo = NULL;
+
+	sys->cinfo.flags |= SD_CLUSTER_FLAG_DISKMODE;
+	gen_nodes(false);
+	for (int i = 0; i < 100; i++) {
+		/* 1 to 3 disks of 16 to 112 GB */
+		for (int j = 0; j <= i % 3; j++) {
+			nodes[i].disks[j].disk_id = i * DISK_MAX + j + 1;
+			nodes[i].disks[j].disk_space =
+				(1 + (i + j) % 7) * 16 * WEIGHT_MIN;
+		}
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+		vinfo = update_ring(vinfo, &nroot);
+		if (i < 10 || i % 11 == 0)
+			check_ring(vinfo, &nroot);
+	}
+
+	/* a disk is unplugged */
+	rb_erase(&nodes[5].rb, &nroot);
+	memset(&nodes[5].disks[1], 0, sizeof(nodes[5].disks[1]));
+	rb_insert(&nroot, &nodes[5], rb, node_cmp);
+	vinfo = update_ring(vinfo, &nroot);
+	check_ring(vinfo, &nroot);
+
+	for (int i = 0; i < 100; i += 3) {
+		rb_erase(&nodes[i].rb, &nroot);
+		vinfo = update_ring(vinfo, &nroot);
+		if (i % 11 == 0)
+			check_ring(vinfo, &nroot);
+	}
+	check_ring(vinfo, &nroot);
+	put_vnode_info(vinfo);
+	sys->cinfo.flags &= ~SD_CLUSTER_FLAG_DISKMODE;
+}
+END_TEST
+#endif
+
+/*
+ * Simulate NR_NODES nodes joining the cluster one by one and leaving again,
+ * deriving every ring from the previous one, and compare the cost of an event
+ * with building the ring of the full cluster from scratch.  With nodes of
+ * different space, most of the vnodes are hashed again on every event.
+ */
+static void join_leave_benchmark(bool mixed)
+{
+	struct rb_root nroot = RB_ROOT;
+	struct vnode_info *vinfo = NULL, *full;
+	uint64_t start, full_usec, incr_usec;
+
+	gen_nodes(mixed);
+	start = now_usec();
+	for (int i = 0; i < NR_NODES; i++) {
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+		vinfo = update_ring(vinfo, &nroot);
+	}
+	incr_usec = now_usec() - start;
+
+	start = now_usec();
+	for (int i = 0; i < NR_FULL_REBUILD; i++) {
+		full = alloc_vnode_info(&nroot);
+		put_vnode_info(full);
+	}
+	full_usec = now_usec() - start;
+
+	start = now_usec();
+	for (int i = 0; i < NR_NODES - 1; i++) {
+		rb_erase(&nodes[i].rb, &nroot);
+		vinfo = update_ring(vinfo, &nroot);
+	}
+	incr_usec += now_usec() - start;
+	check_ring(vinfo, &nroot);
+	put_vnode_info(vinfo);
+
+	printf("%d %s nodes join and leave: %"PRIu64" ms in total, "
+	       "%"PRIu64" us per event\n", NR_NODES,
+	       mixed ? "mixed space" : "same space", incr_usec / 1000,
+	       incr_usec / (2 * NR_NODES - 1));
+	printf("full rebuild of %d nodes: %"PRIu64" us per event\n",
+	       NR_NODES, full_usec / NR_FULL_REBUILD);
+}
+
+START_TEST(test_join_leave_benchmark)
+{
+	join_leave_benchmark(false);
+	join_leave_benchmark(true);
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test vnode info");
+
+	TCase *tc_ring = tcase_create("ring");
+	TCase *tc_bench = tcase_create("benchmark");
+
+	tcase_add_test(tc_ring, test_vnode_ring_update);
+	tcase_add_test(tc_ring, test_vnode_ring_update_mixed);
+#ifdef HAVE_DISKVNODES
+	tcase_add_test(tc_ring, test_vnode_ring_update_diskmode);
+#endif
+	tcase_set_timeout(tc_ring, 60);
+	tcase_add_test(tc_bench, test_join_leave_benchmark);
+	tcase_set_timeout(tc_bench, 600);
+
+	suite_add_tcase(s, tc_ring);
+	/* the benchmark only prints the timings, run it on demand */
+	if (getenv("SD_UNIT_BENCHMARK"))
+		suite_add_tcase(s, tc_bench);
+
+	return s;
+}
+
+int main(void)
+{
+	struct system_info __sys;
+	int number_failed;
+
+	memset(&__sys, 0, sizeof(__sys));
+	sys = &__sys;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}